@@ -36,6 +36,7 @@
 #include <unordered_set>
 #include <optional>
 #include <string>
+#include <future>
 
 #include <assert.h>
 
@@ -113,11 +114,14 @@ public:
   Tensor& operator=(Tensor const&) = delete;
   Tensor(Tensor const&) = delete;
 
+  // NaN and inf elements are counted but left out of the rest
   struct Stats {
     double min;
     double max;
     double mean;
     double stddev;
+    int64_t nans = 0;
+    int64_t infs = 0;
   };
 
   enum class DataType {
@@ -126,6 +130,7 @@ public:
     FLOAT,
     INT64,
     I32,
+    I8,
   };
 
   static size_t DataTypeSize(DataType dt);
@@ -176,7 +181,11 @@ public:
   void print(const char *prefix, int elements_per_rank = 0);
   void printRGB(const char *prefix,
                 std::optional<std::pair<float, float>> range = std::nullopt);
-  Stats stats();
+  virtual Stats stats();
+  // For reductions done elsewhere (eg. on a GPU), variance is clamped at 0
+  static Stats statsFromSums(double min, double max, double sum,
+                             double sum2, int64_t count,
+                             int64_t nans, int64_t infs);
   void printStats(const char *prefix);
   std::string statsString(void);
 
@@ -220,9 +229,17 @@ public:
 //------------------------------------------------------------------------
 
 
+// Writes item n of batch into data and returns its size. If the item
+// does not fit, returns the required size without writing anything and
+// is called again with a large enough buffer. 0 means no data
 typedef std::function<size_t(long batch, int n,
                              uint8_t *data, size_t capacity)> Loader;
 
+// Zero copy alternative to Loader. Returns item n of batch in memory that
+// stays valid while the program runs and sets *size, nullptr if no data
+typedef std::function<const uint8_t *(long batch, int n,
+                                      size_t *size)> MappedLoader;
+
 class Node {
 public:
 
@@ -238,6 +255,8 @@ public:
     , inputs_(n.inputs_)
     , attributes_(n.attributes_)
     , outputs_(n.outputs_)
+    , loader_(n.loader_)
+    , mapped_loader_(n.mapped_loader_)
   {}
 
   const std::string type_;
@@ -247,6 +266,7 @@ public:
   Attributes attributes_;
   Tensors outputs_;
   Loader loader_;
+  MappedLoader mapped_loader_;  // Used instead of loader_ when set
 
   std::shared_ptr<Tensor> inferTensor_y(const std::optional<const std::string> &name = std::nullopt);
   void print() const;
@@ -282,6 +302,10 @@ public:
   std::unordered_set<std::shared_ptr<Tensor>> outputs_;
   Tensors tensors_;
 
+  // Optimizer state loaded from a checkpoint, restored into programs
+  // created for training
+  Tensors optimizer_state_;
+
   std::shared_ptr<Node> addNode(const std::string &type,
                                 const Tensors &inputs,
                                 const Attributes &attributes,
@@ -293,10 +317,17 @@ public:
 
   static std::shared_ptr<Graph> load(const char *path);
 
+  // Loads a directory of tensor files or a single checkpoint file
   void loadTensors(const char *path);
 
   bool saveTensors(const char *path, Program *p);
 
+  // Single file with all tensors (and the optimizer state of p) laid out
+  // so they can be copied straight to the device from a mmap:ed file
+  bool saveCheckpoint(const char *path, Program *p) const;
+
+  bool loadCheckpoint(const char *path);
+
   void print() const;
 
   std::pair<TensorMapping, TensorMapping> tensorMappings() const;
@@ -305,6 +336,14 @@ public:
 
   std::unordered_set<std::shared_ptr<Tensor>> outputTensors() const;
 
+  // Backend independent rewrites done before lowering: Constant folding
+  // (inference only), common subexpression and dead node elimination.
+  // inputs_, outputs_ and tensors in keep are left intact, without
+  // outputs_ so are results no node consumes. Returns the number of
+  // nodes removed
+  size_t optimize(bool training,
+                  const std::unordered_set<std::shared_ptr<Tensor>> &keep = {});
+
 };
 
 
@@ -355,6 +394,67 @@ struct ProgramConfig {
   int batch_size;
   float initial_learning_rate;
   TensorLayout tensor_layout;
+
+  // Benchmark convolution algorithms instead of relying on heuristics.
+  // Results are cached in autotune_cache (default: $HOME/.saga_autotune)
+  // keyed on the workspace benchmarked with: autotune_max_workspace, or
+  // less when the device doesn't have that much free
+  bool autotune = false;
+  size_t autotune_max_workspace = 512 * 1024 * 1024;
+  std::string autotune_cache;
+
+  // Directory where the CUDA backend stores the outcome of lowering a
+  // graph (chosen algorithms and memory plan). Programs later built from
+  // the same graph, config, device and library versions reuse it and
+  // skip algorithm search and planning. Empty to disable
+  std::string program_cache;
+
+  // Capture the operations of a batch into a CUDA graph and replay it
+  bool cuda_graph = false;
+
+  // Number of batches loaded (PRE accessors and loaders) ahead of the
+  // batch being computed
+  int prefetch_depth = 1;
+
+  // Split each batch over all visible GPUs, gradients are averaged
+  // across devices before the weight update. batch_size is the total
+  // over all devices
+  bool data_parallel = false;
+
+  // CPU (DNNL) backend: Number of worker threads, 0 for one per core
+  // available to the process. With cpu_affinity each worker is pinned
+  // to a core of its own
+  int cpu_threads = 0;
+  bool cpu_affinity = false;
+
+  // Inference only: Run convolutions and fully connected layers in
+  // INT8. Activation ranges are calibrated when the program is created
+  // by running int8_calibration_batches batches through a float copy of
+  // the network, fed by the PRE accessors. POST accessors are not
+  // invoked during calibration
+  bool int8 = false;
+  int int8_calibration_batches = 8;
+
+  // Training: Free forward activations after their last forward use and
+  // recompute them from the nearest checkpoint during the backward pass.
+  // Outputs of nodes with the "checkpoint" attribute set are kept. If no
+  // node has it, every sqrt(n):th operation is a checkpoint
+  bool recompute = false;
+
+  // Training: Sum weight gradients over this many batches and update
+  // the weights once per gradient_accumulation batches. The loss is
+  // scaled so the update uses the mean gradient over all of them
+  int gradient_accumulation = 1;
+
+  // Compute Tensor::Stats of health_check_tensors (default: weights and
+  // weight gradients when training, graph outputs otherwise) every
+  // health_check_interval batches. Runs on the device and is read back
+  // without stalling execution, NaN / inf are reported on stderr and
+  // through Program::healthReport(). Tensors are sampled before the
+  // weight update, with gradient_accumulation on the next batch that
+  // completes an accumulation
+  int health_check_interval = 0;
+  std::vector<std::shared_ptr<Tensor>> health_check_tensors;
 };
 
 
@@ -370,6 +470,51 @@ enum class BatchTensorAccessType {
 };
 
 
+struct ProfileEntry {
+  std::string name;
+  std::string algo;
+  long count = 0;
+  double min_us = 0;
+  double mean_us = 0;
+  double p99_us = 0;
+  int64_t bytes = 0;  // Read and written per call
+  int64_t flops = 0;  // Per call, 0 if unknown
+};
+
+struct ProfileReport {
+  std::vector<ProfileEntry> entries;
+  long batches = 0;
+
+  // Device state when the report was created, 0 if unknown
+  std::string device;
+  int sm_clock_mhz = 0;
+  int mem_clock_mhz = 0;
+  float power_watts = 0;
+  int temperature = 0;
+  size_t mem_used = 0;
+  size_t mem_total = 0;
+
+  // Device memory allocated by the program for tensors and workspace
+  size_t program_memory = 0;
+
+  void print() const;
+};
+
+struct HealthEntry {
+  std::string name;
+  long batch = -1;  // Batch the statistics are from
+  Tensor::Stats stats;
+};
+
+struct HealthReport {
+  std::vector<HealthEntry> entries;
+  long checks = 0;
+  long first_unhealthy_batch = -1;  // First batch with NaN or inf
+
+  bool healthy() const { return first_unhealthy_batch == -1; }
+  void print() const;
+};
+
 class Program {
 
 public:
@@ -379,6 +524,26 @@ public:
   virtual void train(long batches = 1) = 0;
   virtual void print() const = 0;
   virtual void debug(bool on) = 0;
+
+  // Time each operation while enabled. Enabling resets collected data
+  virtual void profile(bool on) {}
+  virtual ProfileReport profileReport() { return {}; }
+
+  // Latest results of the checks enabled by health_check_interval
+  virtual HealthReport healthReport() { return {}; }
+
+  // Optimizer state (eg. Adam moments) by name. The tensors alias the
+  // program's own state so they can be written to as well
+  virtual Tensors optimizerState() { return {}; }
+
+  // Graph::saveCheckpoint() without stalling training. Tensors are
+  // snapshotted at the next batch boundary (or right away when idle) and
+  // written by a background thread. The future is set once the file is
+  // durable on disk. Blocks while a previous checkpoint is being
+  // written, fails right away (future set to false) if one still waits
+  // for its batch boundary
+  virtual std::future<bool> saveCheckpointAsync(const Graph &g,
+                                                const std::string &path);
 };
 
 //------------------------------------------------------------------------
@@ -391,11 +556,178 @@ public:
   virtual std::shared_ptr<Program> createProgram(const Graph &graph,
                                                  const ProgramConfig &pc,
                                                  const BatchTensorAccessors &accessors = {}) = 0;
+
+  // True if programs created with pc can run n
+  virtual bool supportsNode(const Node &n, const ProgramConfig &pc) const {
+    return true;
+  }
 };
 
 
+// Copy of g with Graph::optimize() applied, keeping the tensors of
+// accessors. Done by contexts before lowering
+Graph optimizedGraph(const Graph &g, const ProgramConfig &pc,
+                     const BatchTensorAccessors &accessors);
+
 std::shared_ptr<Context> createContext();
 
 std::vector<std::shared_ptr<Context>> createContexts();
 
+// Inference programs split across contexts. Each node is placed on the
+// context (in priority order, as returned by createContexts()) that
+// supports it at the lowest estimated cost, including the cost of moving
+// tensors across partition boundaries. Partitions run concurrently on
+// consecutive batches with boundary tensors handed over through host
+// memory. Graph inputs used by more than one partition must be fed
+// through batch accessors. Training programs are not split
+std::shared_ptr<Context> createHeterogeneousContext(const std::vector<std::shared_ptr<Context>> &contexts = createContexts());
+
+
+//------------------------------------------------------------------------
+//------------------------------------------------------------------------
+
+// Dynamic batching front-end. Single requests are queued and collected
+// into batches for a pool of inference programs, one per batch size.
+// A batch is dispatched when it fills the largest idle program or when
+// its oldest request has waited max_delay_us. Partial batches go to the
+// smallest idle program they fit in, unused rows are zeroed and their
+// results dropped
+
+struct InferenceServerConfig {
+  std::vector<int> batch_sizes = {1, 8, 32};
+  int max_delay_us = 2000;
+
+  // Graph input and output, default to the graph's only input / output
+  std::shared_ptr<Tensor> input;
+  std::shared_ptr<Tensor> output;
+
+  TensorLayout tensor_layout = TensorLayout::Auto;
+  bool cuda_graph = false;
+
+  // See ProgramConfig::program_cache
+  std::string program_cache;
+};
+
+struct InferenceServerStats {
+  long requests = 0;
+  long batches = 0;
+  double mean_batch_fill = 0;  // Requests per row of dispatched batches
+
+  // Request latency (queueing included) over recent requests
+  double p50_us = 0;
+  double p99_us = 0;
+  double max_us = 0;
+
+  void print() const;
+};
+
+class InferenceServer {
+public:
+  virtual ~InferenceServer() {}
+
+  // input holds one element of the graph input, ie. its dims with a
+  // batch size of 1. The result is a host tensor with one element of the
+  // graph output, nullptr if the request could not be served
+  virtual std::future<std::shared_ptr<Tensor>> infer(std::shared_ptr<Tensor> input) = 0;
+
+  virtual InferenceServerStats stats() = 0;
+};
+
+std::shared_ptr<InferenceServer> createInferenceServer(const std::shared_ptr<Context> &ctx,
+                                                       const Graph &g,
+                                                       const InferenceServerConfig &config);
+
+
+//------------------------------------------------------------------------
+//------------------------------------------------------------------------
+
+// Record datasets. Samples are packed into shard files holding the
+// payloads followed by an index of (offset, size, label). Shards are
+// mmap:ed and read ahead of use so datasets larger than memory stream
+// from disk. Records are handed out as pointers into the mapping
+
+enum class RecordType {
+  JPEG,    // Encoded images, for the jpegdecoder node
+  TENSOR,  // Raw elements of a tensor, see RecordFormat
+};
+
+struct RecordFormat {
+  RecordType type = RecordType::JPEG;
+
+  // Element held by each TENSOR record, without batch dimension
+  Tensor::DataType data_type = Tensor::DataType::U8;
+  Dims dims;
+};
+
+class RecordWriter {
+public:
+  virtual ~RecordWriter() {}
+
+  virtual bool write(const void *data, size_t size, int label) = 0;
+
+  // Completes the last shard
+  virtual bool finish() = 0;
+};
+
+// Shards are named <prefix>-00000.rec, -00001.rec, ...
+std::shared_ptr<RecordWriter> createRecordWriter(const std::string &prefix,
+                                                 const RecordFormat &format,
+                                                 size_t records_per_shard = 65536);
+
+struct DatasetConfig {
+  // Shards are visited in random order and records drawn at random from
+  // a buffer of this many upcoming records. 0 keeps file order
+  size_t shuffle_buffer = 16384;
+
+  // Bytes of upcoming records read ahead of use
+  size_t readahead = 64 * 1024 * 1024;
+
+  // 0 for a random seed
+  unsigned int seed = 0;
+};
+
+// Labels outside [0, classes) are ignored by catclassifier on every
+// backend: the row gets zero loss and zero gradient. Records past the end
+// of the dataset carry IGNORE_LABEL so a partial final batch can be
+// trained on without skewing the update
+static constexpr int IGNORE_LABEL = -1;
+
+struct Record {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  int label = IGNORE_LABEL;
+};
+
+class Dataset {
+public:
+  virtual ~Dataset() {}
+
+  virtual size_t size() const = 0;
+
+  virtual const RecordFormat &format() const = 0;
+
+  // Decide the order of records for the next epoch, records are shuffled
+  // according to DatasetConfig::shuffle_buffer if shuffle is set. Must
+  // not be called while a program is reading from the dataset
+  virtual void beginEpoch(int batch_size, bool shuffle) = 0;
+
+  // Item n of batch in the current epoch. Empty past the end
+  virtual Record get(long batch, int n) = 0;
+
+  // Sources for the jpegdecoder node (see Node::mapped_loader_)
+  virtual Loader loader() = 0;
+  virtual MappedLoader mappedLoader() = 0;
+
+  // PRE accessor copying a batch of TENSOR records straight from the
+  // mapping into the program's input. Rows past the end are zeroed
+  virtual BatchTensorAccessFn inputAccessor() = 0;
+
+  // PRE accessor for a [batch, 1] tensor of labels. Rows past the end
+  // are set to IGNORE_LABEL
+  virtual BatchTensorAccessFn labelAccessor() = 0;
+};
+
+std::shared_ptr<Dataset> openDataset(const std::vector<std::string> &paths,
+                                     const DatasetConfig &config = {});
+
 }
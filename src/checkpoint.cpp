@@ -0,0 +1,272 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+
+#include "saga.h"
+#include "tensor.h"
+
+/*
+ * Single file checkpoint
+ *
+ *   CheckpointHeader
+ *   CheckpointEntry[entries], each followed by its name padded to 8 bytes
+ *   Payloads, packed in row-major order, each starting at a multiple of
+ *   CHECKPOINT_ALIGNMENT so they can be DMA:ed straight from the mapping
+ */
+
+namespace saga {
+
+#define CHECKPOINT_ALIGNMENT 4096
+#define CHECKPOINT_MAX_RANK 8
+
+#define CHECKPOINT_FLAG_OPTIMIZER 0x1
+
+struct CheckpointHeader {
+  uint8_t magic[8];
+  uint32_t entries;
+  uint32_t index_size;   // Size of CheckpointEntry:s + names in bytes
+} __attribute__((packed));
+
+struct CheckpointEntry {
+  uint64_t offset;
+  uint64_t size;
+  uint32_t type;
+  uint32_t flags;
+  uint32_t rank;
+  uint32_t name_len;
+  uint32_t dims[CHECKPOINT_MAX_RANK];
+} __attribute__((packed));
+
+
+static size_t
+name_size(size_t len)
+{
+  return (len + 7) & ~7;
+}
+
+
+static uint64_t
+align(uint64_t v)
+{
+  return (v + CHECKPOINT_ALIGNMENT - 1) & ~(uint64_t)(CHECKPOINT_ALIGNMENT - 1);
+}
+
+
+bool
+checkpoint_write(const char *path, const std::vector<CheckpointItem> &items)
+{
+  std::vector<CheckpointEntry> entries;
+  size_t index_size = 0;
+  for(const auto &i : items) {
+    CheckpointEntry ce{};
+    uint32_t type;
+    if(!tensor_disk_type(i.tensor->data_type_, &type) ||
+       i.tensor->dims_.size() > CHECKPOINT_MAX_RANK) {
+      fprintf(stderr, "Unable to save %s -- Unsupported tensor %s\n",
+              path, i.tensor->info().c_str());
+      return false;
+    }
+    ce.type = type;
+    ce.flags = i.optimizer ? CHECKPOINT_FLAG_OPTIMIZER : 0;
+    ce.rank = i.tensor->dims_.size();
+    for(size_t j = 0; j < ce.rank; j++)
+      ce.dims[j] = i.tensor->dims_[j];
+    ce.name_len = i.name.size();
+    ce.size = i.tensor->elements_ * Tensor::DataTypeSize(i.tensor->data_type_);
+    entries.push_back(ce);
+    index_size += sizeof(CheckpointEntry) + name_size(ce.name_len);
+  }
+
+  uint64_t offset = align(sizeof(CheckpointHeader) + index_size);
+  for(auto &ce : entries) {
+    ce.offset = offset;
+    offset = align(offset + ce.size);
+  }
+
+  std::vector<uint8_t> index(sizeof(CheckpointHeader) + index_size);
+  CheckpointHeader *ch = (CheckpointHeader *)&index[0];
+  memcpy(ch->magic, "sagaC001", 8);
+  ch->entries = entries.size();
+  ch->index_size = index_size;
+
+  uint8_t *ptr = &index[sizeof(CheckpointHeader)];
+  for(size_t i = 0; i < entries.size(); i++) {
+    memcpy(ptr, &entries[i], sizeof(CheckpointEntry));
+    ptr += sizeof(CheckpointEntry);
+    memcpy(ptr, items[i].name.data(), entries[i].name_len);
+    ptr += name_size(entries[i].name_len);
+  }
+
+  // Write to a temporary file so a crash never leaves a truncated
+  // checkpoint in place
+  char tmppath[PATH_MAX];
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+  int fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if(fd == -1) {
+    fprintf(stderr, "Unable to save %s -- %s\n", tmppath, strerror(errno));
+    return false;
+  }
+
+  bool ok = write(fd, &index[0], index.size()) == (ssize_t)index.size();
+
+  for(size_t i = 0; ok && i < entries.size(); i++) {
+    ok = lseek(fd, entries[i].offset, SEEK_SET) == (off_t)entries[i].offset &&
+      tensor_write(fd, *items[i].tensor);
+  }
+
+  // Extend the file to cover the padding of the last payload
+  if(ok)
+    ok = ftruncate(fd, offset) == 0;
+  if(ok)
+    ok = fsync(fd) == 0;
+
+  if(!ok) {
+    fprintf(stderr, "Unable to save %s -- %s\n", tmppath, strerror(errno));
+    close(fd);
+    unlink(tmppath);
+    return false;
+  }
+  close(fd);
+
+  if(rename(tmppath, path)) {
+    fprintf(stderr, "Unable to save %s -- %s\n", path, strerror(errno));
+    unlink(tmppath);
+    return false;
+  }
+  return true;
+}
+
+
+bool
+Graph::saveCheckpoint(const char *path, Program *p) const
+{
+  std::vector<CheckpointItem> items;
+  for(const auto &it : tensors_) {
+    auto t = p ? p->resolveTensor(it.second) : it.second;
+    if(t)
+      items.push_back(CheckpointItem{it.first, t, false});
+  }
+  if(p) {
+    for(const auto &it : p->optimizerState())
+      items.push_back(CheckpointItem{it.first, it.second, true});
+  }
+  return checkpoint_write(path, items);
+}
+
+
+std::future<bool>
+Program::saveCheckpointAsync(const Graph &g, const std::string &path)
+{
+  std::promise<bool> promise;
+  promise.set_value(g.saveCheckpoint(path.c_str(), this));
+  return promise.get_future();
+}
+
+
+bool
+Graph::loadCheckpoint(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    fprintf(stderr, "Unable to open %s -- %s\n", path, strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st)) {
+    fprintf(stderr, "Unable to stat %s -- %s\n", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  if((size_t)st.st_size < sizeof(CheckpointHeader)) {
+    fprintf(stderr, "Unable to load %s -- Not a saga checkpoint\n", path);
+    close(fd);
+    return false;
+  }
+
+  const size_t size = st.st_size;
+  void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(mem == MAP_FAILED) {
+    fprintf(stderr, "Unable to load %s -- %s\n", path, strerror(errno));
+    return false;
+  }
+
+  // All tensors loaded share the mapping, it's unmapped once the last
+  // one goes away
+  std::shared_ptr<void> mapping(mem, [=](void *p) { munmap(p, size); });
+  madvise(mem, size, MADV_WILLNEED);
+
+  const CheckpointHeader *ch = (const CheckpointHeader *)mem;
+  if(memcmp(ch->magic, "sagaC001", 8) ||
+     sizeof(CheckpointHeader) + ch->index_size > size) {
+    fprintf(stderr, "Unable to load %s -- Not a saga checkpoint\n", path);
+    return false;
+  }
+
+  const uint8_t *ptr = (const uint8_t *)mem + sizeof(CheckpointHeader);
+  const uint8_t *end = ptr + ch->index_size;
+  size_t tensors = 0;
+  size_t bytes = 0;
+
+  for(uint32_t i = 0; i < ch->entries; i++) {
+    if(ptr + sizeof(CheckpointEntry) > end) {
+      fprintf(stderr, "Unable to load %s -- Index truncated\n", path);
+      return false;
+    }
+
+    CheckpointEntry ce;
+    memcpy(&ce, ptr, sizeof(ce));
+    ptr += sizeof(ce);
+
+    if(ptr + ce.name_len > end) {
+      fprintf(stderr, "Unable to load %s -- Index truncated\n", path);
+      return false;
+    }
+    const std::string name((const char *)ptr, ce.name_len);
+    ptr += name_size(ce.name_len);
+
+    Tensor::DataType data_type;
+    if(!tensor_data_type(ce.type, &data_type) ||
+       ce.rank > CHECKPOINT_MAX_RANK) {
+      fprintf(stderr, "Unable to load %s -- Unsupported tensor %s\n",
+              path, name.c_str());
+      return false;
+    }
+
+    Dims dims;
+    int64_t elements = 1;
+    for(uint32_t j = 0; j < ce.rank; j++) {
+      dims.push_back(ce.dims[j]);
+      elements *= ce.dims[j];
+    }
+
+    if(ce.size != elements * Tensor::DataTypeSize(data_type) ||
+       ce.offset % CHECKPOINT_ALIGNMENT || ce.offset + ce.size > size) {
+      fprintf(stderr, "Unable to load %s -- Bad extent for tensor %s\n",
+              path, name.c_str());
+      return false;
+    }
+
+    auto t = makeMappedCPUTensor(data_type, dims, mapping,
+                                 (char *)mem + ce.offset, name);
+    if(ce.flags & CHECKPOINT_FLAG_OPTIMIZER) {
+      optimizer_state_[name] = t;
+    } else {
+      tensors_[name] = t;
+    }
+    tensors++;
+    bytes += ce.size;
+  }
+
+  printf("Loaded %zd tensors (%zd MB) from %s\n", tensors, bytes >> 20, path);
+  return true;
+}
+
+}
@@ -57,4 +57,58 @@ registerContextFactory(ContextType type,
   allfactories[type] = fn;
 }
 
+
+
+void
+ProfileReport::print() const
+{
+  printf("\nProfile over %ld batches\n", batches);
+  if(!device.empty()) {
+    printf("Device: %s SM:%d MHz Mem:%d MHz Power:%.1f W Temp:%d C "
+           "Memory:%zd / %zd MB\n",
+           device.c_str(), sm_clock_mhz, mem_clock_mhz, power_watts,
+           temperature, mem_used >> 20, mem_total >> 20);
+  }
+  if(program_memory)
+    printf("Program memory: %zd MB\n", program_memory >> 20);
+
+  printf("%-40s %8s %10s %10s %10s %10s %10s  %s\n",
+         "Operation", "Count", "Min us", "Mean us", "P99 us",
+         "GB/s", "GFLOP/s", "Algorithm");
+
+  double total = 0;
+  for(const auto &e : entries) {
+    const double s = e.mean_us * 1e-6;
+    printf("%-40s %8ld %10.1f %10.1f %10.1f %10.1f ",
+           e.name.c_str(), e.count, e.min_us, e.mean_us, e.p99_us,
+           s > 0 ? e.bytes / s * 1e-9 : 0);
+    if(e.flops && s > 0)
+      printf("%10.1f", e.flops / s * 1e-9);
+    else
+      printf("%10s", "-");
+    printf("  %s\n", e.algo.c_str());
+    total += e.mean_us * e.count;
+  }
+  if(batches)
+    printf("Total %.1f us GPU time per batch\n", total / batches);
+}
+
+
+void
+HealthReport::print() const
+{
+  printf("\nHealth over %ld checks\n", checks);
+  if(!healthy())
+    printf("NaN/inf first seen in batch %ld\n", first_unhealthy_batch);
+
+  printf("%-40s %8s %12s %12s %12s %12s %8s %8s\n",
+         "Tensor", "Batch", "Min", "Max", "Mean", "Stddev", "NaN", "Inf");
+  for(const auto &e : entries) {
+    printf("%-40s %8ld %12g %12g %12g %12g %8ld %8ld\n",
+           e.name.c_str(), e.batch, e.stats.min, e.stats.max,
+           e.stats.mean, e.stats.stddev, (long)e.stats.nans,
+           (long)e.stats.infs);
+  }
+}
+
 }
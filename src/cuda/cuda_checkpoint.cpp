@@ -0,0 +1,217 @@
+#include "saga.h"
+#include "tensor.h"
+#include "context.h"
+
+#include "cuda_common.h"
+#include "cuda_tensor.h"
+
+namespace saga {
+
+/**
+ * A checkpoint in flight. At a batch boundary the tensors are copied
+ * into a device side staging buffer on the compute stream (so training
+ * can carry on modifying the weights) and from there to pinned host
+ * memory on a stream of its own. If the staging buffer can't be
+ * allocated we copy straight to host memory on the compute stream
+ * instead. A writer thread waits for the copies and writes the file
+ */
+struct CudaCheckpoint {
+
+  static const size_t ALIGNMENT = 256;
+
+  struct Item {
+    std::string name;
+    std::shared_ptr<CudaTensor> tensor;
+    bool optimizer;
+    size_t offset;
+    size_t size;
+  };
+
+  std::string path_;
+  std::vector<Item> items_;
+  size_t size_ = 0;
+  std::promise<bool> promise_;
+
+  void add(const std::string &name, std::shared_ptr<CudaTensor> t,
+           bool optimizer) {
+    const int max_rank = 8;
+    int dims[max_rank];
+    int strides[max_rank];
+    int rank;
+    cudnnDataType_t data_type;
+
+    chkCUDNN(cudnnGetTensorNdDescriptor(t->desc_, max_rank, &data_type,
+                                        &rank, dims, strides));
+    int64_t span = 1;
+    for(int i = 0; i < rank; i++)
+      span += (int64_t)(dims[i] - 1) * strides[i];
+
+    const size_t size = span * Tensor::DataTypeSize(t->data_type_);
+    items_.push_back(Item{name, t, optimizer, size_, size});
+    size_ += (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  }
+};
+
+
+std::future<bool>
+CudaProgram::saveCheckpointAsync(const Graph &g, const std::string &path)
+{
+  auto c = std::make_shared<CudaCheckpoint>();
+  c->path_ = path;
+  auto f = c->promise_.get_future();
+
+  {
+    std::scoped_lock lock(ctx_->mutex_);
+    for(const auto &it : g.tensors_) {
+      auto t = resolveTensor_locked(it.second);
+      if(t)
+        c->add(it.first, t, false);
+    }
+  }
+  for(const auto &it : optimizer_state_)
+    c->add(it.first, it.second, true);
+
+  // Only one checkpoint is written at a time, its buffers are reused
+  std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+  joinCheckpointWriter(lock);
+
+  // The previous request still waits for a batch boundary. It has not
+  // been copied anywhere yet so this one can't be accepted
+  if(pending_checkpoint_) {
+    fprintf(stderr, "Checkpoint %s rejected, %s is not snapshotted yet\n",
+            path.c_str(), pending_checkpoint_->path_.c_str());
+    c->promise_.set_value(false);
+    return f;
+  }
+
+  if(c->size_ > checkpoint_size_) {
+    chkCuda(cudaFreeHost(checkpoint_host_));
+    chkCuda(cudaFree(checkpoint_device_));
+    checkpoint_size_ = c->size_;
+    chkCuda(cudaMallocHost(&checkpoint_host_, checkpoint_size_));
+    if(cudaMalloc(&checkpoint_device_, checkpoint_size_) != cudaSuccess) {
+      cudaGetLastError();
+      checkpoint_device_ = NULL;
+    }
+  }
+
+  if(executing_) {
+    pending_checkpoint_ = c;
+  } else {
+    snapshot(c);
+  }
+  return f;
+}
+
+
+// Called with checkpoint_mutex_ held
+void
+CudaProgram::snapshot(std::shared_ptr<CudaCheckpoint> c)
+{
+  cudaStream_t stream = stream_;
+  char *dst = (char *)(checkpoint_device_ ? checkpoint_device_ :
+                       checkpoint_host_);
+
+  for(const auto &i : c->items_) {
+    chkCuda(cudaMemcpyAsync(dst + i.offset, i.tensor->deviceMem(), i.size,
+                            cudaMemcpyDefault, stream));
+  }
+
+  cudaEvent_t done;
+  chkCuda(cudaEventCreateWithFlags(&done, cudaEventDisableTiming));
+
+  cudaStream_t download = NULL;
+  if(checkpoint_device_) {
+    chkCuda(cudaEventRecord(done, stream));
+    chkCuda(cudaStreamCreateWithFlags(&download, cudaStreamNonBlocking));
+    chkCuda(cudaStreamWaitEvent(download, done, 0));
+    chkCuda(cudaMemcpyAsync(checkpoint_host_, checkpoint_device_, c->size_,
+                            cudaMemcpyDeviceToHost, download));
+    stream = download;
+  }
+  chkCuda(cudaEventRecord(done, stream));
+
+  // Host buffer is owned by the program which joins the writer before
+  // reallocating or freeing it
+  char *host = (char *)checkpoint_host_;
+  const int device = ctx_->deviceId_;
+
+  checkpoint_writer_ = std::thread([c, host, device, done, download] {
+      chkCuda(cudaSetDevice(device));
+      chkCuda(cudaEventSynchronize(done));
+      chkCuda(cudaEventDestroy(done));
+      if(download)
+        chkCuda(cudaStreamDestroy(download));
+
+      std::shared_ptr<void> mapping(host, [](void *) {});
+
+      std::vector<CheckpointItem> items;
+      for(const auto &i : c->items_) {
+        const int max_rank = 8;
+        int dims[max_rank];
+        int strides[max_rank];
+        int rank;
+        cudnnDataType_t data_type;
+
+        chkCUDNN(cudnnGetTensorNdDescriptor(i.tensor->desc_, max_rank,
+                                            &data_type, &rank, dims,
+                                            strides));
+        auto t = makeMappedCPUTensor(i.tensor->data_type_,
+                                     Dims(dims, dims + rank), mapping,
+                                     host + i.offset,
+                                     i.name, Dims(strides, strides + rank));
+        items.push_back(CheckpointItem{i.name, t, i.optimizer});
+      }
+      c->promise_.set_value(checkpoint_write(c->path_.c_str(), items));
+    });
+}
+
+
+// Called by execute() after each batch has been issued and once more
+// when it's done
+void
+CudaProgram::checkpointBoundary(bool last)
+{
+  std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+  if(last)
+    executing_ = false;
+  if(pending_checkpoint_) {
+    snapshot(pending_checkpoint_);
+    pending_checkpoint_.reset();
+  }
+}
+
+
+// Wait for the writer to finish. Drops the lock while waiting, so a
+// pending checkpoint may be snapshotted and start a new writer meanwhile
+void
+CudaProgram::joinCheckpointWriter(std::unique_lock<std::mutex> &lock)
+{
+  while(checkpoint_writer_.joinable()) {
+    std::thread writer;
+    writer.swap(checkpoint_writer_);
+    lock.unlock();
+    writer.join();
+    lock.lock();
+  }
+}
+
+
+void
+CudaProgram::finishCheckpoint()
+{
+  std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+  // No more batch boundaries, fail a checkpoint that never got one
+  if(pending_checkpoint_) {
+    pending_checkpoint_->promise_.set_value(false);
+    pending_checkpoint_.reset();
+  }
+  joinCheckpointWriter(lock);
+  chkCuda(cudaFreeHost(checkpoint_host_));
+  chkCuda(cudaFree(checkpoint_device_));
+  checkpoint_host_ = NULL;
+  checkpoint_device_ = NULL;
+  checkpoint_size_ = 0;
+}
+
+}
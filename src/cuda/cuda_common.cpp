@@ -25,6 +25,11 @@
  */
 
 #include <map>
+#include <thread>
+#include <condition_variable>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "saga.h"
 #include "tensor.h"
@@ -39,7 +44,10 @@ namespace saga {
 int
 CudaContext::init()
 {
-  cudaGetDevice(&deviceId_);
+  if(deviceId_ < 0)
+    cudaGetDevice(&deviceId_);
+  else
+    chkCuda(cudaSetDevice(deviceId_));
 
   struct cudaDeviceProp prop;
   cudaGetDeviceProperties(&prop, deviceId_);
@@ -47,6 +55,9 @@ CudaContext::init()
   chkCuda(cudaStreamCreateWithFlags(&stream_,
                                     cudaStreamNonBlocking));
 
+  algo_cache_prefix_ = std::string(prop.name) + ":cudnn" +
+    std::to_string(cudnnGetVersion()) + ":";
+
   printf("Device:%s (%d.%d) Concurrent:%s CanMapHostMem:%s id:%d\n",
          prop.name, prop.major, prop.minor,
          prop.concurrentKernels ? "yes":"no",
@@ -64,6 +75,177 @@ CudaContext::init()
 }
 
 
+//------------------------------------------------------------------------
+
+void
+CudaContext::loadAlgoCache(const std::string &path)
+{
+  if(path == algo_cache_path_)
+    return;
+
+  saveAlgoCache();
+  algo_cache_.clear();
+  algo_cache_path_ = path;
+
+  FILE *fp = fopen(path.c_str(), "r");
+  if(fp == NULL)
+    return;
+
+  char line[1024];
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    char *key;
+    const int algo = strtol(line, &key, 10);
+    if(*key != ' ')
+      continue;
+    key++;
+    key[strcspn(key, "\n")] = 0;
+    algo_cache_[key] = algo;
+  }
+  fclose(fp);
+}
+
+
+void
+CudaContext::saveAlgoCache()
+{
+  if(!algo_cache_dirty_ || algo_cache_path_.empty())
+    return;
+
+  // Write to a temporary file and rename so concurrent readers
+  // never see a partial file
+  const std::string tmp = algo_cache_path_ + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if(fp == NULL) {
+    fprintf(stderr, "Unable to save algorithm cache to %s -- %s\n",
+            tmp.c_str(), strerror(errno));
+    return;
+  }
+
+  for(const auto &it : algo_cache_)
+    fprintf(fp, "%d %s\n", it.second, it.first.c_str());
+
+  if(fclose(fp) || rename(tmp.c_str(), algo_cache_path_.c_str())) {
+    fprintf(stderr, "Unable to save algorithm cache to %s -- %s\n",
+            algo_cache_path_.c_str(), strerror(errno));
+    unlink(tmp.c_str());
+    return;
+  }
+  algo_cache_dirty_ = false;
+}
+
+
+bool
+CudaContext::findAlgo(const std::string &key, int *algo) const
+{
+  auto it = algo_cache_.find(algo_cache_prefix_ + key);
+  if(it == algo_cache_.end())
+    return false;
+  *algo = it->second;
+  return true;
+}
+
+
+void
+CudaContext::storeAlgo(const std::string &key, int algo)
+{
+  algo_cache_[algo_cache_prefix_ + key] = algo;
+  algo_cache_dirty_ = true;
+}
+
+
+CudaContext::~CudaContext()
+{
+  for(int i = 0; i < UPLOAD_BUFFERS; i++) {
+    if(upload_buffers_[i] == NULL)
+      continue;
+    chkCuda(cudaEventSynchronize(upload_done_[i]));
+    chkCuda(cudaEventDestroy(upload_done_[i]));
+    chkCuda(cudaFreeHost(upload_buffers_[i]));
+  }
+}
+
+
+void
+CudaContext::uploadAsync(void *dst, const void *src, size_t size)
+{
+  while(size) {
+    const int i = upload_index_;
+    upload_index_ = (upload_index_ + 1) % UPLOAD_BUFFERS;
+
+    if(upload_buffers_[i] == NULL) {
+      chkCuda(cudaMallocHost(&upload_buffers_[i], UPLOAD_BUFFER_SIZE));
+      chkCuda(cudaEventCreateWithFlags(&upload_done_[i],
+                                       cudaEventDisableTiming));
+    } else {
+      // Previous transfer from this buffer must be done
+      chkCuda(cudaEventSynchronize(upload_done_[i]));
+    }
+
+    const size_t chunk = std::min(size, UPLOAD_BUFFER_SIZE);
+    memcpy(upload_buffers_[i], src, chunk);
+    chkCuda(cudaMemcpyAsync(dst, upload_buffers_[i], chunk,
+                            cudaMemcpyHostToDevice, stream_));
+    chkCuda(cudaEventRecord(upload_done_[i], stream_));
+
+    dst = (char *)dst + chunk;
+    src = (const char *)src + chunk;
+    size -= chunk;
+  }
+}
+
+
+std::shared_ptr<CudaTensorStorage>
+CudaContext::findSharedStorage(const std::shared_ptr<Tensor> &src,
+                               const Dims &dims,
+                               cudnnTensorFormat_t format)
+{
+  auto range = shared_tensors_.equal_range(src.get());
+  for(auto it = range.first; it != range.second; ++it) {
+    const auto &st = it->second;
+    if(st.src.lock() != src || st.dims != dims || st.format != format)
+      continue;
+    auto storage = st.storage.lock();
+    if(storage)
+      return storage;
+  }
+  return nullptr;
+}
+
+
+void
+CudaContext::addSharedStorage(const std::shared_ptr<Tensor> &src,
+                              const CudaTensor &t, cudnnTensorFormat_t format)
+{
+  for(auto it = shared_tensors_.begin(); it != shared_tensors_.end();) {
+    if(it->second.storage.expired() || it->second.src.expired())
+      it = shared_tensors_.erase(it);
+    else
+      ++it;
+  }
+  shared_tensors_.insert({src.get(), SharedTensor{src, t.storage_,
+                                                  t.dims_, format}});
+}
+
+
+std::shared_ptr<Tensor>
+CudaContext::derivedTensor(const std::shared_ptr<Tensor> &src,
+                           const std::string &what,
+                           const std::function<std::shared_ptr<Tensor>(void)> &create)
+{
+  auto &dt = derived_tensors_[std::make_pair(src.get(), what)];
+  auto derived = dt.derived.lock();
+  if(derived && dt.src.lock() == src)
+    return derived;
+
+  derived = create();
+  dt.src = src;
+  dt.derived = derived;
+  return derived;
+}
+
+
+//------------------------------------------------------------------------
+
 static
 std::shared_ptr<Context> createCudaContext()
 {
@@ -110,6 +292,13 @@ CudaProgram::upd(const std::shared_ptr<CudaOperation> &op)
   upd_operations_.push_back(op);
 }
 
+void
+CudaProgram::upd(std::shared_ptr<CudaTensor> weights,
+                 std::shared_ptr<CudaTensor> gradient)
+{
+  params_.push_back(std::make_pair(weights, gradient));
+}
+
 
 std::shared_ptr<CudaTensor>
 CudaProgram::resolveTensor_locked(std::shared_ptr<Tensor> src)
@@ -134,9 +323,73 @@ CudaProgram::resolveTensor(std::shared_ptr<Tensor> src)
 }
 
 
+Tensors
+CudaProgram::optimizerState()
+{
+  Tensors r;
+  for(const auto &it : optimizer_state_)
+    r[it.first] = it.second;
+  return r;
+}
+
+
+// The train state is kept in a tensor so it's saved with the optimizer
+// state and Adam's bias correction continues where it left off
+void
+CudaProgram::setupTrainState()
+{
+  train_state_tensor_ =
+    std::make_shared<CudaTensor>(Tensor::DataType::U8,
+                                 Dims({(int)sizeof(TrainState), 1, 1, 1}),
+                                 CUDNN_TENSOR_NCHW, ctx_, "train_state");
+  train_state_ = (TrainState *)train_state_tensor_->deviceMem();
+
+  const TrainState ts = {.mp_scaling = (float)batch_size_};
+  chkCuda(cudaMemcpy(train_state_, &ts, sizeof(ts),
+                     cudaMemcpyHostToDevice));
+  optimizer_state_["train_state"] = train_state_tensor_;
+
+  if(accumulate_ > 1) {
+    const AccumulateState as = {.accumulate = accumulate_};
+    chkCuda(cudaMalloc(&accumulate_state_, sizeof(as)));
+    chkCuda(cudaMemcpy(accumulate_state_, &as, sizeof(as),
+                       cudaMemcpyHostToDevice));
+  }
+}
+
+
+void
+CudaProgram::restoreOptimizerState(const Graph &g)
+{
+  if(g.optimizer_state_.empty())
+    return;
+
+  size_t restored = 0;
+  for(const auto &it : optimizer_state_) {
+    auto src = g.optimizer_state_.find(it.first);
+    if(src == g.optimizer_state_.end())
+      continue;
+    if(src->second->elements_ != it.second->elements_) {
+      fprintf(stderr, "Optimizer state %s has wrong size, ignored\n",
+              it.first.c_str());
+      continue;
+    }
+    it.second->copyFromLocked(*src->second);
+    restored++;
+  }
+  chkCuda(cudaStreamSynchronize(ctx_->stream_));
+  printf("Restored %zd of %zd optimizer tensors\n", restored,
+         optimizer_state_.size());
+}
+
+
 cudnnTensorFormat_t
 CudaProgram::tensorFormat(Tensor::DataType data_type)
 {
+  // cuDNN only convolves INT8 tensors in NHWC
+  if(data_type == Tensor::DataType::I8)
+    return CUDNN_TENSOR_NHWC;
+
   switch(tensor_layout_) {
   case TensorLayout::Auto:
 
@@ -178,13 +431,27 @@ CudaProgram::lower_tensor(std::shared_ptr<Tensor> src,
       dims.insert(dims.begin(), 1);
   }
 
-  auto t = std::make_shared<CudaTensor>(src->data_type_,
-                                        dims, tensorFormat(src->data_type_),
-                                        ctx_,
-                                        src->name_);
+  const auto format = tensorFormat(src->data_type_);
+
+  if(share_tensors_) {
+    auto storage = ctx_->findSharedStorage(src, dims, format);
+    if(storage) {
+      auto t = std::make_shared<CudaTensor>(storage, dims, format,
+                                            src->name_);
+      shared_.insert(t.get());
+      shareable_.push_back(std::make_pair(src, t));
+      tensors_[src] = t;
+      return t;
+    }
+  }
+
+  auto t = std::make_shared<CudaTensor>(src->data_type_, dims, format,
+                                        ctx_, src->name_);
 
   t->copyFromLocked(*src);
   tensors_[src] = t;
+  if(share_tensors_)
+    shareable_.push_back(std::make_pair(src, t));
   return t;
 }
 
@@ -239,69 +506,234 @@ CudaProgram::lower_tensor_batch(std::shared_ptr<Tensor> src)
 
 
 
+/**
+ * When enabled, the operations for one batch are captured into a CUDA
+ * graph on first execution and replayed after that. As double buffered
+ * tensors rotate between device buffers we keep one graph per pipeline
+ * slot. Anything that changes between batches (mixed precision
+ * scaling, Adam iteration) lives on the device in train_state_
+ */
 void
-CudaProgram::infer(long batches)
+CudaProgram::run(cudaGraphExec_t *graph, const std::function<void(void)> &fn)
+{
+  if(!config_.cuda_graph || debug_ || profiler_) {
+    fn();
+    return;
+  }
+
+  if(*graph == NULL) {
+    cudaGraph_t g;
+    chkCuda(cudaStreamBeginCapture(stream_,
+                                   cudaStreamCaptureModeThreadLocal));
+    fn();
+    chkCuda(cudaStreamEndCapture(stream_, &g));
+    chkCuda(cudaGraphInstantiate(graph, g, NULL, NULL, 0));
+    chkCuda(cudaGraphDestroy(g));
+  }
+  chkCuda(cudaGraphLaunch(*graph, stream_));
+}
+
+
+/**
+ * Pipelined batch execution. Three threads cooperate:
+ *
+ *  Loader thread:     Runs PRE accessors and op->load() for batches up
+ *                     to prefetch_depth_ ahead of the batch being
+ *                     computed and uploads them on copy_stream_
+ *
+ *  Calling thread:    Issues the compute work and the download of POST
+ *                     tensors on download_stream_
+ *
+ *  Completion thread: Waits for each batch's download to finish and
+ *                     runs POST accessors
+ *
+ * Batch N uses slot (N % slots_) of all double buffered tensors and the
+ * per slot events order the streams against each other. The host side
+ * counters make sure an event is recorded before anyone waits on it and
+ * that a slot is not reused while still being accessed from the CPU
+ */
+void
+CudaProgram::execute(long batches,
+                     const CudaBatchAccessOps &pre,
+                     const CudaBatchAccessOps &post,
+                     const std::vector<std::shared_ptr<CudaOperation>> &ops,
+                     std::vector<cudaGraphExec_t> &graphs,
+                     bool training,
+                     const std::function<void(void)> &fn)
 {
   if(batches == 0)
     return;
 
-  issueOps(infer_pre_, 0);
-  flipDoubleBufferedTensors();
-  for(const auto &op : infer_operations_) op->load(*this, 0);
-  cudaStreamSynchronize(ctx_->stream_);
+  {
+    std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+    executing_ = true;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  long loaded = 0;      // Batches uploaded by the loader thread
+  long issued = 0;      // Batches issued for computation
+  long downloaded = 0;  // Batches with downloads issued
+  long completed = 0;   // Batches that POST accessors are done with
+
+  auto wait_for = [&](const std::function<bool(void)> &pred) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, pred);
+  };
+
+  auto advance = [&](long &counter) {
+    std::unique_lock<std::mutex> lock(mutex);
+    counter++;
+    cond.notify_all();
+  };
+
+  std::thread loader([&] {
+      chkCuda(cudaSetDevice(ctx_->deviceId_));
+      for(long i = 0; i < batches; i++) {
+        const int slot = batchSlot(i);
+
+        // Batch (i - slots_) must have been issued so its compute_done_
+        // event is recorded before we make the copy stream wait on it
+        wait_for([&] { return issued > i - slots_; });
+
+        // Pinned host buffer is free once the previous upload is done
+        chkCuda(cudaEventSynchronize(upload_done_[slot]));
+
+        const int token = profiler_ ?
+          profiler_->begin(NULL, "[upload]", copy_stream_) : 0;
+
+        issueOps(pre, i);
+        for(const auto &op : ops)
+          op->load(*this, i);
+
+        if(profiler_)
+          profiler_->end(token, copy_stream_);
+
+        chkCuda(cudaEventRecord(upload_done_[slot], copy_stream_));
+        advance(loaded);
+      }
+    });
+
+  std::thread completion;
+  if(!post.empty()) {
+    completion = std::thread([&] {
+        chkCuda(cudaSetDevice(ctx_->deviceId_));
+        for(long i = 0; i < batches; i++) {
+          wait_for([&] { return downloaded > i; });
+          postOps(post, i);
+          advance(completed);
+        }
+      });
+  }
+
   for(long i = 0; i < batches; i++) {
+    const int slot = batchSlot(i);
+
+    wait_for([&] { return loaded > i; });
+    chkCuda(cudaStreamWaitEvent(stream_, upload_done_[slot], 0));
+
+    // Don't overwrite POST tensors until the previous download from
+    // this slot has finished
+    if(!post.empty())
+      chkCuda(cudaStreamWaitEvent(stream_, download_done_[slot], 0));
+
+    selectSlot(i);
+
+    // Checked batches reduce statistics inside the batch so they are
+    // captured in graphs of their own
+    health_sample_ = health_ &&
+      health_->begin(!training || (train_batches_ + 1) % accumulate_ == 0);
+    run(&graphs[slot + (health_sample_ ? slots_ : 0)], fn);
+    if(health_sample_)
+      health_->end(stream_);
+    if(training)
+      train_batches_++;
+    chkCuda(cudaEventRecord(compute_done_[slot], stream_));
+    advance(issued);
+
+    // Batch boundary, weights are consistent in stream order
+    checkpointBoundary(false);
+
+    if(!post.empty()) {
+      // Host side buffer must have been consumed by the completion thread
+      wait_for([&] { return completed > i - slots_; });
+      const int token = profiler_ ?
+        profiler_->begin(NULL, "[download]", download_stream_) : 0;
+      downloadOps(post, i);
+      if(profiler_)
+        profiler_->end(token, download_stream_);
+      advance(downloaded);
+    }
 
-    for(const auto &op : infer_operations_) op->exec(*this);
+    // Keep the number of outstanding events bounded
+    if(profiler_ && (i & 63) == 63)
+      profiler_->harvest();
+  }
+
+  loader.join();
+  if(completion.joinable())
+    completion.join();
 
-    if(i < batches - 1)
-      issueOps(infer_pre_, i + 1);
-    if(i > 0)
-      issueOps(infer_post_, i - 1);
+  cudaStreamSynchronize(stream_);
+  cudaStreamSynchronize(copy_stream_);
+  checkpointBoundary(true);
 
-    flipDoubleBufferedTensors();
-    for(const auto &op : infer_operations_) op->load(*this, i + 1);
-    cudaStreamSynchronize(ctx_->stream_);
+  if(profiler_) {
+    profiler_->batches_ += batches;
+    profiler_->harvest();
   }
-  issueOps(infer_post_, batches - 1);
 }
 
 
 void
-CudaProgram::train(long batches)
+CudaProgram::infer(long batches)
 {
-  if(batches == 0)
-    return;
+  execute(batches, infer_pre_, infer_post_, infer_operations_,
+          infer_graph_, false, [&] {
+            execOps(infer_operations_);
+            if(health_sample_)
+              health_->sample(stream_);
+          });
+}
 
-  issueOps(train_pre_, 0);
-  flipDoubleBufferedTensors();
-  for(const auto &op : train_operations_) op->load(*this, 0);
-  cudaStreamSynchronize(ctx_->stream_);
 
-  for(long i = 0; i < batches; i++) {
+void
+CudaProgram::execOps(const std::vector<std::shared_ptr<CudaOperation>> &ops)
+{
+  if(!profiler_) {
+    for(const auto &op : ops)
+      op->exec(*this);
+    return;
+  }
 
-    for(const auto &op : train_operations_) op->exec(*this);
-    for(const auto &op : bwd_operations_)   op->exec(*this);
-    for(const auto &op : upd_operations_)   op->exec(*this);
+  for(const auto &op : ops) {
+    const int token = profiler_->begin(op.get(), NULL, stream_);
+    op->exec(*this);
+    profiler_->end(token, stream_);
+  }
+}
 
-    if(i < batches - 1)
-      issueOps(train_pre_, i + 1);
-    if(i > 0)
-      issueOps(train_post_, i - 1);
 
-    flipDoubleBufferedTensors();
-    if(i < batches - 1)
-      for(const auto &op : train_operations_) op->load(*this, i + 1);
-    cudaStreamSynchronize(ctx_->stream_);
+void
+CudaProgram::execTrainOps()
+{
+  train_step_begin(train_state_, accumulate_state_, stream_);
+  execOps(train_operations_);
+  execOps(bwd_operations_);
+  // Before the optimizer clears accumulated gradients
+  if(health_sample_)
+    health_->sample(stream_);
+  execOps(upd_operations_);
+  train_step_end(train_state_, accumulate_state_, (int *)check_result_,
+                 stream_);
+}
 
-    if(*(int *)check_result_) {
-      mp_scaling_ *= 0.5;
-      *(int *)check_result_ = 0;
-    } else {
-      mp_scaling_ *= 1.01;
-    }
-  }
 
-  issueOps(train_post_, batches - 1);
+void
+CudaProgram::train(long batches)
+{
+  execute(batches, train_pre_, train_post_, train_operations_,
+          train_graph_, true, [&] { execTrainOps(); });
 }
 
 
@@ -325,6 +757,13 @@ CudaProgram::print() const
   for(const auto &op : upd_operations_) {
     op->print();
   }
+
+  printf("\nTensor memory: %zd kB (%zd kB unplanned), "
+         "%zd kB of intermediates in %zd kB arena, workspace %zd kB\n",
+         (total_size_ - planned_size_ + arena_size_) / 1024,
+         total_size_ / 1024,
+         planned_size_ / 1024, arena_size_ / 1024,
+         workspace_size_ / 1024);
 }
 
 void
@@ -370,6 +809,25 @@ find_operation(const Node &n)
 }
 
 
+bool
+CudaContext::supportsNode(const Node &n, const ProgramConfig &pc) const
+{
+  // Lowered by transforms into other operations (or away entirely)
+  if(n.type_ == "concat" || n.type_ == "reshape" ||
+     (n.type_ == "dropout" && !pc.training))
+    return true;
+
+  auto op = find_operation(n);
+  if(op == NULL)
+    return false;
+  if(pc.training && !op->mk_train)
+    return false;
+  if(pc.inference && !op->mk_infer)
+    return false;
+  return true;
+}
+
+
 
 struct CudaNodeTransform {
   CudaTransformType type;
@@ -503,7 +961,7 @@ CudaProgram::addPrePostOp(std::shared_ptr<CudaTensor> t,
   auto op = CudaBatchAccessOp{.tensor_ = t, .fn_ = a.fn};
 
   if(a.phase == Phase::PRE) {
-    op.prefetch_ = true;
+    op.upload_ = true;
     if(a.mode == Mode::INFER || a.mode == Mode::ALL)
       infer_pre_.push_back(op);
 
@@ -532,7 +990,7 @@ CudaProgram::setupAccessors(const BatchTensorAccessors &accessors)
     auto dims = src->dims_.n(batch_size_);
     auto t = std::make_shared<CudaTensor>(src->data_type_, dims,
                                           tensorFormat(src->data_type_),
-                                          ctx_, src->name_, 2);
+                                          ctx_, src->name_, slots_);
 
     flips_.push_back(t->storage_);
     t->copyFromLocked(*src);
@@ -549,7 +1007,7 @@ CudaProgram::setupAccessors(const BatchTensorAccessors &accessors)
     auto dims = src->dims_.n(batch_size_);
     auto g = std::make_shared<CudaTensor>(src->data_type_, dims,
                                           tensorFormat(src->data_type_),
-                                          ctx_, src->name_, 2);
+                                          ctx_, src->name_, slots_);
     flips_.push_back(g->storage_);
 
     auto t = lower_tensor_batch(src);
@@ -561,17 +1019,69 @@ CudaProgram::setupAccessors(const BatchTensorAccessors &accessors)
 
 
 
+static CudaDataParallelFactory *data_parallel_factory;
+
+void
+CudaRegisterDataParallel(CudaDataParallelFactory *fn)
+{
+  data_parallel_factory = fn;
+}
+
+
 std::shared_ptr<Program>
-CudaContext::createProgram(const Graph &g,
+CudaContext::createProgram(const Graph &graph,
                            const ProgramConfig &pc,
                            const BatchTensorAccessors &accessors)
 {
+  const Graph g = optimizedGraph(graph, pc, accessors);
+
+  if(pc.data_parallel) {
+    if(data_parallel_factory)
+      return data_parallel_factory(shared_from_this(), g, pc, accessors);
+    fprintf(stderr, "Data parallel training not available "
+            "(built without NCCL), using a single device\n");
+  }
+  return createCudaProgram(g, pc, accessors);
+}
+
+
+std::shared_ptr<CudaProgram>
+CudaContext::createCudaProgram(const Graph &g,
+                               const ProgramConfig &pc,
+                               const BatchTensorAccessors &accessors,
+                               int batch_offset)
+{
+  // Calibration creates and runs a program of its own so it must be
+  // done before taking the lock
+  std::unordered_map<std::shared_ptr<Tensor>, float> int8_ranges;
+  if(pc.int8) {
+    if(pc.training) {
+      fprintf(stderr, "INT8 is only supported by inference-only programs, "
+              "ignored\n");
+    } else {
+      int8_ranges = CudaCalibrateInt8(*this, g, pc, accessors, batch_offset);
+    }
+  }
+
   std::scoped_lock lock(mutex_);
 
-  auto p = std::make_shared<CudaProgram>(shared_from_this(),
-                                          pc.tensor_layout,
-                                          pc.batch_size,
-                                          pc.initial_learning_rate);
+  auto p = std::make_shared<CudaProgram>(shared_from_this(), pc,
+                                         batch_offset);
+  p->int8_ranges_ = std::move(int8_ranges);
+  p->setupTrainState();
+
+  if(pc.autotune) {
+    std::string path = pc.autotune_cache;
+    if(path.empty() && getenv("HOME"))
+      path = std::string(getenv("HOME")) + "/.saga_autotune";
+    loadAlgoCache(path);
+  }
+
+  if(!pc.program_cache.empty()) {
+    p->cache_ = std::make_unique<CudaProgramCache>();
+    p->cache_->load(CudaProgramCachePath(*this, g, pc, accessors,
+                                         batch_offset));
+  }
 
   p->setupAccessors(accessors);
 
@@ -579,11 +1089,17 @@ CudaContext::createProgram(const Graph &g,
 
   if(pc.training) {
     auto train_nodes = applyTransforms(CUDA_TRANSFORM_TRAINING, *p, nodes);
+    std::unordered_set<const CudaOperation *> checkpoints;
 
     for(const auto &n : train_nodes) {
       auto op = find_operation(*n);
       if(op != NULL && op->mk_train) {
+        const size_t first = p->train_operations_.size();
         op->mk_train(*p, *n);
+        if(n->attributes_.get("checkpoint", false)) {
+          for(size_t i = first; i < p->train_operations_.size(); i++)
+            checkpoints.insert(p->train_operations_[i].get());
+        }
       } else {
         fprintf(stderr, "Unable to create training operation for node %s\n",
                 n->type_.c_str());
@@ -593,6 +1109,13 @@ CudaContext::createProgram(const Graph &g,
     }
 
     assert(p->infer_operations_.empty());
+
+    // Before planMemory() as the optimizer packs weights and gradients
+    p->setupOptimizer();
+    p->restoreOptimizerState(g);
+
+    if(pc.recompute)
+      p->setupRecompute(checkpoints);
   }
 
   if(pc.inference) {
@@ -609,8 +1132,19 @@ CudaContext::createProgram(const Graph &g,
       }
     }
   }
+  if(p->share_tensors_)
+    p->shareTensors();
+  p->setupHealthMonitor(g);
+  p->planMemory(g);
   p->allocWorkspace();
 
+  // Tensors copied from host memory during setup may still be in flight
+  chkCuda(cudaStreamSynchronize(stream_));
+
+  if(pc.autotune)
+    saveAlgoCache();
+  if(p->cache_)
+    p->cache_->save();
 
   return p;
 }
@@ -2,11 +2,20 @@
 
 #pragma once
 
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <cudnn.h>
 #include <cublas_v2.h>
+#include <cublasLt.h>
+
+#include "cuda_kernels.h"
 
 
 #define chkCUDNN(expression) {                                          \
@@ -33,20 +42,23 @@ namespace saga {
 
 class CudaTensor;
 class CudaOperation;
+class CudaProgram;
+struct CudaCheckpoint;
 class CudaTensorStorage;
 
+typedef std::vector<std::shared_ptr<CudaTensor>> CudaTensors;
 
 
 class CudaContext : public Context,
                     public std::enable_shared_from_this<CudaContext> {
 public:
-  CudaContext()
+  CudaContext(int deviceId = -1)
     : cudnn_(NULL)
     , cublas_(NULL)
+    , deviceId_(deviceId)
   {}
 
-  ~CudaContext()
-  {}
+  ~CudaContext();
 
   int init();
 
@@ -54,18 +66,214 @@ public:
                                          const ProgramConfig &pc,
                                          const BatchTensorAccessors &accessors);
 
+  bool supportsNode(const Node &n, const ProgramConfig &pc) const override;
+
+  // batch_offset is the position of this program's first batch element
+  // when the batch is split over multiple programs (see cuda_parallel.cpp)
+  std::shared_ptr<CudaProgram> createCudaProgram(const Graph &g,
+                                                 const ProgramConfig &pc,
+                                                 const BatchTensorAccessors &accessors,
+                                                 int batch_offset = 0);
+
+  // Autotuned algorithm cache. Keys are implicitly prefixed with
+  // device name and cuDNN version
+  void loadAlgoCache(const std::string &path);
+  void saveAlgoCache();
+  bool findAlgo(const std::string &key, int *algo) const;
+  void storeAlgo(const std::string &key, int algo);
+
+  // cuBLASLt algorithms picked by heuristics, per shape and epilogue
+  std::unordered_map<std::string, cublasLtMatmulHeuristicResult_t> lt_algos_;
+
   cudaStream_t stream_;
   cudnnHandle_t cudnn_;
   cublasHandle_t cublas_;
   int deviceId_;
   std::mutex mutex_;
+
+  std::string algo_cache_prefix_;
+  std::string algo_cache_path_;
+  std::unordered_map<std::string, int> algo_cache_;
+  bool algo_cache_dirty_ = false;
+
+  // Copy from pageable host memory (eg. a mmap:ed model) to the device
+  // on stream_ through a ring of pinned staging buffers. Returns as soon
+  // as src has been consumed, the transfer may still be in flight
+  void uploadAsync(void *dst, const void *src, size_t size);
+
+  static const int UPLOAD_BUFFERS = 4;
+  static const size_t UPLOAD_BUFFER_SIZE = 4 * 1024 * 1024;
+  void *upload_buffers_[UPLOAD_BUFFERS] = {};
+  cudaEvent_t upload_done_[UPLOAD_BUFFERS] = {};
+  int upload_index_ = 0;
+
+  // Device storage of graph tensors shared between inference-only
+  // programs. Entries expire with the last program using the storage
+  struct SharedTensor {
+    std::weak_ptr<Tensor> src;
+    std::weak_ptr<CudaTensorStorage> storage;
+    Dims dims;
+    cudnnTensorFormat_t format;
+  };
+
+  std::unordered_multimap<const Tensor *, SharedTensor> shared_tensors_;
+
+  std::shared_ptr<CudaTensorStorage> findSharedStorage(const std::shared_ptr<Tensor> &src,
+                                                       const Dims &dims,
+                                                       cudnnTensorFormat_t format);
+
+  void addSharedStorage(const std::shared_ptr<Tensor> &src,
+                        const CudaTensor &t, cudnnTensorFormat_t format);
+
+  // Tensors created by transforms from a graph tensor (eg. batchnorm
+  // folded weights). Handing out the same tensor to all programs lets
+  // them share its storage as well
+  struct DerivedTensor {
+    std::weak_ptr<Tensor> src;
+    std::weak_ptr<Tensor> derived;
+  };
+
+  std::map<std::pair<const Tensor *, std::string>,
+           DerivedTensor> derived_tensors_;
+
+  std::shared_ptr<Tensor> derivedTensor(const std::shared_ptr<Tensor> &src,
+                                        const std::string &what,
+                                        const std::function<std::shared_ptr<Tensor>(void)> &create);
+};
+
+
+/**
+ * GPU time of operations and program phases, measured with events
+ * recorded around them. Implemented in cuda_profile.cpp
+ */
+class CudaProfiler {
+public:
+  ~CudaProfiler();
+
+  // op is NULL for program phases such as uploads. Returns a token for
+  // end(). Thread safe
+  int begin(const CudaOperation *op, const char *phase,
+            cudaStream_t stream);
+  void end(int token, cudaStream_t stream);
+
+  // Collect timings of finished samples. Blocks on their events
+  void harvest();
+
+  ProfileReport report();
+
+  struct Entry {
+    const CudaOperation *op;
+    std::string name;
+    std::vector<float> samples;  // In ms
+  };
+
+  struct Sample {
+    int entry;
+    cudaEvent_t start;
+    cudaEvent_t end;
+    bool done;
+  };
+
+  std::mutex mutex_;
+  std::vector<Entry> entries_;
+  std::unordered_map<const void *, int> entry_index_;
+  std::unordered_map<int, Sample> pending_;
+  std::vector<cudaEvent_t> free_events_;
+  int next_token_ = 0;
+  long batches_ = 0;
 };
 
 
+/**
+ * Periodic checks of selected tensors for NaN / inf, see
+ * ProgramConfig::health_check_interval. The statistics are reduced on
+ * the program's stream and copied to pinned memory. They are collected
+ * at a later batch once the copy has completed, so execution never
+ * waits for them. A check is skipped if the previous one is still in
+ * flight. Implemented in cuda_profile.cpp
+ *
+ * The reduction is issued from within the batch, before the optimizer
+ * step which clears accumulated gradients. With gradient accumulation a
+ * due check waits for the last batch of an accumulation so it sees the
+ * complete sums
+ */
+class CudaHealthMonitor {
+public:
+  CudaHealthMonitor(const CudaTensors &tensors, int interval);
+  ~CudaHealthMonitor();
+
+  // Before each batch is issued. complete is false for training batches
+  // that don't end an accumulation. Returns true if the batch is checked
+  bool begin(bool complete);
+
+  // Within a checked batch, may be captured in a CUDA graph
+  void sample(cudaStream_t stream);
+
+  // After a checked batch has been issued on stream
+  void end(cudaStream_t stream);
+
+  // Waits for a check in flight
+  HealthReport report();
+
+  const CudaTensors tensors_;
+  const int interval_;
+
+private:
+  void collect();
+
+  std::mutex mutex_;
+  long batches_ = 0;
+  TensorStatsResult *device_;  // Partials of all tensors, then results
+  TensorStatsResult *host_;    // Pinned
+  cudaEvent_t done_;
+  bool due_ = false;
+  long sample_batch_ = 0;
+  bool pending_ = false;
+  long pending_batch_ = 0;
+  HealthReport report_;
+};
+
+
+/**
+ * Outcome of lowering a graph: algorithms picked for cuDNN convolutions
+ * and cuBLASLt matmuls and the placement of storages in the memory
+ * arena. Stored in ProgramConfig::program_cache under a key derived
+ * from the graph, config, device and library versions. A later program
+ * built from the same graph replays it instead of searching and
+ * planning again. Implemented in cuda_program_cache.cpp
+ */
+struct CudaProgramCache {
+  bool load(const std::string &path);
+  void save();
+
+  std::string path_;
+  bool loaded_ = false;
+  bool dirty_ = false;
+
+  std::unordered_map<std::string, int> algos_;
+  std::unordered_map<std::string, cublasLtMatmulHeuristicResult_t> lt_algos_;
+
+  // Planned storages in placement order. seq is the order in which the
+  // planner first saw the storage, size and seq must match on replay
+  struct Placement {
+    size_t seq;
+    size_t size;
+    size_t offset;
+  };
+  std::vector<Placement> placement_;
+  size_t arena_size_ = 0;
+};
+
+std::string CudaProgramCachePath(const CudaContext &ctx, const Graph &g,
+                                 const ProgramConfig &pc,
+                                 const BatchTensorAccessors &accessors,
+                                 int batch_offset);
+
+
 struct CudaBatchAccessOp {
   std::shared_ptr<CudaTensor> tensor_;
   BatchTensorAccessFn fn_;
-  bool prefetch_ = false;
+  bool upload_ = false;
 };
 
 typedef std::vector<CudaBatchAccessOp> CudaBatchAccessOps;
@@ -76,27 +284,75 @@ class CudaProgram : public Program {
 public:
 
   CudaProgram(std::shared_ptr<CudaContext> ctx,
-               TensorLayout tensor_layout,
-               int batch_size,
-               float learning_rate)
+              const ProgramConfig &pc,
+              int batch_offset = 0)
     : ctx_(ctx)
-    , tensor_layout_(tensor_layout)
-    , batch_size_(batch_size)
-    , learning_rate_(learning_rate)
+    , config_(pc)
+    , tensor_layout_(pc.tensor_layout)
+    , batch_size_(pc.batch_size)
+    , batch_offset_(batch_offset)
+    , learning_rate_(pc.initial_learning_rate)
+    , accumulate_(std::max(1, pc.gradient_accumulation))
     , debug_(false)
+    , share_tensors_(pc.inference && !pc.training)
     , workspace_(NULL)
     , workspace_size_(0)
     , workspace_requested_(0)
-    , mp_scaling_(batch_size)
+    , arena_size_(0)
+    , planned_size_(0)
+    , total_size_(0)
+    , prefetch_depth_(std::max(1, std::min(pc.prefetch_depth,
+                                           MAX_PREFETCH_DEPTH)))
+    , slots_(prefetch_depth_ + 1)
+    , infer_graph_(slots_ * 2)
+    , train_graph_(slots_ * 2)
   {
-    chkCuda(cudaMallocManaged(&check_result_, sizeof(int), cudaMemAttachGlobal));
-    chkCuda(cudaMemset(check_result_, 0, sizeof(int)));
+    chkCuda(cudaMalloc(&check_result_, sizeof(int)));
+    chkCuda(cudaMemsetAsync(check_result_, 0, sizeof(int), ctx_->stream_));
+
+    chkCuda(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+    chkCUDNN(cudnnCreate(&cudnn_));
+    chkCUDNN(cudnnSetStream(cudnn_, stream_));
+    chkCuda(cublasCreate(&cublas_));
+    chkCuda(cublasSetStream(cublas_, stream_));
+    chkCuda(cublasSetMathMode(cublas_, CUBLAS_TENSOR_OP_MATH));
+    chkCuda(cublasLtCreate(&cublaslt_));
+
+    chkCuda(cudaStreamCreateWithFlags(&copy_stream_,
+                                      cudaStreamNonBlocking));
+    chkCuda(cudaStreamCreateWithFlags(&download_stream_,
+                                      cudaStreamNonBlocking));
+
+    for(auto v : {&upload_done_, &compute_done_, &download_done_}) {
+      v->resize(slots_);
+      for(auto &e : *v)
+        chkCuda(cudaEventCreateWithFlags(&e, cudaEventDisableTiming));
+    }
   }
 
   ~CudaProgram()
   {
+    finishCheckpoint();
     chkCuda(cudaFree(workspace_));
     chkCuda(cudaFree(check_result_));
+    chkCuda(cudaFree(accumulate_state_));
+    for(int i = 0; i < slots_ * 2; i++) {
+      if(infer_graph_[i])
+        chkCuda(cudaGraphExecDestroy(infer_graph_[i]));
+      if(train_graph_[i])
+        chkCuda(cudaGraphExecDestroy(train_graph_[i]));
+    }
+    for(int i = 0; i < slots_; i++) {
+      chkCuda(cudaEventDestroy(upload_done_[i]));
+      chkCuda(cudaEventDestroy(compute_done_[i]));
+      chkCuda(cudaEventDestroy(download_done_[i]));
+    }
+    chkCuda(cudaStreamDestroy(copy_stream_));
+    chkCuda(cudaStreamDestroy(download_stream_));
+    chkCuda(cublasLtDestroy(cublaslt_));
+    chkCuda(cublasDestroy(cublas_));
+    chkCUDNN(cudnnDestroy(cudnn_));
+    chkCuda(cudaStreamDestroy(stream_));
   }
 
 
@@ -105,11 +361,23 @@ public:
   void train(long batches) override;
   void print() const override;
   void debug(bool) override;
+  void profile(bool on) override;
+  ProfileReport profileReport() override;
+  HealthReport healthReport() override;
+  Tensors optimizerState() override;
+  std::future<bool> saveCheckpointAsync(const Graph &g,
+                                        const std::string &path) override;
 
   void requetstWorkspace(size_t size) {
     workspace_requested_ = std::max(workspace_requested_, size);
   }
 
+  // Weight gradients are summed over accumulate_ batches before each
+  // optimizer step, ops producing them write with this beta
+  float gradientBeta() const {
+    return accumulate_ > 1 ? 1.0f : 0.0f;
+  }
+
   void allocWorkspace() {
     if(workspace_requested_ <= workspace_size_)
       return;
@@ -119,19 +387,61 @@ public:
   }
 
   const std::shared_ptr<CudaContext> ctx_;
+  const ProgramConfig config_;
   const TensorLayout tensor_layout_;
   const int batch_size_;
+  const int batch_offset_;
   const float learning_rate_;
+  const int accumulate_;
   bool debug_;
 
   std::unordered_map<std::shared_ptr<Tensor>,
                      std::shared_ptr<CudaTensor>> tensors_;
 
+  // Operations execute on the program's own stream and handles so
+  // programs of the same context can run concurrently. The context's
+  // stream and handles are only used while creating programs
+  cudaStream_t stream_;
+  cudnnHandle_t cudnn_;
+  cublasHandle_t cublas_;
+  cublasLtHandle_t cublaslt_;
+
+  // Inference-only programs share the device storage of tensors lowered
+  // by lower_tensor() (weights etc) with other programs of the context.
+  // shared_ holds the tensors that were found already uploaded by
+  // someone else, see shareTensors()
+  const bool share_tensors_;
+  std::vector<std::pair<std::shared_ptr<Tensor>,
+                        std::shared_ptr<CudaTensor>>> shareable_;
+  std::unordered_set<const CudaTensor *> shared_;
+
+  bool isShared(const CudaTensor &t) const {
+    return shared_.find(&t) != shared_.end();
+  }
+
+  void shareTensors();
+
+  // Calibrated activation ranges for INT8 inference, see cuda_int8.cpp
+  std::unordered_map<std::shared_ptr<Tensor>, float> int8_ranges_;
+
+  // profiler_ is set while profiling, last_profile_ keeps the result
+  // when profiling is turned off
+  std::shared_ptr<CudaProfiler> profiler_;
+  std::shared_ptr<CudaProfiler> last_profile_;
+
+  std::unique_ptr<CudaHealthMonitor> health_;
+  bool health_sample_ = false;  // Current batch is checked
+  long train_batches_ = 0;
+
   std::vector<std::shared_ptr<CudaOperation>> infer_operations_;
   std::vector<std::shared_ptr<CudaOperation>> train_operations_;
   std::vector<std::shared_ptr<CudaOperation>> bwd_operations_;
   std::vector<std::shared_ptr<CudaOperation>> upd_operations_;
 
+  // Weights and their gradients, all updated by one optimizer operation
+  std::vector<std::pair<std::shared_ptr<CudaTensor>,
+                        std::shared_ptr<CudaTensor>>> params_;
+
   CudaBatchAccessOps infer_pre_;
   CudaBatchAccessOps infer_post_;
   CudaBatchAccessOps train_pre_;
@@ -144,7 +454,71 @@ public:
   size_t workspace_requested_;
 
   void *check_result_;
-  float mp_scaling_;
+
+  // Points into train_state_tensor_, see setupTrainState()
+  TrainState *train_state_;
+  std::shared_ptr<CudaTensor> train_state_tensor_;
+
+  // Only allocated when accumulate_ > 1
+  AccumulateState *accumulate_state_ = NULL;
+
+  // Saved and restored with checkpoints, see optimizerState()
+  std::unordered_map<std::string, std::shared_ptr<CudaTensor>> optimizer_state_;
+
+  // Asynchronous checkpointing, see cuda_checkpoint.cpp. checkpoint_mutex_
+  // protects executing_ and pending_checkpoint_
+  std::mutex checkpoint_mutex_;
+  bool executing_ = false;
+  std::shared_ptr<CudaCheckpoint> pending_checkpoint_;
+  std::thread checkpoint_writer_;
+  void *checkpoint_host_ = NULL;
+  void *checkpoint_device_ = NULL;
+  size_t checkpoint_size_ = 0;
+
+  void snapshot(std::shared_ptr<CudaCheckpoint> c);
+
+  void checkpointBoundary(bool last);
+
+  void joinCheckpointWriter(std::unique_lock<std::mutex> &lock);
+
+  void finishCheckpoint();
+
+  // Host <-> device transfers of double buffered tensors. Events are
+  // per pipeline slot (see execute())
+  cudaStream_t copy_stream_;
+  cudaStream_t download_stream_;
+  std::vector<cudaEvent_t> upload_done_;
+  std::vector<cudaEvent_t> compute_done_;
+  std::vector<cudaEvent_t> download_done_;
+
+  size_t arena_size_;
+  size_t planned_size_;
+  size_t total_size_;
+
+  // Set when ProgramConfig::program_cache is. Algorithms found here are
+  // used as is, everything picked while lowering is recorded
+  std::unique_ptr<CudaProgramCache> cache_;
+
+  bool findAlgo(const std::string &key, int *algo) const;
+  void storeAlgo(const std::string &key, int algo);
+  bool findLtAlgo(const std::string &key,
+                  cublasLtMatmulHeuristicResult_t *algo) const;
+  void storeLtAlgo(const std::string &key,
+                   const cublasLtMatmulHeuristicResult_t &algo);
+
+  // Batches loaded ahead of the one being computed. Each batch in
+  // flight occupies one slot of the ring buffered edge tensors
+  static const int MAX_PREFETCH_DEPTH = 16;
+  const int prefetch_depth_;
+  const int slots_;
+
+  int batchSlot(long batch) const {
+    return batch % slots_;
+  }
+
+  // One captured graph per slot
+  std::vector<cudaGraphExec_t> infer_graph_;
+  std::vector<cudaGraphExec_t> train_graph_;
 
   std::shared_ptr<CudaTensor> resolveTensor_locked(std::shared_ptr<Tensor> t);
 
@@ -165,14 +539,51 @@ public:
   void train(const std::shared_ptr<CudaOperation> &op);
   void bwd(const std::shared_ptr<CudaOperation> &op);
   void upd(const std::shared_ptr<CudaOperation> &op);
+  void upd(std::shared_ptr<CudaTensor> weights,
+           std::shared_ptr<CudaTensor> gradient);
+
+  void setupTrainState();
+
+  void setupOptimizer();
+
+  void restoreOptimizerState(const Graph &g);
 
   void setupAccessors(const BatchTensorAccessors &accessors);
 
   void addPrePostOp(std::shared_ptr<CudaTensor> t, const BatchTensorAccess &a);
 
-  void issueOps(const CudaBatchAccessOps ops, long batch);
+  void issueOps(const CudaBatchAccessOps &ops, long batch);
+
+  void downloadOps(const CudaBatchAccessOps &ops, long batch);
 
-  void flipDoubleBufferedTensors();
+  void postOps(const CudaBatchAccessOps &ops, long batch);
+
+  void selectSlot(long batch);
+
+  void run(cudaGraphExec_t *graph, const std::function<void(void)> &fn);
+
+  void execute(long batches,
+               const CudaBatchAccessOps &pre,
+               const CudaBatchAccessOps &post,
+               const std::vector<std::shared_ptr<CudaOperation>> &ops,
+               std::vector<cudaGraphExec_t> &graphs,
+               bool training,
+               const std::function<void(void)> &fn);
+
+  void execOps(const std::vector<std::shared_ptr<CudaOperation>> &ops);
+
+  void execTrainOps();
+
+  void planMemory(const Graph &g);
+
+  // Activation recomputation, see setupRecompute(). recomputing_ is set
+  // while a forward operation is re-executed during the backward pass
+  bool recomputing_ = false;
+  std::unordered_set<CudaTensorStorage *> recomputed_;
+
+  void setupRecompute(const std::unordered_set<const CudaOperation *> &checkpoints);
+
+  void setupHealthMonitor(const Graph &g);
 
 };
 
@@ -183,6 +594,21 @@ public:
   virtual void load(CudaProgram &p, long batch) {};
   virtual void exec(CudaProgram &p) = 0;
   virtual void print() const = 0;
+
+  // Tensors read and written by exec(), used for memory planning.
+  // Entries may be nullptr
+  virtual CudaTensors getInputs() const { return {}; }
+  virtual CudaTensors getOutputs() const { return {}; }
+
+  // True if exec() can run again during the backward pass to recreate
+  // its outputs. Executing twice must yield the same values in all
+  // outputs, with p.recomputing_ set on the second run
+  virtual bool recomputable() const { return false; }
+
+  // Reported by the profiler. name() defaults to the class name
+  virtual std::string name() const;
+  virtual std::string algo() const { return ""; }
+  virtual int64_t flops() const { return 0; }
 };
 
 
@@ -217,4 +643,21 @@ void CudaRegisterTransform(CudaTransformType type,
   CPPJOIN(init, __LINE__)(void) {                                       \
     CudaRegisterTransform(type, op);                                    \
   }
+
+
+typedef std::shared_ptr<Program> (CudaDataParallelFactory)(std::shared_ptr<CudaContext> ctx,
+                                                           const Graph &g,
+                                                           const ProgramConfig &pc,
+                                                           const BatchTensorAccessors &accessors);
+
+// Registered by cuda_parallel.cpp when built with NCCL
+void CudaRegisterDataParallel(CudaDataParallelFactory *fn);
+
+// Absolute max of activations by graph tensor, measured by running
+// ProgramConfig::int8_calibration_batches through a float copy of the
+// program. See cuda_int8.cpp
+std::unordered_map<std::shared_ptr<Tensor>, float>
+CudaCalibrateInt8(CudaContext &ctx, const Graph &g, const ProgramConfig &pc,
+                  const BatchTensorAccessors &accessors, int batch_offset);
+
 }
@@ -25,7 +25,6 @@
  */
 
 #include <sstream>
-#include <x86intrin.h>
 #include "saga.h"
 #include "tensor.h"
 #include "context.h"
@@ -38,96 +37,194 @@ namespace saga {
 
 
 //------------------------------------------------------------------------
-struct CudnnAdam : public CudaOperation {
-
-  const std::shared_ptr<CudaTensor> weights_, gradient_;
-  float learning_rate_;
-  float *temp_;
-  int iter_;
-
-  CudnnAdam(CudaProgram &p,
-            std::shared_ptr<CudaTensor> weights,
-            std::shared_ptr<CudaTensor> gradient)
-    : weights_(weights)
-    , gradient_(gradient)
-    , learning_rate_(p.learning_rate_)
-    , iter_(0)
+/**
+ * Adam update of all weights in the program. Weights and gradients of
+ * each data type are packed into flat buffers so the whole update is a
+ * single kernel launch per data type. The optimizer state (m, v and the
+ * fp32 master weights for HALF) uses the same layout
+ */
+struct CudaAdam : public CudaOperation {
+
+  static const size_t ALIGNMENT = 256;
+
+  struct Group {
+    Tensor::DataType data_type_;
+    CudaTensors weights_;
+    CudaTensors gradients_;
+    std::vector<size_t> offsets_;  // In elements
+    size_t elements_ = 0;
+    bool packed_ = false;
+    std::shared_ptr<CudaTensor> state_tensor_;
+    float *state_ = NULL;
+
+    float *m() const { return state_; }
+    float *v() const { return state_ + elements_; }
+    float *w32() const { return state_ + elements_ * 2; }
+  };
+
+  const float learning_rate_;
+  // Gradients are cleared after each update and must persist between
+  // batches, so they are outputs here and not planned into the arena
+  const bool accumulate_;
+  std::vector<Group> groups_;
+
+  CudaAdam(CudaProgram &p)
+    : learning_rate_(p.learning_rate_)
+    , accumulate_(p.accumulate_ > 1)
   {
-    assert(weights->dims_ == gradient->dims_);
+    for(auto t : {Tensor::DataType::FLOAT, Tensor::DataType::HALF}) {
+      Group g;
+      g.data_type_ = t;
+      for(const auto &it : p.params_) {
+        if(it.first->data_type_ != t)
+          continue;
+        assert(it.first->dims_ == it.second->dims_);
+        g.weights_.push_back(it.first);
+        g.gradients_.push_back(it.second);
+      }
+      if(!g.weights_.empty())
+        groups_.push_back(g);
+    }
 
-    size_t bytes;
-    switch(weights->data_type_) {
-    case Tensor::DataType::FLOAT:
-      // Allocate 2x floats for each weight (m and v)
-      bytes = weights_->elements_ * 2 * sizeof(float);
-      chkCuda(cudaMalloc(&temp_, bytes));
-      chkCuda(cudaMemset(temp_, 0, bytes));
-      break;
+    for(const auto &it : p.params_) {
+      auto t = it.first->data_type_;
+      if(t != Tensor::DataType::FLOAT && t != Tensor::DataType::HALF) {
+        fprintf(stderr, "Adam: Unsupported data type for %s\n",
+                it.first->info().c_str());
+        abort();
+      }
+    }
 
-    case Tensor::DataType::HALF:
-      // Allocate 3x floats for each weight (m and v and float32 copy)
-      bytes = weights_->elements_ * 3 * sizeof(float);
-      chkCuda(cudaMallocManaged(&temp_, bytes, cudaMemAttachGlobal));
-      {
-        const uint16_t *src = (const uint16_t *)weights->deviceMem();
-        float *dst = temp_;
-        for(int i = 0; i < weights->elements_; i++) {
-          *dst++ = 0;
-          *dst++ = 0;
-          *dst++ = _cvtsh_ss(*src++);
-        }
-        break;
+    for(auto &g : groups_) {
+      const size_t element_size = Tensor::DataTypeSize(g.data_type_);
+      for(const auto &w : g.weights_) {
+        g.offsets_.push_back(g.elements_);
+        g.elements_ += ((w->elements_ * element_size + ALIGNMENT - 1) &
+                        ~(ALIGNMENT - 1)) / element_size;
       }
 
+      // Tensors shared between nodes or aliasing other storage can't be
+      // packed, those get one launch each instead
+      g.packed_ = CudaPackTensors(g.gradients_, ALIGNMENT) &&
+        CudaPackTensors(g.weights_, ALIGNMENT);
+
+      // Allocated as a tensor so per weight views of the state can be
+      // handed out through Program::optimizerState()
+      const int state_arrays = g.data_type_ == Tensor::DataType::HALF ? 3 : 2;
+      g.state_tensor_ =
+        std::make_shared<CudaTensor>(Tensor::DataType::FLOAT,
+                                     Dims({(int)(g.elements_ * state_arrays),
+                                           1, 1, 1}),
+                                     CUDNN_TENSOR_NCHW, p.ctx_, "adam");
+      g.state_ = (float *)g.state_tensor_->deviceMem();
+
+      static const char *names[3] = {"adam.m", "adam.v", "adam.w32"};
+      for(size_t i = 0; i < g.weights_.size(); i++) {
+        const auto &w = g.weights_[i];
+        if(!w->name_)
+          continue;
+        Dims strides(w->dims_.size(), 1);
+        for(int j = (int)w->dims_.size() - 2; j >= 0; j--)
+          strides[j] = strides[j + 1] * w->dims_[j + 1];
+        for(int j = 0; j < state_arrays; j++) {
+          const std::string name = *w->name_ + "." + names[j];
+          p.optimizer_state_[name] =
+            std::make_shared<CudaTensor>(g.state_tensor_->storage_, w->dims_,
+                                         g.elements_ * j + g.offsets_[i],
+                                         &strides[0], name);
+        }
+      }
 
-    default:
-      abort();
+      if(g.data_type_ == Tensor::DataType::HALF) {
+        for(size_t i = 0; i < g.weights_.size(); i++) {
+          adam_mixed_init(g.weights_[i]->elements_,
+                          (const __half *)g.weights_[i]->deviceMem(),
+                          g.w32() + g.offsets_[i], p.ctx_->stream_);
+        }
+      }
     }
   }
 
-  ~CudnnAdam()
-  {
-    chkCuda(cudaFree(temp_));
-  }
-
   void print() const {
-    printf("Adam\n");
-    printf("\tweights:  %s\n", weights_->info().c_str());
-    printf("\tgradient: %s\n", gradient_->info().c_str());
+    size_t launches = 0;
+    size_t tensors = 0;
+    for(const auto &g : groups_) {
+      launches += g.packed_ ? 1 : g.weights_.size();
+      tensors += g.weights_.size();
+    }
+    printf("Adam (%zd tensors in %zd launches)\n", tensors, launches);
+    for(const auto &g : groups_) {
+      for(size_t i = 0; i < g.weights_.size(); i++) {
+        printf("\tweights:  %s\n", g.weights_[i]->info().c_str());
+        printf("\tgradient: %s\n", g.gradients_[i]->info().c_str());
+      }
+    }
   }
 
-  void exec(CudaProgram &p) {
-    const int i = ++iter_;
-
-#define ADAM_B1      0.9
-#define ADAM_B2      0.999
+  CudaTensors getInputs() const override {
+    CudaTensors r;
+    for(const auto &g : groups_) {
+      r.insert(r.end(), g.weights_.begin(), g.weights_.end());
+      r.insert(r.end(), g.gradients_.begin(), g.gradients_.end());
+    }
+    return r;
+  }
 
-    const float b1t = 1.0 / (1.0 - pow(ADAM_B1, i));
-    const float b2t = 1.0 / (1.0 - pow(ADAM_B2, i));
+  CudaTensors getOutputs() const override {
+    CudaTensors r;
+    for(const auto &g : groups_) {
+      r.insert(r.end(), g.weights_.begin(), g.weights_.end());
+      if(accumulate_)
+        r.insert(r.end(), g.gradients_.begin(), g.gradients_.end());
+    }
+    return r;
+  }
 
-    switch(weights_->data_type_) {
+  void update(CudaProgram &p, const Group &g, int n,
+              void *weights, void *gradient, size_t offset) {
+    switch(g.data_type_) {
     case Tensor::DataType::FLOAT:
-      adam_float(weights_->elements_,
-                 (float *)weights_->deviceMem(),
-                 (const float *)gradient_->deviceMem(),
-                 (float *)temp_, b1t, b2t, learning_rate_,
-                 p.ctx_->stream_);
+      adam_float(n, (float *)weights, (float *)gradient,
+                 g.m() + offset, g.v() + offset,
+                 p.train_state_, p.accumulate_state_, learning_rate_,
+                 p.stream_);
       break;
     case Tensor::DataType::HALF:
-      adam_mixed(weights_->elements_, 1.0f / p.mp_scaling_,
-                 (__half *)weights_->deviceMem(),
-                 (const __half *)gradient_->deviceMem(),
-                 (float *)temp_, b1t, b2t, learning_rate_,
-                 (int *)p.check_result_,
-                 p.ctx_->stream_);
+      adam_mixed(n, (__half *)weights, (__half *)gradient,
+                 g.m() + offset, g.v() + offset, g.w32() + offset,
+                 p.train_state_, p.accumulate_state_, learning_rate_,
+                 (int *)p.check_result_, p.stream_);
       break;
     default:
       abort();
     }
   }
+
+  void exec(CudaProgram &p) {
+    for(const auto &g : groups_) {
+      if(g.packed_) {
+        update(p, g, g.elements_, g.weights_[0]->deviceMem(),
+               g.gradients_[0]->deviceMem(), 0);
+        continue;
+      }
+      for(size_t i = 0; i < g.weights_.size(); i++) {
+        update(p, g, g.weights_[i]->elements_, g.weights_[i]->deviceMem(),
+               g.gradients_[i]->deviceMem(), g.offsets_[i]);
+      }
+    }
+  }
 };
 
 
+void
+CudaProgram::setupOptimizer()
+{
+  if(params_.empty())
+    return;
+  upd(std::make_shared<CudaAdam>(*this));
+}
+
+
 //------------------------------------------------------------------------
 
 
@@ -202,6 +299,150 @@ convbwdfilteralgostr(cudnnConvolutionBwdFilterAlgo_t algo)
 
 
 
+//------------------------------------------------------------------------
+// Convolution algorithm autotuning
+
+static std::string
+desc_key(cudnnTensorDescriptor_t desc)
+{
+  const int max_rank = 8;
+  int dims[max_rank];
+  int strides[max_rank];
+  int rank;
+  cudnnDataType_t data_type;
+
+  chkCUDNN(cudnnGetTensorNdDescriptor(desc, max_rank, &data_type,
+                                      &rank, dims, strides));
+  std::string r = "t" + std::to_string(data_type);
+  for(int i = 0; i < rank; i++)
+    r += "," + std::to_string(dims[i]) + "/" + std::to_string(strides[i]);
+  return r;
+}
+
+static std::string
+desc_key(cudnnFilterDescriptor_t desc)
+{
+  const int max_rank = 8;
+  int dims[max_rank];
+  int rank;
+  cudnnDataType_t data_type;
+  cudnnTensorFormat_t format;
+
+  chkCUDNN(cudnnGetFilterNdDescriptor(desc, max_rank, &data_type,
+                                      &format, &rank, dims));
+  std::string r = "f" + std::to_string(data_type) + "/" +
+    std::to_string(format);
+  for(int i = 0; i < rank; i++)
+    r += "," + std::to_string(dims[i]);
+  return r;
+}
+
+static std::string
+desc_key(cudnnConvolutionDescriptor_t desc)
+{
+  int pad_h, pad_w, u, v, dilation_h, dilation_w;
+  cudnnConvolutionMode_t mode;
+  cudnnDataType_t compute_type;
+  cudnnMathType_t math_type;
+
+  chkCUDNN(cudnnGetConvolution2dDescriptor(desc, &pad_h, &pad_w, &u, &v,
+                                           &dilation_h, &dilation_w,
+                                           &mode, &compute_type));
+  chkCUDNN(cudnnGetConvolutionMathType(desc, &math_type));
+
+  char buf[128];
+  snprintf(buf, sizeof(buf), "c%d,%d,%d,%d,%d,%d,%d,%d,%d",
+           pad_h, pad_w, u, v, dilation_h, dilation_w,
+           mode, compute_type, math_type);
+  return buf;
+}
+
+
+/**
+ * Workspace limit for benchmarking: autotune_max_workspace halved until
+ * it fits in free device memory. Results depend on it so it's part of
+ * the autotune key. Zero when not autotuning as the heuristics don't
+ * look at it
+ */
+static size_t
+autotune_workspace(const CudaProgram &p)
+{
+  if(!p.config_.autotune)
+    return 0;
+
+  size_t size = p.config_.autotune_max_workspace;
+  size_t free_mem, total_mem;
+  if(cudaMemGetInfo(&free_mem, &total_mem) != cudaSuccess) {
+    cudaGetLastError();
+    return size;
+  }
+  while(size > free_mem)
+    size /= 2;
+  return size;
+}
+
+
+/**
+ * Scratch memory for cudnnFind*AlgorithmEx(). We don't benchmark on the
+ * real tensors as that would force them to be allocated before the
+ * memory planner gets to run. Workspace is capped to workspace_limit
+ * (or whatever we get, see complete())
+ */
+struct CudnnAutotuneScratch {
+
+  std::vector<void *> mem_;
+  void *workspace_;
+  size_t workspace_size_;
+  const size_t workspace_limit_;
+
+  CudnnAutotuneScratch(const CudaTensors &tensors, size_t workspace_limit)
+    : workspace_(NULL)
+    , workspace_size_(workspace_limit)
+    , workspace_limit_(workspace_limit)
+  {
+    for(const auto &t : tensors) {
+      size_t bytes;
+      void *m;
+      chkCUDNN(cudnnGetTensorSizeInBytes(t->desc_, &bytes));
+      chkCuda(cudaMalloc(&m, bytes));
+      mem_.push_back(m);
+    }
+
+    while(workspace_size_ &&
+          cudaMalloc(&workspace_, workspace_size_) != cudaSuccess) {
+      workspace_size_ /= 2;
+    }
+    cudaGetLastError();
+  }
+
+  ~CudnnAutotuneScratch()
+  {
+    for(auto m : mem_)
+      chkCuda(cudaFree(m));
+    chkCuda(cudaFree(workspace_));
+  }
+
+  // False if less than the limit in the key could be allocated. The
+  // result is still usable but must not be cached under that key
+  bool complete() const {
+    return workspace_size_ == workspace_limit_;
+  }
+};
+
+
+template<typename T> static bool
+pick_algo(const T *perf, int count, int *algo)
+{
+  for(int i = 0; i < count; i++) {
+    if(perf[i].status == CUDNN_STATUS_SUCCESS) {
+      *algo = perf[i].algo;
+      return true;
+    }
+  }
+  return false;
+}
+
+
 struct CudnnConvolutionFwd : public CudaOperation {
 
   const std::shared_ptr<CudaContext> ctx_;
@@ -251,14 +492,22 @@ struct CudnnConvolutionFwd : public CudaOperation {
                                              CUDNN_CROSS_CORRELATION,
                                              CUDNN_DATA_FLOAT));
 
-    chkCUDNN(cudnnGetConvolutionForwardAlgorithm(ctx_->cudnn_,
-                                                 x_->desc_,
-                                                 filter_desc_,
-                                                 conv_desc_,
-                                                 y_->desc_,
-                                                 CUDNN_CONVOLUTION_FWD_PREFER_FASTEST,
-                                                 0,
-                                                 &conv_fwd_algo_));
+    const size_t tune_workspace = autotune_workspace(p);
+    const std::string key = autotuneKey("fwd", tune_workspace);
+    int algo;
+    if(p.findAlgo(key, &algo)) {
+      conv_fwd_algo_ = (cudnnConvolutionFwdAlgo_t)algo;
+    } else if(!p.config_.autotune || !autotune(p, key, tune_workspace)) {
+      chkCUDNN(cudnnGetConvolutionForwardAlgorithm(ctx_->cudnn_,
+                                                   x_->desc_,
+                                                   filter_desc_,
+                                                   conv_desc_,
+                                                   y_->desc_,
+                                                   CUDNN_CONVOLUTION_FWD_PREFER_FASTEST,
+                                                   0,
+                                                   &conv_fwd_algo_));
+      p.storeAlgo(key, conv_fwd_algo_);
+    }
 
     size_t workspace;
     chkCUDNN(cudnnGetConvolutionForwardWorkspaceSize(ctx_->cudnn_,
@@ -270,8 +519,105 @@ struct CudnnConvolutionFwd : public CudaOperation {
                                                      &workspace));
 
     p.requetstWorkspace(workspace);
+
+    // Folded weights shared with another program are already computed
+    if(n.inputs_.get("bn.m") && !(p.isShared(*w_) && p.isShared(*b_)))
+      foldBatchNorm(p, n);
+  }
+
+
+  // w_ and b_ are placeholders created by batchnorm_fold_transform(),
+  // compute them from the original weights and batchnorm parameters.
+  // The original tensors are lowered as well so resolveTensor() and
+  // saveTensors() keep seeing the unfolded values
+  void foldBatchNorm(CudaProgram &p, const Node &n) {
+    auto w = p.lower_tensor(n.inputs_.get("unfolded.w"));
+    auto b = p.lower_tensor(n.inputs_.get("unfolded.b"), 2);
+    auto s = p.lower_tensor(n.inputs_.get("bn.s"), 2);
+    auto bb = p.lower_tensor(n.inputs_.get("bn.b"), 2);
+    auto m = p.lower_tensor(n.inputs_.get("bn.m"), 2);
+    auto v = p.lower_tensor(n.inputs_.get("bn.v"), 2);
+    const float epsilon = n.attributes_.get("bn.epsilon", 1e-5f);
+
+    const int channels = w_->dims_[0];
+    const int per_channel = w_->elements_ / channels;
+
+    switch(w_->data_type_) {
+    case Tensor::DataType::FLOAT:
+      batchnorm_fold_float(channels, per_channel,
+                           (const float *)w->deviceMem(),
+                           (float *)w_->deviceMem(),
+                           b ? (const float *)b->deviceMem() : NULL,
+                           (float *)b_->deviceMem(),
+                           (const float *)s->deviceMem(),
+                           (const float *)bb->deviceMem(),
+                           (const float *)m->deviceMem(),
+                           (const float *)v->deviceMem(),
+                           epsilon, ctx_->stream_);
+      break;
+    case Tensor::DataType::HALF:
+      batchnorm_fold_half(channels, per_channel,
+                          (const __half *)w->deviceMem(),
+                          (__half *)w_->deviceMem(),
+                          b ? (const __half *)b->deviceMem() : NULL,
+                          (__half *)b_->deviceMem(),
+                          (const float *)s->deviceMem(),
+                          (const float *)bb->deviceMem(),
+                          (const float *)m->deviceMem(),
+                          (const float *)v->deviceMem(),
+                          epsilon, ctx_->stream_);
+      break;
+    default:
+      abort();
+    }
+    chkCuda(cudaStreamSynchronize(ctx_->stream_));
+  }
+
+  std::string autotuneKey(const char *prefix, size_t workspace) const {
+    return std::string(prefix) + ":" +
+      desc_key(x_->desc_) + ":" + desc_key(filter_desc_) + ":" +
+      desc_key(conv_desc_) + ":" + desc_key(y_->desc_) + ":" +
+      std::to_string(workspace);
+  }
+
+  // Stores the result in the caches unless it was benchmarked with less
+  // workspace than the key says
+  bool autotune(CudaProgram &p, const std::string &key, size_t workspace) {
+    int algo;
+    bool complete = true;
+    if(!ctx_->findAlgo(key, &algo)) {
+      CudnnAutotuneScratch s({x_, w_, y_}, workspace);
+      cudnnConvolutionFwdAlgoPerf_t perf[CUDNN_CONVOLUTION_FWD_ALGO_COUNT];
+      int count;
+      chkCUDNN(cudnnFindConvolutionForwardAlgorithmEx(ctx_->cudnn_,
+                                                      x_->desc_, s.mem_[0],
+                                                      filter_desc_, s.mem_[1],
+                                                      conv_desc_,
+                                                      y_->desc_, s.mem_[2],
+                                                      CUDNN_CONVOLUTION_FWD_ALGO_COUNT,
+                                                      &count, perf,
+                                                      s.workspace_,
+                                                      s.workspace_size_));
+      if(!pick_algo(perf, count, &algo))
+        return false;
+      complete = s.complete();
+      if(complete)
+        ctx_->storeAlgo(key, algo);
+    }
+    conv_fwd_algo_ = (cudnnConvolutionFwdAlgo_t)algo;
+    if(complete)
+      p.storeAlgo(key, algo);
+    return true;
+  }
+
+
+  std::string algo() const override {
+    return convfwdalgostr(conv_fwd_algo_);
   }
 
+  int64_t flops() const override {
+    return 2 * y_->elements_ * (w_->elements_ / w_->dims_[0]);
+  }
 
   void print() const {
     printf("Convolution Fwd %s\n", convfwdalgostr(conv_fwd_algo_));
@@ -282,10 +628,22 @@ struct CudnnConvolutionFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, w_, b_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
+  bool recomputable() const {
+    return y_beta_ == 0;
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
 
-    chkCUDNN(cudnnConvolutionForward(ctx_->cudnn_, &alpha,
+    chkCUDNN(cudnnConvolutionForward(p.cudnn_, &alpha,
                                      x_->desc(),
                                      x_->deviceMem(),
                                      filter_desc_,
@@ -298,7 +656,7 @@ struct CudnnConvolutionFwd : public CudaOperation {
                                      y_->deviceMem()));
 
     if(b_) {
-      chkCUDNN(cudnnAddTensor(ctx_->cudnn_,
+      chkCUDNN(cudnnAddTensor(p.cudnn_,
                               &alpha, b_->desc(), b_->deviceMem(),
                               &alpha, y_->desc(), y_->deviceMem()));
     }
@@ -321,6 +679,7 @@ struct CudnnConvolutionBwd : public CudaOperation {
   const std::shared_ptr<CudnnConvolutionFwd> fwd_;
   const std::shared_ptr<CudaTensor> dx_, dw_, db_, dy_;
   const float dx_beta_;
+  const float dw_beta_;
 
   cudnnConvolutionBwdDataAlgo_t bwd_data_algo_;
   cudnnConvolutionBwdFilterAlgo_t bwd_filter_algo_;
@@ -335,16 +694,26 @@ struct CudnnConvolutionBwd : public CudaOperation {
     , db_(fwd_->b_ ? fwd_->b_->makeGrad() : nullptr)
     , dy_(fwd_->y_->makeGrad())
     , dx_beta_(n.attributes_.get("dx.beta", 0.0f))
+    , dw_beta_(p.gradientBeta())
   {
 
-    chkCUDNN(cudnnGetConvolutionBackwardDataAlgorithm(ctx_->cudnn_,
-                                                      fwd->filter_desc_,
-                                                      fwd->y_->desc(),
-                                                      fwd->conv_desc_,
-                                                      fwd->x_->desc(),
-                                                      CUDNN_CONVOLUTION_BWD_DATA_PREFER_FASTEST,
-                                                      0,
-                                                      &bwd_data_algo_));
+    const size_t tune_workspace = autotune_workspace(p);
+    const std::string data_key = fwd->autotuneKey("bwddata", tune_workspace);
+    int algo;
+    if(p.findAlgo(data_key, &algo)) {
+      bwd_data_algo_ = (cudnnConvolutionBwdDataAlgo_t)algo;
+    } else if(!p.config_.autotune ||
+              !autotuneData(p, data_key, tune_workspace)) {
+      chkCUDNN(cudnnGetConvolutionBackwardDataAlgorithm(ctx_->cudnn_,
+                                                        fwd->filter_desc_,
+                                                        fwd->y_->desc(),
+                                                        fwd->conv_desc_,
+                                                        fwd->x_->desc(),
+                                                        CUDNN_CONVOLUTION_BWD_DATA_PREFER_FASTEST,
+                                                        0,
+                                                        &bwd_data_algo_));
+      p.storeAlgo(data_key, bwd_data_algo_);
+    }
 
 
 
@@ -360,14 +729,22 @@ struct CudnnConvolutionBwd : public CudaOperation {
 
     p.requetstWorkspace(workspace_bytes);
 
-    chkCUDNN(cudnnGetConvolutionBackwardFilterAlgorithm(ctx_->cudnn_,
-                                                        fwd->x_->desc(),
-                                                        fwd->y_->desc(),
-                                                        fwd->conv_desc_,
-                                                        fwd->filter_desc_,
-                                                        CUDNN_CONVOLUTION_BWD_FILTER_PREFER_FASTEST,
-                                                        0,
-                                                        &bwd_filter_algo_));
+    const std::string filter_key = fwd->autotuneKey("bwdfilter",
+                                                    tune_workspace);
+    if(p.findAlgo(filter_key, &algo)) {
+      bwd_filter_algo_ = (cudnnConvolutionBwdFilterAlgo_t)algo;
+    } else if(!p.config_.autotune ||
+              !autotuneFilter(p, filter_key, tune_workspace)) {
+      chkCUDNN(cudnnGetConvolutionBackwardFilterAlgorithm(ctx_->cudnn_,
+                                                          fwd->x_->desc(),
+                                                          fwd->y_->desc(),
+                                                          fwd->conv_desc_,
+                                                          fwd->filter_desc_,
+                                                          CUDNN_CONVOLUTION_BWD_FILTER_PREFER_FASTEST,
+                                                          0,
+                                                          &bwd_filter_algo_));
+      p.storeAlgo(filter_key, bwd_filter_algo_);
+    }
 
     chkCUDNN(cudnnGetConvolutionBackwardFilterWorkspaceSize(ctx_->cudnn_,
                                                             fwd->x_->desc(),
@@ -385,6 +762,74 @@ struct CudnnConvolutionBwd : public CudaOperation {
 
   }
 
+  bool autotuneData(CudaProgram &p, const std::string &key,
+                    size_t workspace) {
+    int algo;
+    bool complete = true;
+    if(!ctx_->findAlgo(key, &algo)) {
+      CudnnAutotuneScratch s({fwd_->w_, fwd_->y_, fwd_->x_}, workspace);
+      cudnnConvolutionBwdDataAlgoPerf_t perf[CUDNN_CONVOLUTION_BWD_DATA_ALGO_COUNT];
+      int count;
+      chkCUDNN(cudnnFindConvolutionBackwardDataAlgorithmEx(ctx_->cudnn_,
+                                                           fwd_->filter_desc_, s.mem_[0],
+                                                           fwd_->y_->desc_, s.mem_[1],
+                                                           fwd_->conv_desc_,
+                                                           fwd_->x_->desc_, s.mem_[2],
+                                                           CUDNN_CONVOLUTION_BWD_DATA_ALGO_COUNT,
+                                                           &count, perf,
+                                                           s.workspace_,
+                                                           s.workspace_size_));
+      if(!pick_algo(perf, count, &algo))
+        return false;
+      complete = s.complete();
+      if(complete)
+        ctx_->storeAlgo(key, algo);
+    }
+    bwd_data_algo_ = (cudnnConvolutionBwdDataAlgo_t)algo;
+    if(complete)
+      p.storeAlgo(key, algo);
+    return true;
+  }
+
+  bool autotuneFilter(CudaProgram &p, const std::string &key,
+                      size_t workspace) {
+    int algo;
+    bool complete = true;
+    if(!ctx_->findAlgo(key, &algo)) {
+      CudnnAutotuneScratch s({fwd_->x_, fwd_->y_, fwd_->w_}, workspace);
+      cudnnConvolutionBwdFilterAlgoPerf_t perf[CUDNN_CONVOLUTION_BWD_FILTER_ALGO_COUNT];
+      int count;
+      chkCUDNN(cudnnFindConvolutionBackwardFilterAlgorithmEx(ctx_->cudnn_,
+                                                             fwd_->x_->desc_, s.mem_[0],
+                                                             fwd_->y_->desc_, s.mem_[1],
+                                                             fwd_->conv_desc_,
+                                                             fwd_->filter_desc_, s.mem_[2],
+                                                             CUDNN_CONVOLUTION_BWD_FILTER_ALGO_COUNT,
+                                                             &count, perf,
+                                                             s.workspace_,
+                                                             s.workspace_size_));
+      if(!pick_algo(perf, count, &algo))
+        return false;
+      complete = s.complete();
+      if(complete)
+        ctx_->storeAlgo(key, algo);
+    }
+    bwd_filter_algo_ = (cudnnConvolutionBwdFilterAlgo_t)algo;
+    if(complete)
+      p.storeAlgo(key, algo);
+    return true;
+  }
+
+  std::string algo() const override {
+    return std::string(convbwdfilteralgostr(bwd_filter_algo_)) +
+      (dx_ ? std::string(" ") + convbwddataalgostr(bwd_data_algo_) : "");
+  }
+
+  int64_t flops() const override {
+    const auto &w = fwd_->w_;
+    return (dx_ ? 4 : 2) * dy_->elements_ * (w->elements_ / w->dims_[0]);
+  }
+
   void print() const {
     printf("Convolution Bwd Filter:%s Data:%s dx.beta:%f\n",
            convbwdfilteralgostr(bwd_filter_algo_),
@@ -398,20 +843,29 @@ struct CudnnConvolutionBwd : public CudaOperation {
       printf("\tdx: %s\n", dx_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {fwd_->x_, fwd_->w_, dy_, dx_beta_ ? dx_ : nullptr,
+      dw_beta_ ? dw_ : nullptr, dw_beta_ ? db_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {dx_, dw_, db_};
+  }
+
   void exec(CudaProgram &p) {
 
-    float alpha = 1.0f, beta = 0.0f;
+    float alpha = 1.0f;
 
     if(db_) {
-      chkCUDNN(cudnnConvolutionBackwardBias(ctx_->cudnn_, &alpha,
+      chkCUDNN(cudnnConvolutionBackwardBias(p.cudnn_, &alpha,
                                             dy_->desc(),
                                             dy_->deviceMem(),
-                                            &beta,
+                                            &dw_beta_,
                                             db_->desc(),
                                             db_->deviceMem()));
     }
 
-    chkCUDNN(cudnnConvolutionBackwardFilter(ctx_->cudnn_, &alpha,
+    chkCUDNN(cudnnConvolutionBackwardFilter(p.cudnn_, &alpha,
                                             fwd_->x_->desc(),
                                             fwd_->x_->deviceMem(),
                                             dy_->desc(),
@@ -419,12 +873,12 @@ struct CudnnConvolutionBwd : public CudaOperation {
                                             fwd_->conv_desc_,
                                             bwd_filter_algo_,
                                             p.workspace_, p.workspace_size_,
-                                            &beta,
+                                            &dw_beta_,
                                             fwd_->filter_desc_,
                                             dw_->deviceMem()));
 
     if(dx_ != NULL) {
-      chkCUDNN(cudnnConvolutionBackwardData(ctx_->cudnn_, &alpha,
+      chkCUDNN(cudnnConvolutionBackwardData(p.cudnn_, &alpha,
                                             fwd_->filter_desc_,
                                             fwd_->w_->deviceMem(),
                                             dy_->desc(),
@@ -463,15 +917,264 @@ conv_train(CudaProgram &p, const Node &n)
   auto b = std::make_shared<CudnnConvolutionBwd>(p, n, f);
   p.bwd(b);
 
-  p.upd(std::make_shared<CudnnAdam>(p, f->w_, b->dw_));
+  p.upd(f->w_, b->dw_);
   if(f->b_)
-    p.upd(std::make_shared<CudnnAdam>(p, f->b_, b->db_));
+    p.upd(f->b_, b->db_);
 }
 
 REGISTER_CUDA_OP("conv", conv_infer, conv_train);
 
 
 
+static std::shared_ptr<Node>
+batchnorm_fold_transform_node(CudaProgram &p,
+                              const std::vector<std::shared_ptr<Node>> &nodes,
+                              std::shared_ptr<Node> conv,
+                              std::shared_ptr<Node> bn)
+{
+  auto y = conv->outputs_["y"];
+  auto w = conv->inputs_["w"];
+  auto b = conv->inputs_.get("b");
+
+  if(bn->inputs_["x"] != y)
+    return nullptr;
+
+  if(conv->attributes_.find("y.beta") != conv->attributes_.end() ||
+     bn->attributes_.find("y.beta") != bn->attributes_.end())
+    return nullptr;
+
+  if(w->data_type_ != Tensor::DataType::FLOAT &&
+     w->data_type_ != Tensor::DataType::HALF)
+    return nullptr;
+
+  if(b && b->data_type_ != w->data_type_)
+    return nullptr;
+
+  for(const char *k : {"s", "b", "m", "v"}) {
+    auto t = bn->inputs_.get(k);
+    if(!t || t->data_type_ != Tensor::DataType::FLOAT)
+      return nullptr;
+  }
+
+  for(const auto &n : nodes) {
+    if(n == bn)
+      continue;
+    for(const auto &t : n->inputs_) {
+      if(t.second == y)
+        return nullptr;
+    }
+  }
+
+  auto nn = std::make_shared<Node>("conv");
+
+  nn->inputs_ = conv->inputs_;
+  nn->attributes_ = conv->attributes_;
+
+  // Same placeholders for all programs of the context so the folded
+  // weights can be shared as well
+  nn->inputs_["w"] = p.ctx_->derivedTensor(w, "folded", [&] {
+    return std::make_shared<Tensor>(w->data_type_, w->dims_,
+                                    w->namePostfix("folded"));
+  });
+  nn->inputs_["b"] = p.ctx_->derivedTensor(w, "folded.b", [&] {
+    return std::make_shared<Tensor>(w->data_type_,
+                                    Dims({1, w->dims_[0]}),
+                                    w->namePostfix("folded.b"));
+  });
+  nn->inputs_["unfolded.w"] = w;
+  if(b)
+    nn->inputs_["unfolded.b"] = b;
+  nn->inputs_["bn.s"] = bn->inputs_["s"];
+  nn->inputs_["bn.b"] = bn->inputs_["b"];
+  nn->inputs_["bn.m"] = bn->inputs_["m"];
+  nn->inputs_["bn.v"] = bn->inputs_["v"];
+
+  if(bn->attributes_.find("epsilon") != bn->attributes_.end())
+    nn->attributes_["bn.epsilon"] = bn->attributes_["epsilon"];
+
+  nn->outputs_["y"] = bn->outputs_["y"];
+  return nn;
+}
+
+
+/**
+ * Fold batchnorm into the weights and bias of the preceding convolution.
+ * Only done for inference-only programs as the folded weights are
+ * computed once when the program is created
+ */
+static std::vector<std::shared_ptr<Node>>
+batchnorm_fold_transform(CudaProgram &p,
+                         const std::vector<std::shared_ptr<Node>> &nodes)
+{
+  std::vector<std::shared_ptr<Node>> r;
+
+  if(nodes.size() < 2 || p.config_.training)
+    return nodes;
+
+  for(size_t i = 0; i < nodes.size(); i++) {
+    std::shared_ptr<Node> n = nodes[i];
+
+    if(i < nodes.size() - 1 &&
+       nodes[i + 0]->type_ == "conv" &&
+       nodes[i + 1]->type_ == "batchnorm") {
+      auto n2 = batchnorm_fold_transform_node(p, nodes, nodes[i],
+                                              nodes[i + 1]);
+      if(n2) {
+        i++;
+        n = n2;
+      }
+    }
+    r.push_back(n);
+  }
+  return r;
+}
+
+REGISTER_CUDA_TRANSFORM(550, CUDA_TRANSFORM_INFERENCE, batchnorm_fold_transform);
+
+
+
+/**
+ * Convolution, bias and relu in one pass over y using
+ * cudnnConvolutionBiasActivationForward(). Only used for inference,
+ * created by conv_relu_transform() below
+ */
+struct CudnnConvolutionBiasActivationFwd : public CudnnConvolutionFwd {
+
+  const std::shared_ptr<CudaTensor> bias_;
+  cudnnActivationDescriptor_t act_desc_;
+
+  CudnnConvolutionBiasActivationFwd(CudaProgram &p, const Node &n)
+    : CudnnConvolutionFwd(p, n)
+    , bias_(b_ ? b_ : std::make_shared<CudaTensor>(w_->data_type_,
+                                                   Dims{1, w_->dims_[0]},
+                                                   p.tensorFormat(w_->data_type_),
+                                                   p.ctx_))
+  {
+    chkCUDNN(cudnnCreateActivationDescriptor(&act_desc_));
+    chkCUDNN(cudnnSetActivationDescriptor(act_desc_, CUDNN_ACTIVATION_RELU,
+                                          CUDNN_PROPAGATE_NAN, 0.0f));
+  }
+
+  ~CudnnConvolutionBiasActivationFwd()
+  {
+    chkCUDNN(cudnnDestroyActivationDescriptor(act_desc_));
+  }
+
+  void print() const {
+    printf("Convolution+Bias+Relu Fwd %s\n", convfwdalgostr(conv_fwd_algo_));
+    printf("\tx: %s\n", x_->info().c_str());
+    printf("\tw: %s\n", w_->info().c_str());
+    printf("\tb: %s\n", bias_->info().c_str());
+    printf("\ty: %s\n", y_->info().c_str());
+  }
+
+  CudaTensors getInputs() const override {
+    return {x_, w_, bias_};
+  }
+
+  void exec(CudaProgram &p) {
+    float alpha1 = 1.0f, alpha2 = 0.0f;
+
+    chkCUDNN(cudnnConvolutionBiasActivationForward(p.cudnn_, &alpha1,
+                                                   x_->desc(),
+                                                   x_->deviceMem(),
+                                                   filter_desc_,
+                                                   w_->deviceMem(),
+                                                   conv_desc_,
+                                                   conv_fwd_algo_,
+                                                   p.workspace_,
+                                                   p.workspace_size_,
+                                                   &alpha2,
+                                                   y_->desc(),
+                                                   y_->deviceMem(),
+                                                   bias_->desc(),
+                                                   bias_->deviceMem(),
+                                                   act_desc_,
+                                                   y_->desc(),
+                                                   y_->deviceMem()));
+    if(p.debug_) {
+      x_->printStats("conv_relu.x");
+      w_->printStats("conv_relu.w");
+      bias_->printStats("conv_relu.b");
+      y_->printStats("conv_relu.y");
+    }
+  }
+};
+
+
+static void
+conv_relu_infer(CudaProgram &p, const Node &n)
+{
+  p.infer(std::make_shared<CudnnConvolutionBiasActivationFwd>(p, n));
+}
+
+REGISTER_CUDA_OP("conv_relu", conv_relu_infer, NULL);
+
+
+
+static std::shared_ptr<Node>
+conv_relu_transform_node(const std::vector<std::shared_ptr<Node>> &nodes,
+                         std::shared_ptr<Node> conv,
+                         std::shared_ptr<Node> relu)
+{
+  auto y = conv->outputs_["y"];
+
+  if(relu->inputs_["x"] != y)
+    return nullptr;
+
+  if(conv->attributes_.find("y.beta") != conv->attributes_.end() ||
+     relu->attributes_.find("y.beta") != relu->attributes_.end())
+    return nullptr;
+
+  // The intermediate output goes away so nothing else may read it
+  for(const auto &n : nodes) {
+    if(n == relu)
+      continue;
+    for(const auto &t : n->inputs_) {
+      if(t.second == y)
+        return nullptr;
+    }
+  }
+
+  auto nn = std::make_shared<Node>("conv_relu");
+
+  nn->inputs_ = conv->inputs_;
+  nn->attributes_ = conv->attributes_;
+  nn->outputs_["y"] = relu->outputs_["y"];
+  return nn;
+}
+
+
+static std::vector<std::shared_ptr<Node>>
+conv_relu_transform(CudaProgram &p,
+                    const std::vector<std::shared_ptr<Node>> &nodes)
+{
+  std::vector<std::shared_ptr<Node>> r;
+
+  if(nodes.size() < 2)
+    return nodes;
+
+  for(size_t i = 0; i < nodes.size(); i++) {
+    std::shared_ptr<Node> n = nodes[i];
+
+    if(i < nodes.size() - 1 &&
+       nodes[i + 0]->type_ == "conv" &&
+       nodes[i + 1]->type_ == "relu") {
+      auto n2 = conv_relu_transform_node(nodes, nodes[i], nodes[i + 1]);
+      if(n2) {
+        i++;
+        n = n2;
+      }
+    }
+    r.push_back(n);
+  }
+  return r;
+}
+
+REGISTER_CUDA_TRANSFORM(600, CUDA_TRANSFORM_INFERENCE, conv_relu_transform);
+
+
+
 //------------------------------------------------------------------------
 
 struct CudnnBatchNormInference : public CudaOperation {
@@ -503,9 +1206,17 @@ struct CudnnBatchNormInference : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, s_, b_, m_, v_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
-    chkCUDNN(cudnnBatchNormalizationForwardInference(ctx_->cudnn_,
+    chkCUDNN(cudnnBatchNormalizationForwardInference(p.cudnn_,
                                                      CUDNN_BATCHNORM_SPATIAL,
                                                      &alpha, &y_beta_,
                                                      x_->desc(),
@@ -535,15 +1246,28 @@ struct CudnnBatchNormTrain : public CudnnBatchNormInference {
     , expavgf_(n.attributes_.get("expavg", 0.1f))
   {}
 
-  void print() const {
-    CudnnBatchNormInference::print();
-    printf("\tsm: %s\n", sm_->info().c_str());
-    printf("\tsv: %s\n", sv_->info().c_str());
+  void print() const {
+    CudnnBatchNormInference::print();
+    printf("\tsm: %s\n", sm_->info().c_str());
+    printf("\tsv: %s\n", sv_->info().c_str());
+  }
+
+  CudaTensors getInputs() const override {
+    return {x_, s_, b_, m_, v_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_, m_, v_, sm_, sv_};
+  }
+
+  // Running averages are left untouched when recomputing
+  bool recomputable() const {
+    return y_beta_ == 0;
   }
 
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
-    chkCUDNN(cudnnBatchNormalizationForwardTraining(ctx_->cudnn_,
+    chkCUDNN(cudnnBatchNormalizationForwardTraining(p.cudnn_,
                                                     CUDNN_BATCHNORM_SPATIAL,
                                                     &alpha, &y_beta_,
                                                     x_->desc(),
@@ -553,7 +1277,7 @@ struct CudnnBatchNormTrain : public CudnnBatchNormInference {
                                                     s_->desc(),
                                                     s_->deviceMem(),
                                                     b_->deviceMem(),
-                                                    expavgf_,
+                                                    p.recomputing_ ? 0.0f : expavgf_,
                                                     m_->deviceMem(),
                                                     v_->deviceMem(),
                                                     epsilon_,
@@ -570,6 +1294,7 @@ struct CudnnBatchNormBwd : public CudaOperation {
   const std::shared_ptr<CudaTensor> x_, dy_, dx_, s_, ds_, db_, sm_, sv_;
   const float epsilon_;
   const float dx_beta_;
+  const float dw_beta_;
 
   CudnnBatchNormBwd(CudaProgram &p, const Node &n,
                     const CudnnBatchNormTrain &fwd)
@@ -584,19 +1309,29 @@ struct CudnnBatchNormBwd : public CudaOperation {
     , sv_(fwd.sv_)
     , epsilon_(fwd.epsilon_)
     , dx_beta_(n.attributes_.get("dx.beta", 0.0f))
+    , dw_beta_(p.gradientBeta())
   {}
 
   void print() const {
     printf("BatchNorm Bwd\n");
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, dy_, s_, sm_, sv_, dx_beta_ ? dx_ : nullptr,
+      dw_beta_ ? ds_ : nullptr, dw_beta_ ? db_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {dx_, ds_, db_};
+  }
+
   void exec(CudaProgram &p) {
-    float alpha = 1.0f, beta = 0.0f;
+    float alpha = 1.0f;
 
-    chkCUDNN(cudnnBatchNormalizationBackward(ctx_->cudnn_,
+    chkCUDNN(cudnnBatchNormalizationBackward(p.cudnn_,
                                              CUDNN_BATCHNORM_SPATIAL,
                                              &alpha, &dx_beta_,
-                                             &alpha, &beta,
+                                             &alpha, &dw_beta_,
                                              x_->desc(),
                                              x_->deviceMem(),
                                              dy_->desc(),
@@ -629,8 +1364,8 @@ batchnorm_train(CudaProgram &p, const Node &n)
   auto b = std::make_shared<CudnnBatchNormBwd>(p, n, *f);
   p.bwd(b);
 
-  p.upd(std::make_shared<CudnnAdam>(p, f->s_, b->ds_));
-  p.upd(std::make_shared<CudnnAdam>(p, f->b_, b->db_));
+  p.upd(f->s_, b->ds_);
+  p.upd(f->b_, b->db_);
 }
 
 REGISTER_CUDA_OP("batchnorm", batchnorm_infer, batchnorm_train);
@@ -718,9 +1453,22 @@ struct CudnnBatchNormActivationTrain : public CudaOperation {
   }
 
 
+  CudaTensors getInputs() const override {
+    return {x_, s_, b_, m_, v_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_, m_, v_, sm_, sv_};
+  }
+
+  // Running averages are left untouched when recomputing
+  bool recomputable() const {
+    return y_beta_ == 0;
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
-    chkCUDNN(cudnnBatchNormalizationForwardTrainingEx(ctx_->cudnn_,
+    chkCUDNN(cudnnBatchNormalizationForwardTrainingEx(p.cudnn_,
                                                       mode_, bnOps_,
                                                       &alpha, &y_beta_,
                                                       x_->desc(),
@@ -731,7 +1479,7 @@ struct CudnnBatchNormActivationTrain : public CudaOperation {
                                                       s_->desc(),
                                                       s_->deviceMem(),
                                                       b_->deviceMem(),
-                                                      expavgf_,
+                                                      p.recomputing_ ? 0.0f : expavgf_,
                                                       m_->deviceMem(),
                                                       v_->deviceMem(),
                                                       epsilon_,
@@ -751,6 +1499,7 @@ struct CudnnBatchNormActivationBwd : public CudaOperation {
   const std::shared_ptr<CudnnBatchNormActivationTrain> fwd_;
   const std::shared_ptr<CudaTensor> dy_, dx_, ds_, db_;
   const float dx_beta_;
+  const float dw_beta_;
   CudnnBatchNormActivationBwd(CudaProgram &p, const Node &n,
                               std::shared_ptr<CudnnBatchNormActivationTrain> fwd)
     : ctx_(p.ctx_)
@@ -760,6 +1509,7 @@ struct CudnnBatchNormActivationBwd : public CudaOperation {
     , ds_(fwd->s_->makeGrad())
     , db_(fwd->b_->makeGrad())
     , dx_beta_(n.attributes_.get("dx.beta", 0.0f))
+    , dw_beta_(p.gradientBeta())
   {
     size_t workspace;
 
@@ -782,12 +1532,22 @@ struct CudnnBatchNormActivationBwd : public CudaOperation {
   }
 
 
+  CudaTensors getInputs() const override {
+    return {fwd_->x_, fwd_->y_, fwd_->s_, fwd_->b_, fwd_->sm_, fwd_->sv_,
+            dy_, dx_beta_ ? dx_ : nullptr,
+            dw_beta_ ? ds_ : nullptr, dw_beta_ ? db_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {dx_, ds_, db_};
+  }
+
   void exec(CudaProgram &p) {
-    float alpha = 1.0f, beta = 0.0f;
-    chkCUDNN(cudnnBatchNormalizationBackwardEx(ctx_->cudnn_,
+    float alpha = 1.0f;
+    chkCUDNN(cudnnBatchNormalizationBackwardEx(p.cudnn_,
                                                fwd_->mode_, fwd_->bnOps_,
                                                &alpha, &dx_beta_,
-                                               &alpha, &beta,
+                                               &alpha, &dw_beta_,
                                                fwd_->x_->desc(),
                                                fwd_->x_->deviceMem(),
                                                fwd_->y_->desc(),
@@ -822,8 +1582,8 @@ batchnorm_relu_train(CudaProgram &p, const Node &n)
   auto b = std::make_shared<CudnnBatchNormActivationBwd>(p, n, f);
   p.bwd(b);
 
-  p.upd(std::make_shared<CudnnAdam>(p, f->s_, b->ds_));
-  p.upd(std::make_shared<CudnnAdam>(p, f->b_, b->db_));
+  p.upd(f->s_, b->ds_);
+  p.upd(f->b_, b->db_);
 }
 
 REGISTER_CUDA_OP("batchnorm_relu", NULL, batchnorm_relu_train);
@@ -867,6 +1627,9 @@ batchnorm_relu_transform_node(CudaProgram &p,
   if(bn->attributes_.find("epsilon") != bn->attributes_.end())
     nn->attributes_["epsilon"] = bn->attributes_["epsilon"];
 
+  if(mp->attributes_.get("checkpoint", false))
+    nn->attributes_["checkpoint"] = true;
+
   nn->outputs_["y"] = mp->outputs_["y"];
   return nn;
 }
@@ -935,10 +1698,22 @@ struct CudnnActivationFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
+  bool recomputable() const {
+    return y_beta_ == 0;
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
 
-    chkCUDNN(cudnnActivationForward(ctx_->cudnn_, desc_,
+    chkCUDNN(cudnnActivationForward(p.cudnn_, desc_,
                                     &alpha,
                                     x_->desc(), x_->deviceMem(),
                                     &y_beta_,
@@ -974,10 +1749,18 @@ struct CudnnActivationBwd : public CudaOperation {
     printf("\tdx: %s\n", dx_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {fwd_->x_, fwd_->y_, dy_, dx_beta_ ? dx_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {dx_};
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
 
-    chkCUDNN(cudnnActivationBackward(ctx_->cudnn_, fwd_->desc_,
+    chkCUDNN(cudnnActivationBackward(p.cudnn_, fwd_->desc_,
                                      &alpha,
                                      fwd_->y_->desc(), fwd_->y_->deviceMem(),
                                      dy_->desc(), dy_->deviceMem(),
@@ -1072,10 +1855,22 @@ struct CudnnPoolingFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
+  bool recomputable() const {
+    return y_beta_ == 0;
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
 
-    chkCUDNN(cudnnPoolingForward(ctx_->cudnn_, desc_,
+    chkCUDNN(cudnnPoolingForward(p.cudnn_, desc_,
                                  &alpha,
                                  x_->desc(), x_->deviceMem(),
                                  &y_beta_,
@@ -1109,10 +1904,18 @@ struct CudnnPoolingBwd : public CudaOperation {
     printf("\tdx: %s\n", dx_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {fwd_->x_, fwd_->y_, dy_, dx_beta_ ? dx_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {dx_};
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
 
-    chkCUDNN(cudnnPoolingBackward(ctx_->cudnn_, fwd_->desc_,
+    chkCUDNN(cudnnPoolingBackward(p.cudnn_, fwd_->desc_,
                                   &alpha,
                                   fwd_->y_->desc(), fwd_->y_->deviceMem(),
                                   dy_->desc(), dy_->deviceMem(),
@@ -1194,12 +1997,20 @@ struct CudnnSumFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x0_, x1_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
   void exec(CudaProgram &p) {
 
     float alpha = 1.0f;
     float beta = 0.0f;
 
-    cudnnOpTensor(ctx_->cudnn_, desc_,
+    cudnnOpTensor(p.cudnn_, desc_,
                   &alpha,
                   x0_->desc(),
                   x0_->deviceMem(),
@@ -1319,11 +2130,19 @@ struct CudnnReduce : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
   void exec(CudaProgram &p) {
 
     float alpha = 1.0f, beta = 0.0f;
 
-    chkCUDNN(cudnnReduceTensor(ctx_->cudnn_,
+    chkCUDNN(cudnnReduceTensor(p.cudnn_,
                                desc_,
                                NULL, 0,
                                p.workspace_, p.workspace_size_,
@@ -1350,6 +2169,130 @@ cudnn_reduce_add_make(CudaProgram &p, const Node &n)
 
 //------------------------------------------------------------------------
 
+/**
+ * Column major matrix multiplication on cuBLASLt with the bias, relu or
+ * bias gradient fused into the GEMM as an epilogue. Algorithms are
+ * picked by cuBLASLt's heuristics and cached in the context per shape.
+ * valid() is false if no algorithm supports the configuration, callers
+ * then fall back to plain cuBLAS
+ */
+struct CublasLtMatmul {
+
+  cublasLtMatmulDesc_t desc_ = NULL;
+  cublasLtMatrixLayout_t a_ = NULL, b_ = NULL, c_ = NULL;
+  cublasLtMatmulHeuristicResult_t heuristic_;
+  bool valid_ = false;
+
+  static const size_t MAX_WORKSPACE = 32 * 1024 * 1024;
+
+  CublasLtMatmul(CudaProgram &p, cudnnDataType_t data_type,
+                 cublasOperation_t transa, cublasOperation_t transb,
+                 int m, int n, int k, int lda, int ldb, int ldc,
+                 cublasLtEpilogue_t epilogue)
+  {
+    cudaDataType_t type;
+    switch(data_type) {
+    case CUDNN_DATA_FLOAT:
+      type = CUDA_R_32F;
+      break;
+    case CUDNN_DATA_HALF:
+      type = CUDA_R_16F;
+      break;
+    default:
+      return;
+    }
+
+    chkCuda(cublasLtMatmulDescCreate(&desc_, CUBLAS_COMPUTE_32F,
+                                     CUDA_R_32F));
+    chkCuda(cublasLtMatmulDescSetAttribute(desc_,
+                                           CUBLASLT_MATMUL_DESC_TRANSA,
+                                           &transa, sizeof(transa)));
+    chkCuda(cublasLtMatmulDescSetAttribute(desc_,
+                                           CUBLASLT_MATMUL_DESC_TRANSB,
+                                           &transb, sizeof(transb)));
+    chkCuda(cublasLtMatmulDescSetAttribute(desc_,
+                                           CUBLASLT_MATMUL_DESC_EPILOGUE,
+                                           &epilogue, sizeof(epilogue)));
+
+    const bool ta = transa != CUBLAS_OP_N;
+    const bool tb = transb != CUBLAS_OP_N;
+    chkCuda(cublasLtMatrixLayoutCreate(&a_, type, ta ? k : m, ta ? m : k,
+                                       lda));
+    chkCuda(cublasLtMatrixLayoutCreate(&b_, type, tb ? n : k, tb ? k : n,
+                                       ldb));
+    chkCuda(cublasLtMatrixLayoutCreate(&c_, type, m, n, ldc));
+
+    std::stringstream ss;
+    ss << "lt:" << (int)type << ":" << ta << tb << ":" << m << "x" << n
+       << "x" << k << ":" << lda << ":" << ldb << ":" << ldc << ":"
+       << (int)epilogue;
+    const std::string key = ss.str();
+
+    auto it = p.ctx_->lt_algos_.find(key);
+    if(it != p.ctx_->lt_algos_.end()) {
+      heuristic_ = it->second;
+    } else if(p.findLtAlgo(key, &heuristic_)) {
+      p.ctx_->lt_algos_[key] = heuristic_;
+    } else {
+      cublasLtMatmulPreference_t pref;
+      chkCuda(cublasLtMatmulPreferenceCreate(&pref));
+      size_t max_workspace = MAX_WORKSPACE;
+      chkCuda(cublasLtMatmulPreferenceSetAttribute(pref,
+                                                   CUBLASLT_MATMUL_PREF_MAX_WORKSPACE_BYTES,
+                                                   &max_workspace,
+                                                   sizeof(max_workspace)));
+      int count = 0;
+      if(cublasLtMatmulAlgoGetHeuristic(p.cublaslt_, desc_, a_, b_, c_, c_,
+                                        pref, 1, &heuristic_, &count) ||
+         count == 0) {
+        heuristic_.state = CUBLAS_STATUS_NOT_SUPPORTED;
+      }
+      chkCuda(cublasLtMatmulPreferenceDestroy(pref));
+      p.ctx_->lt_algos_[key] = heuristic_;
+    }
+    p.storeLtAlgo(key, heuristic_);
+
+    valid_ = heuristic_.state == CUBLAS_STATUS_SUCCESS;
+    if(valid_)
+      p.requetstWorkspace(heuristic_.workspaceSize);
+  }
+
+  ~CublasLtMatmul()
+  {
+    if(c_)
+      chkCuda(cublasLtMatrixLayoutDestroy(c_));
+    if(b_)
+      chkCuda(cublasLtMatrixLayoutDestroy(b_));
+    if(a_)
+      chkCuda(cublasLtMatrixLayoutDestroy(a_));
+    if(desc_)
+      chkCuda(cublasLtMatmulDescDestroy(desc_));
+  }
+
+  bool valid() const {
+    return valid_;
+  }
+
+  // c = a * b + beta * c followed by the epilogue. bias is read by the
+  // bias epilogues and written by the bias gradient ones
+  void exec(CudaProgram &p, const void *a, const void *b, void *c,
+            float beta, void *bias)
+  {
+    float alpha = 1.0f;
+    if(bias) {
+      chkCuda(cublasLtMatmulDescSetAttribute(desc_,
+                                             CUBLASLT_MATMUL_DESC_BIAS_POINTER,
+                                             &bias, sizeof(bias)));
+    }
+    chkCuda(cublasLtMatmul(p.cublaslt_, desc_, &alpha,
+                           a, a_, b, b_, &beta, c, c_, c, c_,
+                           &heuristic_.algo,
+                           p.workspace_, heuristic_.workspaceSize,
+                           p.stream_));
+  }
+};
+
+
 struct CudnnGemmFwd : public CudaOperation {
 
   const std::shared_ptr<CudaContext> ctx_;
@@ -1359,6 +2302,10 @@ struct CudnnGemmFwd : public CudaOperation {
   const int num_outputs_;
   const bool transW_;
   const float y_beta_;
+  const bool relu_;
+
+  std::unique_ptr<CublasLtMatmul> matmul_;
+  cudnnActivationDescriptor_t relu_desc_;
 
   CudnnGemmFwd(CudaProgram &p, const Node &n)
     : ctx_(p.ctx_)
@@ -1371,13 +2318,43 @@ struct CudnnGemmFwd : public CudaOperation {
     , num_outputs_(y_->dims_[1])
     , transW_(n.attributes_.get("transW", false))
     , y_beta_(n.attributes_.get("y.beta", 0.0f))
+    , relu_(n.attributes_.get("relu", false))
+  {
+    cublasLtEpilogue_t epilogue;
+    if(b_)
+      epilogue = relu_ ? CUBLASLT_EPILOGUE_RELU_BIAS : CUBLASLT_EPILOGUE_BIAS;
+    else
+      epilogue = relu_ ? CUBLASLT_EPILOGUE_RELU : CUBLASLT_EPILOGUE_DEFAULT;
+
+    matmul_ = std::make_unique<CublasLtMatmul>(p, x_->type_,
+                                               transW_ ? CUBLAS_OP_T : CUBLAS_OP_N,
+                                               CUBLAS_OP_N,
+                                               num_outputs_, n_, num_inputs_,
+                                               transW_ ? num_inputs_ : num_outputs_,
+                                               num_inputs_, num_outputs_,
+                                               epilogue);
+
+    chkCUDNN(cudnnCreateActivationDescriptor(&relu_desc_));
+    chkCUDNN(cudnnSetActivationDescriptor(relu_desc_, CUDNN_ACTIVATION_RELU,
+                                          CUDNN_PROPAGATE_NAN, 0.0f));
+  }
+
+  ~CudnnGemmFwd()
   {
-    assert(y_beta_ == 0); // The trailing cudnnAddTensor operations doesn't support this
+    chkCUDNN(cudnnDestroyActivationDescriptor(relu_desc_));
+  }
+
+  std::string algo() const override {
+    return matmul_->valid() ? "cublasLt" : "cublas";
+  }
+
+  int64_t flops() const override {
+    return 2LL * n_ * num_inputs_ * num_outputs_;
   }
 
   void print() const {
-    printf("Gemm Fwd (%d inputs, %d outputs)\n",
-           num_inputs_, num_outputs_);
+    printf("Gemm Fwd (%d inputs, %d outputs)%s\n",
+           num_inputs_, num_outputs_, relu_ ? " +Relu" : "");
     printf("\tx: %s\n", x_->info().c_str());
     printf("\tw: %s\n", w_->info().c_str());
     if(b_)
@@ -1385,24 +2362,54 @@ struct CudnnGemmFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, w_, b_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
+  bool recomputable() const {
+    return y_beta_ == 0;
+  }
+
   void exec(CudaProgram &p) {
 
-    float alpha = 1.0f, beta = 0.0f;
-    __half halpha = 1.0f, hbeta = 0.0f;
+    if(matmul_->valid()) {
+      matmul_->exec(p, w_->deviceMem(), x_->deviceMem(), y_->deviceMem(),
+                    y_beta_, b_ ? b_->deviceMem() : NULL);
+    } else {
+      gemm(p);
+    }
+
+    if(p.debug_) {
+      x_->printStats("gemm.x");
+      w_->printStats("gemm.w");
+      if(b_)
+        b_->printStats("gemm.b");
+      y_->printStats("gemm.y");
+    }
+  }
+
+  // Fallback without cuBLASLt: GEMM, bias and relu as separate passes
+  void gemm(CudaProgram &p) {
+    float alpha = 1.0f;
+    __half halpha = 1.0f, hbeta = y_beta_;
     cublasOperation_t transA = transW_ ? CUBLAS_OP_T : CUBLAS_OP_N;
     cublasOperation_t transB = CUBLAS_OP_N;
     switch(x_->type_) {
     case CUDNN_DATA_FLOAT:
-      chkCuda(cublasSgemm(ctx_->cublas_, transA, transB,
+      chkCuda(cublasSgemm(p.cublas_, transA, transB,
                           num_outputs_, n_, num_inputs_,
                           &alpha,
                           (const float *)w_->deviceMem(), transW_ ? num_inputs_ : num_outputs_,
                           (const float *)x_->deviceMem(), num_inputs_,
-                          &beta,
+                          &y_beta_,
                           (float *)y_->deviceMem(), num_outputs_));
       break;
     case CUDNN_DATA_HALF:
-      chkCuda(cublasHgemm(ctx_->cublas_, transA, transB,
+      chkCuda(cublasHgemm(p.cublas_, transA, transB,
                           num_outputs_, n_, num_inputs_,
                           &halpha,
                           (const __half *)w_->deviceMem(), transW_ ? num_inputs_ : num_outputs_,
@@ -1414,19 +2421,16 @@ struct CudnnGemmFwd : public CudaOperation {
       abort();
     }
     if(b_) {
-      chkCUDNN(cudnnAddTensor(ctx_->cudnn_,
+      chkCUDNN(cudnnAddTensor(p.cudnn_,
                               &alpha, b_->desc(), b_->deviceMem(),
                               &alpha, y_->desc(), y_->deviceMem()));
     }
-
-    if(p.debug_) {
-      x_->printStats("gemm.x");
-      w_->printStats("gemm.w");
-      b_->printStats("gemm.b");
-      y_->printStats("gemm.y");
+    if(relu_) {
+      float beta = 0.0f;
+      chkCUDNN(cudnnActivationForward(p.cudnn_, relu_desc_,
+                                      &alpha, y_->desc(), y_->deviceMem(),
+                                      &beta, y_->desc(), y_->deviceMem()));
     }
-
-
   }
 };
 
@@ -1438,60 +2442,108 @@ struct CudnnGemmBwd : public CudaOperation {
   const int n_;
   const int num_inputs_;
   const int num_outputs_;
-  const std::shared_ptr<CudaTensor> ones_;
   const float dx_beta_;
+  const float dw_beta_;
+
+  // dw = x * dy^T with db reduced from dy in the epilogue. The bias
+  // gradient epilogue can't accumulate so db is done separately then
+  std::unique_ptr<CublasLtMatmul> dw_matmul_;
+  const bool db_epilogue_;
+
+  // Only needed for db when cuBLASLt can't be used
+  std::shared_ptr<CudaTensor> ones_;
 
   CudnnGemmBwd(CudaProgram &p, const Node &n,
                std::shared_ptr<CudnnGemmFwd> fwd)
     : ctx_(p.ctx_)
     , dx_(fwd->x_->makeGrad())
     , dw_(fwd->w_->makeGrad())
-    , db_(fwd->b_->makeGrad())
+    , db_(fwd->b_ ? fwd->b_->makeGrad() : nullptr)
     , dy_(fwd->y_->makeGrad())
     , x_(fwd->x_)
     , w_(fwd->w_)
     , n_(fwd->n_)
     , num_inputs_(fwd->num_inputs_)
     , num_outputs_(fwd->num_outputs_)
-    , ones_(p.lower_tensor(Tensor::make(x_->data_type_, {n_,1}, 1, 0)))
     , dx_beta_(n.attributes_.get("dx.beta", 0.0f))
+    , dw_beta_(p.gradientBeta())
+    , dw_matmul_(std::make_unique<CublasLtMatmul>(p, x_->type_,
+                                                  CUBLAS_OP_N, CUBLAS_OP_T,
+                                                  num_inputs_, num_outputs_, n_,
+                                                  num_inputs_, num_outputs_,
+                                                  num_inputs_,
+                                                  db_ && !dw_beta_ ?
+                                                  CUBLASLT_EPILOGUE_BGRADB :
+                                                  CUBLASLT_EPILOGUE_DEFAULT))
+    , db_epilogue_(db_ && !dw_beta_ && dw_matmul_->valid())
   {
     assert(fwd->transW_ == true);
+    assert(!fwd->relu_);
+
+    if(db_ && !db_epilogue_)
+      ones_ = p.lower_tensor(Tensor::make(x_->data_type_, {n_,1}, 1, 0));
+  }
+
+  std::string algo() const override {
+    return dw_matmul_->valid() ? "cublasLt" : "cublas";
+  }
+
+  int64_t flops() const override {
+    return (dx_ ? 4LL : 2LL) * n_ * num_inputs_ * num_outputs_;
   }
 
   void print() const {
     printf("Gemm Bwd\n");
     printf("\tdy: %s\n", dy_->info().c_str());
-    printf("\tdb: %s\n", db_->info().c_str());
+    if(db_)
+      printf("\tdb: %s\n", db_->info().c_str());
     printf("\tdw: %s\n", dw_->info().c_str());
     if(dx_)
       printf("\tdx: %s\n", dx_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, w_, dy_, ones_, dx_beta_ ? dx_ : nullptr,
+      dw_beta_ ? dw_ : nullptr, dw_beta_ ? db_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {dx_, dw_, db_};
+  }
+
   void exec(CudaProgram &p) {
-    float alpha = 1.0f, beta = 0.0f;
-    __half halpha = 1.0f, hbeta = 0.0f;
+    float alpha = 1.0f;
+    __half halpha = 1.0f, hbeta = dw_beta_;
+
+    if(dw_matmul_->valid()) {
+      dw_matmul_->exec(p, x_->deviceMem(), dy_->deviceMem(), dw_->deviceMem(),
+                       dw_beta_, db_epilogue_ ? db_->deviceMem() : NULL);
+    }
 
     switch(x_->type_) {
     case CUDNN_DATA_FLOAT:
-      chkCuda(cublasSgemm(ctx_->cublas_, CUBLAS_OP_N, CUBLAS_OP_T,
-                          num_inputs_, num_outputs_, n_,
-                          &alpha,
-                          (const float *)x_->deviceMem(), num_inputs_,
-                          (const float *)dy_->deviceMem(),
-                          num_outputs_,
-                          &beta,
-                          (float *)dw_->deviceMem(), num_inputs_));
+      if(!dw_matmul_->valid()) {
+        chkCuda(cublasSgemm(p.cublas_, CUBLAS_OP_N, CUBLAS_OP_T,
+                            num_inputs_, num_outputs_, n_,
+                            &alpha,
+                            (const float *)x_->deviceMem(), num_inputs_,
+                            (const float *)dy_->deviceMem(),
+                            num_outputs_,
+                            &dw_beta_,
+                            (float *)dw_->deviceMem(), num_inputs_));
+      }
 
-      chkCuda(cublasSgemv(ctx_->cublas_, CUBLAS_OP_N, num_outputs_, n_,
-                          &alpha,
-                          (const float *)dy_->deviceMem(), num_outputs_,
-                          (const float *)ones_->deviceMem(), 1,
-                          &beta,
-                          (float *)db_->deviceMem(), 1));
+      if(db_ && !db_epilogue_) {
+        chkCuda(cublasSgemv(p.cublas_, CUBLAS_OP_N, num_outputs_, n_,
+                            &alpha,
+                            (const float *)dy_->deviceMem(), num_outputs_,
+                            (const float *)ones_->deviceMem(), 1,
+                            &dw_beta_,
+                            (float *)db_->deviceMem(), 1));
+      }
 
       if(dx_ != NULL) {
-        chkCuda(cublasSgemm(ctx_->cublas_, CUBLAS_OP_N, CUBLAS_OP_N,
+        chkCuda(cublasSgemm(p.cublas_, CUBLAS_OP_N, CUBLAS_OP_N,
                             num_inputs_, n_, num_outputs_,
                             &alpha,
                             (const float *)w_->deviceMem(), num_inputs_,
@@ -1504,29 +2556,33 @@ struct CudnnGemmBwd : public CudaOperation {
       break;
 
     case CUDNN_DATA_HALF:
-      chkCuda(cublasHgemm(ctx_->cublas_, CUBLAS_OP_N, CUBLAS_OP_T,
-                          num_inputs_, num_outputs_, n_,
-                          &halpha,
-                          (const __half *)x_->deviceMem(), num_inputs_,
-                          (const __half *)dy_->deviceMem(),
-                          num_outputs_,
-                          &hbeta,
-                          (__half *)dw_->deviceMem(), num_inputs_));
+      if(!dw_matmul_->valid()) {
+        chkCuda(cublasHgemm(p.cublas_, CUBLAS_OP_N, CUBLAS_OP_T,
+                            num_inputs_, num_outputs_, n_,
+                            &halpha,
+                            (const __half *)x_->deviceMem(), num_inputs_,
+                            (const __half *)dy_->deviceMem(),
+                            num_outputs_,
+                            &hbeta,
+                            (__half *)dw_->deviceMem(), num_inputs_));
+      }
 
       // No cublasSgemv() for half type, so do matrix*matrix instead
-      chkCuda(cublasHgemm(ctx_->cublas_, CUBLAS_OP_N, CUBLAS_OP_T,
-                          1, num_outputs_, n_,
-                          &halpha,
-                          (const __half *)ones_->deviceMem(),
-                          1,
-                          (const __half *)dy_->deviceMem(),
-                          num_outputs_,
-                          &hbeta,
-                          (__half *)db_->deviceMem(), 1));
+      if(db_ && !db_epilogue_) {
+        chkCuda(cublasHgemm(p.cublas_, CUBLAS_OP_N, CUBLAS_OP_T,
+                            1, num_outputs_, n_,
+                            &halpha,
+                            (const __half *)ones_->deviceMem(),
+                            1,
+                            (const __half *)dy_->deviceMem(),
+                            num_outputs_,
+                            &hbeta,
+                            (__half *)db_->deviceMem(), 1));
+      }
 
       if(dx_ != NULL) {
         __half dx_hbeta = dx_beta_;
-        chkCuda(cublasHgemm(ctx_->cublas_, CUBLAS_OP_N, CUBLAS_OP_N,
+        chkCuda(cublasHgemm(p.cublas_, CUBLAS_OP_N, CUBLAS_OP_N,
                             num_inputs_, n_, num_outputs_,
                             &halpha,
                             (const __half *)w_->deviceMem(), num_inputs_,
@@ -1546,7 +2602,8 @@ struct CudnnGemmBwd : public CudaOperation {
       w_->print("gemm.w", 4);
       dy_->print("gemm.dy", 4);
       dw_->print("gemm.dw", 4);
-      db_->print("gemm.db", 4);
+      if(db_)
+        db_->print("gemm.db", 4);
       if(dx_)
         dx_->print("gemm.dx", 4);
     }
@@ -1554,7 +2611,6 @@ struct CudnnGemmBwd : public CudaOperation {
 };
 
 
-
 static void
 fc_infer(CudaProgram &p, const Node &n)
 {
@@ -1569,14 +2625,77 @@ fc_train(CudaProgram &p, const Node &n)
   auto b = std::make_shared<CudnnGemmBwd>(p, n, f);
   p.bwd(b);
 
-  p.upd(std::make_shared<CudnnAdam>(p, f->w_, b->dw_));
+  p.upd(f->w_, b->dw_);
   if(f->b_)
-    p.upd(std::make_shared<CudnnAdam>(p, f->b_, b->db_));
+    p.upd(f->b_, b->db_);
 }
 
 REGISTER_CUDA_OP("fc", fc_infer, fc_train);
 
 
+// Fold a relu following a fully connected layer into its GEMM epilogue
+static std::shared_ptr<Node>
+fc_relu_transform_node(const std::vector<std::shared_ptr<Node>> &nodes,
+                       std::shared_ptr<Node> fc,
+                       std::shared_ptr<Node> relu)
+{
+  auto y = fc->outputs_["y"];
+
+  if(relu->inputs_["x"] != y)
+    return nullptr;
+
+  if(fc->attributes_.find("y.beta") != fc->attributes_.end() ||
+     relu->attributes_.find("y.beta") != relu->attributes_.end())
+    return nullptr;
+
+  for(const auto &n : nodes) {
+    if(n == relu)
+      continue;
+    for(const auto &t : n->inputs_) {
+      if(t.second == y)
+        return nullptr;
+    }
+  }
+
+  auto nn = std::make_shared<Node>("fc");
+
+  nn->inputs_ = fc->inputs_;
+  nn->attributes_ = fc->attributes_;
+  nn->attributes_["relu"] = true;
+  nn->outputs_["y"] = relu->outputs_["y"];
+  return nn;
+}
+
+
+static std::vector<std::shared_ptr<Node>>
+fc_relu_transform(CudaProgram &p,
+                  const std::vector<std::shared_ptr<Node>> &nodes)
+{
+  std::vector<std::shared_ptr<Node>> r;
+
+  if(nodes.size() < 2)
+    return nodes;
+
+  for(size_t i = 0; i < nodes.size(); i++) {
+    std::shared_ptr<Node> n = nodes[i];
+
+    if(i < nodes.size() - 1 &&
+       nodes[i + 0]->type_ == "fc" &&
+       nodes[i + 1]->type_ == "relu") {
+      auto n2 = fc_relu_transform_node(nodes, nodes[i], nodes[i + 1]);
+      if(n2) {
+        i++;
+        n = n2;
+      }
+    }
+    r.push_back(n);
+  }
+  return r;
+}
+
+REGISTER_CUDA_TRANSFORM(600, CUDA_TRANSFORM_INFERENCE, fc_relu_transform);
+
+
 //------------------------------------------------------------------------
 
 struct CudnnSoftmaxFwd : public CudaOperation {
@@ -1597,11 +2716,19 @@ struct CudnnSoftmaxFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
   void exec(CudaProgram &p) {
 
     float alpha = 1.0f, beta = 0.0f;
 
-    chkCUDNN(cudnnSoftmaxForward(ctx_->cudnn_,
+    chkCUDNN(cudnnSoftmaxForward(p.cudnn_,
                                  CUDNN_SOFTMAX_ACCURATE,
                                  CUDNN_SOFTMAX_MODE_CHANNEL,
                                  &alpha,
@@ -1639,19 +2766,27 @@ struct CudnnCatClassifierFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
   void exec(CudaProgram &p) {
     switch(x_->type_) {
     case CUDNN_DATA_FLOAT:
       catclassifier_fwd_float_i32(x_->dims_[0],
                                   (const float *)x_->deviceMem(),
                                   (int32_t *)y_->deviceMem(), x_->dims_[1],
-                                  p.ctx_->stream_);
+                                  p.stream_);
       break;
     case CUDNN_DATA_HALF:
       catclassifier_fwd_half_i32(x_->dims_[0],
                                  (const __half *)x_->deviceMem(),
                                  (int32_t *)y_->deviceMem(), x_->dims_[1],
-                                 p.ctx_->stream_);
+                                 p.stream_);
       break;
     default:
       abort();
@@ -1681,11 +2816,20 @@ struct CudnnCatClassifierBwd : public CudaOperation {
     printf("\tdx: %s\n", dx_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {fwd_->x_, fwd_->y_, dy_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {dx_, loss_};
+  }
+
   void exec(CudaProgram &p) {
 
     const int n = fwd_->x_->dims_[0];
     const int c = fwd_->x_->dims_[1];
-    const float scale = 1.0f / n;
+    // Mean over all batches of a gradient accumulation
+    const float scale = 1.0f / (n * p.accumulate_);
 
     switch(fwd_->x_->type_) {
     case CUDNN_DATA_FLOAT:
@@ -1696,7 +2840,7 @@ struct CudnnCatClassifierBwd : public CudaOperation {
                                   (const int32_t *)dy_->deviceMem(),
                                   loss_ ? (float *)loss_->deviceMem() : NULL,
                                   c, scale,
-                                  p.ctx_->stream_);
+                                  p.stream_);
 
       break;
     case CUDNN_DATA_HALF:
@@ -1706,8 +2850,8 @@ struct CudnnCatClassifierBwd : public CudaOperation {
                                  (const int32_t *)fwd_->y_->deviceMem(),
                                  (const int32_t *)dy_->deviceMem(),
                                  loss_ ? (float *)loss_->deviceMem() : NULL,
-                                 c, scale * p.mp_scaling_,
-                                 p.ctx_->stream_);
+                                 c, scale, &p.train_state_->mp_scaling,
+                                 p.stream_);
 
       break;
     default:
@@ -1766,9 +2910,17 @@ struct CudnnTransform : public CudaOperation {
     printf("\tb: %s\n", b_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {a_, beta_ ? b_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {b_};
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
-    chkCUDNN(cudnnTransformTensor(ctx_->cudnn_,
+    chkCUDNN(cudnnTransformTensor(p.cudnn_,
                                   &alpha,
                                   a_->desc(),
                                   a_->deviceMem(),
@@ -1832,18 +2984,29 @@ struct CudnnConvert : public CudaOperation {
 
   const std::shared_ptr<CudaContext> ctx_;
   const std::shared_ptr<CudaTensor> x_, y_;
+  const std::shared_ptr<CudaTensor> mean_, stddev_;
   const float scale_;
+  int channels_;
+  int channel_stride_;
   void (*algo_)(const void *src, void *dst, int elements, float scale,
+                const float *mean, const float *stddev,
+                int channels, int channel_stride,
                 cudaStream_t stream);
 
   CudnnConvert(CudaProgram &p,
                std::shared_ptr<CudaTensor> x,
                std::shared_ptr<CudaTensor> y,
-               float scale)
+               float scale,
+               std::shared_ptr<CudaTensor> mean = nullptr,
+               std::shared_ptr<CudaTensor> stddev = nullptr)
     : ctx_(p.ctx_)
     , x_(x)
     , y_(y)
+    , mean_(mean)
+    , stddev_(stddev)
     , scale_(scale)
+    , channels_(1)
+    , channel_stride_(1)
   {
     if(x_->data_type_ == Tensor::DataType::U8 &&
        y_->data_type_ == Tensor::DataType::FLOAT) {
@@ -1857,41 +3020,95 @@ struct CudnnConvert : public CudaOperation {
     } else {
       abort();
     }
+
+    if(!mean_ && !stddev_)
+      return;
+
+    if(!mean_ || !stddev_ ||
+       mean_->data_type_ != Tensor::DataType::FLOAT ||
+       stddev_->data_type_ != Tensor::DataType::FLOAT) {
+      fprintf(stderr, "Convert: Normalization needs FLOAT mean and std\n");
+      abort();
+    }
+
+    const int max_rank = 8;
+    int dims[max_rank];
+    int strides[max_rank];
+    int rank;
+    cudnnDataType_t data_type;
+
+    chkCUDNN(cudnnGetTensorNdDescriptor(x_->desc_, max_rank, &data_type,
+                                        &rank, dims, strides));
+
+    // Channel is computed from the element index, so x must be packed
+    int64_t span = 1;
+    for(int i = 0; i < rank; i++)
+      span += (int64_t)(dims[i] - 1) * strides[i];
+
+    if(rank < 2 || span != x_->elements_ ||
+       mean_->elements_ != dims[1] || stddev_->elements_ != dims[1]) {
+      fprintf(stderr, "Convert: Unable to normalize %s\n",
+              x_->info().c_str());
+      abort();
+    }
+    channels_ = dims[1];
+    channel_stride_ = strides[1];
   }
 
   void print() const {
-    printf("Convert %zd elements\n", (size_t)x_->elements_);
+    printf("Convert %zd elements%s\n", (size_t)x_->elements_,
+           mean_ ? " (normalize)" : "");
     printf("\tx: %s\n", x_->info().c_str());
+    if(mean_) {
+      printf("\tmean: %s\n", mean_->info().c_str());
+      printf("\tstd:  %s\n", stddev_->info().c_str());
+    }
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, mean_, stddev_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
   void exec(CudaProgram &p) {
     algo_(x_->deviceMem(), y_->deviceMem(), x_->elements_, scale_,
-          p.ctx_->stream_);
+          mean_ ? (const float *)mean_->deviceMem() : NULL,
+          stddev_ ? (const float *)stddev_->deviceMem() : NULL,
+          channels_, channel_stride_,
+          p.stream_);
   }
 
 };
 
 
 
-static void
-convert_infer(CudaProgram &p, const Node &n)
+static std::shared_ptr<CudaOperation>
+convert_make(CudaProgram &p, const Node &n)
 {
   auto x = p.lower_tensor_batch(n.inputs_.get("x"));
   auto y = p.lower_tensor_batch(n.outputs_.get("y"), *x);
   auto scale = n.attributes_.get("scale", 1.0f);
-  p.infer(std::make_shared<CudnnConvert>(p, x, y, scale));
+  auto mean = p.lower_tensor(n.inputs_.get("mean"));
+  auto stddev = p.lower_tensor(n.inputs_.get("std"));
+  return std::make_shared<CudnnConvert>(p, x, y, scale, mean, stddev);
+}
+
+static void
+convert_infer(CudaProgram &p, const Node &n)
+{
+  p.infer(convert_make(p, n));
 }
 
 static void
 convert_train(CudaProgram &p, const Node &n)
 {
-  auto x = p.lower_tensor_batch(n.inputs_.get("x"));
-  auto y = p.lower_tensor_batch(n.outputs_.get("y"), *x);
-  auto scale = n.attributes_.get("scale", 1.0f);
-  p.train(std::make_shared<CudnnConvert>(p, x, y, scale));
+  p.train(convert_make(p, n));
 
-  assert(y->grad_ == NULL); // No backprop here yet
+  assert(p.lower_tensor(n.outputs_.get("y"))->grad_ == NULL); // No backprop here yet
 }
 
 REGISTER_CUDA_OP("convert", convert_infer, convert_train);
@@ -1933,11 +3150,19 @@ struct CudnnMathOp : public CudaOperation {
     printf("\tc: %s\n", c_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {a_, b_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {c_};
+  }
+
   void exec(CudaProgram &p) {
 
     float alpha = 1.0f, beta = 0.0f;
 
-    chkCUDNN(cudnnOpTensor(ctx_->cudnn_,
+    chkCUDNN(cudnnOpTensor(p.cudnn_,
                            desc_,
                            &alpha,
                            a_->desc(),
@@ -2068,8 +3293,16 @@ struct CudnnDropoutFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
   void exec(CudaProgram &p) {
-    chkCUDNN(cudnnDropoutForward(ctx_->cudnn_, desc_,
+    chkCUDNN(cudnnDropoutForward(p.cudnn_, desc_,
                                  x_->desc(), x_->deviceMem(),
                                  y_->desc(), y_->deviceMem(),
                                  reserve_, reserve_size_));
@@ -2104,8 +3337,16 @@ struct CudnnDropoutBwd : public CudaOperation {
     printf("\tdx: %s\n", dx_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {dy_, dx_beta_ ? dx_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {dx_};
+  }
+
   void exec(CudaProgram &p) {
-    chkCUDNN(cudnnDropoutBackward(ctx_->cudnn_, fwd_->desc_,
+    chkCUDNN(cudnnDropoutBackward(p.cudnn_, fwd_->desc_,
                                   dy_->desc(), dy_->deviceMem(),
                                   dx_->desc(), dx_->deviceMem(),
                                   fwd_->reserve_, fwd_->reserve_size_));
@@ -2217,13 +3458,21 @@ struct CudnnSpatialTransformFwd : public CudaOperation {
     printf("\ty: %s\n", y_->info().c_str());
   }
 
+  CudaTensors getInputs() const override {
+    return {x_, theta_, y_beta_ ? y_ : nullptr};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_, grid_};
+  }
+
   void exec(CudaProgram &p) {
     float alpha = 1.0f;
 
-    chkCUDNN(cudnnSpatialTfGridGeneratorForward(ctx_->cudnn_, desc_,
+    chkCUDNN(cudnnSpatialTfGridGeneratorForward(p.cudnn_, desc_,
                                                 theta_->deviceMem(),
                                                 grid_->deviceMem()));
-    chkCUDNN(cudnnSpatialTfSamplerForward(ctx_->cudnn_, desc_,
+    chkCUDNN(cudnnSpatialTfSamplerForward(p.cudnn_, desc_,
                                           &alpha,
                                           x_->desc(), x_->deviceMem(),
                                           grid_->deviceMem(),
@@ -0,0 +1,796 @@
+#include <math.h>
+#include <algorithm>
+#include <unordered_set>
+
+#include "saga.h"
+#include "tensor.h"
+#include "context.h"
+
+#include "cuda_common.h"
+#include "cuda_tensor.h"
+
+namespace saga {
+
+/**
+ * INT8 inference (ProgramConfig::int8)
+ *
+ * Activations are quantized symmetrically with one scale per tensor,
+ * derived from the absolute max observed while running calibration
+ * batches through a float copy of the network (CudaCalibrateInt8()).
+ * Weights are quantized per output channel when the program is created.
+ *
+ * int8_transform() rewrites eligible convolutions and fully connected
+ * layers into conv_int8 / fc_int8 nodes. Their input is quantized by a
+ * quantize node unless it's already produced in INT8 by another such
+ * node, and an output is only kept in INT8 if all its readers are INT8
+ * nodes as well. Everything else stays in the original data type, so
+ * quantize / dequantize only happens at the edges of INT8 regions.
+ */
+
+// Tensors of rank <= 4, missing dimensions are added as size 1
+static bool
+int8_layout(const CudaTensor &t, ImageLayout *l)
+{
+  const int max_rank = 8;
+  int dims[max_rank];
+  int strides[max_rank];
+  int rank;
+  cudnnDataType_t data_type;
+
+  chkCUDNN(cudnnGetTensorNdDescriptor(t.desc_, max_rank, &data_type,
+                                      &rank, dims, strides));
+  if(rank > 4)
+    return false;
+  for(int i = rank; i < 4; i++) {
+    dims[i] = 1;
+    strides[i] = 1;
+  }
+  *l = ImageLayout{dims[1], dims[2], dims[3],
+    {strides[0], strides[1], strides[2], strides[3]}};
+  return true;
+}
+
+
+//------------------------------------------------------------------------
+// Calibration
+//------------------------------------------------------------------------
+
+struct CudaAbsMax : public CudaOperation {
+
+  const std::shared_ptr<CudaTensor> x_;
+  float *const result_;
+  const ImageLayout l_;
+
+  CudaAbsMax(std::shared_ptr<CudaTensor> x, float *result,
+             const ImageLayout &l)
+    : x_(x)
+    , result_(result)
+    , l_(l)
+  {}
+
+  void print() const {
+    printf("AbsMax\n");
+    printf("\tx: %s\n", x_->info().c_str());
+  }
+
+  CudaTensors getInputs() const override {
+    return {x_};
+  }
+
+  void exec(CudaProgram &p) {
+    switch(x_->type_) {
+    case CUDNN_DATA_FLOAT:
+      absmax_float(x_->dims_[0], (const float *)x_->deviceMem(), l_,
+                   result_, p.stream_);
+      break;
+    case CUDNN_DATA_HALF:
+      absmax_half(x_->dims_[0], (const __half *)x_->deviceMem(), l_,
+                  result_, p.stream_);
+      break;
+    default:
+      abort();
+    }
+  }
+};
+
+
+std::unordered_map<std::shared_ptr<Tensor>, float>
+CudaCalibrateInt8(CudaContext &ctx, const Graph &g, const ProgramConfig &pc,
+                  const BatchTensorAccessors &accessors, int batch_offset)
+{
+  ProgramConfig cpc = pc;
+  cpc.inference = true;
+  cpc.training = false;
+  cpc.int8 = false;
+  cpc.autotune = false;
+  cpc.cuda_graph = false;
+
+  BatchTensorAccessors pre;
+  for(const auto &a : accessors) {
+    if(a.phase == Phase::PRE && a.mode != Mode::TRAIN)
+      pre.push_back(a);
+  }
+
+  auto p = ctx.createCudaProgram(g, cpc, pre, batch_offset);
+
+  // Several graph tensors may be lowered to the same device tensor
+  std::unordered_map<CudaTensor *,
+                     std::vector<std::shared_ptr<Tensor>>> graph_tensors;
+  for(const auto &it : p->tensors_)
+    graph_tensors[it.second.get()].push_back(it.first);
+
+  // Observe every float input right before it's read
+  std::unordered_map<CudaTensor *, std::pair<int, ImageLayout>> slots;
+  for(const auto &op : p->infer_operations_) {
+    for(const auto &t : op->getInputs()) {
+      if(!t || slots.find(t.get()) != slots.end() ||
+         graph_tensors.find(t.get()) == graph_tensors.end())
+        continue;
+      if(t->type_ != CUDNN_DATA_FLOAT && t->type_ != CUDNN_DATA_HALF)
+        continue;
+      ImageLayout l;
+      if(int8_layout(*t, &l))
+        slots[t.get()] = std::make_pair((int)slots.size(), l);
+    }
+  }
+
+  std::unordered_map<std::shared_ptr<Tensor>, float> r;
+  if(slots.empty())
+    return r;
+
+  float *ranges;
+  chkCuda(cudaMalloc(&ranges, slots.size() * sizeof(float)));
+  chkCuda(cudaMemset(ranges, 0, slots.size() * sizeof(float)));
+
+  std::vector<std::shared_ptr<CudaOperation>> ops;
+  for(const auto &op : p->infer_operations_) {
+    for(const auto &t : op->getInputs()) {
+      auto it = t ? slots.find(t.get()) : slots.end();
+      if(it != slots.end())
+        ops.push_back(std::make_shared<CudaAbsMax>(t,
+                                                   ranges + it->second.first,
+                                                   it->second.second));
+    }
+    ops.push_back(op);
+  }
+  p->infer_operations_ = ops;
+  p->infer(std::max(1, pc.int8_calibration_batches));
+  chkCuda(cudaStreamSynchronize(p->stream_));
+
+  std::vector<float> host(slots.size());
+  chkCuda(cudaMemcpy(&host[0], ranges, host.size() * sizeof(float),
+                     cudaMemcpyDeviceToHost));
+  chkCuda(cudaFree(ranges));
+
+  for(const auto &it : slots) {
+    for(const auto &t : graph_tensors[it.first])
+      r[t] = host[it.second.first];
+  }
+  return r;
+}
+
+
+//------------------------------------------------------------------------
+// Weights
+//------------------------------------------------------------------------
+
+// One value per channel from a tensor such as [C] or [1, C]. Missing
+// tensors (or ones without data) read as def
+static std::vector<float>
+channel_values(const std::shared_ptr<Tensor> &t, int channels, float def)
+{
+  std::vector<float> r(channels, def);
+  auto ta = t ? t->access() : nullptr;
+  if(!ta)
+    return r;
+
+  Dims e(t->dims_.size(), 0);
+  size_t d = 0;
+  while(d < e.size() - 1 && t->dims_[d] == 1)
+    d++;
+
+  for(int k = 0; k < channels; k++) {
+    e[d] = k;
+    r[k] = ta->get(e);
+  }
+  return r;
+}
+
+// Advance e to the next element of dims in row-major order, leaving
+// dimension skip alone
+static bool
+next_element(Dims &e, const Dims &dims, int skip)
+{
+  for(int i = dims.size() - 1; i >= 0; i--) {
+    if(i == skip)
+      continue;
+    if(++e[i] < dims[i])
+      return true;
+    e[i] = 0;
+  }
+  return false;
+}
+
+
+struct Int8Weights {
+  std::shared_ptr<CudaTensor> w;      // Output channel is the outermost dim
+  std::shared_ptr<CudaTensor> scale;  // Accumulator to real value, per channel
+  std::shared_ptr<CudaTensor> bias;
+};
+
+static std::shared_ptr<CudaTensor>
+int8_upload(CudaProgram &p, Tensor &t, cudnnTensorFormat_t format)
+{
+  auto ct = std::make_shared<CudaTensor>(t.data_type_, t.dims_, format,
+                                         p.ctx_, t.name_);
+  ct->copyFromLocked(t);
+  return ct;
+}
+
+/**
+ * Quantize the weights of node n with output channels along dimension
+ * kdim of w. Batchnorm parameters attached by batchnorm_fold_transform()
+ * are folded in first, in float on the host
+ */
+static Int8Weights
+int8_weights(CudaProgram &p, const Node &n, int kdim,
+             cudnnTensorFormat_t format)
+{
+  const bool fold = n.inputs_.get("bn.m") != nullptr;
+  auto w = n.inputs_.get(fold ? "unfolded.w" : "w");
+  const int channels = w->dims_[kdim];
+  const int64_t per_channel = w->elements_ / channels;
+
+  std::vector<float> bias =
+    channel_values(n.inputs_.get(fold ? "unfolded.b" : "b"), channels, 0);
+  std::vector<float> factor(channels, 1.0f);
+
+  if(fold) {
+    const float epsilon = n.attributes_.get("bn.epsilon", 1e-5f);
+    const auto s = channel_values(n.inputs_.get("bn.s"), channels, 1);
+    const auto bb = channel_values(n.inputs_.get("bn.b"), channels, 0);
+    const auto m = channel_values(n.inputs_.get("bn.m"), channels, 0);
+    const auto v = channel_values(n.inputs_.get("bn.v"), channels, 1);
+    for(int k = 0; k < channels; k++) {
+      factor[k] = s[k] / sqrtf(v[k] + epsilon);
+      bias[k] = (bias[k] - m[k]) * factor[k] + bb[k];
+    }
+  }
+
+  std::vector<float> wf(w->elements_, 0.0f);
+  auto ta = w->access();
+  if(ta) {
+    for(int k = 0; k < channels; k++) {
+      Dims e(w->dims_.size(), 0);
+      e[kdim] = k;
+      float *dst = &wf[k * per_channel];
+      do {
+        *dst++ = ta->get(e) * factor[k];
+      } while(next_element(e, w->dims_, kdim));
+    }
+  }
+  ta.reset();
+
+  Dims dims = w->dims_;
+  dims.erase(dims.begin() + kdim);
+  dims.insert(dims.begin(), channels);
+
+  auto qw = makeCPUTensor(Tensor::DataType::I8, dims, w->namePostfix("int8"));
+  auto qs = makeCPUTensor(Tensor::DataType::FLOAT, Dims({1, channels}),
+                          w->namePostfix("int8.scale"));
+  auto qb = makeCPUTensor(Tensor::DataType::FLOAT, Dims({1, channels}),
+                          w->namePostfix("int8.b"));
+  {
+    auto wa = qw->access();
+    auto sa = qs->access();
+    auto ba = qb->access();
+    int8_t *q = (int8_t *)wa->data();
+    float *scale = (float *)sa->data();
+    float *b = (float *)ba->data();
+    const float x_scale = n.attributes_.get("x.scale", 1.0f);
+
+    for(int k = 0; k < channels; k++) {
+      const float *src = &wf[k * per_channel];
+      float max = 0;
+      for(int64_t i = 0; i < per_channel; i++)
+        max = std::max(max, fabsf(src[i]));
+
+      const float step = max > 0 ? max / 127.0f : 1.0f;
+      for(int64_t i = 0; i < per_channel; i++)
+        q[k * per_channel + i] = std::clamp(rintf(src[i] / step),
+                                            -127.0f, 127.0f);
+      scale[k] = x_scale * step;
+      b[k] = bias[k];
+    }
+  }
+
+  return Int8Weights{int8_upload(p, *qw, format),
+                     int8_upload(p, *qs, CUDNN_TENSOR_NCHW),
+                     int8_upload(p, *qb, CUDNN_TENSOR_NCHW)};
+}
+
+
+//------------------------------------------------------------------------
+// Operations
+//------------------------------------------------------------------------
+
+struct CudaQuantize : public CudaOperation {
+
+  const std::shared_ptr<CudaContext> ctx_;
+  const std::shared_ptr<CudaTensor> x_, y_;
+  const float scale_;
+  ImageLayout xl_, yl_;
+
+  CudaQuantize(CudaProgram &p, const Node &n)
+    : ctx_(p.ctx_)
+    , x_(p.lower_tensor_batch(n.inputs_.get("x")))
+    , y_(p.lower_tensor_batch(n.outputs_.get("y")))
+    , scale_(1.0f / n.attributes_.get("scale", 1.0f))
+  {
+    if(!int8_layout(*x_, &xl_) || !int8_layout(*y_, &yl_)) {
+      fprintf(stderr, "quantize: Unsupported tensor rank\n");
+      abort();
+    }
+  }
+
+  void print() const {
+    printf("Quantize (1/%g)\n", 1.0f / scale_);
+    printf("\tx: %s\n", x_->info().c_str());
+    printf("\ty: %s\n", y_->info().c_str());
+  }
+
+  CudaTensors getInputs() const override {
+    return {x_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
+  void exec(CudaProgram &p) {
+    switch(x_->type_) {
+    case CUDNN_DATA_FLOAT:
+      quantize_float_i8(x_->dims_[0], (const float *)x_->deviceMem(), xl_,
+                        (int8_t *)y_->deviceMem(), yl_, scale_,
+                        p.stream_);
+      break;
+    case CUDNN_DATA_HALF:
+      quantize_half_i8(x_->dims_[0], (const __half *)x_->deviceMem(), xl_,
+                       (int8_t *)y_->deviceMem(), yl_, scale_,
+                       p.stream_);
+      break;
+    default:
+      abort();
+    }
+  }
+};
+
+static void
+quantize_infer(CudaProgram &p, const Node &n)
+{
+  p.infer(std::make_shared<CudaQuantize>(p, n));
+}
+
+REGISTER_CUDA_OP("quantize", quantize_infer, NULL);
+
+
+
+/**
+ * Scale, bias, optional relu and conversion of the accumulator (float
+ * for cuDNN, int32 for cuBLAS) into y
+ */
+static void
+int8_epilogue(int batch, const float *acc, CudaTensor &y,
+              const ImageLayout &l, const Int8Weights &w, bool relu,
+              float y_scale, cudaStream_t stream)
+{
+  const float *scale = (const float *)w.scale->deviceMem();
+  const float *bias = (const float *)w.bias->deviceMem();
+
+  switch(y.type_) {
+  case CUDNN_DATA_FLOAT:
+    int8_epilogue_float_float(batch, acc, (float *)y.deviceMem(), l,
+                              scale, bias, relu, y_scale, stream);
+    break;
+  case CUDNN_DATA_HALF:
+    int8_epilogue_float_half(batch, acc, (__half *)y.deviceMem(), l,
+                             scale, bias, relu, y_scale, stream);
+    break;
+  case CUDNN_DATA_INT8:
+    int8_epilogue_float_i8(batch, acc, (int8_t *)y.deviceMem(), l,
+                           scale, bias, relu, y_scale, stream);
+    break;
+  default:
+    abort();
+  }
+}
+
+static void
+int8_epilogue(int batch, const int32_t *acc, CudaTensor &y,
+              const ImageLayout &l, const Int8Weights &w, bool relu,
+              float y_scale, cudaStream_t stream)
+{
+  const float *scale = (const float *)w.scale->deviceMem();
+  const float *bias = (const float *)w.bias->deviceMem();
+
+  switch(y.type_) {
+  case CUDNN_DATA_FLOAT:
+    int8_epilogue_i32_float(batch, acc, (float *)y.deviceMem(), l,
+                            scale, bias, relu, y_scale, stream);
+    break;
+  case CUDNN_DATA_HALF:
+    int8_epilogue_i32_half(batch, acc, (__half *)y.deviceMem(), l,
+                           scale, bias, relu, y_scale, stream);
+    break;
+  case CUDNN_DATA_INT8:
+    int8_epilogue_i32_i8(batch, acc, (int8_t *)y.deviceMem(), l,
+                         scale, bias, relu, y_scale, stream);
+    break;
+  default:
+    abort();
+  }
+}
+
+
+// The accumulator lives at the start of the workspace
+static size_t
+int8_acc_size(const CudaTensor &y)
+{
+  const size_t alignment = 256;
+  return (y.elements_ * sizeof(float) + alignment - 1) & ~(alignment - 1);
+}
+
+
+struct CudnnConvolutionInt8Fwd : public CudaOperation {
+
+  const std::shared_ptr<CudaContext> ctx_;
+  const std::shared_ptr<CudaTensor> x_, y_;
+  const Int8Weights w_;
+  const bool relu_;
+  const float y_scale_;
+  const size_t acc_size_;
+  ImageLayout yl_;
+
+  cudnnConvolutionDescriptor_t conv_desc_;
+  cudnnFilterDescriptor_t filter_desc_;
+  cudnnTensorDescriptor_t acc_desc_;
+  cudnnConvolutionFwdAlgo_t conv_fwd_algo_;
+
+  ~CudnnConvolutionInt8Fwd()
+  {
+    chkCUDNN(cudnnDestroyTensorDescriptor(acc_desc_));
+    chkCUDNN(cudnnDestroyFilterDescriptor(filter_desc_));
+    chkCUDNN(cudnnDestroyConvolutionDescriptor(conv_desc_));
+  }
+
+  CudnnConvolutionInt8Fwd(CudaProgram &p, const Node &n)
+    : ctx_(p.ctx_)
+    , x_(p.lower_tensor_batch(n.inputs_.get("x")))
+    , y_(p.lower_tensor_batch(n.outputs_.get("y")))
+    , w_(int8_weights(p, n, 0, CUDNN_TENSOR_NHWC))
+    , relu_(n.attributes_.get("relu", false))
+    , y_scale_(1.0f / n.attributes_.get("y.scale", 1.0f))
+    , acc_size_(int8_acc_size(*y_))
+  {
+    assert(x_->type_ == CUDNN_DATA_INT8);
+    int8_layout(*y_, &yl_);
+
+    chkCUDNN(cudnnCreateFilterDescriptor(&filter_desc_));
+    chkCUDNN(cudnnCreateConvolutionDescriptor(&conv_desc_));
+    chkCUDNN(cudnnCreateTensorDescriptor(&acc_desc_));
+
+    const auto &wd = w_.w->dims_;
+    chkCUDNN(cudnnSetFilter4dDescriptor(filter_desc_,
+                                        CUDNN_DATA_INT8,
+                                        CUDNN_TENSOR_NHWC,
+                                        wd[0], wd[1], wd[2], wd[3]));
+
+    chkCUDNN(cudnnSetConvolutionMathType(conv_desc_,
+                                         CUDNN_TENSOR_OP_MATH));
+
+    const int pad = n.attributes_.get("pad", 0);
+    const int stride = n.attributes_.get("stride", 1);
+
+    chkCUDNN(cudnnSetConvolution2dDescriptor(conv_desc_,
+                                             pad, pad,
+                                             stride, stride,
+                                             1, 1,
+                                             CUDNN_CROSS_CORRELATION,
+                                             CUDNN_DATA_INT32));
+
+    // INT8_EXT_CONFIG: INT8 x and w, float y
+    chkCUDNN(cudnnSetTensor4dDescriptor(acc_desc_, CUDNN_TENSOR_NHWC,
+                                        CUDNN_DATA_FLOAT,
+                                        y_->dims_[0], y_->dims_[1],
+                                        y_->dims_[2], y_->dims_[3]));
+
+    // The only algorithm cuDNN implements for INT8
+    conv_fwd_algo_ = CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_PRECOMP_GEMM;
+
+    size_t workspace;
+    chkCUDNN(cudnnGetConvolutionForwardWorkspaceSize(ctx_->cudnn_,
+                                                     x_->desc_,
+                                                     filter_desc_,
+                                                     conv_desc_,
+                                                     acc_desc_,
+                                                     conv_fwd_algo_,
+                                                     &workspace));
+
+    p.requetstWorkspace(acc_size_ + workspace);
+  }
+
+  std::string algo() const override {
+    return "int8";
+  }
+
+  int64_t flops() const override {
+    return 2 * y_->elements_ * (w_.w->elements_ / w_.w->dims_[0]);
+  }
+
+  void print() const {
+    printf("Convolution INT8 Fwd%s\n", relu_ ? " +Relu" : "");
+    printf("\tx: %s\n", x_->info().c_str());
+    printf("\tw: %s\n", w_.w->info().c_str());
+    printf("\ty: %s\n", y_->info().c_str());
+  }
+
+  CudaTensors getInputs() const override {
+    return {x_, w_.w, w_.scale, w_.bias};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
+  void exec(CudaProgram &p) {
+    float alpha = 1.0f, beta = 0.0f;
+    float *acc = (float *)p.workspace_;
+
+    chkCUDNN(cudnnConvolutionForward(p.cudnn_, &alpha,
+                                     x_->desc(),
+                                     x_->deviceMem(),
+                                     filter_desc_,
+                                     w_.w->deviceMem(),
+                                     conv_desc_,
+                                     conv_fwd_algo_,
+                                     (char *)p.workspace_ + acc_size_,
+                                     p.workspace_size_ - acc_size_,
+                                     &beta,
+                                     acc_desc_,
+                                     acc));
+
+    int8_epilogue(y_->dims_[0], (const float *)acc, *y_, yl_, w_,
+                  relu_, y_scale_, p.stream_);
+
+    if(p.debug_)
+      y_->printStats("conv_int8.y");
+  }
+};
+
+static void
+conv_int8_infer(CudaProgram &p, const Node &n)
+{
+  p.infer(std::make_shared<CudnnConvolutionInt8Fwd>(p, n));
+}
+
+REGISTER_CUDA_OP("conv_int8", conv_int8_infer, NULL);
+
+
+
+struct CublasGemmInt8Fwd : public CudaOperation {
+
+  const std::shared_ptr<CudaContext> ctx_;
+  const std::shared_ptr<CudaTensor> x_, y_;
+  const int n_;
+  const int num_inputs_;
+  const int num_outputs_;
+  const Int8Weights w_;
+  const float y_scale_;
+  const bool relu_;
+  const size_t acc_size_;
+  ImageLayout yl_;
+
+  CublasGemmInt8Fwd(CudaProgram &p, const Node &n)
+    : ctx_(p.ctx_)
+    , x_(p.lower_tensor_batch(n.inputs_.get("x")))
+    , y_(p.lower_tensor_batch(n.outputs_.get("y")))
+    , n_(x_->dims_[0])
+    , num_inputs_(x_->dims_[1])
+    , num_outputs_(y_->dims_[1])
+    , w_(int8_weights(p, n, n.attributes_.get("transW", false) ? 0 : 1,
+                      CUDNN_TENSOR_NCHW))
+    , y_scale_(1.0f / n.attributes_.get("y.scale", 1.0f))
+    , relu_(n.attributes_.get("relu", false))
+    , acc_size_(int8_acc_size(*y_))
+  {
+    assert(x_->type_ == CUDNN_DATA_INT8);
+    int8_layout(*y_, &yl_);
+    p.requetstWorkspace(acc_size_);
+  }
+
+  std::string algo() const override {
+    return "int8";
+  }
+
+  int64_t flops() const override {
+    return 2LL * n_ * num_inputs_ * num_outputs_;
+  }
+
+  void print() const {
+    printf("Gemm INT8 Fwd (%d inputs, %d outputs)%s\n",
+           num_inputs_, num_outputs_, relu_ ? " +Relu" : "");
+    printf("\tx: %s\n", x_->info().c_str());
+    printf("\tw: %s\n", w_.w->info().c_str());
+    printf("\ty: %s\n", y_->info().c_str());
+  }
+
+  CudaTensors getInputs() const override {
+    return {x_, w_.w, w_.scale, w_.bias};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
+
+  void exec(CudaProgram &p) {
+    int32_t alpha = 1, beta = 0;
+    int32_t *acc = (int32_t *)p.workspace_;
+
+    // w is [outputs][inputs] so this is y = x * w^T like transW in fc
+    chkCuda(cublasGemmEx(p.cublas_, CUBLAS_OP_T, CUBLAS_OP_N,
+                         num_outputs_, n_, num_inputs_,
+                         &alpha,
+                         w_.w->deviceMem(), CUDA_R_8I, num_inputs_,
+                         x_->deviceMem(), CUDA_R_8I, num_inputs_,
+                         &beta,
+                         acc, CUDA_R_32I, num_outputs_,
+                         CUDA_R_32I, CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+
+    int8_epilogue(n_, (const int32_t *)acc, *y_, yl_, w_,
+                  relu_, y_scale_, p.stream_);
+
+    if(p.debug_)
+      y_->printStats("fc_int8.y");
+  }
+};
+
+static void
+fc_int8_infer(CudaProgram &p, const Node &n)
+{
+  p.infer(std::make_shared<CublasGemmInt8Fwd>(p, n));
+}
+
+REGISTER_CUDA_OP("fc_int8", fc_int8_infer, NULL);
+
+
+//------------------------------------------------------------------------
+// Transform
+//------------------------------------------------------------------------
+
+static float
+int8_range(const CudaProgram &p, const std::shared_ptr<Tensor> &t)
+{
+  auto it = p.int8_ranges_.find(t);
+  return it == p.int8_ranges_.end() ? 0 : it->second;
+}
+
+
+// cuDNN and cuBLAS want INT8 channels / leading dimensions in
+// multiples of 4, anything else stays in float
+static bool
+int8_candidate(const CudaProgram &p, const Node &n)
+{
+  const bool conv = n.type_ == "conv" || n.type_ == "conv_relu";
+  if(!conv && n.type_ != "fc")
+    return false;
+
+  if(n.attributes_.find("y.beta") != n.attributes_.end())
+    return false;
+
+  auto x = n.inputs_.get("x");
+  auto w = n.inputs_.get(n.inputs_.get("unfolded.w") ? "unfolded.w" : "w");
+  auto y = n.outputs_.get("y");
+  if(!x || !w || !y)
+    return false;
+
+  for(const auto &t : {x, w}) {
+    if(t->data_type_ != Tensor::DataType::FLOAT &&
+       t->data_type_ != Tensor::DataType::HALF)
+      return false;
+  }
+
+  if(int8_range(p, x) <= 0)
+    return false;
+
+  if(conv)
+    return x->dims_.size() == 4 && w->dims_.size() == 4 &&
+      x->dims_[1] % 4 == 0 && w->dims_[0] % 4 == 0;
+
+  return x->dims_.size() == 2 && y->dims_.size() == 2 &&
+    x->dims_[1] % 4 == 0 && y->dims_[1] % 4 == 0;
+}
+
+
+static Nodes
+int8_transform(CudaProgram &p, const Nodes &nodes)
+{
+  if(p.int8_ranges_.empty())
+    return nodes;
+
+  std::unordered_set<const Node *> candidates;
+  for(const auto &n : nodes) {
+    if(int8_candidate(p, *n))
+      candidates.insert(n.get());
+  }
+
+  // True if a tensor is only read as x by INT8 nodes
+  std::unordered_map<std::shared_ptr<Tensor>, bool> int8_readers;
+  for(const auto &n : nodes) {
+    const bool int8 = candidates.find(n.get()) != candidates.end();
+    for(const auto &t : n->inputs_) {
+      const bool ok = int8 && t.first == "x";
+      auto it = int8_readers.find(t.second);
+      if(it == int8_readers.end())
+        int8_readers[t.second] = ok;
+      else
+        it->second = it->second && ok;
+    }
+  }
+
+  std::unordered_map<std::shared_ptr<Tensor>, std::shared_ptr<Tensor>> quantized;
+  Nodes r;
+
+  for(const auto &n : nodes) {
+    if(candidates.find(n.get()) == candidates.end()) {
+      r.push_back(n);
+      continue;
+    }
+
+    auto x = n->inputs_.get("x");
+    auto y = n->outputs_.get("y");
+    const float x_scale = int8_range(p, x) / 127.0f;
+
+    auto &xq = quantized[x];
+    if(!xq) {
+      xq = std::make_shared<Tensor>(Tensor::DataType::I8, x->dims_,
+                                    x->namePostfix("int8"));
+      auto q = std::make_shared<Node>("quantize");
+      q->inputs_["x"] = x;
+      q->attributes_["scale"] = x_scale;
+      q->outputs_["y"] = xq;
+      r.push_back(q);
+    }
+
+    auto nn = std::make_shared<Node>(n->type_ == "fc" ? "fc_int8" :
+                                     "conv_int8");
+    nn->inputs_ = n->inputs_;
+    nn->attributes_ = n->attributes_;
+    nn->inputs_["x"] = xq;
+    nn->attributes_["x.scale"] = x_scale;
+    nn->attributes_["relu"] = n->type_ == "conv_relu" ||
+      n->attributes_.get("relu", false);
+
+    // Tensors already lowered are accessed by the user or aliased
+    // (eg. concat) and must keep their data type
+    auto ri = int8_readers.find(y);
+    const float y_range = int8_range(p, y);
+    if(y_range > 0 && ri != int8_readers.end() && ri->second &&
+       p.tensors_.find(y) == p.tensors_.end()) {
+      auto yq = std::make_shared<Tensor>(Tensor::DataType::I8, y->dims_,
+                                         y->namePostfix("int8"));
+      quantized[y] = yq;
+      nn->attributes_["y.scale"] = y_range / 127.0f;
+      nn->outputs_["y"] = yq;
+    } else {
+      nn->outputs_["y"] = y;
+    }
+    r.push_back(nn);
+  }
+  return r;
+}
+
+// After conv_relu_transform() and fc_relu_transform() so fused
+// activations are picked up
+REGISTER_CUDA_TRANSFORM(700, CUDA_TRANSFORM_INFERENCE, int8_transform);
+
+}
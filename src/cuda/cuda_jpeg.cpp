@@ -1,6 +1,11 @@
 #include <thread>
+#include <atomic>
+#include <algorithm>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
+#include <math.h>
+#include <string.h>
 
 #include <nvjpeg.h>
 
@@ -12,71 +17,207 @@
 #include "cuda_tensor.h"
 #include "cuda_kernels.h"
 
-#define JPEG_THREADS 8
+#define JPEG_DEFAULT_THREADS 8
+
+#define chkNVJPEG(expression) {                                         \
+    const nvjpegStatus_t nvjpeg_status__ = (expression);                \
+    if(nvjpeg_status__ != NVJPEG_STATUS_SUCCESS) {                      \
+      fprintf(stderr, "NVJPEG error at %s:%d in %s: %d\n",              \
+              __FILE__, __LINE__, __FUNCTION__, nvjpeg_status__);       \
+      abort();                                                          \
+    }                                                                   \
+  }
 
 namespace saga {
 
+/**
+ * Each decoder thread has its own nvjpeg state, pinned staging buffers
+ * and CUDA stream and decodes complete images straight into the output
+ * tensor. Images are handed out through an atomic index so the mutex is
+ * only taken when a batch starts and when a thread runs out of work
+ */
+struct CudaJpegWorker {
+
+  nvjpegJpegState_t state_;
+  nvjpegJpegStream_t jpeg_stream_;
+  nvjpegDecodeParams_t params_;
+  nvjpegBufferDevice_t device_buffer_;
+
+  // Host decode output is staged in pinned memory and copied to the
+  // device asynchronously, so alternate between two of them
+  nvjpegBufferPinned_t pinned_buffers_[2];
+  cudaEvent_t pinned_done_[2];
+  int pinned_index_;
+
+  cudaStream_t stream_;
+  cudaEvent_t done_;
+
+  // Compressed data, grown when the loader asks for more space
+  std::vector<uint8_t> data_;
+
+  std::thread thread_;
+
+  CudaJpegWorker(nvjpegHandle_t handle, nvjpegJpegDecoder_t decoder)
+    : pinned_index_(0)
+    , data_(65536)
+  {
+    chkNVJPEG(nvjpegDecoderStateCreate(handle, decoder, &state_));
+    chkNVJPEG(nvjpegJpegStreamCreate(handle, &jpeg_stream_));
+    chkNVJPEG(nvjpegDecodeParamsCreate(handle, &params_));
+    chkNVJPEG(nvjpegDecodeParamsSetOutputFormat(params_, NVJPEG_OUTPUT_RGBI));
+    chkNVJPEG(nvjpegBufferDeviceCreate(handle, NULL, &device_buffer_));
+    chkNVJPEG(nvjpegStateAttachDeviceBuffer(state_, device_buffer_));
+
+    for(int i = 0; i < 2; i++) {
+      chkNVJPEG(nvjpegBufferPinnedCreate(handle, NULL, &pinned_buffers_[i]));
+      chkCuda(cudaEventCreateWithFlags(&pinned_done_[i],
+                                       cudaEventDisableTiming));
+    }
+
+    chkCuda(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+    chkCuda(cudaEventCreateWithFlags(&done_, cudaEventDisableTiming));
+  }
+
+  ~CudaJpegWorker()
+  {
+    chkCuda(cudaStreamSynchronize(stream_));
+    chkCuda(cudaEventDestroy(done_));
+    chkCuda(cudaStreamDestroy(stream_));
+    for(int i = 0; i < 2; i++) {
+      chkCuda(cudaEventDestroy(pinned_done_[i]));
+      nvjpegBufferPinnedDestroy(pinned_buffers_[i]);
+    }
+    nvjpegBufferDeviceDestroy(device_buffer_);
+    nvjpegDecodeParamsDestroy(params_);
+    nvjpegJpegStreamDestroy(jpeg_stream_);
+    nvjpegJpegStateDestroy(state_);
+  }
+};
+
+
 struct CudaJpeg : public CudaOperation {
 
   const std::shared_ptr<CudaContext> ctx_;
   const Loader loader_;
+  const MappedLoader mapped_loader_;
   const int batch_size_;
+  const int batch_offset_;
 
-  std::unique_ptr<nvjpegImage_t[]> output_images_[2];
+  std::vector<std::unique_ptr<nvjpegImage_t[]>> output_images_;
   std::shared_ptr<CudaTensor> y_;
 
-  cudaStream_t stream_;
-  cudaEvent_t event_;
+  // With augmentation enabled images are decoded into decoded_ and
+  // exec() transforms them into y_. Otherwise decoded_ is y_
+  std::shared_ptr<CudaTensor> decoded_;
+  bool augment_;
+  ImageAugmentation augmentation_;
+
+  // Batch number and decoded width, height of each image. Filled by
+  // the workers and uploaded to the corresponding slot of sizes_
+  std::vector<int32_t *> host_sizes_;
+  std::shared_ptr<CudaTensor> sizes_;
+
+  int max_rows_;
+  int max_row_bytes_;
 
   nvjpegHandle_t handle_;
-  nvjpegJpegState_t jpeg_handle_;
+  nvjpegJpegDecoder_t decoder_;
+
+  std::vector<std::unique_ptr<CudaJpegWorker>> workers_;
 
-  std::thread threads_[JPEG_THREADS];
   std::mutex work_mutex_;
-  std::condition_variable_any work_cond_;
-  std::condition_variable_any complete_cond_;
+  std::condition_variable work_cond_;
+  std::condition_variable complete_cond_;
+
+  // Bumped for each batch, -1 tells workers to exit
+  long generation_;
+  int workers_idle_;
 
-  int decode_;
-  int completed_;
   long current_batch_;
+  int current_slot_;
+  cudaEvent_t slot_free_;
+
+  std::atomic<int> next_image_;
 
   CudaJpeg(CudaProgram &p, const Node &n)
     : ctx_(p.ctx_)
     , loader_(n.loader_)
+    , mapped_loader_(n.mapped_loader_)
     , batch_size_(p.batch_size_)
+    , batch_offset_(p.batch_offset_)
+    , generation_(0)
+    , current_batch_(0)
+    , current_slot_(0)
+    , slot_free_(NULL)
+    , next_image_(0)
   {
 
     auto yh = n.outputs_.get("y");
 
-    auto it = p.tensors_.find(yh);
-    if(it == p.tensors_.end()) {
+    augment_ = yh->data_type_ != Tensor::DataType::U8;
 
-      auto dims = yh->dims_.n(batch_size_);
-      y_ = std::make_shared<CudaTensor>(yh->data_type_, dims,
-                                        CUDNN_TENSOR_NHWC,
-                                        ctx_, yh->name_, 2);
+    if(augment_) {
+      const int width = n.attributes_.get("width", 0);
+      const int height = n.attributes_.get("height", 0);
+      const int channels = n.attributes_.get("channels", 3);
 
-      p.tensors_[yh] = y_;
-    } else {
-      y_ = it->second;
-    }
+      decoded_ = std::make_shared<CudaTensor>(Tensor::DataType::U8,
+                                              Dims({batch_size_, channels,
+                                                    height, width}),
+                                              CUDNN_TENSOR_NHWC, ctx_,
+                                              std::nullopt, p.slots_);
+      p.flips_.push_back(decoded_->storage_);
 
-    output_images_[0] = std::make_unique<nvjpegImage_t[]>(batch_size_);
-    output_images_[1] = std::make_unique<nvjpegImage_t[]>(batch_size_);
+      y_ = p.lower_tensor_batch(yh);
 
+      sizes_ = std::make_shared<CudaTensor>(Tensor::DataType::I32,
+                                            Dims({1 + batch_size_ * 2}),
+                                            CUDNN_TENSOR_NCHW, ctx_,
+                                            std::nullopt, p.slots_);
+      p.flips_.push_back(sizes_->storage_);
 
-    decode_ = batch_size_;
-    completed_ = batch_size_;
+      host_sizes_.resize(p.slots_);
+      for(auto &hs : host_sizes_) {
+        chkCuda(cudaMallocHost(&hs, sizes_->elements_ * sizeof(int32_t)));
+        memset(hs, 0, sizes_->elements_ * sizeof(int32_t));
+      }
+
+      const float ratio = n.attributes_.get("ratio", 1.0f);
+      augmentation_ = {
+        .scale       = n.attributes_.get("scale", 1.0f),
+        .crop_min    = n.attributes_.get("crop_min", 1.0f),
+        .crop_max    = n.attributes_.get("crop_max", 1.0f),
+        .ratio_min   = 1.0f / ratio,
+        .ratio_max   = ratio,
+        .rotation    = n.attributes_.get("rotation", 0.0f) * (float)M_PI / 180,
+        .translation = n.attributes_.get("translation", 0.0f),
+        .flip        = n.attributes_.get("flip", false),
+        .seed        = (uint32_t)n.attributes_.get("seed", 0),
+      };
 
-    chkCuda(cudaStreamCreateWithFlags(&stream_,
-                                      cudaStreamNonBlocking));
-    chkCuda(cudaEventCreate(&event_));
+    } else {
 
-    nvjpegCreateSimple(&handle_);
-    nvjpegJpegStateCreate(handle_, &jpeg_handle_);
+      auto it = p.tensors_.find(yh);
+      if(it == p.tensors_.end()) {
 
-    nvjpegDecodeBatchedInitialize(handle_, jpeg_handle_,
-                                  batch_size_, JPEG_THREADS, NVJPEG_OUTPUT_RGBI);
+        auto dims = yh->dims_.n(batch_size_);
+        y_ = std::make_shared<CudaTensor>(yh->data_type_, dims,
+                                          CUDNN_TENSOR_NHWC,
+                                          ctx_, yh->name_, p.slots_);
+
+        p.tensors_[yh] = y_;
+        p.flips_.push_back(y_->storage_);
+      } else {
+        y_ = it->second;
+      }
+      decoded_ = y_;
+    }
+
+    for(int i = 0; i < p.slots_; i++)
+      output_images_.push_back(std::make_unique<nvjpegImage_t[]>(batch_size_));
+
+    chkNVJPEG(nvjpegCreateSimple(&handle_));
+    chkNVJPEG(nvjpegDecoderCreate(handle_, NVJPEG_BACKEND_DEFAULT, &decoder_));
 
     const int max_rank = 8;
     int dimsA[max_rank];
@@ -84,11 +225,14 @@ struct CudaJpeg : public CudaOperation {
     int rank;
     cudnnDataType_t data_type;
 
-    chkCUDNN(cudnnGetTensorNdDescriptor(y_->desc_, max_rank, &data_type,
+    chkCUDNN(cudnnGetTensorNdDescriptor(decoded_->desc_, max_rank, &data_type,
                                         &rank, dimsA, stridesA));
 
-    for(int i = 0; i < 2; i++) {
-      uint8_t *ymem = (uint8_t *)y_->deviceMem(i);
+    max_rows_ = dimsA[2];
+    max_row_bytes_ = stridesA[2];
+
+    for(int i = 0; i < p.slots_; i++) {
+      uint8_t *ymem = (uint8_t *)decoded_->deviceMem(i);
 
       for(int n = 0; n < batch_size_; n++) {
         for(int c = 0; c < 3; c++) {
@@ -98,92 +242,238 @@ struct CudaJpeg : public CudaOperation {
       }
     }
 
+    const int threads = std::max(1, n.attributes_.get("threads",
+                                                      JPEG_DEFAULT_THREADS));
+    workers_idle_ = threads;
+    for(int i = 0; i < threads; i++)
+      workers_.push_back(std::make_unique<CudaJpegWorker>(handle_, decoder_));
 
-    for(int i = 0; i < JPEG_THREADS; i++) {
-      threads_[i] = std::thread(&CudaJpeg::worker, this, i);
-    }
-
+    for(auto &w : workers_)
+      w->thread_ = std::thread(&CudaJpeg::worker, this, w.get());
   }
 
   ~CudaJpeg()
   {
-    work_mutex_.lock();
-    decode_ = -1;
-    work_cond_.notify_all();
-    work_mutex_.unlock();
-
-    for(int i = 0; i < JPEG_THREADS; i++) {
-      threads_[i].join();
+    {
+      std::unique_lock<std::mutex> lock(work_mutex_);
+      generation_ = -1;
+      work_cond_.notify_all();
     }
 
-    nvjpegJpegStateDestroy(jpeg_handle_);
+    for(auto &w : workers_)
+      w->thread_.join();
+
+    workers_.clear();
+
+    nvjpegDecoderDestroy(decoder_);
     nvjpegDestroy(handle_);
+
+    for(auto hs : host_sizes_)
+      chkCuda(cudaFreeHost(hs));
   }
 
   void print() const {
-    printf("JPEG decoder\n");
+    printf("JPEG decoder (%zd threads)\n", workers_.size());
+    if(augment_) {
+      const auto &a = augmentation_;
+      printf("\tAugmentation: crop:%.2f-%.2f ratio:%.2f-%.2f "
+             "rotation:%.1f translation:%.2f flip:%s\n",
+             a.crop_min, a.crop_max, a.ratio_min, a.ratio_max,
+             a.rotation * 180 / M_PI, a.translation, a.flip ? "yes" : "no");
+      printf("\tdecoded: %s\n", decoded_->info().c_str());
+    }
+    printf("\ty: %s\n", y_->info().c_str());
   }
 
-  void load(CudaProgram &p, long batch) override {
+  CudaTensors getInputs() const override {
+    if(augment_)
+      return {decoded_, sizes_};
+    return {};
+  }
 
-    int buffer_wr = y_->flip();
+  CudaTensors getOutputs() const override {
+    return {y_};
+  }
 
+  // Called on the program's loader thread
+  void load(CudaProgram &p, long batch) override {
+
+    std::unique_lock<std::mutex> lock(work_mutex_);
 
-    work_mutex_.lock();
     current_batch_ = batch;
-    completed_ = 0;
-    decode_ = 0;
+    current_slot_ = p.batchSlot(batch);
+
+    // Output slot is free once the batch previously using it is computed
+    slot_free_ = p.compute_done_[current_slot_];
+
+    next_image_ = 0;
+    workers_idle_ = 0;
+    generation_++;
     work_cond_.notify_all();
 
-    while(completed_ != batch_size_) {
-      complete_cond_.wait(work_mutex_);
+    complete_cond_.wait(lock, [&] {
+        return workers_idle_ == (int)workers_.size();
+      });
+
+    // The compute stream waits for everything loaded on the copy stream
+    for(const auto &w : workers_)
+      chkCuda(cudaStreamWaitEvent(p.copy_stream_, w->done_, 0));
+
+    if(augment_) {
+      // The workers' streams waited for the slot to be free so the
+      // upload is ordered after any earlier use of it
+      int32_t *hs = host_sizes_[current_slot_];
+      hs[0] = batch;
+      chkCuda(cudaMemcpyAsync(sizes_->deviceMem(current_slot_), hs,
+                              sizes_->elements_ * sizeof(int32_t),
+                              cudaMemcpyHostToDevice, p.copy_stream_));
     }
+  }
 
-    work_mutex_.unlock();
-
-    nvjpegDecodeBatchedPhaseTwo(handle_, jpeg_handle_, stream_);
+  static ImageLayout
+  imageLayout(const CudaTensor &t) {
+    const int max_rank = 8;
+    int dims[max_rank];
+    int strides[max_rank];
+    int rank;
+    cudnnDataType_t data_type;
 
-    nvjpegDecodeBatchedPhaseThree(handle_, jpeg_handle_,
-                                  &output_images_[buffer_wr][0],
-                                  stream_);
-    chkCuda(cudaEventRecord(event_, stream_));
+    chkCUDNN(cudnnGetTensorNdDescriptor(t.desc_, max_rank, &data_type,
+                                        &rank, dims, strides));
+    assert(rank == 4);
+    return ImageLayout{dims[1], dims[2], dims[3],
+        {strides[0], strides[1], strides[2], strides[3]}};
   }
 
   void exec(CudaProgram &p) {
-    chkCuda(cudaStreamWaitEvent(ctx_->stream_, event_, 0));
+    if(!augment_)
+      return;
+
+    const ImageLayout sl = imageLayout(*decoded_);
+    const ImageLayout dl = imageLayout(*y_);
+
+    switch(y_->data_type_) {
+    case Tensor::DataType::FLOAT:
+      image_augment_float(augmentation_, batch_size_, batch_offset_,
+                          (const int32_t *)sizes_->deviceMem(),
+                          (const uint8_t *)decoded_->deviceMem(), sl,
+                          (float *)y_->deviceMem(), dl, p.stream_);
+      break;
+    case Tensor::DataType::HALF:
+      image_augment_half(augmentation_, batch_size_, batch_offset_,
+                         (const int32_t *)sizes_->deviceMem(),
+                         (const uint8_t *)decoded_->deviceMem(), sl,
+                         (__half *)y_->deviceMem(), dl, p.stream_);
+      break;
+    default:
+      abort();
+    }
   }
 
 
-  void worker(int id) {
+  // Returns false if nothing was decoded
+  bool decode(CudaJpegWorker *w, long batch, int slot, int n,
+              int *width, int *height) {
 
-    uint8_t jpeg_buffer[65536];
+    const uint8_t *data;
+    size_t len;
 
-    work_mutex_.lock();
-    while(1) {
-      if(decode_ == batch_size_) {
-        work_cond_.wait(work_mutex_);
-        continue;
+    if(mapped_loader_) {
+      data = mapped_loader_(batch, batch_offset_ + n, &len);
+      if(data == NULL || len == 0)
+        return false;
+    } else {
+      len = loader_(batch, batch_offset_ + n, &w->data_[0], w->data_.size());
+      if(len > w->data_.size()) {
+        w->data_.resize(len);
+        len = loader_(batch, batch_offset_ + n, &w->data_[0], w->data_.size());
       }
 
-      if(decode_ == -1)
-        break;
+      if(len == 0 || len > w->data_.size())
+        return false;
+      data = &w->data_[0];
+    }
+
+    int components;
+    nvjpegChromaSubsampling_t subsampling;
+    int widths[NVJPEG_MAX_COMPONENT];
+    int heights[NVJPEG_MAX_COMPONENT];
+
+    if(nvjpegGetImageInfo(handle_, data, len, &components,
+                          &subsampling, widths, heights) !=
+       NVJPEG_STATUS_SUCCESS)
+      return false;
+
+    if(heights[0] > max_rows_ || widths[0] * 3 > max_row_bytes_) {
+      fprintf(stderr, "JPEG image %ld:%d is %dx%d, too large for output\n",
+              batch, batch_offset_ + n, widths[0], heights[0]);
+      return false;
+    }
+
+    if(nvjpegJpegStreamParse(handle_, data, len, 0, 0,
+                             w->jpeg_stream_) != NVJPEG_STATUS_SUCCESS)
+      return false;
+
+    // Wait for the previous transfer out of this pinned buffer
+    const int pi = w->pinned_index_;
+    w->pinned_index_ ^= 1;
+    chkCuda(cudaEventSynchronize(w->pinned_done_[pi]));
+    chkNVJPEG(nvjpegStateAttachPinnedBuffer(w->state_,
+                                            w->pinned_buffers_[pi]));
+
+    if(nvjpegDecodeJpegHost(handle_, decoder_, w->state_, w->params_,
+                            w->jpeg_stream_) != NVJPEG_STATUS_SUCCESS)
+      return false;
+
+    chkNVJPEG(nvjpegDecodeJpegTransferToDevice(handle_, decoder_, w->state_,
+                                               w->jpeg_stream_, w->stream_));
+    chkCuda(cudaEventRecord(w->pinned_done_[pi], w->stream_));
+
+    chkNVJPEG(nvjpegDecodeJpegDevice(handle_, decoder_, w->state_,
+                                     &output_images_[slot][n], w->stream_));
+    *width = widths[0];
+    *height = heights[0];
+    return true;
+  }
 
-      const int n = decode_++;
 
-      work_mutex_.unlock();
+  void worker(CudaJpegWorker *w) {
 
-      size_t l = loader_(current_batch_, n, jpeg_buffer, sizeof(jpeg_buffer));
+    chkCuda(cudaSetDevice(ctx_->deviceId_));
 
-      if(l > 0) {
-        nvjpegDecodeBatchedPhaseOne(handle_, jpeg_handle_, jpeg_buffer,
-                                    l, n, id, ctx_->stream_);
+    long generation = 0;
+
+    while(1) {
+      long batch;
+      int slot;
+      {
+        std::unique_lock<std::mutex> lock(work_mutex_);
+        work_cond_.wait(lock, [&] { return generation_ != generation; });
+        if(generation_ == -1)
+          break;
+        generation = generation_;
+        batch = current_batch_;
+        slot = current_slot_;
+        chkCuda(cudaStreamWaitEvent(w->stream_, slot_free_, 0));
       }
 
-      work_mutex_.lock();
-      completed_++;
+      int n;
+      while((n = next_image_++) < batch_size_) {
+        int width = 0, height = 0;
+        if(!decode(w, batch, slot, n, &width, &height))
+          width = height = 0;
+        if(augment_) {
+          host_sizes_[slot][1 + n * 2] = width;
+          host_sizes_[slot][2 + n * 2] = height;
+        }
+      }
+
+      chkCuda(cudaEventRecord(w->done_, w->stream_));
+
+      std::unique_lock<std::mutex> lock(work_mutex_);
+      workers_idle_++;
       complete_cond_.notify_one();
     }
-    work_mutex_.unlock();
   }
 
 };
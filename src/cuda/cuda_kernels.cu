@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <algorithm>
 #include "cuda_kernels.h"
 
 namespace saga {
@@ -7,6 +8,8 @@ namespace saga {
 // Category Classifier
 //------------------------------------------------------------------------
 
+// One thread per row, used for small number of classes
+
 template< typename T, typename L > __global__ static void
 catclassifier_fwd(int n, const T *x, L *y, unsigned int channels)
 {
@@ -31,15 +34,30 @@ catclassifier_fwd(int n, const T *x, L *y, unsigned int channels)
 
 template< typename T, typename L > __global__ static void
 catclassifier_bwd(int n, const T *x, T *dx, const L *y, const L *dy,
-                  float *loss, unsigned int channels, float scale)
+                  float *loss, unsigned int channels, float scale,
+                  const float *mp_scaling)
 {
   int i = blockIdx.x*blockDim.x + threadIdx.x;
   if(i >= n)
     return;
 
+  if(mp_scaling)
+    scale *= *mp_scaling;
+
   x  += channels * i;
   dx += channels * i;
 
+  // Rows labeled outside of [0, channels) (eg. dataset padding) are
+  // ignored, they yield no gradient and no loss
+  const L label = dy[i];
+  if(label < 0 || (unsigned int)label >= channels) {
+    for(unsigned int j = 0; j < channels; j++)
+      dx[j] = 0;
+    if(loss)
+      loss[i] = 0;
+    return;
+  }
+
   // Softmax
   const double max = x[y[i]];
   double sum = 0;
@@ -48,14 +66,14 @@ catclassifier_bwd(int n, const T *x, T *dx, const L *y, const L *dy,
   }
   const double offset = max + log(sum);
 
-  L label = dy[i];
   for(unsigned int j = 0; j < channels; j++) {
 
     const double p = exp((double)x[j] - offset);
 
-    if(label == j) {
+    if((unsigned int)label == j) {
       dx[j] = (p - 1.0f) * scale;
-      loss[i] = -log(p);
+      if(loss)
+        loss[i] = -log(p);
     } else {
       dx[j] = p * scale;
     }
@@ -63,13 +81,238 @@ catclassifier_bwd(int n, const T *x, T *dx, const L *y, const L *dy,
 }
 
 
+// THREADS threads (a warp or a block) per row. Each thread reads N
+// consecutive elements at a time and partial results are combined
+// with warp shuffles (and shared memory across the warps of a block).
+// Accumulation is always done in fp32
+
+#define CATCLASSIFIER_WARP_MIN_CHANNELS   64
+#define CATCLASSIFIER_BLOCK_MIN_CHANNELS  2048
+#define CATCLASSIFIER_BLOCK_THREADS       256
+#define CATCLASSIFIER_WARP_ROWS           8
+
+template< typename T, int N > struct __align__(sizeof(T) * N) CatVec {
+  T v[N];
+};
+
+
+__device__ static inline void
+warp_argmax(float &v, int &idx)
+{
+  for(int o = 16; o > 0; o >>= 1) {
+    const float ov = __shfl_xor_sync(0xffffffff, v, o);
+    const int oi = __shfl_xor_sync(0xffffffff, idx, o);
+    // Ties go to the lowest index, same as the serial version
+    if(ov > v || (ov == v && oi < idx)) {
+      v = ov;
+      idx = oi;
+    }
+  }
+}
+
+__device__ static inline float
+warp_sum(float v)
+{
+  for(int o = 16; o > 0; o >>= 1)
+    v += __shfl_xor_sync(0xffffffff, v, o);
+  return v;
+}
+
+
+// Result is valid in all threads of the row
+template< int THREADS > __device__ static inline void
+row_argmax(float &v, int &idx)
+{
+  warp_argmax(v, idx);
+  if(THREADS > 32) {
+    __shared__ float sv[THREADS / 32];
+    __shared__ int si[THREADS / 32];
+    const int warp = threadIdx.x / 32;
+    const int lane = threadIdx.x & 31;
+    if(lane == 0) {
+      sv[warp] = v;
+      si[warp] = idx;
+    }
+    __syncthreads();
+    v   = lane < THREADS / 32 ? sv[lane] : -INFINITY;
+    idx = lane < THREADS / 32 ? si[lane] : 0x7fffffff;
+    warp_argmax(v, idx);
+  }
+}
+
+template< int THREADS > __device__ static inline float
+row_sum(float v)
+{
+  v = warp_sum(v);
+  if(THREADS > 32) {
+    __shared__ float s[THREADS / 32];
+    const int warp = threadIdx.x / 32;
+    const int lane = threadIdx.x & 31;
+    if(lane == 0)
+      s[warp] = v;
+    __syncthreads();
+    v = warp_sum(lane < THREADS / 32 ? s[lane] : 0);
+  }
+  return v;
+}
+
+
+template< typename T, typename L, int THREADS, int N > __global__ static void
+catclassifier_fwd_rows(int n, const T *x, L *y, unsigned int channels)
+{
+  // Rows never straddle a block so the entire block returns here
+  // when block-per-row
+  const int i = blockIdx.x * blockDim.y + threadIdx.y;
+  if(i >= n)
+    return;
+
+  x += (size_t)channels * i;
+
+  float best = -INFINITY;
+  int label = 0;
+  for(unsigned int j = threadIdx.x * N; j < channels; j += THREADS * N) {
+    const CatVec<T, N> v = *(const CatVec<T, N> *)(x + j);
+    for(int k = 0; k < N; k++) {
+      const float f = v.v[k];
+      if(f > best) {
+        best = f;
+        label = j + k;
+      }
+    }
+  }
+
+  row_argmax<THREADS>(best, label);
+  if(threadIdx.x == 0)
+    y[i] = label;
+}
+
+
+template< typename T, typename L, int THREADS, int N > __global__ static void
+catclassifier_bwd_rows(int n, const T *x, T *dx, const L *y, const L *dy,
+                       float *loss, unsigned int channels, float scale,
+                       const float *mp_scaling)
+{
+  const int i = blockIdx.x * blockDim.y + threadIdx.y;
+  if(i >= n)
+    return;
+
+  if(mp_scaling)
+    scale *= *mp_scaling;
+
+  x  += (size_t)channels * i;
+  dx += (size_t)channels * i;
+
+  // Same for all threads of the row, so either all of them return or
+  // none does (row_sum() synchronizes the block)
+  const L label = dy[i];
+  if(label < 0 || (unsigned int)label >= channels) {
+    for(unsigned int j = threadIdx.x; j < channels; j += THREADS)
+      dx[j] = 0;
+    if(threadIdx.x == 0 && loss)
+      loss[i] = 0;
+    return;
+  }
+
+  // log-sum-exp relative to the (forward pass) maximum
+  const float max = x[y[i]];
+  float sum = 0;
+  for(unsigned int j = threadIdx.x * N; j < channels; j += THREADS * N) {
+    const CatVec<T, N> v = *(const CatVec<T, N> *)(x + j);
+    for(int k = 0; k < N; k++)
+      sum += expf((float)v.v[k] - max);
+  }
+  const float offset = max + logf(row_sum<THREADS>(sum));
+
+  for(unsigned int j = threadIdx.x * N; j < channels; j += THREADS * N) {
+    const CatVec<T, N> v = *(const CatVec<T, N> *)(x + j);
+    CatVec<T, N> d;
+    for(int k = 0; k < N; k++) {
+      const float p = expf((float)v.v[k] - offset);
+      d.v[k] = (j + k == (unsigned int)label ? p - 1.0f : p) * scale;
+    }
+    *(CatVec<T, N> *)(dx + j) = d;
+  }
+
+  if(threadIdx.x == 0 && loss)
+    loss[i] = offset - (float)x[label];
+}
+
+
+// Elements per 16 byte load
+#define CATCLASSIFIER_VEC(T) (16 / sizeof(T))
+
+template< typename T, typename L > static void
+catclassifier_fwd_launch(int n, const T *x, L *y, unsigned int c,
+                         cudaStream_t stream)
+{
+  const bool vec = c % CATCLASSIFIER_VEC(T) == 0;
+
+  if(c < CATCLASSIFIER_WARP_MIN_CHANNELS) {
+    catclassifier_fwd<<<(n+255)/256, 256, 0, stream>>>(n, x, y, c);
+  } else if(c < CATCLASSIFIER_BLOCK_MIN_CHANNELS) {
+    const dim3 block(32, CATCLASSIFIER_WARP_ROWS);
+    const int blocks = (n + CATCLASSIFIER_WARP_ROWS - 1) /
+      CATCLASSIFIER_WARP_ROWS;
+    if(vec)
+      catclassifier_fwd_rows<T, L, 32, CATCLASSIFIER_VEC(T)>
+        <<<blocks, block, 0, stream>>>(n, x, y, c);
+    else
+      catclassifier_fwd_rows<T, L, 32, 1>
+        <<<blocks, block, 0, stream>>>(n, x, y, c);
+  } else {
+    const int threads = CATCLASSIFIER_BLOCK_THREADS;
+    if(vec)
+      catclassifier_fwd_rows<T, L, threads, CATCLASSIFIER_VEC(T)>
+        <<<n, threads, 0, stream>>>(n, x, y, c);
+    else
+      catclassifier_fwd_rows<T, L, threads, 1>
+        <<<n, threads, 0, stream>>>(n, x, y, c);
+  }
+}
+
+
+template< typename T, typename L > static void
+catclassifier_bwd_launch(int n, const T *x, T *dx, const L *y, const L *dy,
+                         float *loss, unsigned int c, float scale,
+                         const float *mp_scaling, cudaStream_t stream)
+{
+  const bool vec = c % CATCLASSIFIER_VEC(T) == 0;
+
+  if(c < CATCLASSIFIER_WARP_MIN_CHANNELS) {
+    catclassifier_bwd<<<(n+255)/256, 256, 0, stream>>>(n, x, dx, y, dy,
+                                                       loss, c, scale,
+                                                       mp_scaling);
+  } else if(c < CATCLASSIFIER_BLOCK_MIN_CHANNELS) {
+    const dim3 block(32, CATCLASSIFIER_WARP_ROWS);
+    const int blocks = (n + CATCLASSIFIER_WARP_ROWS - 1) /
+      CATCLASSIFIER_WARP_ROWS;
+    if(vec)
+      catclassifier_bwd_rows<T, L, 32, CATCLASSIFIER_VEC(T)>
+        <<<blocks, block, 0, stream>>>(n, x, dx, y, dy, loss, c, scale,
+                                       mp_scaling);
+    else
+      catclassifier_bwd_rows<T, L, 32, 1>
+        <<<blocks, block, 0, stream>>>(n, x, dx, y, dy, loss, c, scale,
+                                       mp_scaling);
+  } else {
+    const int threads = CATCLASSIFIER_BLOCK_THREADS;
+    if(vec)
+      catclassifier_bwd_rows<T, L, threads, CATCLASSIFIER_VEC(T)>
+        <<<n, threads, 0, stream>>>(n, x, dx, y, dy, loss, c, scale,
+                                    mp_scaling);
+    else
+      catclassifier_bwd_rows<T, L, threads, 1>
+        <<<n, threads, 0, stream>>>(n, x, dx, y, dy, loss, c, scale,
+                                    mp_scaling);
+  }
+}
 
 
 void
 catclassifier_fwd_float_i32(int n, const float *x, int32_t *y, unsigned int c,
                             cudaStream_t stream)
 {
-  catclassifier_fwd<<<(n+255)/256, 256, 0, stream>>>(n, x, y, c);
+  catclassifier_fwd_launch(n, x, y, c, stream);
 }
 
 void
@@ -78,7 +321,7 @@ catclassifier_bwd_float_i32(int n, const float *x, float *dx,
                             float *loss, unsigned int c, float scale,
                             cudaStream_t stream)
 {
-  catclassifier_bwd<<<(n+255)/256, 256, 0, stream>>>(n, x, dx, y, dy, loss, c, scale);
+  catclassifier_bwd_launch(n, x, dx, y, dy, loss, c, scale, NULL, stream);
 }
 
 
@@ -86,16 +329,17 @@ void
 catclassifier_fwd_half_i32(int n, const __half *x, int32_t *y, unsigned int c,
                            cudaStream_t stream)
 {
-  catclassifier_fwd<<<(n+255)/256, 256, 0, stream>>>(n, x, y, c);
+  catclassifier_fwd_launch(n, x, y, c, stream);
 }
 
 void
 catclassifier_bwd_half_i32(int n, const __half *x, __half *dx,
                            const int32_t *y, const int32_t *dy,
                            float *loss, unsigned int c, float scale,
-                           cudaStream_t stream)
+                           const float *mp_scaling, cudaStream_t stream)
 {
-  catclassifier_bwd<<<(n+255)/256, 256, 0, stream>>>(n, x, dx, y, dy, loss, c, scale);
+  catclassifier_bwd_launch(n, x, dx, y, dy, loss, c, scale, mp_scaling,
+                           stream);
 }
 
 
@@ -103,121 +347,1023 @@ catclassifier_bwd_half_i32(int n, const __half *x, __half *dx,
 // Datatype conversion
 //------------------------------------------------------------------------
 
-template< typename S, typename D > __global__ static void
-convert(int n, const S *src, D *dst, float scale)
+// y = x * scale, or with mean / stddev given
+// y = (x * scale - mean[c]) / stddev[c] where c is the channel of x
+//
+// The tensors are expected to be fully packed so the channel of
+// element i is (i / channel_stride) % channels
+
+struct ConvertNormalize {
+  const float *mean;
+  const float *stddev;
+  int channels;
+  int channel_stride;
+
+  __device__ float operator()(float v, int i) const {
+    const int c = (i / channel_stride) % channels;
+    return (v - mean[c]) / stddev[c];
+  }
+};
+
+struct ConvertScale {
+  __device__ float operator()(float v, int i) const {
+    return v;
+  }
+};
+
+
+__device__ static inline float4
+convert_load4(const uint8_t *p)
 {
-  int i = blockIdx.x*blockDim.x + threadIdx.x;
-  if(i >= n)
-    return;
+  const uchar4 v = *(const uchar4 *)p;
+  return make_float4(v.x, v.y, v.z, v.w);
+}
+
+__device__ static inline float4
+convert_load4(const float *p)
+{
+  return *(const float4 *)p;
+}
+
+__device__ static inline void
+convert_store4(float *p, float4 v)
+{
+  *(float4 *)p = v;
+}
 
-  dst[i] = src[i] * scale;
+__device__ static inline void
+convert_store4(__half *p, float4 v)
+{
+  __half2 *d = (__half2 *)p;
+  d[0] = __floats2half2_rn(v.x, v.y);
+  d[1] = __floats2half2_rn(v.z, v.w);
+}
+
+
+template< typename S, typename D, typename F > __global__ static void
+convert(int n, const S *src, D *dst, float scale, F f)
+{
+  for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+      i += blockDim.x * gridDim.x) {
+    dst[i] = f(src[i] * scale, i);
+  }
+}
+
+
+// n is in units of 4 elements
+template< typename S, typename D, typename F > __global__ static void
+convert4(int n, const S *src, D *dst, float scale, F f)
+{
+  for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+      i += blockDim.x * gridDim.x) {
+    float4 v = convert_load4(src + i * 4);
+    v.x = f(v.x * scale, i * 4 + 0);
+    v.y = f(v.y * scale, i * 4 + 1);
+    v.z = f(v.z * scale, i * 4 + 2);
+    v.w = f(v.w * scale, i * 4 + 3);
+    convert_store4(dst + i * 4, v);
+  }
+}
+
+
+template< typename S, typename D, typename F > static void
+convert_launch(const S *src, D *dst, int elements, float scale, F f,
+               cudaStream_t stream)
+{
+  const int threads = 256;
+  if((elements & 3) == 0 &&
+     ((uintptr_t)src & (sizeof(S) * 4 - 1)) == 0 &&
+     ((uintptr_t)dst & (sizeof(D) * 4 - 1)) == 0) {
+    const int n = elements / 4;
+    const int blocks = std::min((n + threads - 1) / threads, 4096);
+    convert4<<<blocks, threads, 0, stream>>>(n, src, dst, scale, f);
+  } else {
+    const int blocks = std::min((elements + threads - 1) / threads, 4096);
+    convert<<<blocks, threads, 0, stream>>>(elements, src, dst, scale, f);
+  }
+}
+
+
+template< typename S, typename D > static void
+convert_dispatch(const void *src, void *dst, int elements, float scale,
+                 const float *mean, const float *stddev,
+                 int channels, int channel_stride,
+                 cudaStream_t stream)
+{
+  if(mean != NULL) {
+    const ConvertNormalize f = {mean, stddev, channels, channel_stride};
+    convert_launch((const S *)src, (D *)dst, elements, scale, f, stream);
+  } else {
+    convert_launch((const S *)src, (D *)dst, elements, scale,
+                   ConvertScale(), stream);
+  }
 }
 
 
 void
 convert_u8_float(const void *src, void *dst, int elements, float scale,
+                 const float *mean, const float *stddev,
+                 int channels, int channel_stride,
                  cudaStream_t stream)
 {
-  convert<<<(elements+255)/256, 256, 0, stream>>>(elements, (const uint8_t *)src,
-                                                  (float *)dst, scale);
+  convert_dispatch<uint8_t, float>(src, dst, elements, scale, mean, stddev,
+                                   channels, channel_stride, stream);
 }
 
 void
 convert_u8_half(const void *src, void *dst, int elements, float scale,
+                const float *mean, const float *stddev,
+                int channels, int channel_stride,
                 cudaStream_t stream)
 {
-  convert<<<(elements+255)/256, 256, 0, stream>>>(elements, (const uint8_t *)src,
-                                                  (__half *)dst, scale);
+  convert_dispatch<uint8_t, __half>(src, dst, elements, scale, mean, stddev,
+                                    channels, channel_stride, stream);
 }
 
 void
 convert_float_half(const void *src, void *dst, int elements, float scale,
+                   const float *mean, const float *stddev,
+                   int channels, int channel_stride,
                    cudaStream_t stream)
 {
-  convert<<<(elements+255)/256, 256, 0, stream>>>(elements, (const float *)src,
-                                                  (__half *)dst, scale);
+  convert_dispatch<float, __half>(src, dst, elements, scale, mean, stddev,
+                                  channels, channel_stride, stream);
 }
 
 //------------------------------------------------------------------------
-// Adam weight update
+// Image augmentation
 //------------------------------------------------------------------------
 
-#define ADAM_EPSILON 1e-8
-#define ADAM_B1      0.9
-#define ADAM_B2      0.999
+__device__ static inline uint32_t
+hash32(uint32_t x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
 
-__global__ static void
-adam_kernel(int n, float *weights, const float *dweights, float *t,
-            float b1t, float b2t, float lr)
+// Uniform in [0, 1), k selects one of the random values of an image
+__device__ static inline float
+image_random(uint32_t key, int k)
+{
+  return hash32(key + k * 0x9e3779b9) * (1.0f / 4294967296.0f);
+}
+
+
+__device__ static inline float
+image_tap(const uint8_t *src, const ImageLayout &l, int x, int y,
+          int w, int h)
+{
+  if(x < 0 || y < 0 || x >= w || y >= h)
+    return 0;
+  return src[y * l.strides[2] + x * l.strides[3]];
+}
+
+
+template< typename T > __global__ static void
+image_augment(ImageAugmentation a, int image_offset, const int32_t *sizes,
+              const uint8_t *src, ImageLayout sl, T *dst, ImageLayout dl)
+{
+  const int n = blockIdx.y;
+
+  // Maps output pixel centers to source pixel coordinates
+  __shared__ float m[6];
+  __shared__ int iw, ih;
+
+  if(threadIdx.x == 0) {
+    iw = min(sizes[1 + n * 2], sl.cols);
+    ih = min(sizes[2 + n * 2], sl.rows);
+
+    const uint32_t key = hash32(a.seed ^ hash32(sizes[0])) +
+      hash32(image_offset + n);
+
+    const float area = iw * ih *
+      (a.crop_min + (a.crop_max - a.crop_min) * image_random(key, 0));
+    const float lr0 = logf(a.ratio_min);
+    const float lr1 = logf(a.ratio_max);
+    const float ratio = expf(lr0 + (lr1 - lr0) * image_random(key, 1));
+
+    const float cw = fminf(sqrtf(area * ratio), iw);
+    const float ch = fminf(sqrtf(area / ratio), ih);
+
+    float cx = (iw - cw) * image_random(key, 2) + cw * 0.5f;
+    float cy = (ih - ch) * image_random(key, 3) + ch * 0.5f;
+    cx += (image_random(key, 4) * 2 - 1) * a.translation * cw;
+    cy += (image_random(key, 5) * 2 - 1) * a.translation * ch;
+
+    const float angle = (image_random(key, 6) * 2 - 1) * a.rotation;
+    float sx = cw / dl.cols;
+    const float sy = ch / dl.rows;
+    if(a.flip && image_random(key, 7) < 0.5f)
+      sx = -sx;
+
+    float sn, cs;
+    sincosf(angle, &sn, &cs);
+    const float dcx = dl.cols * 0.5f;
+    const float dcy = dl.rows * 0.5f;
+
+    m[0] = cs * sx;
+    m[1] = -sn * sy;
+    m[2] = cx - (m[0] * dcx + m[1] * dcy);
+    m[3] = sn * sx;
+    m[4] = cs * sy;
+    m[5] = cy - (m[3] * dcx + m[4] * dcy);
+  }
+  __syncthreads();
+
+  src += n * sl.strides[0];
+  dst += n * dl.strides[0];
+
+  const int pixels = dl.rows * dl.cols;
+
+  for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < pixels;
+      i += blockDim.x * gridDim.x) {
+    const int ox = i % dl.cols;
+    const int oy = i / dl.cols;
+    const float fx = ox + 0.5f;
+    const float fy = oy + 0.5f;
+
+    // Sample position relative to source pixel centers
+    const float px = m[0] * fx + m[1] * fy + m[2] - 0.5f;
+    const float py = m[3] * fx + m[4] * fy + m[5] - 0.5f;
+    const float x0f = floorf(px);
+    const float y0f = floorf(py);
+    const int x0 = x0f;
+    const int y0 = y0f;
+    const float wx = px - x0f;
+    const float wy = py - y0f;
+
+    T *d = dst + oy * dl.strides[2] + ox * dl.strides[3];
+
+    for(int c = 0; c < dl.channels; c++) {
+      float v = 0;
+      if(c < sl.channels) {
+        const uint8_t *s = src + c * sl.strides[1];
+        const float v00 = image_tap(s, sl, x0,     y0,     iw, ih);
+        const float v01 = image_tap(s, sl, x0 + 1, y0,     iw, ih);
+        const float v10 = image_tap(s, sl, x0,     y0 + 1, iw, ih);
+        const float v11 = image_tap(s, sl, x0 + 1, y0 + 1, iw, ih);
+        v = (v00 * (1 - wx) + v01 * wx) * (1 - wy) +
+          (v10 * (1 - wx) + v11 * wx) * wy;
+      }
+      d[c * dl.strides[1]] = v * a.scale;
+    }
+  }
+}
+
+
+template< typename T > static void
+image_augment_launch(const ImageAugmentation &a, int batch_size,
+                     int image_offset, const int32_t *sizes,
+                     const uint8_t *src, const ImageLayout &sl,
+                     T *dst, const ImageLayout &dl, cudaStream_t stream)
+{
+  const int pixels = dl.rows * dl.cols;
+  dim3 blocks(std::min((pixels + 255) / 256, 64), batch_size);
+  image_augment<<<blocks, 256, 0, stream>>>(a, image_offset, sizes,
+                                            src, sl, dst, dl);
+}
+
+
+void
+image_augment_float(const ImageAugmentation &a, int batch_size,
+                    int image_offset, const int32_t *sizes,
+                    const uint8_t *src, const ImageLayout &src_layout,
+                    float *dst, const ImageLayout &dst_layout,
+                    cudaStream_t stream)
+{
+  image_augment_launch(a, batch_size, image_offset, sizes,
+                       src, src_layout, dst, dst_layout, stream);
+}
+
+
+void
+image_augment_half(const ImageAugmentation &a, int batch_size,
+                   int image_offset, const int32_t *sizes,
+                   const uint8_t *src, const ImageLayout &src_layout,
+                   __half *dst, const ImageLayout &dst_layout,
+                   cudaStream_t stream)
+{
+  image_augment_launch(a, batch_size, image_offset, sizes,
+                       src, src_layout, dst, dst_layout, stream);
+}
+
+
+//------------------------------------------------------------------------
+// Batchnorm folding
+//------------------------------------------------------------------------
+
+template< typename T > __global__ static void
+batchnorm_fold_w(int n, int per_channel, const T *w, T *wf,
+                 const float *s, const float *v, float epsilon)
 {
   int i = blockIdx.x*blockDim.x + threadIdx.x;
   if(i >= n)
     return;
 
-  t += i * 2; // mt and vt are stored next to each other in RAM
+  // Output channel is the outermost dimension regardless of layout
+  const int k = i / per_channel;
+  wf[i] = (float)w[i] * s[k] * rsqrtf(v[k] + epsilon);
+}
 
-  const float b1 = ADAM_B1;
-  const float b2 = ADAM_B2;
-  const float e = ADAM_EPSILON;
-  const float dw = dweights[i];
 
-  const float m = t[0] = b1 * t[0] + (1.0f - b1) * dw;
-  const float v = t[1] = b2 * t[1] + (1.0f - b2) * dw * dw;
-  const float m_hat = m * b1t;
-  const float v_hat = v * b2t;
+template< typename T > __global__ static void
+batchnorm_fold_b(int channels, const T *b, T *bf,
+                 const float *s, const float *bb,
+                 const float *m, const float *v, float epsilon)
+{
+  int k = blockIdx.x*blockDim.x + threadIdx.x;
+  if(k >= channels)
+    return;
 
-  weights[i] -= lr * m_hat / (sqrtf(v_hat) + e);
+  const float bias = b ? (float)b[k] : 0.0f;
+  bf[k] = (bias - m[k]) * s[k] * rsqrtf(v[k] + epsilon) + bb[k];
 }
 
 
-__global__ static void
-adam_kernel_mp(int n, float alpha, __half *weights, const __half *dweights,
-               float *t, float b1t, float b2t, float lr, int *range)
+void
+batchnorm_fold_float(int channels, int per_channel,
+                     const float *w, float *wf,
+                     const float *b, float *bf,
+                     const float *s, const float *bb,
+                     const float *m, const float *v, float epsilon,
+                     cudaStream_t stream)
+{
+  const int n = channels * per_channel;
+  batchnorm_fold_w<<<(n+255)/256, 256, 0, stream>>>(n, per_channel, w, wf,
+                                                    s, v, epsilon);
+  batchnorm_fold_b<<<(channels+255)/256, 256, 0, stream>>>(channels, b, bf,
+                                                           s, bb, m, v,
+                                                           epsilon);
+}
+
+void
+batchnorm_fold_half(int channels, int per_channel,
+                    const __half *w, __half *wf,
+                    const __half *b, __half *bf,
+                    const float *s, const float *bb,
+                    const float *m, const float *v, float epsilon,
+                    cudaStream_t stream)
+{
+  const int n = channels * per_channel;
+  batchnorm_fold_w<<<(n+255)/256, 256, 0, stream>>>(n, per_channel, w, wf,
+                                                    s, v, epsilon);
+  batchnorm_fold_b<<<(channels+255)/256, 256, 0, stream>>>(channels, b, bf,
+                                                           s, bb, m, v,
+                                                           epsilon);
+}
+
+//------------------------------------------------------------------------
+// INT8 quantization
+//------------------------------------------------------------------------
+
+// Offset of element i when a tensor is traversed in NHWC order
+__device__ static inline int
+layout_offset(int i, const ImageLayout &l)
+{
+  const int c = i % l.channels;
+  i /= l.channels;
+  const int x = i % l.cols;
+  i /= l.cols;
+  const int y = i % l.rows;
+  const int n = i / l.rows;
+  return n * l.strides[0] + c * l.strides[1] +
+    y * l.strides[2] + x * l.strides[3];
+}
+
+__device__ static inline int8_t
+saturate_i8(float v)
+{
+  return fminf(fmaxf(rintf(v), -127.0f), 127.0f);
+}
+
+
+template< typename T > __global__ static void
+absmax_kernel(int n, const T *src, ImageLayout l, float *result)
+{
+  float m = 0;
+  for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+      i += gridDim.x * blockDim.x)
+    m = fmaxf(m, fabsf((float)src[layout_offset(i, l)]));
+
+  for(int o = 16; o > 0; o >>= 1)
+    m = fmaxf(m, __shfl_xor_sync(0xffffffff, m, o));
+
+  // Non-negative floats order the same as their bit patterns
+  if((threadIdx.x & 31) == 0)
+    atomicMax((int *)result, __float_as_int(m));
+}
+
+
+template< typename T > static void
+absmax_launch(int batch, const T *src, const ImageLayout &l,
+              float *result, cudaStream_t stream)
+{
+  const int n = batch * l.channels * l.rows * l.cols;
+  const int blocks = std::min((n + 255) / 256, 1024);
+  absmax_kernel<<<blocks, 256, 0, stream>>>(n, src, l, result);
+}
+
+
+void
+absmax_float(int batch, const float *src, const ImageLayout &l,
+             float *result, cudaStream_t stream)
+{
+  absmax_launch(batch, src, l, result, stream);
+}
+
+void
+absmax_half(int batch, const __half *src, const ImageLayout &l,
+            float *result, cudaStream_t stream)
+{
+  absmax_launch(batch, src, l, result, stream);
+}
+
+
+template< typename T > __global__ static void
+quantize_kernel(int n, const T *src, ImageLayout sl,
+                int8_t *dst, ImageLayout dl, float scale)
 {
   int i = blockIdx.x*blockDim.x + threadIdx.x;
   if(i >= n)
     return;
 
-  const uint16_t u16 = ((const uint16_t *)dweights)[i];
-  if((u16 & 0x7800) == 0x7800) {
-    *range = 1;
-    if((u16 & 0x7c00) == 0x7c00) {
-      // NaN or inf
-      return;
+  dst[layout_offset(i, dl)] = saturate_i8((float)src[layout_offset(i, sl)] *
+                                          scale);
+}
+
+
+void
+quantize_float_i8(int batch, const float *src, const ImageLayout &sl,
+                  int8_t *dst, const ImageLayout &dl, float scale,
+                  cudaStream_t stream)
+{
+  const int n = batch * sl.channels * sl.rows * sl.cols;
+  quantize_kernel<<<(n+255)/256, 256, 0, stream>>>(n, src, sl, dst, dl,
+                                                   scale);
+}
+
+void
+quantize_half_i8(int batch, const __half *src, const ImageLayout &sl,
+                 int8_t *dst, const ImageLayout &dl, float scale,
+                 cudaStream_t stream)
+{
+  const int n = batch * sl.channels * sl.rows * sl.cols;
+  quantize_kernel<<<(n+255)/256, 256, 0, stream>>>(n, src, sl, dst, dl,
+                                                   scale);
+}
+
+
+__device__ static inline void
+epilogue_store(float *p, float v, float scale)
+{
+  *p = v;
+}
+
+__device__ static inline void
+epilogue_store(__half *p, float v, float scale)
+{
+  *p = __float2half(v);
+}
+
+__device__ static inline void
+epilogue_store(int8_t *p, float v, float scale)
+{
+  *p = saturate_i8(v * scale);
+}
+
+
+template< typename A, typename D > __global__ static void
+int8_epilogue_kernel(int n, const A *acc, D *dst, ImageLayout l,
+                     const float *scale, const float *bias, int relu,
+                     float dst_scale)
+{
+  int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if(i >= n)
+    return;
+
+  // acc is packed NHWC so the channel is the innermost index
+  const int c = i % l.channels;
+  float v = (float)acc[i] * scale[c] + bias[c];
+  if(relu)
+    v = fmaxf(v, 0.0f);
+  epilogue_store(dst + layout_offset(i, l), v, dst_scale);
+}
+
+
+template< typename A, typename D > static void
+int8_epilogue_launch(int batch, const A *acc, D *dst, const ImageLayout &l,
+                     const float *scale, const float *bias, bool relu,
+                     float dst_scale, cudaStream_t stream)
+{
+  const int n = batch * l.channels * l.rows * l.cols;
+  int8_epilogue_kernel<<<(n+255)/256, 256, 0, stream>>>(n, acc, dst, l,
+                                                        scale, bias, relu,
+                                                        dst_scale);
+}
+
+
+void
+int8_epilogue_float_float(int batch, const float *acc,
+                          float *dst, const ImageLayout &l,
+                          const float *scale, const float *bias, bool relu,
+                          float dst_scale, cudaStream_t stream)
+{
+  int8_epilogue_launch(batch, acc, dst, l, scale, bias, relu, dst_scale,
+                       stream);
+}
+
+void
+int8_epilogue_float_half(int batch, const float *acc,
+                         __half *dst, const ImageLayout &l,
+                         const float *scale, const float *bias, bool relu,
+                         float dst_scale, cudaStream_t stream)
+{
+  int8_epilogue_launch(batch, acc, dst, l, scale, bias, relu, dst_scale,
+                       stream);
+}
+
+void
+int8_epilogue_float_i8(int batch, const float *acc,
+                       int8_t *dst, const ImageLayout &l,
+                       const float *scale, const float *bias, bool relu,
+                       float dst_scale, cudaStream_t stream)
+{
+  int8_epilogue_launch(batch, acc, dst, l, scale, bias, relu, dst_scale,
+                       stream);
+}
+
+void
+int8_epilogue_i32_float(int batch, const int32_t *acc,
+                        float *dst, const ImageLayout &l,
+                        const float *scale, const float *bias, bool relu,
+                        float dst_scale, cudaStream_t stream)
+{
+  int8_epilogue_launch(batch, acc, dst, l, scale, bias, relu, dst_scale,
+                       stream);
+}
+
+void
+int8_epilogue_i32_half(int batch, const int32_t *acc,
+                       __half *dst, const ImageLayout &l,
+                       const float *scale, const float *bias, bool relu,
+                       float dst_scale, cudaStream_t stream)
+{
+  int8_epilogue_launch(batch, acc, dst, l, scale, bias, relu, dst_scale,
+                       stream);
+}
+
+void
+int8_epilogue_i32_i8(int batch, const int32_t *acc,
+                     int8_t *dst, const ImageLayout &l,
+                     const float *scale, const float *bias, bool relu,
+                     float dst_scale, cudaStream_t stream)
+{
+  int8_epilogue_launch(batch, acc, dst, l, scale, bias, relu, dst_scale,
+                       stream);
+}
+
+//------------------------------------------------------------------------
+// Tensor statistics
+//------------------------------------------------------------------------
+
+__device__ static inline int64_t
+stats_offset(int64_t i, const TensorStatsLayout &l)
+{
+  if(l.rank == 0)
+    return i;
+  int64_t o = 0;
+  for(int j = l.rank - 1; j >= 0; j--) {
+    o += (i % l.dims[j]) * l.strides[j];
+    i /= l.dims[j];
+  }
+  return o;
+}
+
+
+template< typename T > __global__ static void
+tensor_stats_kernel(const T *src, TensorStatsLayout l,
+                    TensorStatsResult *partials)
+{
+  __shared__ TensorStatsResult shared[256];
+
+  // Sums are kept in double, in float the sum of squares minus squared
+  // mean is mostly rounding error
+  float min = INFINITY;
+  float max = -INFINITY;
+  double sum = 0;
+  double sum2 = 0;
+  int count = 0, nans = 0, infs = 0;
+
+  for(int64_t i = blockIdx.x * blockDim.x + threadIdx.x; i < l.elements;
+      i += gridDim.x * blockDim.x) {
+    const float v = (float)src[stats_offset(i, l)];
+    if(isnan(v)) {
+      nans++;
+    } else if(isinf(v)) {
+      infs++;
+    } else {
+      min = fminf(min, v);
+      max = fmaxf(max, v);
+      sum += v;
+      sum2 += (double)v * v;
+      count++;
     }
   }
 
-  t += i * 3;
+  TensorStatsResult &r = shared[threadIdx.x];
+  r.min = min;
+  r.max = max;
+  r.sum = sum;
+  r.sum2 = sum2;
+  r.count = count;
+  r.nans = nans;
+  r.infs = infs;
+  __syncthreads();
+
+  for(int o = blockDim.x / 2; o > 0; o >>= 1) {
+    if(threadIdx.x < o) {
+      const TensorStatsResult &b = shared[threadIdx.x + o];
+      r.min = fminf(r.min, b.min);
+      r.max = fmaxf(r.max, b.max);
+      r.sum += b.sum;
+      r.sum2 += b.sum2;
+      r.count += b.count;
+      r.nans += b.nans;
+      r.infs += b.infs;
+    }
+    __syncthreads();
+  }
+
+  if(threadIdx.x == 0)
+    partials[blockIdx.x] = r;
+}
+
+
+__global__ static void
+tensor_stats_final_kernel(const TensorStatsResult *partials,
+                          TensorStatsResult *result)
+{
+  TensorStatsResult r = partials[0];
+  for(int i = 1; i < TENSOR_STATS_BLOCKS; i++) {
+    const TensorStatsResult &b = partials[i];
+    r.min = fminf(r.min, b.min);
+    r.max = fmaxf(r.max, b.max);
+    r.sum += b.sum;
+    r.sum2 += b.sum2;
+    r.count += b.count;
+    r.nans += b.nans;
+    r.infs += b.infs;
+  }
+  *result = r;
+}
+
+
+template< typename T > static void
+tensor_stats_launch(const T *src, const TensorStatsLayout &l,
+                    TensorStatsResult *partials,
+                    TensorStatsResult *result, cudaStream_t stream)
+{
+  tensor_stats_kernel<<<TENSOR_STATS_BLOCKS, 256, 0, stream>>>(src, l,
+                                                               partials);
+  tensor_stats_final_kernel<<<1, 1, 0, stream>>>(partials, result);
+}
+
+
+void
+tensor_stats_float(const float *src, const TensorStatsLayout &l,
+                   TensorStatsResult *partials,
+                   TensorStatsResult *result, cudaStream_t stream)
+{
+  tensor_stats_launch(src, l, partials, result, stream);
+}
+
+void
+tensor_stats_half(const __half *src, const TensorStatsLayout &l,
+                  TensorStatsResult *partials,
+                  TensorStatsResult *result, cudaStream_t stream)
+{
+  tensor_stats_launch(src, l, partials, result, stream);
+}
+
+void
+tensor_stats_u8(const uint8_t *src, const TensorStatsLayout &l,
+                TensorStatsResult *partials,
+                TensorStatsResult *result, cudaStream_t stream)
+{
+  tensor_stats_launch(src, l, partials, result, stream);
+}
+
+void
+tensor_stats_i8(const int8_t *src, const TensorStatsLayout &l,
+                TensorStatsResult *partials,
+                TensorStatsResult *result, cudaStream_t stream)
+{
+  tensor_stats_launch(src, l, partials, result, stream);
+}
+
+void
+tensor_stats_i32(const int32_t *src, const TensorStatsLayout &l,
+                 TensorStatsResult *partials,
+                 TensorStatsResult *result, cudaStream_t stream)
+{
+  tensor_stats_launch(src, l, partials, result, stream);
+}
+
+//------------------------------------------------------------------------
+// Adam weight update
+//------------------------------------------------------------------------
+
+#define ADAM_EPSILON 1e-8
+#define ADAM_B1      0.9
+#define ADAM_B2      0.999
 
-  const float dw = (float)dweights[i] * alpha;
+// m, v and the fp32 master copy of HALF weights are kept in separate
+// arrays so the update can use 128 bit loads when pointers are aligned
 
+__device__ static inline float
+adam_step(float dw, float *m, float *v, float b1t, float b2t, float lr)
+{
   const float b1 = ADAM_B1;
   const float b2 = ADAM_B2;
   const float e = ADAM_EPSILON;
 
-  const float m = t[0] = b1 * t[0] + (1.0f - b1) * dw;
-  const float v = t[1] = b2 * t[1] + (1.0f - b2) * dw * dw;
-  const float m_hat = m * b1t;
-  const float v_hat = v * b2t;
+  const float mt = *m = b1 * *m + (1.0f - b1) * dw;
+  const float vt = *v = b2 * *v + (1.0f - b2) * dw * dw;
+  const float m_hat = mt * b1t;
+  const float v_hat = vt * b2t;
+
+  return lr * m_hat / (sqrtf(v_hat) + e);
+}
+
+
+// True while gradients are still being accumulated
+__device__ static inline bool
+adam_skip(const AccumulateState *a)
+{
+  return a && a->count < a->accumulate;
+}
+
+
+__global__ static void
+adam_kernel(int n, float *weights, float *dweights,
+            float *m, float *v, const TrainState *s,
+            const AccumulateState *a, float lr)
+{
+  if(adam_skip(a))
+    return;
+
+  const float b1t = s->b1t;
+  const float b2t = s->b2t;
+
+  for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+      i += blockDim.x * gridDim.x) {
+    weights[i] -= adam_step(dweights[i], m + i, v + i, b1t, b2t, lr);
+    if(a)
+      dweights[i] = 0;
+  }
+}
+
+
+__global__ static void
+adam_kernel4(int n, float4 *weights, float4 *dweights,
+             float4 *m, float4 *v, const TrainState *s,
+             const AccumulateState *a, float lr)
+{
+  if(adam_skip(a))
+    return;
+
+  const float b1t = s->b1t;
+  const float b2t = s->b2t;
+
+  for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+      i += blockDim.x * gridDim.x) {
+    const float4 dw = dweights[i];
+    if(a)
+      dweights[i] = make_float4(0, 0, 0, 0);
+    float4 w = weights[i];
+    float4 mt = m[i];
+    float4 vt = v[i];
+    w.x -= adam_step(dw.x, &mt.x, &vt.x, b1t, b2t, lr);
+    w.y -= adam_step(dw.y, &mt.y, &vt.y, b1t, b2t, lr);
+    w.z -= adam_step(dw.z, &mt.z, &vt.z, b1t, b2t, lr);
+    w.w -= adam_step(dw.w, &mt.w, &vt.w, b1t, b2t, lr);
+    weights[i] = w;
+    m[i] = mt;
+    v[i] = vt;
+  }
+}
+
+
+// Returns false if the gradient is NaN or inf. Sets *range if the
+// gradient is close to overflowing so the loss scale is reduced
+__device__ static inline bool
+adam_check_range(__half dw, int *range)
+{
+  const uint16_t u16 = __half_as_ushort(dw);
+  if((u16 & 0x7800) == 0x7800) {
+    *range = 1;
+    if((u16 & 0x7c00) == 0x7c00)
+      return false;
+  }
+  return true;
+}
+
+
+__device__ static inline void
+adam_mixed_step(__half *weight, __half dw, float *m, float *v, float *w32,
+                float alpha, float b1t, float b2t, float lr, int *range)
+{
+  if(!adam_check_range(dw, range))
+    return;
+  const float w = *w32 - adam_step((float)dw * alpha, m, v, b1t, b2t, lr);
+  *w32 = w;
+  *weight = w;
+}
+
+
+__global__ static void
+adam_kernel_mp(int n, __half *weights, __half *dweights,
+               float *m, float *v, float *w32,
+               const TrainState *s, const AccumulateState *a,
+               float lr, int *range)
+{
+  if(adam_skip(a))
+    return;
+
+  const float alpha = 1.0f / s->mp_scaling;
+  const float b1t = s->b1t;
+  const float b2t = s->b2t;
+
+  for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+      i += blockDim.x * gridDim.x) {
+    adam_mixed_step(weights + i, dweights[i], m + i, v + i, w32 + i,
+                    alpha, b1t, b2t, lr, range);
+    if(a)
+      dweights[i] = __float2half(0.0f);
+  }
+}
+
+
+__global__ static void
+adam_kernel_mp4(int n, __half2 *weights, __half2 *dweights,
+                float4 *m, float4 *v, float4 *w32,
+                const TrainState *s, const AccumulateState *a,
+                float lr, int *range)
+{
+  if(adam_skip(a))
+    return;
+
+  const float alpha = 1.0f / s->mp_scaling;
+  const float b1t = s->b1t;
+  const float b2t = s->b2t;
+
+  for(int i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+      i += blockDim.x * gridDim.x) {
+    __half2 dw[2] = {dweights[i * 2], dweights[i * 2 + 1]};
+    if(a)
+      dweights[i * 2] = dweights[i * 2 + 1] = __float2half2_rn(0.0f);
+    __half2 w[2] = {weights[i * 2], weights[i * 2 + 1]};
+    float4 mt = m[i];
+    float4 vt = v[i];
+    float4 wt = w32[i];
+
+    adam_mixed_step(&w[0].x, dw[0].x, &mt.x, &vt.x, &wt.x,
+                    alpha, b1t, b2t, lr, range);
+    adam_mixed_step(&w[0].y, dw[0].y, &mt.y, &vt.y, &wt.y,
+                    alpha, b1t, b2t, lr, range);
+    adam_mixed_step(&w[1].x, dw[1].x, &mt.z, &vt.z, &wt.z,
+                    alpha, b1t, b2t, lr, range);
+    adam_mixed_step(&w[1].y, dw[1].y, &mt.w, &vt.w, &wt.w,
+                    alpha, b1t, b2t, lr, range);
+
+    weights[i * 2] = w[0];
+    weights[i * 2 + 1] = w[1];
+    m[i] = mt;
+    v[i] = vt;
+    w32[i] = wt;
+  }
+}
+
+
+__global__ static void
+adam_mixed_init_kernel(int n, const __half *weights, float *w32)
+{
+  int i = blockIdx.x*blockDim.x + threadIdx.x;
+  if(i >= n)
+    return;
+  w32[i] = weights[i];
+}
+
+
+static bool
+aligned(const void *p, size_t alignment)
+{
+  return ((uintptr_t)p & (alignment - 1)) == 0;
+}
+
+
+static int
+adam_blocks(int n)
+{
+  return std::min((n + 255) / 256, 4096);
+}
+
+
+void
+adam_float(int n, float *weights, float *dweights,
+           float *m, float *v, const TrainState *s,
+           const AccumulateState *a, float lr,
+           cudaStream_t stream)
+{
+  if((n & 3) == 0 && aligned(weights, 16) && aligned(dweights, 16) &&
+     aligned(m, 16) && aligned(v, 16)) {
+    n /= 4;
+    adam_kernel4<<<adam_blocks(n), 256, 0, stream>>>(n, (float4 *)weights,
+                                                     (float4 *)dweights,
+                                                     (float4 *)m, (float4 *)v,
+                                                     s, a, lr);
+  } else {
+    adam_kernel<<<adam_blocks(n), 256, 0, stream>>>(n, weights, dweights,
+                                                    m, v, s, a, lr);
+  }
+}
+
+
+void
+adam_mixed(int n, __half *weights, __half *dweights,
+           float *m, float *v, float *w32,
+           const TrainState *s, const AccumulateState *a,
+           float lr, int *range, cudaStream_t stream)
+{
+  if((n & 3) == 0 && aligned(weights, 8) && aligned(dweights, 8) &&
+     aligned(m, 16) && aligned(v, 16) && aligned(w32, 16)) {
+    n /= 4;
+    adam_kernel_mp4<<<adam_blocks(n), 256, 0, stream>>>(n, (__half2 *)weights,
+                                                        (__half2 *)dweights,
+                                                        (float4 *)m, (float4 *)v,
+                                                        (float4 *)w32,
+                                                        s, a, lr, range);
+  } else {
+    adam_kernel_mp<<<adam_blocks(n), 256, 0, stream>>>(n, weights, dweights,
+                                                       m, v, w32,
+                                                       s, a, lr, range);
+  }
+}
+
+
+void
+adam_mixed_init(int n, const __half *weights, float *w32,
+                cudaStream_t stream)
+{
+  adam_mixed_init_kernel<<<(n+255)/256, 256, 0, stream>>>(n, weights, w32);
+}
 
-  const float w = t[2] - lr * m_hat / (sqrtf(v_hat) + e);
-  t[2] = w;
-  weights[i] = w;
+
+__global__ static void
+train_step_begin_kernel(TrainState *s, AccumulateState *a)
+{
+  // Only the last batch of an accumulation is an optimizer step
+  if(a && ++a->count < a->accumulate)
+    return;
+
+  const int i = ++s->iteration;
+  s->b1t = 1.0 / (1.0 - pow(ADAM_B1, i));
+  s->b2t = 1.0 / (1.0 - pow(ADAM_B2, i));
+}
+
+__global__ static void
+train_step_end_kernel(TrainState *s, AccumulateState *a, int *range)
+{
+  if(a) {
+    if(a->count < a->accumulate)
+      return;
+    a->count = 0;
+  }
+
+  // Dynamic gradient scaling for mixed precision
+  if(*range) {
+    s->mp_scaling *= 0.5f;
+    *range = 0;
+  } else {
+    s->mp_scaling *= 1.01f;
+  }
 }
 
 void
-adam_float(int n, float *weights, const float *dweights, float *t,
-           float b1t, float b2t, float lr, cudaStream_t stream)
+train_step_begin(TrainState *s, AccumulateState *a, cudaStream_t stream)
 {
-  adam_kernel<<<(n+255)/256, 256, 0, stream>>>(n, weights, dweights, t, b1t, b2t, lr);
+  train_step_begin_kernel<<<1, 1, 0, stream>>>(s, a);
 }
 
 void
-adam_mixed(int n, float alpha, __half *weights, const __half *dweights,
-           float *t, float b1t, float b2t, float lr, int *range, cudaStream_t stream)
+train_step_end(TrainState *s, AccumulateState *a, int *range,
+               cudaStream_t stream)
 {
-  adam_kernel_mp<<<(n+255)/256, 256, 0, stream>>>(n, alpha, weights, dweights, t, b1t, b2t,
-                                                  lr, range);
+  train_step_end_kernel<<<1, 1, 0, stream>>>(s, a, range);
 }
 
 };
@@ -6,6 +6,22 @@
 
 namespace saga {
 
+// Training state kept on the device so batches can be replayed
+// (see CudaProgram::cuda_graph_) without host involvement
+struct TrainState {
+  float mp_scaling;
+  int iteration;
+  float b1t;
+  float b2t;
+};
+
+// Gradient accumulation progress. Not part of the saved TrainState as
+// the partially accumulated gradients are not saved either
+struct AccumulateState {
+  int accumulate;  // Batches per weight update
+  int count;       // Batches summed into the gradients so far
+};
+
 void catclassifier_fwd_float_i32(int n, const float *p,
                                  int32_t *y, unsigned int c,
                                  cudaStream_t stream);
@@ -22,23 +38,189 @@ void catclassifier_bwd_float_i32(int n, const float *x, float *dx,
 void catclassifier_bwd_half_i32(int n, const __half *x, __half *dx,
                                 const int32_t *y, const int32_t *dy,
                                 float *loss, unsigned int c, float scale,
-                                cudaStream_t stream);
+                                const float *mp_scaling, cudaStream_t stream);
 
+// mean and stddev are per channel and may be NULL
 void convert_u8_float(const void *src, void *dst, int elements, float scale,
+                      const float *mean, const float *stddev,
+                      int channels, int channel_stride,
                       cudaStream_t stream);
 
 void convert_u8_half(const void *src, void *dst, int elements, float scale,
+                     const float *mean, const float *stddev,
+                     int channels, int channel_stride,
                      cudaStream_t stream);
 
 void convert_float_half(const void *src, void *dst, int elements, float scale,
+                        const float *mean, const float *stddev,
+                        int channels, int channel_stride,
                         cudaStream_t stream);
 
-void adam_float(int n, float *weights, const float *dweights, float *t,
-                float b1t, float b2t, float lr,
-                cudaStream_t stream);
+void batchnorm_fold_float(int channels, int per_channel,
+                          const float *w, float *wf,
+                          const float *b, float *bf,
+                          const float *s, const float *bb,
+                          const float *m, const float *v, float epsilon,
+                          cudaStream_t stream);
+
+void batchnorm_fold_half(int channels, int per_channel,
+                         const __half *w, __half *wf,
+                         const __half *b, __half *bf,
+                         const float *s, const float *bb,
+                         const float *m, const float *v, float epsilon,
+                         cudaStream_t stream);
 
-void adam_mixed(int n, float alpha, __half *weights, const __half *dweights,
-                float *t, float b1t, float b2t, float lr, int *range,
+// With a non-NULL AccumulateState the update only happens on the last
+// batch of each accumulation, after which the gradients are cleared
+void adam_float(int n, float *weights, float *dweights,
+                float *m, float *v, const TrainState *s,
+                const AccumulateState *a, float lr,
                 cudaStream_t stream);
 
+void adam_mixed(int n, __half *weights, __half *dweights,
+                float *m, float *v, float *w32,
+                const TrainState *s, const AccumulateState *a,
+                float lr, int *range, cudaStream_t stream);
+
+void adam_mixed_init(int n, const __half *weights, float *w32,
+                     cudaStream_t stream);
+
+// Random crop, flip and affine transform of decoded U8 images into
+// the network input, see CudaJpeg
+struct ImageAugmentation {
+  float scale;        // Output is pixel value * scale
+  float crop_min;     // Crop area as fraction of the image area
+  float crop_max;
+  float ratio_min;    // Crop aspect ratio (width / height)
+  float ratio_max;
+  float rotation;     // Max rotation in radians
+  float translation;  // Max translation as fraction of crop size
+  int flip;           // Random horizontal flip
+  uint32_t seed;
+};
+
+// Strides are in elements and ordered n, c, h, w
+struct ImageLayout {
+  int channels;
+  int rows;
+  int cols;
+  int strides[4];
+};
+
+// sizes holds the batch number followed by width and height of each
+// decoded image. Images with zero size produce zero output
+void image_augment_float(const ImageAugmentation &a, int batch_size,
+                         int image_offset, const int32_t *sizes,
+                         const uint8_t *src, const ImageLayout &src_layout,
+                         float *dst, const ImageLayout &dst_layout,
+                         cudaStream_t stream);
+
+void image_augment_half(const ImageAugmentation &a, int batch_size,
+                        int image_offset, const int32_t *sizes,
+                        const uint8_t *src, const ImageLayout &src_layout,
+                        __half *dst, const ImageLayout &dst_layout,
+                        cudaStream_t stream);
+
+// INT8 quantization. Tensors are described by ImageLayout with batch
+// elements along strides[0]. result is updated with atomicMax() and
+// must be initialized by the caller
+void absmax_float(int batch, const float *src, const ImageLayout &l,
+                  float *result, cudaStream_t stream);
+
+void absmax_half(int batch, const __half *src, const ImageLayout &l,
+                 float *result, cudaStream_t stream);
+
+// dst = saturate(round(src * scale))
+void quantize_float_i8(int batch, const float *src, const ImageLayout &sl,
+                       int8_t *dst, const ImageLayout &dl, float scale,
+                       cudaStream_t stream);
+
+void quantize_half_i8(int batch, const __half *src, const ImageLayout &sl,
+                      int8_t *dst, const ImageLayout &dl, float scale,
+                      cudaStream_t stream);
+
+// dst = [relu](acc * scale[c] + bias[c]), multiplied by dst_scale and
+// saturated for int8 outputs. acc is packed NHWC with l's dimensions
+void int8_epilogue_float_float(int batch, const float *acc,
+                               float *dst, const ImageLayout &l,
+                               const float *scale, const float *bias,
+                               bool relu, float dst_scale,
+                               cudaStream_t stream);
+
+void int8_epilogue_float_half(int batch, const float *acc,
+                              __half *dst, const ImageLayout &l,
+                              const float *scale, const float *bias,
+                              bool relu, float dst_scale,
+                              cudaStream_t stream);
+
+void int8_epilogue_float_i8(int batch, const float *acc,
+                            int8_t *dst, const ImageLayout &l,
+                            const float *scale, const float *bias,
+                            bool relu, float dst_scale,
+                            cudaStream_t stream);
+
+void int8_epilogue_i32_float(int batch, const int32_t *acc,
+                             float *dst, const ImageLayout &l,
+                             const float *scale, const float *bias,
+                             bool relu, float dst_scale,
+                             cudaStream_t stream);
+
+void int8_epilogue_i32_half(int batch, const int32_t *acc,
+                            __half *dst, const ImageLayout &l,
+                            const float *scale, const float *bias,
+                            bool relu, float dst_scale,
+                            cudaStream_t stream);
+
+void int8_epilogue_i32_i8(int batch, const int32_t *acc,
+                          int8_t *dst, const ImageLayout &l,
+                          const float *scale, const float *bias,
+                          bool relu, float dst_scale,
+                          cudaStream_t stream);
+
+// Min, max, sums and NaN / inf counts of a tensor, reduced in two
+// passes: TENSOR_STATS_BLOCKS partial results, then the final one
+#define TENSOR_STATS_BLOCKS 64
+
+struct TensorStatsLayout {
+  int64_t elements;
+  int rank;          // 0 if the elements are contiguous
+  int dims[8];
+  int strides[8];
+};
+
+struct TensorStatsResult {
+  float min;
+  float max;
+  double sum;
+  double sum2;
+  int64_t count;     // Finite elements
+  int64_t nans;
+  int64_t infs;
+};
+
+void tensor_stats_float(const float *src, const TensorStatsLayout &l,
+                        TensorStatsResult *partials,
+                        TensorStatsResult *result, cudaStream_t stream);
+
+void tensor_stats_half(const __half *src, const TensorStatsLayout &l,
+                       TensorStatsResult *partials,
+                       TensorStatsResult *result, cudaStream_t stream);
+
+void tensor_stats_u8(const uint8_t *src, const TensorStatsLayout &l,
+                     TensorStatsResult *partials,
+                     TensorStatsResult *result, cudaStream_t stream);
+
+void tensor_stats_i8(const int8_t *src, const TensorStatsLayout &l,
+                     TensorStatsResult *partials,
+                     TensorStatsResult *result, cudaStream_t stream);
+
+void tensor_stats_i32(const int32_t *src, const TensorStatsLayout &l,
+                      TensorStatsResult *partials,
+                      TensorStatsResult *result, cudaStream_t stream);
+
+void train_step_begin(TrainState *s, AccumulateState *a, cudaStream_t stream);
+
+void train_step_end(TrainState *s, AccumulateState *a, int *range,
+                    cudaStream_t stream);
+
 }
@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2019, Andreas Smas
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include <nccl.h>
+
+#include "saga.h"
+#include "tensor.h"
+#include "context.h"
+
+#include "cuda_common.h"
+#include "cuda_tensor.h"
+
+
+#define chkNCCL(expression) {                                           \
+    const ncclResult_t nccl_status__ = (expression);                    \
+    if(nccl_status__ != ncclSuccess) {                                  \
+      fprintf(stderr, "NCCL error at %s:%d in %s: %s\n",                \
+              __FILE__, __LINE__, __FUNCTION__,                         \
+              ncclGetErrorString(nccl_status__));                       \
+      abort();                                                          \
+    }                                                                   \
+  }
+
+
+namespace saga {
+
+/**
+ * Data parallel training: One CudaProgram per device, each working on
+ * its own slice of the batch. Every program runs its batch loop in a
+ * separate thread.
+ *
+ * Gradients are averaged with an NCCL allreduce issued on a separate
+ * stream as soon as the backward operation producing them has been
+ * queued, so communication overlaps with the rest of the backward pass.
+ * The weight update waits for all allreduces to finish. As all devices
+ * see identical gradients the weights (and mixed precision scaling)
+ * stay in sync without further communication.
+ */
+
+class Barrier {
+public:
+  Barrier(int count)
+    : count_(count)
+  {}
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const long generation = generation_;
+    if(++waiting_ == count_) {
+      waiting_ = 0;
+      generation_++;
+      cond_.notify_all();
+    } else {
+      cond_.wait(lock, [&]{ return generation != generation_; });
+    }
+  }
+
+private:
+  const int count_;
+  int waiting_ = 0;
+  long generation_ = 0;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+
+//------------------------------------------------------------------------
+
+struct CudaNcclPeer {
+
+  ncclComm_t comm_;
+  cudaStream_t stream_;
+  cudaEvent_t ready_;
+  cudaEvent_t done_;
+
+  CudaNcclPeer(ncclComm_t comm)
+    : comm_(comm)
+  {
+    chkCuda(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+    chkCuda(cudaEventCreateWithFlags(&ready_, cudaEventDisableTiming));
+    chkCuda(cudaEventCreateWithFlags(&done_, cudaEventDisableTiming));
+  }
+
+  ~CudaNcclPeer()
+  {
+    chkCuda(cudaEventDestroy(ready_));
+    chkCuda(cudaEventDestroy(done_));
+    chkCuda(cudaStreamDestroy(stream_));
+    ncclCommDestroy(comm_);
+  }
+};
+
+
+struct NcclAllReduce : public CudaOperation {
+
+  const std::shared_ptr<CudaNcclPeer> peer_;
+  const std::shared_ptr<CudaTensor> t_;
+
+  NcclAllReduce(std::shared_ptr<CudaNcclPeer> peer,
+                std::shared_ptr<CudaTensor> t)
+    : peer_(peer)
+    , t_(t)
+  {}
+
+  void print() const {
+    printf("NCCL AllReduce\n");
+    printf("\tt: %s\n", t_->info().c_str());
+  }
+
+  CudaTensors getInputs() const override {
+    return {t_};
+  }
+
+  CudaTensors getOutputs() const override {
+    return {t_};
+  }
+
+  void exec(CudaProgram &p) {
+    ncclDataType_t type;
+    switch(t_->data_type_) {
+    case Tensor::DataType::FLOAT:
+      type = ncclFloat;
+      break;
+    case Tensor::DataType::HALF:
+      type = ncclHalf;
+      break;
+    default:
+      abort();
+    }
+
+    chkCuda(cudaEventRecord(peer_->ready_, p.stream_));
+    chkCuda(cudaStreamWaitEvent(peer_->stream_, peer_->ready_, 0));
+    chkNCCL(ncclAllReduce(t_->deviceMem(), t_->deviceMem(), t_->elements_,
+                          type, ncclAvg, peer_->comm_, peer_->stream_));
+  }
+};
+
+
+struct NcclWait : public CudaOperation {
+
+  const std::shared_ptr<CudaNcclPeer> peer_;
+
+  NcclWait(std::shared_ptr<CudaNcclPeer> peer)
+    : peer_(peer)
+  {}
+
+  void print() const {
+    printf("NCCL Wait\n");
+  }
+
+  void exec(CudaProgram &p) {
+    chkCuda(cudaEventRecord(peer_->done_, peer_->stream_));
+    chkCuda(cudaStreamWaitEvent(p.stream_, peer_->done_, 0));
+  }
+};
+
+
+/**
+ * Insert an allreduce after the last backward operation writing each
+ * weight gradient. With gradient accumulation the running sums are
+ * reduced every batch, which gives the same average as reducing once
+ */
+static void
+insert_allreduce(CudaProgram &p, std::shared_ptr<CudaNcclPeer> peer)
+{
+  if(p.upd_operations_.empty())
+    return;
+
+  std::vector<std::pair<size_t, std::shared_ptr<CudaTensor>>> reductions;
+
+  for(const auto &it : p.params_) {
+    const auto &g = it.second;
+    size_t pos = p.bwd_operations_.size();
+    for(size_t i = 0; i < p.bwd_operations_.size(); i++) {
+      for(const auto &t : p.bwd_operations_[i]->getOutputs()) {
+        if(t == g)
+          pos = i + 1;
+      }
+    }
+    reductions.push_back({pos, g});
+  }
+
+  std::stable_sort(reductions.begin(), reductions.end(),
+                   [](const auto &a, const auto &b) {
+                     return a.first > b.first;
+                   });
+
+  for(const auto &r : reductions) {
+    p.bwd_operations_.insert(p.bwd_operations_.begin() + r.first,
+                             std::make_shared<NcclAllReduce>(peer, r.second));
+  }
+
+  // Last of the backward pass so the health check, which samples in
+  // between backward and update, sees the reduced gradients
+  p.bwd_operations_.push_back(std::make_shared<NcclWait>(peer));
+}
+
+
+//------------------------------------------------------------------------
+
+/**
+ * Batch accessors are invoked once per batch with a TensorAccess
+ * spanning all devices. Element 0 of each index selects the device.
+ * All devices run the same program so the slices share strides, but
+ * they are separate buffers and there is no single data() pointer
+ */
+class CudaDataParallelAccess : public TensorAccess {
+
+public:
+  CudaDataParallelAccess(const std::vector<TensorAccess *> &parts,
+                         int local_batch_size)
+    : parts_(parts)
+    , local_batch_size_(local_batch_size)
+  {}
+
+  Dims strides() override {
+    return parts_[0]->strides();
+  }
+
+  void *data() override {
+    return nullptr;
+  }
+
+  void copyBytesFrom(const Dims &element,
+                     const void *data, size_t size) override {
+    Dims e = element;
+    part(e)->copyBytesFrom(e, data, size);
+  }
+
+  void *getAddr(const Dims &element) override {
+    Dims e = element;
+    return part(e)->getAddr(e);
+  }
+
+  double get(const Dims &element) override {
+    Dims e = element;
+    return part(e)->get(e);
+  }
+
+  void set(const Dims &element, double value) override {
+    Dims e = element;
+    part(e)->set(e, value);
+  }
+
+private:
+
+  TensorAccess *part(Dims &e) {
+    const int device = e[0] / local_batch_size_;
+    e[0] %= local_batch_size_;
+    return parts_[device];
+  }
+
+  const std::vector<TensorAccess *> &parts_;
+  const int local_batch_size_;
+};
+
+
+struct CudaDataParallelSync {
+
+  CudaDataParallelSync(int devices, int local_batch_size)
+    : barrier_(devices)
+    , parts_(devices)
+    , local_batch_size_(local_batch_size)
+  {}
+
+  // Called from each device's batch loop. All devices rendezvous and the
+  // first one invokes the user's accessor for the entire batch
+  void access(int device, TensorAccess &ta, long batch,
+              const BatchTensorAccessFn &fn) {
+    parts_[device] = &ta;
+    barrier_.wait();
+    if(device == 0) {
+      CudaDataParallelAccess a(parts_, local_batch_size_);
+      fn(a, batch);
+    }
+    barrier_.wait();
+  }
+
+  Barrier barrier_;
+  std::vector<TensorAccess *> parts_;
+  const int local_batch_size_;
+};
+
+
+//------------------------------------------------------------------------
+
+class CudaDataParallelProgram : public Program {
+
+public:
+
+  std::shared_ptr<Tensor> resolveTensor(std::shared_ptr<Tensor> t) override {
+    return programs_[0]->resolveTensor(t);
+  }
+
+  void infer(long batches) override {
+    run([=](CudaProgram &p) { p.infer(batches); });
+  }
+
+  void train(long batches) override {
+    run([=](CudaProgram &p) { p.train(batches); });
+  }
+
+  void print() const override {
+    printf("Data parallel over %zd devices\n", programs_.size());
+    programs_[0]->print();
+  }
+
+  void debug(bool on) override {
+    for(const auto &p : programs_)
+      p->debug(on);
+  }
+
+  void profile(bool on) override {
+    for(const auto &p : programs_)
+      p->profile(on);
+  }
+
+  // Timings of the first device
+  ProfileReport profileReport() override {
+    return programs_[0]->profileReport();
+  }
+
+  // Weights and reduced gradients are the same on all replicas
+  HealthReport healthReport() override {
+    return programs_[0]->healthReport();
+  }
+
+  // Replicas are kept in sync, so the first device's state is saved.
+  // On load each replica restores the state from the graph
+  Tensors optimizerState() override {
+    return programs_[0]->optimizerState();
+  }
+
+  std::future<bool> saveCheckpointAsync(const Graph &g,
+                                        const std::string &path) override {
+    return programs_[0]->saveCheckpointAsync(g, path);
+  }
+
+  void run(const std::function<void(CudaProgram &p)> &fn) {
+    std::vector<std::thread> threads;
+
+    for(size_t i = 1; i < programs_.size(); i++) {
+      auto p = programs_[i];
+      threads.push_back(std::thread([=] {
+            chkCuda(cudaSetDevice(p->ctx_->deviceId_));
+            fn(*p);
+          }));
+    }
+
+    fn(*programs_[0]);
+
+    for(auto &t : threads)
+      t.join();
+  }
+
+  std::vector<std::shared_ptr<CudaProgram>> programs_;
+  std::shared_ptr<CudaDataParallelSync> pre_sync_;
+  std::shared_ptr<CudaDataParallelSync> post_sync_;
+};
+
+
+
+static std::shared_ptr<Program>
+createDataParallelProgram(std::shared_ptr<CudaContext> ctx,
+                          const Graph &g,
+                          const ProgramConfig &pc,
+                          const BatchTensorAccessors &accessors)
+{
+  int count;
+  chkCuda(cudaGetDeviceCount(&count));
+
+  if(count < 2)
+    return ctx->createCudaProgram(g, pc, accessors);
+
+  if(pc.batch_size % count) {
+    fprintf(stderr, "Batch size %d is not divisible by number of devices %d\n",
+            pc.batch_size, count);
+    return nullptr;
+  }
+
+  // The device of the given context comes first and is the one
+  // resolveTensor() returns tensors from
+  std::vector<int> devices = {ctx->deviceId_};
+  for(int i = 0; i < count; i++) {
+    if(i != ctx->deviceId_)
+      devices.push_back(i);
+  }
+
+  std::vector<ncclComm_t> comms(count);
+  chkNCCL(ncclCommInitAll(&comms[0], count, &devices[0]));
+
+  ProgramConfig local_pc = pc;
+  local_pc.batch_size = pc.batch_size / count;
+
+  auto dpp = std::make_shared<CudaDataParallelProgram>();
+  // PRE and POST accessors run on different threads of each program
+  // so they rendezvous separately
+  dpp->pre_sync_ = std::make_shared<CudaDataParallelSync>(count,
+                                                          local_pc.batch_size);
+  dpp->post_sync_ = std::make_shared<CudaDataParallelSync>(count,
+                                                           local_pc.batch_size);
+
+  for(int i = 0; i < count; i++) {
+
+    BatchTensorAccessors local_accessors = accessors;
+    for(auto &a : local_accessors) {
+      auto sync = a.phase == Phase::PRE ? dpp->pre_sync_ : dpp->post_sync_;
+      auto fn = a.fn;
+      a.fn = [=](TensorAccess &ta, long batch) {
+        sync->access(i, ta, batch, fn);
+      };
+    }
+
+    auto c = i == 0 ? ctx : std::make_shared<CudaContext>(devices[i]);
+    if(i)
+      c->init();
+
+    chkCuda(cudaSetDevice(devices[i]));
+    auto p = c->createCudaProgram(g, local_pc, local_accessors,
+                                  i * local_pc.batch_size);
+    insert_allreduce(*p, std::make_shared<CudaNcclPeer>(comms[i]));
+    dpp->programs_.push_back(p);
+  }
+
+  chkCuda(cudaSetDevice(devices[0]));
+  return dpp;
+}
+
+
+static void __attribute__((constructor))
+registerDataParallel(void)
+{
+  CudaRegisterDataParallel(&createDataParallelProgram);
+}
+
+}
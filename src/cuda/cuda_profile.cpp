@@ -0,0 +1,403 @@
+#include <algorithm>
+#include <mutex>
+#include <typeinfo>
+#include <cxxabi.h>
+
+#include <nvml.h>
+#include <nvtx3/nvToolsExt.h>
+
+#include "saga.h"
+#include "tensor.h"
+#include "context.h"
+
+#include "cuda_common.h"
+#include "cuda_tensor.h"
+
+namespace saga {
+
+
+std::string
+CudaOperation::name() const
+{
+  const char *mangled = typeid(*this).name();
+  int status;
+  char *demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+  std::string r = demangled ? demangled : mangled;
+  free(demangled);
+  if(r.compare(0, 6, "saga::") == 0)
+    r = r.substr(6);
+  return r;
+}
+
+
+//------------------------------------------------------------------------
+
+CudaProfiler::~CudaProfiler()
+{
+  for(auto &it : pending_) {
+    free_events_.push_back(it.second.start);
+    free_events_.push_back(it.second.end);
+  }
+  for(auto e : free_events_)
+    chkCuda(cudaEventDestroy(e));
+}
+
+
+int
+CudaProfiler::begin(const CudaOperation *op, const char *phase,
+                    cudaStream_t stream)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  const void *key = op ? (const void *)op : (const void *)phase;
+  auto it = entry_index_.find(key);
+  int entry;
+  if(it == entry_index_.end()) {
+    entry = entries_.size();
+    entry_index_[key] = entry;
+    entries_.push_back(Entry{op, op ? op->name() : std::string(phase), {}});
+  } else {
+    entry = it->second;
+  }
+
+  cudaEvent_t ev[2];
+  for(int i = 0; i < 2; i++) {
+    if(free_events_.empty()) {
+      chkCuda(cudaEventCreate(&ev[i]));
+    } else {
+      ev[i] = free_events_.back();
+      free_events_.pop_back();
+    }
+  }
+
+  const int token = next_token_++;
+  pending_[token] = Sample{entry, ev[0], ev[1], false};
+
+  nvtxRangePushA(entries_[entry].name.c_str());
+  chkCuda(cudaEventRecord(ev[0], stream));
+  return token;
+}
+
+
+void
+CudaProfiler::end(int token, cudaStream_t stream)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto &s = pending_[token];
+  chkCuda(cudaEventRecord(s.end, stream));
+  s.done = true;
+  nvtxRangePop();
+}
+
+
+void
+CudaProfiler::harvest()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  for(auto it = pending_.begin(); it != pending_.end(); ) {
+    auto &s = it->second;
+    if(!s.done) {
+      ++it;
+      continue;
+    }
+    float ms;
+    chkCuda(cudaEventSynchronize(s.end));
+    chkCuda(cudaEventElapsedTime(&ms, s.start, s.end));
+    entries_[s.entry].samples.push_back(ms);
+    free_events_.push_back(s.start);
+    free_events_.push_back(s.end);
+    it = pending_.erase(it);
+  }
+}
+
+
+static void
+device_info(int device, ProfileReport &r)
+{
+  cudaDeviceProp prop;
+  if(cudaGetDeviceProperties(&prop, device) == cudaSuccess)
+    r.device = prop.name;
+
+  static std::once_flag nvml_init;
+  static bool nvml_ok;
+  std::call_once(nvml_init, [] {
+      nvml_ok = nvmlInit_v2() == NVML_SUCCESS;
+    });
+  if(!nvml_ok)
+    return;
+
+  char busid[64];
+  if(cudaDeviceGetPCIBusId(busid, sizeof(busid), device) != cudaSuccess)
+    return;
+
+  nvmlDevice_t dev;
+  if(nvmlDeviceGetHandleByPciBusId_v2(busid, &dev) != NVML_SUCCESS)
+    return;
+
+  unsigned int v;
+  if(nvmlDeviceGetClockInfo(dev, NVML_CLOCK_SM, &v) == NVML_SUCCESS)
+    r.sm_clock_mhz = v;
+  if(nvmlDeviceGetClockInfo(dev, NVML_CLOCK_MEM, &v) == NVML_SUCCESS)
+    r.mem_clock_mhz = v;
+  if(nvmlDeviceGetPowerUsage(dev, &v) == NVML_SUCCESS)
+    r.power_watts = v / 1000.0f;
+  if(nvmlDeviceGetTemperature(dev, NVML_TEMPERATURE_GPU, &v) == NVML_SUCCESS)
+    r.temperature = v;
+
+  nvmlMemory_t mem;
+  if(nvmlDeviceGetMemoryInfo(dev, &mem) == NVML_SUCCESS) {
+    r.mem_used = mem.used;
+    r.mem_total = mem.total;
+  }
+}
+
+
+static int64_t
+tensor_bytes(const CudaTensors &tensors)
+{
+  int64_t r = 0;
+  for(const auto &t : tensors) {
+    if(t)
+      r += t->elements_ * Tensor::DataTypeSize(t->data_type_);
+  }
+  return r;
+}
+
+
+ProfileReport
+CudaProfiler::report()
+{
+  harvest();
+
+  ProfileReport r;
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  r.batches = batches_;
+
+  for(auto &e : entries_) {
+    if(e.samples.empty())
+      continue;
+
+    ProfileEntry pe;
+    pe.name = e.name;
+    pe.count = e.samples.size();
+
+    auto samples = e.samples;
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for(auto v : samples)
+      sum += v;
+    const size_t p99 = std::min(samples.size() - 1,
+                                (size_t)(samples.size() * 0.99));
+
+    pe.min_us = samples[0] * 1000.0;
+    pe.mean_us = sum / samples.size() * 1000.0;
+    pe.p99_us = samples[p99] * 1000.0;
+
+    if(e.op) {
+      pe.algo = e.op->algo();
+      pe.flops = e.op->flops();
+      pe.bytes = tensor_bytes(e.op->getInputs()) +
+        tensor_bytes(e.op->getOutputs());
+    }
+    r.entries.push_back(pe);
+  }
+  return r;
+}
+
+
+//------------------------------------------------------------------------
+
+void
+CudaProgram::profile(bool on)
+{
+  if(on) {
+    profiler_ = std::make_shared<CudaProfiler>();
+    last_profile_.reset();
+  } else if(profiler_) {
+    last_profile_ = profiler_;
+    profiler_.reset();
+  }
+}
+
+
+ProfileReport
+CudaProgram::profileReport()
+{
+  auto p = profiler_ ? profiler_ : last_profile_;
+  ProfileReport r = p ? p->report() : ProfileReport();
+
+  device_info(ctx_->deviceId_, r);
+  r.program_memory = total_size_ - planned_size_ + arena_size_ +
+    workspace_size_;
+  return r;
+}
+
+
+
+//------------------------------------------------------------------------
+
+CudaHealthMonitor::CudaHealthMonitor(const CudaTensors &tensors, int interval)
+  : tensors_(tensors)
+  , interval_(interval)
+{
+  const size_t n = tensors_.size();
+  chkCuda(cudaMalloc(&device_, sizeof(TensorStatsResult) *
+                     n * (TENSOR_STATS_BLOCKS + 1)));
+  chkCuda(cudaMallocHost(&host_, sizeof(TensorStatsResult) * n));
+  chkCuda(cudaEventCreateWithFlags(&done_, cudaEventDisableTiming));
+
+  for(const auto &t : tensors_) {
+    HealthEntry e;
+    e.name = t->name_ ? *t->name_ : t->info();
+    report_.entries.push_back(e);
+  }
+}
+
+
+CudaHealthMonitor::~CudaHealthMonitor()
+{
+  if(pending_)
+    chkCuda(cudaEventSynchronize(done_));
+  chkCuda(cudaEventDestroy(done_));
+  chkCuda(cudaFreeHost(host_));
+  chkCuda(cudaFree(device_));
+}
+
+
+void
+CudaHealthMonitor::collect()
+{
+  for(size_t i = 0; i < tensors_.size(); i++) {
+    const auto &r = host_[i];
+    auto &e = report_.entries[i];
+    e.batch = pending_batch_;
+    e.stats = Tensor::statsFromSums(r.min, r.max, r.sum, r.sum2, r.count,
+                                    r.nans, r.infs);
+    if(r.nans || r.infs) {
+      fprintf(stderr, "Health check: Batch %ld: %s has %ld NaN and "
+              "%ld inf\n", pending_batch_, e.name.c_str(),
+              (long)r.nans, (long)r.infs);
+      if(report_.first_unhealthy_batch == -1)
+        report_.first_unhealthy_batch = pending_batch_;
+    }
+  }
+  report_.checks++;
+  pending_ = false;
+}
+
+
+bool
+CudaHealthMonitor::begin(bool complete)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  const long batch = batches_++;
+
+  if(pending_ && cudaEventQuery(done_) == cudaSuccess)
+    collect();
+
+  if((batch + 1) % interval_ == 0)
+    due_ = !pending_;
+
+  if(!due_ || !complete)
+    return false;
+
+  due_ = false;
+  sample_batch_ = batch;
+  return true;
+}
+
+
+void
+CudaHealthMonitor::sample(cudaStream_t stream)
+{
+  TensorStatsResult *results = device_ + tensors_.size() * TENSOR_STATS_BLOCKS;
+  for(size_t i = 0; i < tensors_.size(); i++) {
+    tensors_[i]->statsAsync(device_ + i * TENSOR_STATS_BLOCKS,
+                            results + i, stream);
+  }
+}
+
+
+void
+CudaHealthMonitor::end(cudaStream_t stream)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  const TensorStatsResult *results =
+    device_ + tensors_.size() * TENSOR_STATS_BLOCKS;
+  chkCuda(cudaMemcpyAsync(host_, results,
+                          sizeof(TensorStatsResult) * tensors_.size(),
+                          cudaMemcpyDeviceToHost, stream));
+  chkCuda(cudaEventRecord(done_, stream));
+  pending_ = true;
+  pending_batch_ = sample_batch_;
+}
+
+
+HealthReport
+CudaHealthMonitor::report()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  if(pending_) {
+    chkCuda(cudaEventSynchronize(done_));
+    collect();
+  }
+  return report_;
+}
+
+
+void
+CudaProgram::setupHealthMonitor(const Graph &g)
+{
+  if(config_.health_check_interval <= 0)
+    return;
+
+  CudaTensors candidates;
+  if(!config_.health_check_tensors.empty()) {
+    for(const auto &t : config_.health_check_tensors) {
+      auto ct = resolveTensor_locked(t);
+      if(!ct) {
+        fprintf(stderr, "Health check: %s not in program, ignored\n",
+                t->info().c_str());
+        continue;
+      }
+      candidates.push_back(ct);
+    }
+  } else if(!params_.empty()) {
+    for(const auto &it : params_) {
+      candidates.push_back(it.first);
+      candidates.push_back(it.second);
+    }
+  } else {
+    for(const auto &t : g.outputs_)
+      candidates.push_back(resolveTensor_locked(t));
+  }
+
+  CudaTensors tensors;
+  for(const auto &t : candidates) {
+    if(!t)
+      continue;
+    if(t->data_type_ == Tensor::DataType::INT64) {
+      fprintf(stderr, "Health check: %s: Unsupported data type, ignored\n",
+              t->info().c_str());
+      continue;
+    }
+    tensors.push_back(t);
+  }
+
+  if(!tensors.empty())
+    health_ = std::make_unique<CudaHealthMonitor>(tensors,
+                                                  config_.health_check_interval);
+}
+
+
+HealthReport
+CudaProgram::healthReport()
+{
+  return health_ ? health_->report() : HealthReport();
+}
+
+}
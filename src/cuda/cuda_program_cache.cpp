@@ -0,0 +1,338 @@
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "saga.h"
+#include "tensor.h"
+#include "context.h"
+
+#include "cuda_common.h"
+#include "cuda_tensor.h"
+
+/*
+ * Program cache file. One entry per line, keys last as they are free
+ * form strings
+ *
+ *   saga-program-cache <version>
+ *   algo <algo> <key>
+ *   lt <heuristic result as hex> <key>
+ *   arena <size>
+ *   place <seq> <size> <offset>
+ */
+
+namespace saga {
+
+#define PROGRAM_CACHE_VERSION 1
+
+
+static uint64_t
+fnv1a(const std::string &s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+
+namespace {
+
+struct GraphFingerprint {
+  std::stringstream ss;
+  std::unordered_map<const Tensor *, int> ids;
+
+  void tensor(const std::shared_ptr<Tensor> &t) {
+    if(!t) {
+      ss << "-";
+      return;
+    }
+    auto r = ids.insert(std::make_pair(t.get(), (int)ids.size()));
+    ss << "#" << r.first->second;
+    if(r.second)
+      ss << t->info();
+  }
+
+  void tensors(const Tensors &ts) {
+    std::vector<std::string> names;
+    for(const auto &it : ts)
+      names.push_back(it.first);
+    std::sort(names.begin(), names.end());
+    for(const auto &n : names) {
+      ss << " " << n << "=";
+      tensor(ts.get(n));
+    }
+  }
+
+  void attributes(const Attributes &as) {
+    std::vector<std::string> names;
+    for(const auto &it : as)
+      names.push_back(it.first);
+    std::sort(names.begin(), names.end());
+    for(const auto &n : names) {
+      const auto &a = as.find(n)->second;
+      ss << " " << n << "=" << a.index() << ":";
+      if(auto v = std::get_if<float>(&a)) {
+        ss << std::hexfloat << *v << std::defaultfloat;
+      } else if(auto v = std::get_if<int>(&a)) {
+        ss << *v;
+      } else if(auto v = std::get_if<std::vector<int>>(&a)) {
+        for(int x : *v)
+          ss << x << ",";
+      } else if(auto v = std::get_if<bool>(&a)) {
+        ss << *v;
+      }
+    }
+  }
+
+  void set(const std::unordered_set<std::shared_ptr<Tensor>> &ts) {
+    std::vector<int> v;
+    for(const auto &t : ts) {
+      auto it = ids.find(t.get());
+      v.push_back(it == ids.end() ? -1 : it->second);
+    }
+    std::sort(v.begin(), v.end());
+    for(int x : v)
+      ss << " " << x;
+  }
+};
+
+}
+
+
+/**
+ * Everything that changes the outcome of lowering goes into the key:
+ * the graph structure (tensor values are irrelevant, weights can change
+ * between runs), the accessors, the program config, the device and
+ * library versions
+ */
+std::string
+CudaProgramCachePath(const CudaContext &ctx, const Graph &g,
+                     const ProgramConfig &pc,
+                     const BatchTensorAccessors &accessors,
+                     int batch_offset)
+{
+  GraphFingerprint f;
+
+  for(const auto &n : g.nodes_) {
+    f.ss << n->type_ << ":";
+    f.tensors(n->inputs_);
+    f.ss << " ->";
+    f.tensors(n->outputs_);
+    f.attributes(n->attributes_);
+    f.ss << "\n";
+  }
+  f.ss << "inputs";
+  f.set(g.inputs_);
+  f.ss << "\noutputs";
+  f.set(g.outputs_);
+  f.ss << "\n";
+
+  for(const auto &a : accessors) {
+    f.ss << "access " << (int)a.phase << (int)a.which << (int)a.mode << " ";
+    f.tensor(a.tensor);
+    f.ss << "\n";
+  }
+
+  f.ss << "config " << pc.inference << pc.training << " "
+       << pc.batch_size << " " << batch_offset << " "
+       << (int)pc.tensor_layout << " "
+       << pc.autotune << " " << pc.autotune_max_workspace << " "
+       << pc.int8 << " " << pc.recompute << " "
+       << pc.gradient_accumulation << " " << pc.prefetch_depth << " "
+       << pc.health_check_interval << " "
+       << std::hexfloat << pc.initial_learning_rate << std::defaultfloat;
+  for(const auto &t : pc.health_check_tensors) {
+    f.ss << " ";
+    f.tensor(t);
+  }
+  f.ss << "\n";
+
+  int runtime = 0, driver = 0, cublas = 0;
+  cudaRuntimeGetVersion(&runtime);
+  cudaDriverGetVersion(&driver);
+  cublasGetVersion(ctx.cublas_, &cublas);
+  f.ss << ctx.algo_cache_prefix_ << "cuda" << runtime << ":" << driver
+       << ":cublas" << cublas << ":cublaslt" << cublasLtGetVersion()
+       << "\n";
+
+  char name[32];
+  snprintf(name, sizeof(name), "/%016lx.prog",
+           (unsigned long)fnv1a(f.ss.str()));
+  return pc.program_cache + name;
+}
+
+
+//------------------------------------------------------------------------
+
+static std::string
+to_hex(const void *data, size_t size)
+{
+  static const char digits[] = "0123456789abcdef";
+  const uint8_t *p = (const uint8_t *)data;
+  std::string r;
+  for(size_t i = 0; i < size; i++) {
+    r += digits[p[i] >> 4];
+    r += digits[p[i] & 0xf];
+  }
+  return r;
+}
+
+
+static bool
+from_hex(const char *str, void *data, size_t size)
+{
+  uint8_t *p = (uint8_t *)data;
+  for(size_t i = 0; i < size; i++) {
+    unsigned int v;
+    if(sscanf(str + i * 2, "%2x", &v) != 1)
+      return false;
+    p[i] = v;
+  }
+  return str[size * 2] == ' ';
+}
+
+
+bool
+CudaProgramCache::load(const std::string &path)
+{
+  path_ = path;
+
+  FILE *fp = fopen(path.c_str(), "r");
+  if(fp == NULL)
+    return false;
+
+  char line[4096];
+  int version = 0;
+  if(fgets(line, sizeof(line), fp) == NULL ||
+     sscanf(line, "saga-program-cache %d", &version) != 1 ||
+     version != PROGRAM_CACHE_VERSION) {
+    fclose(fp);
+    return false;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\n")] = 0;
+    char *arg;
+    if(!strncmp(line, "algo ", 5)) {
+      const int algo = strtol(line + 5, &arg, 10);
+      if(*arg == ' ')
+        algos_[arg + 1] = algo;
+    } else if(!strncmp(line, "lt ", 3)) {
+      cublasLtMatmulHeuristicResult_t h;
+      if(from_hex(line + 3, &h, sizeof(h)))
+        lt_algos_[line + 3 + sizeof(h) * 2 + 1] = h;
+    } else if(!strncmp(line, "arena ", 6)) {
+      arena_size_ = strtoull(line + 6, NULL, 10);
+    } else if(!strncmp(line, "place ", 6)) {
+      Placement p;
+      if(sscanf(line + 6, "%zu %zu %zu", &p.seq, &p.size, &p.offset) == 3)
+        placement_.push_back(p);
+    }
+  }
+  fclose(fp);
+  loaded_ = true;
+  return true;
+}
+
+
+void
+CudaProgramCache::save()
+{
+  if(!dirty_ || path_.empty())
+    return;
+
+  mkdir(path_.substr(0, path_.rfind('/')).c_str(), 0777);
+
+  // Write to a temporary file and rename so concurrent readers
+  // never see a partial file
+  const std::string tmp = path_ + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if(fp == NULL) {
+    fprintf(stderr, "Unable to save program cache to %s -- %s\n",
+            tmp.c_str(), strerror(errno));
+    return;
+  }
+
+  fprintf(fp, "saga-program-cache %d\n", PROGRAM_CACHE_VERSION);
+  for(const auto &it : algos_)
+    fprintf(fp, "algo %d %s\n", it.second, it.first.c_str());
+  for(const auto &it : lt_algos_)
+    fprintf(fp, "lt %s %s\n",
+            to_hex(&it.second, sizeof(it.second)).c_str(), it.first.c_str());
+  fprintf(fp, "arena %zu\n", arena_size_);
+  for(const auto &p : placement_)
+    fprintf(fp, "place %zu %zu %zu\n", p.seq, p.size, p.offset);
+
+  if(fclose(fp) || rename(tmp.c_str(), path_.c_str())) {
+    fprintf(stderr, "Unable to save program cache to %s -- %s\n",
+            path_.c_str(), strerror(errno));
+    unlink(tmp.c_str());
+    return;
+  }
+  dirty_ = false;
+}
+
+
+//------------------------------------------------------------------------
+
+bool
+CudaProgram::findAlgo(const std::string &key, int *algo) const
+{
+  if(!cache_)
+    return false;
+  auto it = cache_->algos_.find(key);
+  if(it == cache_->algos_.end())
+    return false;
+  *algo = it->second;
+  return true;
+}
+
+
+void
+CudaProgram::storeAlgo(const std::string &key, int algo)
+{
+  if(!cache_)
+    return;
+  auto it = cache_->algos_.find(key);
+  if(it != cache_->algos_.end() && it->second == algo)
+    return;
+  cache_->algos_[key] = algo;
+  cache_->dirty_ = true;
+}
+
+
+bool
+CudaProgram::findLtAlgo(const std::string &key,
+                        cublasLtMatmulHeuristicResult_t *algo) const
+{
+  if(!cache_)
+    return false;
+  auto it = cache_->lt_algos_.find(key);
+  if(it == cache_->lt_algos_.end())
+    return false;
+  *algo = it->second;
+  return true;
+}
+
+
+void
+CudaProgram::storeLtAlgo(const std::string &key,
+                         const cublasLtMatmulHeuristicResult_t &algo)
+{
+  if(!cache_)
+    return;
+  auto it = cache_->lt_algos_.find(key);
+  if(it != cache_->lt_algos_.end() &&
+     !memcmp(&it->second, &algo, sizeof(algo)))
+    return;
+  cache_->lt_algos_[key] = algo;
+  cache_->dirty_ = true;
+}
+
+}
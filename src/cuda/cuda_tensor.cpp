@@ -26,6 +26,11 @@
 
 
 #include <sstream>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 #include "saga.h"
 #include "tensor.h"
 
@@ -47,23 +52,64 @@ public:
     , element_size_(Tensor::DataTypeSize(data_type))
     , num_buffers_(num_buffers)
     , size_(size)
+    , index_(0)
+    , buffers_(num_buffers)
+    , host_buffers_(num_buffers)
   {
-    for(int i = 0; i < num_buffers; i++) {
-      chkCuda(cudaMallocManaged(&buffers_[i], size, cudaMemAttachGlobal));
-      chkCuda(cudaMemset(buffers_[i], 0, size));
-    }
   }
 
   ~CudaTensorStorage()
   {
     for(int i = 0; i < num_buffers_; i++) {
-      chkCuda(cudaFree(buffers_[i]));
+      if(!arena_)
+        chkCuda(cudaFree(buffers_[i]));
+      chkCuda(cudaFreeHost(host_buffers_[i]));
+    }
+  }
+
+  // Memory is allocated on first use unless the memory planner
+  // has placed the storage in the program's arena
+  void alloc()
+  {
+    if(buffers_[0])
+      return;
+    for(int i = 0; i < num_buffers_; i++) {
+      chkCuda(cudaMalloc(&buffers_[i], size_));
+      chkCuda(cudaMemsetAsync(buffers_[i], 0, size_, ctx_->stream_));
     }
+    cudaStreamSynchronize(ctx_->stream_);
+  }
+
+  void setArena(const std::shared_ptr<void> &arena, size_t offset)
+  {
+    assert(num_buffers_ == 1);
+    assert(buffers_[0] == NULL);
+    arena_ = arena;
+    buffers_[0] = (char *)arena.get() + offset;
+  }
+
+  // Move into memory owned by someone else, keeping current contents
+  void relocate(const std::shared_ptr<void> &mem, size_t offset)
+  {
+    assert(num_buffers_ == 1);
+    void *dst = (char *)mem.get() + offset;
+    if(buffers_[0]) {
+      chkCuda(cudaMemcpy(dst, buffers_[0], size_, cudaMemcpyDeviceToDevice));
+      if(!arena_)
+        chkCuda(cudaFree(buffers_[0]));
+    }
+    arena_ = mem;
+    buffers_[0] = dst;
+  }
+
+  bool allocated() const {
+    return buffers_[0] != NULL;
   }
 
   void *deviceMem(int64_t offset)
   {
-    void *buf = buffers_[index_ & (num_buffers_ - 1)];
+    alloc();
+    void *buf = buffers_[index_];
 
     void *r = (void *)((char *)buf + offset * element_size_);
     return r;
@@ -71,31 +117,57 @@ public:
 
   void *deviceMem(int64_t offset, int buffer_index)
   {
-    void *buf = buffers_[buffer_index & (num_buffers_ - 1)];
+    alloc();
+    void *buf = buffers_[buffer_index % num_buffers_];
 
     void *r = (void *)((char *)buf + offset * element_size_);
     return r;
   }
 
-  void *data(int buffer) const {
-    return buffers_[(buffer + index_) & (num_buffers_ - 1)];
+  // Pinned host mirror, used for double buffered tensors where the
+  // CPU side is filled / read back while the GPU works on another slot
+  void *hostMem(int slot) {
+    const int i = slot % num_buffers_;
+    if(host_buffers_[i] == NULL) {
+      chkCuda(cudaMallocHost(&host_buffers_[i], size_));
+      memset(host_buffers_[i], 0, size_);
+    }
+    return host_buffers_[i];
+  }
+
+  double get(size_t offset, int slot) {
+    return get_(hostMem(slot), offset);
   }
 
-  double get(size_t offset, int buffer = 0) const {
-    return get_(data(buffer), offset);
+  void set(size_t offset, double value, int slot) {
+    set_(hostMem(slot), offset, value);
   }
 
-  void set(size_t offset, double value, int buffer = 0) {
-    set_(data(buffer), offset, value);
+  void upload(cudaStream_t stream, int slot) {
+    chkCuda(cudaMemcpyAsync(deviceMem(0, slot), hostMem(slot),
+                            size_, cudaMemcpyHostToDevice, stream));
   }
 
+  void download(cudaStream_t stream, int slot) {
+    chkCuda(cudaMemcpyAsync(hostMem(slot), deviceMem(0, slot),
+                            size_, cudaMemcpyDeviceToHost, stream));
+  }
 
-  void flip() {
-    index_++;
+  // Synchronous copies of [offset, offset + size) bytes of the current
+  // buffer, with host memory mirroring the layout of the whole storage
+  void copyToHost(void *dst, size_t offset, size_t size) {
+    chkCuda(cudaMemcpy((char *)dst + offset, (char *)deviceMem(0) + offset,
+                       size, cudaMemcpyDeviceToHost));
   }
 
-  void prefetchGPU() {
-    cudaMemPrefetchAsync(deviceMem(1), size_, ctx_->deviceId_, ctx_->stream_);
+  void copyFromHost(const void *src, size_t offset, size_t size) {
+    chkCuda(cudaMemcpy((char *)deviceMem(0) + offset, (const char *)src + offset,
+                       size, cudaMemcpyHostToDevice));
+  }
+
+  // Select the buffer used by deviceMem() without explicit index
+  void setIndex(int slot) {
+    index_ = slot % num_buffers_;
   }
 
   const std::shared_ptr<CudaContext> ctx_;
@@ -105,8 +177,12 @@ public:
 
   int index_;
 
-  void *buffers_[2];
+  // Ring of buffers for tensors at the edge of the graph, one per
+  // pipeline slot
+  std::vector<void *> buffers_;
+  std::vector<void *> host_buffers_;
 
+  std::shared_ptr<void> arena_;
 };
 
 
@@ -120,6 +196,28 @@ makeCudaTensorStorage(Tensor::DataType data_type, size_t size,
 
 
 
+// Bytes from the first to one past the last element of a tensor
+static size_t
+tensor_span_bytes(cudnnTensorDescriptor_t desc, size_t element_size)
+{
+  const int max_rank = 8;
+  int dims[max_rank];
+  int strides[max_rank];
+  int rank;
+  cudnnDataType_t data_type;
+
+  chkCUDNN(cudnnGetTensorNdDescriptor(desc, max_rank, &data_type,
+                                      &rank, dims, strides));
+  int64_t span = 1;
+  for(int i = 0; i < rank; i++) {
+    if(dims[i] == 0)
+      return 0;
+    span += (int64_t)(dims[i] - 1) * strides[i];
+  }
+  return span * element_size;
+}
+
+
 class CudaTensorAccess : public TensorAccess {
 
 public:
@@ -128,7 +226,9 @@ public:
                    int64_t offset)
     : storage_(storage)
     , offset_(offset)
-    , sync_(false)
+    , span_(tensor_span_bytes(desc, storage->element_size_))
+    , host_(NULL)
+    , dirty_(false)
   {
     const int max_rank = 8;
     int dims[max_rank];
@@ -147,12 +247,32 @@ public:
   }
 
   ~CudaTensorAccess() {
+    if(dirty_)
+      storage_->copyFromHost(host_, offset_ * storage_->element_size_, span_);
+    free(host_);
     storage_->ctx_->mutex_.unlock();
   }
 
+  // Device memory is not accessible from the CPU so we work on a copy
+  // that is written back when the access goes out of scope. Only the
+  // part covered by this tensor is transferred as the storage may be
+  // shared by many tensors
+  void *hostMem() {
+    if(host_ == NULL) {
+      // Programs execute on streams of their own
+      cudaDeviceSynchronize();
+      host_ = malloc(storage_->size_);
+      storage_->copyToHost(host_, offset_ * storage_->element_size_, span_);
+    }
+    return host_;
+  }
+
   Dims strides() { return strides_; }
 
-  void *data() { return storage_->data(0); }
+  void *data() {
+    dirty_ = true;
+    return hostMem();
+  }
 
   int64_t offsetForElement(const Dims &element) const {
     size_t offset = offset_;
@@ -163,28 +283,27 @@ public:
   }
 
   virtual double get(const Dims &element) {
-    if(!sync_) {
-      cudaStreamSynchronize(storage_->ctx_->stream_);
-      sync_ = true;
-    }
-    return storage_->get(offsetForElement(element));
+    return storage_->get_(hostMem(), offsetForElement(element));
   };
 
   virtual void set(const Dims &element, double value) {
-    storage_->set(offsetForElement(element), value);
+    dirty_ = true;
+    storage_->set_(hostMem(), offsetForElement(element), value);
   }
 
   virtual void copyBytesFrom(const Dims &element,
                              const void *data, size_t size) {
     const size_t o = offsetForElement(element) * storage_->element_size_;
-    char *dst = (char *)storage_->data(0);
-    cudaMemcpy(dst + o, data, size, cudaMemcpyHostToDevice);
+    dirty_ = true;
+    memcpy((char *)hostMem() + o, data, size);
   }
 
   Dims strides_;
   const std::shared_ptr<CudaTensorStorage> storage_;
   const int64_t offset_;
-  bool sync_;
+  const size_t span_;
+  void *host_;
+  bool dirty_;
 };
 
 
@@ -201,6 +320,8 @@ cudnnDataType_from_dataType(Tensor::DataType data_type)
     return CUDNN_DATA_UINT8;
   case Tensor::DataType::I32:
     return CUDNN_DATA_INT32;
+  case Tensor::DataType::I8:
+    return CUDNN_DATA_INT8;
   default:
     fprintf(stderr, "Unsupported data_type %d for cuda tensor\n",
             (int)data_type);
@@ -433,11 +554,67 @@ CudaTensor::deviceMem(int i) const
 };
 
 
-int
-CudaTensor::flip() const
+bool
+CudaTensor::statsAsync(TensorStatsResult *partials, TensorStatsResult *result,
+                       cudaStream_t stream) const
 {
-  storage_->flip();
-  return storage_->index_ & 1;
+  TensorStatsLayout l;
+  cudnnDataType_t data_type;
+
+  chkCUDNN(cudnnGetTensorNdDescriptor(desc_, 8, &data_type,
+                                      &l.rank, l.dims, l.strides));
+  l.elements = elements_;
+
+  // Element order doesn't matter, so gap free tensors are read linearly
+  if(tensor_span_bytes(desc_, 1) == (size_t)elements_)
+    l.rank = 0;
+
+  const void *src = deviceMem();
+  switch(data_type_) {
+  case DataType::FLOAT:
+    tensor_stats_float((const float *)src, l, partials, result, stream);
+    break;
+  case DataType::HALF:
+    tensor_stats_half((const __half *)src, l, partials, result, stream);
+    break;
+  case DataType::U8:
+    tensor_stats_u8((const uint8_t *)src, l, partials, result, stream);
+    break;
+  case DataType::I8:
+    tensor_stats_i8((const int8_t *)src, l, partials, result, stream);
+    break;
+  case DataType::I32:
+    tensor_stats_i32((const int32_t *)src, l, partials, result, stream);
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+
+Tensor::Stats
+CudaTensor::stats()
+{
+  const auto &ctx = storage_->ctx_;
+  TensorStatsResult *mem;
+  chkCuda(cudaMalloc(&mem, sizeof(TensorStatsResult) *
+                     (TENSOR_STATS_BLOCKS + 1)));
+
+  // Programs execute on streams of their own
+  chkCuda(cudaDeviceSynchronize());
+
+  if(!statsAsync(mem, mem + TENSOR_STATS_BLOCKS, ctx->stream_)) {
+    chkCuda(cudaFree(mem));
+    return Tensor::stats();
+  }
+
+  TensorStatsResult r;
+  chkCuda(cudaMemcpyAsync(&r, mem + TENSOR_STATS_BLOCKS, sizeof(r),
+                          cudaMemcpyDeviceToHost, ctx->stream_));
+  chkCuda(cudaStreamSynchronize(ctx->stream_));
+  chkCuda(cudaFree(mem));
+  return statsFromSums(r.min, r.max, r.sum, r.sum2, r.count, r.nans, r.infs);
 }
 
 
@@ -490,9 +667,9 @@ CudaTensor::info() const
     prefix = ", ";
   }
   ss << "}@cuda:" << storage_->buffers_[0];
+  for(int i = 1; i < storage_->num_buffers_; i++)
+    ss << "/" << storage_->buffers_[i];
 
-  if(storage_->num_buffers_ == 2)
-    ss << "/" << storage_->buffers_[1];
 
   if(offset_) {
     ss << " + " << offset_;
@@ -526,14 +703,48 @@ CudaTensor::copyFromLocked(Tensor &t)
   chkCUDNN(cudnnGetTensorNdDescriptor(desc_, max_rank, &data_type,
                                       &rank, dims, strides));
 
+  {
+    auto ta = t.access();
+    if(ta == nullptr)
+      return; // Nothing to copy, don't force allocation of storage
+
+    // Same type and layout (eg. weights mmap:ed from a checkpoint or an
+    // onnx file) are streamed straight to the device
+    if(t.data_type_ == data_type_ && t.dims_.size() == (size_t)rank &&
+       ta->strides() == Dims(strides, strides + rank)) {
+      bool same_dims = true;
+      for(int i = 0; i < rank; i++)
+        same_dims &= t.dims_[i] == dims[i];
+
+      const void *src = same_dims ? ta->data() : NULL;
+      if(src != NULL) {
+        storage_->ctx_->uploadAsync(deviceMem(), src,
+                                    elements_ * storage_->element_size_);
+        return;
+      }
+    }
+  }
+
   cudaStreamSynchronize(storage_->ctx_->stream_);
 
-  if(!copy_tensor(storage_->deviceMem(offset_),
-                  dims_.size(),
-                  &dims_[0],
-                  &strides[0],
-                  data_type_,
-                  t)) {
+  // Copy via host memory. Only the span of this tensor is round-tripped
+  // as other tensors may alias the rest of the storage
+  const size_t offset = offset_ * storage_->element_size_;
+  const size_t span = tensor_span_bytes(desc_, storage_->element_size_);
+  void *host = malloc(storage_->size_);
+  storage_->copyToHost(host, offset, span);
+
+  const bool ok = copy_tensor((char *)host + offset,
+                              dims_.size(),
+                              &dims_[0],
+                              &strides[0],
+                              data_type_,
+                              t);
+  if(ok)
+    storage_->copyFromHost(host, offset, span);
+  free(host);
+
+  if(!ok) {
     fprintf(stderr,
             "Cuda Tensor copy failed\n"
             "From: %s\n"
@@ -555,9 +766,11 @@ class CudaTensorBatchAccess : public TensorAccess {
 public:
   CudaTensorBatchAccess(CudaTensorStorage *storage,
                         cudnnTensorDescriptor_t desc,
-                        int64_t offset)
+                        int64_t offset,
+                        int slot)
     : storage_(storage)
     , offset_(offset)
+    , slot_(slot)
   {
     int dims[MAX_RANK];
     cudnnDataType_t data_type;
@@ -574,61 +787,646 @@ public:
     return offset;
   }
 
+  // The pinned host mirror of the slot, laid out as on the device
   Dims strides() override {
-    abort();
+    return Dims(strides_, strides_ + rank_);
   }
 
   void *data() override {
-    abort();
+    return (char *)storage_->hostMem(slot_) + offset_ * storage_->element_size_;
   };
 
   void copyBytesFrom(const Dims &element,
                      const void *data, size_t size) override {
     const size_t o = offsetForElement(element) * storage_->element_size_;
-    char *dst = (char *)storage_->data(1);
-    cudaMemcpy(dst + o, data, size, cudaMemcpyHostToDevice);
+    char *dst = (char *)storage_->hostMem(slot_);
+    memcpy(dst + o, data, size);
   }
 
   void *getAddr(const Dims &element) override {
     size_t off = offsetForElement(element) * storage_->element_size_;
-    return (void *)((char *)storage_->data(1) + off);
+    return (void *)((char *)storage_->hostMem(slot_) + off);
   };
 
   double get(const Dims &element) override {
-    return storage_->get(offsetForElement(element), 1);
+    return storage_->get(offsetForElement(element), slot_);
   };
 
   void set(const Dims &element, double value) override {
-    storage_->set(offsetForElement(element), value, 1);
+    storage_->set(offsetForElement(element), value, slot_);
   }
 
 
   CudaTensorStorage *storage_;
   int64_t offset_;
+  const int slot_;
   int rank_;
   int strides_[MAX_RANK];
 };
 
 
+// Run PRE accessors for the given batch and upload the result.
+// Called on the loader thread
 void
-CudaProgram::issueOps(const CudaBatchAccessOps ops, long batch)
+CudaProgram::issueOps(const CudaBatchAccessOps &ops, long batch)
 {
+  const int slot = batchSlot(batch);
+
   for(const auto &op : ops) {
     CudaTensorBatchAccess ta(op.tensor_->storage_.get(),
                              op.tensor_->desc_,
-                             op.tensor_->offset_);
+                             op.tensor_->offset_,
+                             slot);
     op.fn_(ta, batch);
-    if(op.prefetch_)
-      op.tensor_->storage_->prefetchGPU();
   }
+
+  // The device side buffer is in use until the batch that previously
+  // occupied the slot has been computed
+  chkCuda(cudaStreamWaitEvent(copy_stream_, compute_done_[slot], 0));
+
+  for(const auto &op : ops)
+    op.tensor_->storage_->upload(copy_stream_, slot);
 }
 
+
+// Called on the compute thread once the batch has been issued
 void
-CudaProgram::flipDoubleBufferedTensors()
+CudaProgram::downloadOps(const CudaBatchAccessOps &ops, long batch)
 {
+  const int slot = batchSlot(batch);
+
+  chkCuda(cudaStreamWaitEvent(download_stream_, compute_done_[slot], 0));
+
+  for(const auto &op : ops)
+    op.tensor_->storage_->download(download_stream_, slot);
+
+  chkCuda(cudaEventRecord(download_done_[slot], download_stream_));
+}
+
+
+// Run POST accessors for the given batch. Called on the completion
+// thread once the batch has been downloaded
+void
+CudaProgram::postOps(const CudaBatchAccessOps &ops, long batch)
+{
+  const int slot = batchSlot(batch);
+
+  chkCuda(cudaEventSynchronize(download_done_[slot]));
+
+  for(const auto &op : ops) {
+    CudaTensorBatchAccess ta(op.tensor_->storage_.get(),
+                             op.tensor_->desc_,
+                             op.tensor_->offset_,
+                             slot);
+    op.fn_(ta, batch);
+  }
+}
+
+
+void
+CudaProgram::selectSlot(long batch)
+{
+  const int slot = batchSlot(batch);
   for(const auto &s : flips_)
-    s->flip();
+    s->setIndex(slot);
+}
+
+
+//------------------------------------------------------------------------
+
+/**
+ * Intermediate tensors are only live between the operation that first
+ * writes them and the last operation that reads them. Tensors whose
+ * lifetimes do not overlap can share memory, so instead of allocating
+ * every tensor separately they are packed into a single arena.
+ *
+ * Inference and training are two separate timelines (they never
+ * execute concurrently) so a tensor gets one live range per timeline.
+ *
+ * A tensor is only eligible if, in every timeline it appears in, it is
+ * written before it's read and its last use is a read. Anything else
+ * (weights, running statistics, graph inputs and outputs) carries state
+ * across batches or is visible to the user and gets its own memory, as
+ * do double-buffered tensors and tensors that have been initialized
+ * with data.
+ */
+
+namespace {
+
+struct LiveRange {
+  int first[2] = {-1, -1};
+  int last[2] = {-1, -1};
+  bool eligible = true;
+  bool last_is_read[2] = {false, false};
+  size_t offset = 0;
+  int seq = -1;  // Order of first use, stable across identical programs
+
+  // Recomputed activations are dead in the training timeline from
+  // after gap_from until they are recreated at gap_to
+  int gap_from = -1;
+  int gap_to = -1;
+};
+
+}
+
+static void
+use_storage(std::unordered_map<CudaTensorStorage *, LiveRange> &ranges,
+            const CudaTensors &tensors, int timeline, int step, bool read)
+{
+  for(const auto &t : tensors) {
+    if(!t)
+      continue;
+    auto &r = ranges[t->storage_.get()];
+    if(r.seq == -1)
+      r.seq = ranges.size() - 1;
+    if(timeline == 1 && r.gap_from != -1 && r.gap_to == -1)
+      r.gap_to = step;
+    if(r.first[timeline] == -1) {
+      r.first[timeline] = step;
+      if(read)
+        r.eligible = false;
+    }
+    r.last[timeline] = step;
+    r.last_is_read[timeline] = read;
+  }
+}
+
+static int
+live_segments(const LiveRange &r, int timeline, std::pair<int, int> *seg)
+{
+  if(r.first[timeline] == -1)
+    return 0;
+  if(timeline == 1 && r.gap_to != -1) {
+    seg[0] = std::make_pair(r.first[1], r.gap_from);
+    seg[1] = std::make_pair(r.gap_to, r.last[1]);
+    return 2;
+  }
+  seg[0] = std::make_pair(r.first[timeline], r.last[timeline]);
+  return 1;
 }
 
+static bool
+overlaps(const LiveRange &a, const LiveRange &b)
+{
+  for(int i = 0; i < 2; i++) {
+    std::pair<int, int> as[2], bs[2];
+    const int na = live_segments(a, i, as);
+    const int nb = live_segments(b, i, bs);
+    for(int j = 0; j < na; j++) {
+      for(int k = 0; k < nb; k++) {
+        if(as[j].first <= bs[k].second && bs[k].first <= as[j].second)
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+/**
+ * Publish tensors lowered from the graph that no operation writes to
+ * (weights, folded weights, constants) so other inference-only programs
+ * on the same context can use their device memory instead of uploading
+ * a copy of their own. A tensor that turned out to be written by this
+ * program gets private storage even if someone else already uploaded it
+ */
+void
+CudaProgram::shareTensors()
+{
+  std::unordered_set<CudaTensorStorage *> written;
+  for(const auto &op : infer_operations_) {
+    for(const auto &t : op->getOutputs()) {
+      if(t)
+        written.insert(t->storage_.get());
+    }
+  }
+
+  for(const auto &it : shareable_) {
+    const auto &src = it.first;
+    const auto &t = it.second;
+    const bool is_written = written.count(t->storage_.get()) != 0;
+
+    if(isShared(*t)) {
+      if(!is_written)
+        continue;
+      shared_.erase(t.get());
+      t->storage_ = makeCudaTensorStorage(src->data_type_,
+                                          t->storage_->size_, ctx_, 1);
+      t->copyFromLocked(*src);
+      continue;
+    }
+
+    if(is_written || !t->storage_->allocated())
+      continue;
+
+    ctx_->addSharedStorage(src, *t, tensorFormat(src->data_type_));
+  }
+  shareable_.clear();
+}
+
+
+void
+CudaProgram::planMemory(const Graph &g)
+{
+  const std::vector<std::shared_ptr<CudaOperation>> *timelines[2][3] = {
+    {&infer_operations_},
+    {&train_operations_, &bwd_operations_, &upd_operations_}
+  };
+
+  std::unordered_map<CudaTensorStorage *, LiveRange> ranges;
+
+  for(int i = 0; i < 2; i++) {
+    int step = 0;
+    for(const auto *ops : timelines[i]) {
+      if(ops == NULL)
+        continue;
+      for(const auto &op : *ops) {
+        // Inputs first so read-modify-write counts as read-before-write
+        use_storage(ranges, op->getInputs(), i, step, true);
+        use_storage(ranges, op->getOutputs(), i, step, false);
+        step++;
+      }
+
+      if(ops == &train_operations_) {
+        for(auto s : recomputed_)
+          ranges[s].gap_from = ranges[s].last[1];
+      }
+    }
+  }
+
+  for(const auto &t : tensors_) {
+    ranges[t.second->storage_.get()];
+    if(t.second->grad_)
+      ranges[t.second->grad_->storage_.get()];
+  }
+
+  // Graph outputs and accessor tensors are read by the application
+  // outside of the operation timeline, and health checked tensors are
+  // sampled before the update. All must keep storage of their own
+  std::unordered_set<CudaTensorStorage *> pinned;
+  for(const auto &t : g.outputs_) {
+    auto ct = resolveTensor_locked(t);
+    if(ct)
+      pinned.insert(ct->storage_.get());
+  }
+  for(const auto *ops : {&infer_pre_, &infer_post_,
+                         &train_pre_, &train_post_}) {
+    for(const auto &op : *ops)
+      pinned.insert(op.tensor_->storage_.get());
+  }
+  if(health_) {
+    for(const auto &t : health_->tensors_)
+      pinned.insert(t->storage_.get());
+  }
+
+  std::vector<std::pair<CudaTensorStorage *, LiveRange *>> planned;
+
+  total_size_ = 0;
+  for(auto &it : ranges) {
+    auto s = it.first;
+    auto &r = it.second;
+    total_size_ += s->size_ * s->num_buffers_;
+
+    if(s->num_buffers_ != 1 || s->allocated() || s->size_ == 0)
+      r.eligible = false;
+
+    if(pinned.count(s))
+      r.eligible = false;
+
+    for(int i = 0; i < 2; i++) {
+      if(r.first[i] != -1 && !r.last_is_read[i])
+        r.eligible = false;
+    }
+    if(r.first[0] == -1 && r.first[1] == -1)
+      r.eligible = false;
+
+    if(r.eligible)
+      planned.push_back(std::make_pair(s, &r));
+  }
+
+  // Greedy placement, largest first, at the lowest offset that does not
+  // collide with any already placed storage that is live at the same time
+  std::sort(planned.begin(), planned.end(),
+            [](const auto &a, const auto &b) {
+              if(a.first->size_ != b.first->size_)
+                return a.first->size_ > b.first->size_;
+              return a.second->seq < b.second->seq;
+            });
+
+  const size_t alignment = 256;
+  size_t arena_size = 0;
+  planned_size_ = 0;
+
+  bool replay = cache_ && cache_->loaded_ &&
+    cache_->placement_.size() == planned.size();
+  for(size_t i = 0; replay && i < planned.size(); i++) {
+    const auto &c = cache_->placement_[i];
+    replay = c.seq == (size_t)planned[i].second->seq &&
+      c.size == planned[i].first->size_ &&
+      c.offset + c.size <= cache_->arena_size_;
+  }
+
+  if(replay) {
+    for(size_t i = 0; i < planned.size(); i++) {
+      planned[i].second->offset = cache_->placement_[i].offset;
+      planned_size_ += planned[i].first->size_;
+    }
+    arena_size = cache_->arena_size_;
+  }
+
+  for(size_t i = 0; !replay && i < planned.size(); i++) {
+    const size_t size = (planned[i].first->size_ + alignment - 1) &
+      ~(alignment - 1);
+
+    std::vector<std::pair<size_t, size_t>> busy;
+    for(size_t j = 0; j < i; j++) {
+      if(overlaps(*planned[i].second, *planned[j].second))
+        busy.push_back(std::make_pair(planned[j].second->offset,
+                                      planned[j].second->offset +
+                                      planned[j].first->size_));
+    }
+    std::sort(busy.begin(), busy.end());
+
+    size_t offset = 0;
+    for(const auto &b : busy) {
+      if(offset + size <= b.first)
+        break;
+      offset = std::max(offset, (b.second + alignment - 1) & ~(alignment - 1));
+    }
+
+    planned[i].second->offset = offset;
+    arena_size = std::max(arena_size, offset + size);
+    planned_size_ += planned[i].first->size_;
+  }
+
+  if(cache_ && !replay) {
+    cache_->placement_.clear();
+    for(const auto &it : planned)
+      cache_->placement_.push_back({(size_t)it.second->seq,
+                                    it.first->size_, it.second->offset});
+    cache_->arena_size_ = arena_size;
+    cache_->dirty_ = true;
+  }
+
+  // Storages not yet allocated go after the arena in the same
+  // allocation rather than getting a cudaMalloc() each
+  std::vector<std::pair<CudaTensorStorage *, size_t>> rest;
+  size_t total = arena_size;
+  for(const auto &it : ranges) {
+    auto s = it.first;
+    if(it.second.eligible || s->allocated() || s->num_buffers_ != 1 ||
+       s->size_ == 0)
+      continue;
+    rest.push_back(std::make_pair(s, total));
+    total += (s->size_ + alignment - 1) & ~(alignment - 1);
+  }
+
+  if(total) {
+    void *mem;
+    chkCuda(cudaMalloc(&mem, total));
+    chkCuda(cudaMemsetAsync(mem, 0, total, ctx_->stream_));
+    std::shared_ptr<void> arena(mem, [](void *p) { chkCuda(cudaFree(p)); });
+
+    for(const auto &it : planned)
+      it.first->setArena(arena, it.second->offset);
+    for(const auto &it : rest)
+      it.first->setArena(arena, it.second);
+  }
+  arena_size_ = arena_size;
+
+  // Multi buffered storages are allocated now rather than during first
+  // execution
+  for(auto &it : ranges)
+    it.first->alloc();
+}
+
+
+
+//------------------------------------------------------------------------
+
+/**
+ * Activation recomputation (gradient checkpointing).
+ *
+ * A forward activation that is only kept for the backward pass is
+ * dropped after its last forward use and recreated by executing the
+ * operations that produced it again, right before the first backward
+ * operation that needs it. Producers are recomputed transitively back
+ * to the nearest kept tensor, so a segment between two checkpoints is
+ * recomputed in one go. The memory planner treats a recomputed storage
+ * as dead in between (see LiveRange::gap_from) so it can be reused.
+ *
+ * Operations are only recomputed if they say they can be and all their
+ * inputs hold the same values when the backward pass runs. Storages
+ * written by several operations are only dropped if every writer can
+ * be recomputed (eg. concat)
+ */
+
+namespace {
+
+struct CudaRecompute : public CudaOperation {
+
+  const std::shared_ptr<CudaOperation> op_;
+
+  CudaRecompute(std::shared_ptr<CudaOperation> op)
+    : op_(op)
+  {}
+
+  void exec(CudaProgram &p) override {
+    p.recomputing_ = true;
+    op_->exec(p);
+    p.recomputing_ = false;
+  }
+
+  void print() const override {
+    printf("Recompute ");
+    op_->print();
+  }
+
+  CudaTensors getInputs() const override { return op_->getInputs(); }
+  CudaTensors getOutputs() const override { return op_->getOutputs(); }
+
+  std::string name() const override { return "Recompute " + op_->name(); }
+  std::string algo() const override { return op_->algo(); }
+  int64_t flops() const override { return op_->flops(); }
+};
+
+struct StorageUse {
+  std::vector<int> writers;  // Forward operations
+  bool read_first = false;   // Read before written in the forward pass
+  bool bwd_read = false;
+  bool bwd_written = false;
+};
+
+}
+
+
+void
+CudaProgram::setupRecompute(const std::unordered_set<const CudaOperation *> &checkpoints)
+{
+  const auto &fwd = train_operations_;
+  const int num_fwd = fwd.size();
+  if(num_fwd == 0)
+    return;
+
+  std::unordered_map<CudaTensorStorage *, StorageUse> uses;
+
+  for(int i = 0; i < num_fwd; i++) {
+    for(const auto &t : fwd[i]->getInputs()) {
+      if(!t)
+        continue;
+      auto &u = uses[t->storage_.get()];
+      if(u.writers.empty())
+        u.read_first = true;
+    }
+    for(const auto &t : fwd[i]->getOutputs()) {
+      if(!t)
+        continue;
+      auto &u = uses[t->storage_.get()];
+      if(u.writers.empty() || u.writers.back() != i)
+        u.writers.push_back(i);
+    }
+  }
+
+  for(const auto &op : bwd_operations_) {
+    for(const auto &t : op->getInputs()) {
+      if(t)
+        uses[t->storage_.get()].bwd_read = true;
+    }
+    for(const auto &t : op->getOutputs()) {
+      if(t)
+        uses[t->storage_.get()].bwd_written = true;
+    }
+  }
+
+  // State that carries across batches, never dropped
+  auto persistent = [&](CudaTensorStorage *s) {
+    return uses[s].read_first || s->allocated() || s->num_buffers_ != 1 ||
+      s->size_ == 0;
+  };
+
+  // Without explicit checkpoints keep the outputs of every sqrt(n):th
+  // operation, recomputing about one extra forward pass
+  std::vector<bool> checkpoint(num_fwd);
+  if(checkpoints.empty()) {
+    const int every = std::max(2, (int)lrint(sqrt(num_fwd)));
+    for(int i = every - 1; i < num_fwd; i += every)
+      checkpoint[i] = true;
+  } else {
+    for(int i = 0; i < num_fwd; i++)
+      checkpoint[i] = checkpoints.count(fwd[i].get()) != 0;
+  }
+
+  std::vector<bool> candidate(num_fwd);
+  for(int i = 0; i < num_fwd; i++) {
+    if(checkpoint[i] || !fwd[i]->recomputable())
+      continue;
+
+    std::unordered_set<CudaTensorStorage *> outputs;
+    bool ok = true;
+    for(const auto &t : fwd[i]->getOutputs()) {
+      if(!t)
+        continue;
+      outputs.insert(t->storage_.get());
+      ok &= !uses[t->storage_.get()].bwd_written;
+    }
+
+    for(const auto &t : fwd[i]->getInputs()) {
+      if(!t)
+        continue;
+      auto s = t->storage_.get();
+      const auto &u = uses[s];
+      // Read-modify-write is only fine for state (eg. running averages)
+      if(outputs.count(s)) {
+        ok &= persistent(s);
+        continue;
+      }
+      ok &= !u.bwd_written;
+      for(int w : u.writers)
+        ok &= w < i;
+    }
+    candidate[i] = ok;
+  }
+
+  recomputed_.clear();
+  for(auto &it : uses) {
+    const auto &u = it.second;
+    if(!u.bwd_read || u.writers.empty() || persistent(it.first))
+      continue;
+    bool ok = true;
+    for(int w : u.writers)
+      ok &= candidate[w];
+    if(ok)
+      recomputed_.insert(it.first);
+  }
+
+  if(recomputed_.empty())
+    return;
+
+  // Insert recomputation in front of the first backward operation that
+  // reads a dropped storage
+  std::vector<bool> done(num_fwd);
+  std::vector<int> chain;
+
+  std::function<void(CudaTensorStorage *)> need = [&](CudaTensorStorage *s) {
+    if(recomputed_.count(s) == 0)
+      return;
+    for(int w : uses[s].writers) {
+      if(done[w])
+        continue;
+      done[w] = true;
+      for(const auto &t : fwd[w]->getInputs()) {
+        if(t)
+          need(t->storage_.get());
+      }
+      chain.push_back(w);
+    }
+  };
+
+  std::vector<std::shared_ptr<CudaOperation>> bwd;
+  for(const auto &op : bwd_operations_) {
+    chain.clear();
+    for(const auto &t : op->getInputs()) {
+      if(t)
+        need(t->storage_.get());
+    }
+    std::sort(chain.begin(), chain.end());
+    for(int i : chain)
+      bwd.push_back(std::make_shared<CudaRecompute>(fwd[i]));
+    bwd.push_back(op);
+  }
+  bwd_operations_ = std::move(bwd);
+}
+
+
+size_t
+CudaPackTensors(const CudaTensors &tensors, size_t alignment)
+{
+  std::unordered_set<CudaTensorStorage *> seen;
+  size_t total = 0;
+
+  for(const auto &t : tensors) {
+    const auto &s = t->storage_;
+    if(t->offset_ != 0 || s->num_buffers_ != 1 ||
+       s->size_ != t->elements_ * Tensor::DataTypeSize(t->data_type_) ||
+       !seen.insert(s.get()).second)
+      return 0;
+    total += (s->size_ + alignment - 1) & ~(alignment - 1);
+  }
+
+  if(total == 0)
+    return 0;
+
+  void *mem;
+  chkCuda(cudaMalloc(&mem, total));
+  chkCuda(cudaMemset(mem, 0, total));
+  std::shared_ptr<void> packed(mem, [](void *p) { chkCuda(cudaFree(p)); });
+
+  size_t offset = 0;
+  for(const auto &t : tensors) {
+    t->storage_->relocate(packed, offset);
+    offset += (t->storage_->size_ + alignment - 1) & ~(alignment - 1);
+  }
+  return total;
+}
 
 }
@@ -87,6 +87,15 @@ public:
     return grad_;
   }
 
+  // Reduced on the device, only the result is copied back
+  Stats stats() override;
+
+  // Enqueue the reduction on stream, *result is valid once the stream
+  // reaches this point. partials must hold TENSOR_STATS_BLOCKS entries.
+  // Returns false if the data type is not supported
+  bool statsAsync(TensorStatsResult *partials, TensorStatsResult *result,
+                  cudaStream_t stream) const;
+
   cudnnTensorDescriptor_t desc() const {
     return desc_;
   }
@@ -95,8 +104,6 @@ public:
 
   void *deviceMem(int buffer_index) const;
 
-  int flip() const;
-
   std::shared_ptr<CudaTensor> makeGrad();
 
   bool cpacked() const;
@@ -110,4 +117,10 @@ public:
   std::shared_ptr<CudaTensor> grad_;
 };
 
+
+// Move the storage of all tensors into one allocation, each starting at
+// a multiple of alignment bytes. Returns the total size or 0 (without
+// moving anything) if a tensor does not exclusively own its storage
+size_t CudaPackTensors(const CudaTensors &tensors, size_t alignment);
+
 }
@@ -0,0 +1,594 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "saga.h"
+#include "tensor.h"
+
+/*
+ * Record shard
+ *
+ *   RecordShardHeader
+ *   Payloads, each starting at a multiple of RECORD_ALIGNMENT
+ *   RecordIndexEntry[records] at index_offset
+ *
+ * The header is written last so a shard that was not completed is
+ * rejected on open
+ */
+
+namespace saga {
+
+#define RECORD_ALIGNMENT 64
+#define RECORD_MAX_RANK 8
+
+static const uint8_t record_magic[8] = {'s','a','g','a','r','e','c','1'};
+
+struct RecordShardHeader {
+  uint8_t magic[8];
+  uint32_t type;       // RecordType
+  uint32_t data_type;  // TensorDiskType of TENSOR records
+  uint32_t rank;
+  uint32_t dims[RECORD_MAX_RANK];
+  uint64_t records;
+  uint64_t index_offset;
+} __attribute__((packed));
+
+struct RecordIndexEntry {
+  uint64_t offset;
+  uint32_t size;
+  int32_t label;
+} __attribute__((packed));
+
+
+//------------------------------------------------------------------------
+
+class ShardRecordWriter : public RecordWriter {
+public:
+  ShardRecordWriter(const std::string &prefix, const RecordFormat &format,
+                    size_t records_per_shard)
+    : prefix_(prefix)
+    , format_(format)
+    , records_per_shard_(std::max((size_t)1, records_per_shard))
+  {}
+
+  ~ShardRecordWriter() {
+    finish();
+  }
+
+  bool write(const void *data, size_t size, int label) override;
+  bool finish() override;
+
+private:
+  bool open();
+
+  const std::string prefix_;
+  const RecordFormat format_;
+  const size_t records_per_shard_;
+
+  int fd_ = -1;
+  int shard_ = 0;
+  uint64_t offset_ = 0;
+  std::vector<RecordIndexEntry> index_;
+  bool failed_ = false;
+};
+
+
+bool
+ShardRecordWriter::open()
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s-%05d.rec", prefix_.c_str(), shard_);
+  fd_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd_ == -1) {
+    fprintf(stderr, "Unable to create %s -- %s\n", path, strerror(errno));
+    return false;
+  }
+  shard_++;
+  offset_ = sizeof(RecordShardHeader);
+  index_.clear();
+  return true;
+}
+
+
+static bool
+write_at(int fd, const void *data, size_t size, uint64_t offset)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while(size) {
+    ssize_t r = pwrite(fd, p, size, offset);
+    if(r <= 0)
+      return false;
+    p += r;
+    offset += r;
+    size -= r;
+  }
+  return true;
+}
+
+
+bool
+ShardRecordWriter::write(const void *data, size_t size, int label)
+{
+  if(failed_)
+    return false;
+
+  if(size > UINT32_MAX) {
+    fprintf(stderr, "Record of %zd bytes is too large\n", size);
+    return false;
+  }
+
+  if(fd_ == -1 && !open()) {
+    failed_ = true;
+    return false;
+  }
+
+  const uint64_t offset = (offset_ + RECORD_ALIGNMENT - 1) &
+    ~(uint64_t)(RECORD_ALIGNMENT - 1);
+
+  if(!write_at(fd_, data, size, offset)) {
+    fprintf(stderr, "Unable to write record -- %s\n", strerror(errno));
+    failed_ = true;
+    return false;
+  }
+
+  index_.push_back(RecordIndexEntry{offset, (uint32_t)size, label});
+  offset_ = offset + size;
+
+  if(index_.size() == records_per_shard_)
+    return finish();
+  return true;
+}
+
+
+bool
+ShardRecordWriter::finish()
+{
+  if(fd_ == -1)
+    return !failed_;
+
+  RecordShardHeader h = {};
+  memcpy(h.magic, record_magic, sizeof(h.magic));
+  h.type = (uint32_t)format_.type;
+  uint32_t data_type = 0;
+  tensor_disk_type(format_.data_type, &data_type);
+  h.data_type = data_type;
+  h.rank = std::min(format_.dims.size(), (size_t)RECORD_MAX_RANK);
+  for(uint32_t i = 0; i < h.rank; i++)
+    h.dims[i] = format_.dims[i];
+  h.records = index_.size();
+  h.index_offset = offset_;
+
+  const bool ok =
+    write_at(fd_, index_.data(), index_.size() * sizeof(RecordIndexEntry),
+             offset_) &&
+    write_at(fd_, &h, sizeof(h), 0);
+
+  if(!ok)
+    fprintf(stderr, "Unable to write shard -- %s\n", strerror(errno));
+
+  close(fd_);
+  fd_ = -1;
+  failed_ |= !ok;
+  return ok;
+}
+
+
+std::shared_ptr<RecordWriter>
+createRecordWriter(const std::string &prefix, const RecordFormat &format,
+                   size_t records_per_shard)
+{
+  if(format.dims.size() > RECORD_MAX_RANK) {
+    fprintf(stderr, "Record rank %zd not supported\n", format.dims.size());
+    return nullptr;
+  }
+  uint32_t type;
+  if(!tensor_disk_type(format.data_type, &type)) {
+    fprintf(stderr, "Record data type not supported\n");
+    return nullptr;
+  }
+  return std::make_shared<ShardRecordWriter>(prefix, format,
+                                             records_per_shard);
+}
+
+
+//------------------------------------------------------------------------
+
+struct RecordShard {
+  ~RecordShard() {
+    if(base != MAP_FAILED)
+      munmap(base, size);
+  }
+
+  std::string path;
+  void *base = MAP_FAILED;
+  size_t size = 0;
+  const RecordIndexEntry *index = NULL;
+  uint64_t records = 0;
+  uint64_t first = 0;  // Dataset-wide number of the first record
+};
+
+
+static std::unique_ptr<RecordShard>
+open_shard(const std::string &path, RecordFormat *format)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd == -1) {
+    fprintf(stderr, "Unable to open %s -- %s\n", path.c_str(),
+            strerror(errno));
+    return nullptr;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st)) {
+    fprintf(stderr, "Unable to stat %s -- %s\n", path.c_str(),
+            strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+
+  auto s = std::make_unique<RecordShard>();
+  s->path = path;
+  s->size = st.st_size;
+  if(s->size >= sizeof(RecordShardHeader))
+    s->base = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(s->base == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s\n", path.c_str());
+    return nullptr;
+  }
+
+  const RecordShardHeader *h = (const RecordShardHeader *)s->base;
+  RecordFormat f;
+  if(memcmp(h->magic, record_magic, sizeof(h->magic)) ||
+     h->type > (uint32_t)RecordType::TENSOR ||
+     h->rank > RECORD_MAX_RANK ||
+     !tensor_data_type(h->data_type, &f.data_type) ||
+     h->index_offset > s->size ||
+     h->records > (s->size - h->index_offset) / sizeof(RecordIndexEntry)) {
+    fprintf(stderr, "%s is not a valid record shard\n", path.c_str());
+    return nullptr;
+  }
+
+  f.type = (RecordType)h->type;
+  for(uint32_t i = 0; i < h->rank; i++)
+    f.dims.push_back(h->dims[i]);
+  *format = f;
+
+  s->records = h->records;
+  s->index = (const RecordIndexEntry *)((const uint8_t *)s->base +
+                                         h->index_offset);
+
+  for(uint64_t i = 0; i < s->records; i++) {
+    const auto &e = s->index[i];
+    if(e.offset > h->index_offset || e.size > h->index_offset - e.offset) {
+      fprintf(stderr, "%s: Record %ld out of bounds\n", path.c_str(),
+              (long)i);
+      return nullptr;
+    }
+  }
+
+  // Access pattern is decided by the readahead thread
+  madvise(s->base, s->size, MADV_RANDOM);
+  return s;
+}
+
+
+/**
+ * The order of an epoch is decided up front as a list of record numbers.
+ * With shuffling, shards are visited in random order and records are
+ * drawn from a buffer of upcoming records, so reads stay mostly
+ * sequential within a few shards. A thread follows the position of the
+ * consumer and asks the kernel to read ahead the pages of the records
+ * about to be used
+ */
+class ShardDataset : public Dataset,
+                     public std::enable_shared_from_this<ShardDataset> {
+public:
+  ShardDataset(const DatasetConfig &config)
+    : config_(config)
+    , rnd_(config.seed ? config.seed : std::random_device{}())
+  {}
+
+  ~ShardDataset();
+
+  bool open(const std::vector<std::string> &paths);
+
+  size_t size() const override { return records_; }
+
+  const RecordFormat &format() const override { return format_; }
+
+  void beginEpoch(int batch_size, bool shuffle) override;
+
+  Record get(long batch, int n) override;
+
+  Loader loader() override;
+
+  MappedLoader mappedLoader() override;
+
+  BatchTensorAccessFn inputAccessor() override;
+
+  BatchTensorAccessFn labelAccessor() override;
+
+private:
+  Record record(uint32_t n) const;
+
+  void readahead();
+
+  const DatasetConfig config_;
+  std::mt19937 rnd_;
+
+  RecordFormat format_;
+  std::vector<std::unique_ptr<RecordShard>> shards_;
+  size_t records_ = 0;
+  size_t element_size_ = 0;
+
+  int batch_size_ = 1;
+  std::vector<uint32_t> order_;
+
+  // Positions in order_: Furthest requested and read ahead up to
+  std::atomic<size_t> requested_{0};
+  std::atomic<size_t> advised_{0};
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+
+bool
+ShardDataset::open(const std::vector<std::string> &paths)
+{
+  for(const auto &path : paths) {
+    RecordFormat f;
+    auto s = open_shard(path, &f);
+    if(!s)
+      return false;
+
+    if(shards_.empty()) {
+      format_ = f;
+    } else if(f.type != format_.type || f.data_type != format_.data_type ||
+              f.dims != format_.dims) {
+      fprintf(stderr, "%s: Record format differs from %s\n",
+              path.c_str(), shards_[0]->path.c_str());
+      return false;
+    }
+    s->first = records_;
+    records_ += s->records;
+    shards_.push_back(std::move(s));
+  }
+
+  if(records_ > UINT32_MAX) {
+    fprintf(stderr, "Too many records in dataset\n");
+    return false;
+  }
+
+  if(format_.type == RecordType::TENSOR)
+    element_size_ = format_.dims.elements() *
+      Tensor::DataTypeSize(format_.data_type);
+
+  beginEpoch(1, false);
+  thread_ = std::thread([this] { readahead(); });
+  return true;
+}
+
+
+ShardDataset::~ShardDataset()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+    cond_.notify_all();
+  }
+  if(thread_.joinable())
+    thread_.join();
+}
+
+
+void
+ShardDataset::beginEpoch(int batch_size, bool shuffle)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  batch_size_ = std::max(1, batch_size);
+  order_.clear();
+  order_.reserve(records_);
+
+  std::vector<size_t> shards(shards_.size());
+  for(size_t i = 0; i < shards.size(); i++)
+    shards[i] = i;
+
+  if(!shuffle || config_.shuffle_buffer == 0) {
+    for(uint32_t i = 0; i < records_; i++)
+      order_.push_back(i);
+  } else {
+    std::shuffle(shards.begin(), shards.end(), rnd_);
+
+    std::vector<uint32_t> buffer;
+    buffer.reserve(config_.shuffle_buffer);
+    for(size_t si : shards) {
+      const auto &s = *shards_[si];
+      for(uint64_t i = 0; i < s.records; i++) {
+        const uint32_t r = s.first + i;
+        if(buffer.size() < config_.shuffle_buffer) {
+          buffer.push_back(r);
+          continue;
+        }
+        // Emit a random buffered record, its place is taken by r
+        const size_t pick = rnd_() % buffer.size();
+        order_.push_back(buffer[pick]);
+        buffer[pick] = r;
+      }
+    }
+    std::shuffle(buffer.begin(), buffer.end(), rnd_);
+    order_.insert(order_.end(), buffer.begin(), buffer.end());
+  }
+
+  requested_ = 0;
+  advised_ = 0;
+  cond_.notify_all();
+}
+
+
+Record
+ShardDataset::record(uint32_t n) const
+{
+  // Shards are few, a linear search is fine
+  for(const auto &s : shards_) {
+    if(n >= s->first + s->records)
+      continue;
+    const auto &e = s->index[n - s->first];
+    return Record{(const uint8_t *)s->base + e.offset, e.size, e.label};
+  }
+  return Record{};
+}
+
+
+Record
+ShardDataset::get(long batch, int n)
+{
+  const size_t pos = (size_t)batch * batch_size_ + n;
+  if(batch < 0 || n < 0 || pos >= order_.size())
+    return Record{};
+
+  size_t r = requested_.load();
+  while(pos > r && !requested_.compare_exchange_weak(r, pos)) {}
+
+  // Let the readahead thread catch up once per batch
+  if(n == 0)
+    cond_.notify_one();
+  return record(order_[pos]);
+}
+
+
+void
+ShardDataset::readahead()
+{
+  const size_t page = sysconf(_SC_PAGESIZE);
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while(!stop_) {
+    size_t pos = std::max(advised_.load(), requested_.load());
+    size_t bytes = 0;
+
+    // Bytes already advised ahead of the consumer
+    for(size_t i = requested_.load(); i < pos && i < order_.size(); i++)
+      bytes += record(order_[i]).size;
+
+    // Pages of consecutive records are advised as one range
+    const uint8_t *start = NULL, *end = NULL;
+    auto flush = [&] {
+      if(start == NULL)
+        return;
+      const uintptr_t a = (uintptr_t)start & ~(uintptr_t)(page - 1);
+      madvise((void *)a, end - (const uint8_t *)a, MADV_WILLNEED);
+      start = end = NULL;
+    };
+
+    for(; pos < order_.size() && bytes < config_.readahead; pos++) {
+      const Record r = record(order_[pos]);
+      if(start != NULL && r.data >= end && r.data <= end + page) {
+        end = r.data + r.size;
+      } else {
+        flush();
+        start = r.data;
+        end = r.data + r.size;
+      }
+      bytes += r.size;
+    }
+    flush();
+    advised_ = pos;
+
+    cond_.wait_for(lock, std::chrono::milliseconds(50));
+  }
+}
+
+
+Loader
+ShardDataset::loader()
+{
+  auto self = shared_from_this();
+  return [self](long batch, int n, uint8_t *data, size_t capacity) -> size_t {
+    const Record r = self->get(batch, n);
+    if(r.size <= capacity)
+      memcpy(data, r.data, r.size);
+    return r.size;
+  };
+}
+
+
+MappedLoader
+ShardDataset::mappedLoader()
+{
+  auto self = shared_from_this();
+  return [self](long batch, int n, size_t *size) -> const uint8_t * {
+    const Record r = self->get(batch, n);
+    *size = r.size;
+    return r.data;
+  };
+}
+
+
+BatchTensorAccessFn
+ShardDataset::inputAccessor()
+{
+  auto self = shared_from_this();
+  auto zeroes = std::make_shared<std::vector<uint8_t>>(element_size_);
+  return [self, zeroes](TensorAccess &ta, long batch) {
+    for(int i = 0; i < self->batch_size_; i++) {
+      const Record r = self->get(batch, i);
+      if(r.data == NULL) {
+        // Padding of a partial final batch
+        ta.copyBytesFrom({i}, zeroes->data(), zeroes->size());
+        continue;
+      }
+      if(r.size != self->element_size_) {
+        fprintf(stderr, "Record of %zd bytes, expected %zd\n",
+                r.size, self->element_size_);
+        continue;
+      }
+      ta.copyBytesFrom({i}, r.data, r.size);
+    }
+  };
+}
+
+
+BatchTensorAccessFn
+ShardDataset::labelAccessor()
+{
+  auto self = shared_from_this();
+  return [self](TensorAccess &ta, long batch) {
+    for(int i = 0; i < self->batch_size_; i++)
+      ta.set({i, 0}, self->get(batch, i).label);
+  };
+}
+
+
+std::shared_ptr<Dataset>
+openDataset(const std::vector<std::string> &paths,
+            const DatasetConfig &config)
+{
+  if(paths.empty()) {
+    fprintf(stderr, "No record shards given\n");
+    return nullptr;
+  }
+
+  auto ds = std::make_shared<ShardDataset>(config);
+  if(!ds->open(paths))
+    return nullptr;
+  return ds;
+}
+
+}
@@ -26,6 +26,15 @@
 
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <omp.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 
 #include "context.h"
 
@@ -45,6 +54,7 @@ DnnlContext::DnnlContext()
 DnnlContext::~DnnlContext()
 {
   chkDNNL(dnnl_stream_wait(stream_));
+  primitive_cache_.clear();
   dnnl_stream_destroy(stream_);
   dnnl_engine_destroy(engine_);
 
@@ -72,108 +82,45 @@ registerDnnlContext(void)
 
 //------------------------------------------------------------------------
 
-class DnnlOperation;
-
-
-class DnnlProgram : public Program {
-public:
-
-  DnnlProgram(std::shared_ptr<DnnlContext> ctx,
-              TensorLayout tensor_layout,
-              int batch_size,
-              float learning_rate)
-    : ctx_(ctx)
-    , tensor_layout_(tensor_layout)
-    , batch_size_(batch_size)
-    , learning_rate_(learning_rate)
-    , debug_(false)
-    , workspace_(NULL)
-    , workspace_size_(0)
-    , workspace_requested_(0)
-  {
-  }
-
-  ~DnnlProgram()
-  {
-  }
-
-  std::shared_ptr<Tensor> resolveTensor(std::shared_ptr<Tensor> t) override;
-  void infer() override;
-  void train() override;
-  void print() const override;
-  void debug(bool) override;
-
-  const std::shared_ptr<DnnlContext> ctx_;
-  const TensorLayout tensor_layout_;
-  const int batch_size_;
-  const float learning_rate_;
-  bool debug_;
-
-  void *workspace_;
-  size_t workspace_size_;
-  size_t workspace_requested_;
-
-  std::vector<std::shared_ptr<DnnlOperation>> infer_operations_;
-
-
-  std::unordered_map<std::shared_ptr<Tensor>,
-                     std::shared_ptr<DnnlTensor>> tensors_;
-
-  dnnl_memory_desc_t dnnl_desc_from_tensor_any(std::shared_ptr<Tensor> t);
-
-  dnnl_memory_desc_t dnnl_desc_from_tensor(std::shared_ptr<Tensor> t);
-
-  std::shared_ptr<DnnlTensor> lower_tensor(std::shared_ptr<Tensor> src);
-
-  std::shared_ptr<DnnlTensor> lower_tensor(std::shared_ptr<Tensor> src,
-                                           const dnnl_memory_desc_t *desc);
-
-  std::shared_ptr<DnnlTensor> lower_tensor(std::shared_ptr<Tensor> src,
-                                           dnnl_primitive_desc_t desc,
-                                           dnnl_query_t what);
-
-  std::shared_ptr<DnnlTensor> lower_tensor_batch(std::shared_ptr<Tensor> src);
-
-
-  void infer(const std::shared_ptr<DnnlOperation> &op)
-  {
-    infer_operations_.push_back(op);
-
-    chkDNNL(dnnl_stream_wait(ctx_->stream_));
-
+DnnlPrimitiveCacheEntry::DnnlPrimitiveCacheEntry(dnnl_primitive_desc_t desc,
+                                                 const std::string &key)
+  : key_(key)
+  , desc_(desc)
+{
+  chkDNNL(dnnl_primitive_create(&prim_, desc_));
+}
 
-  }
 
-};
+DnnlPrimitiveCacheEntry::~DnnlPrimitiveCacheEntry()
+{
+  chkDNNL(dnnl_primitive_destroy(prim_));
+  chkDNNL(dnnl_primitive_desc_destroy(desc_));
+}
 
-//------------------------------------------------------------------------
 
-static dnnl_data_type_t
-dnnlDataType_from_dataType(Tensor::DataType data_type)
-{
-  switch(data_type) {
-  case Tensor::DataType::FLOAT:
-    return dnnl_f32;
-  case Tensor::DataType::HALF:
-    return dnnl_f16;
-  case Tensor::DataType::U8:
-    return dnnl_u8;
-  case Tensor::DataType::I32:
-    return dnnl_s32;
-  default:
-    fprintf(stderr, "Unsupported data_type %d for dnnl tensor\n",
-            (int)data_type);
-    abort();
+/**
+ * Primitives are immutable once created so programs of the same
+ * context (eg. one per batch size) share them. Creating a primitive
+ * typically means JIT:ing its kernel, so this makes creating further
+ * programs for the same network cheap
+ */
+std::shared_ptr<DnnlPrimitiveCacheEntry>
+DnnlContext::findPrimitive(const std::string &key,
+                           const std::function<dnnl_primitive_desc_t(void)> &create)
+{
+  std::unique_lock<std::mutex> lock(primitive_cache_mutex_);
+  auto it = primitive_cache_.find(key);
+  if(it != primitive_cache_.end()) {
+    primitive_cache_hits_++;
+    return it->second;
   }
+  auto e = std::make_shared<DnnlPrimitiveCacheEntry>(create(), key);
+  primitive_cache_[key] = e;
+  return e;
 }
 
 
-class DnnlOperation {
-public:
-  virtual ~DnnlOperation() {}
-  virtual void exec(DnnlProgram &p) = 0;
-  virtual void print() const = 0;
-};
+//------------------------------------------------------------------------
 
 
 std::shared_ptr<Tensor>
@@ -191,27 +138,86 @@ DnnlProgram::resolveTensor(std::shared_ptr<Tensor> src)
 
 
 void
-DnnlProgram::infer()
+DnnlProgram::infer(const std::shared_ptr<DnnlOperation> &op)
 {
-  for(const auto &op : infer_operations_) {
-    op->exec(*this);
-  }
+  infer_operations_.push_back(op);
+}
+
+void
+DnnlProgram::train(const std::shared_ptr<DnnlOperation> &op)
+{
+  train_operations_.push_back(op);
 }
 
 void
-DnnlProgram::train()
+DnnlProgram::bwd(const std::shared_ptr<DnnlOperation> &op)
 {
-  fprintf(stderr, "%s not implemented\n", __FUNCTION__);
-  usleep(100000);
+  bwd_operations_.insert(bwd_operations_.begin(), op);
+}
+
+void
+DnnlProgram::upd(std::shared_ptr<DnnlTensor> weights,
+                 std::shared_ptr<DnnlTensor> gradient)
+{
+  params_.push_back(std::make_pair(weights, gradient));
+}
+
+
+Tensors
+DnnlProgram::optimizerState()
+{
+  Tensors r;
+  for(const auto &it : optimizer_state_)
+    r[it.first] = it.second;
+  return r;
+}
+
+
+void
+DnnlProgram::restoreOptimizerState(const Graph &g)
+{
+  if(g.optimizer_state_.empty())
+    return;
+
+  size_t restored = 0;
+  for(const auto &it : optimizer_state_) {
+    auto src = g.optimizer_state_.find(it.first);
+    if(src == g.optimizer_state_.end())
+      continue;
+    if(src->second->elements_ != it.second->elements_) {
+      fprintf(stderr, "Optimizer state %s has wrong size, ignored\n",
+              it.first.c_str());
+      continue;
+    }
+    it.second->copyFromLocked(*src->second);
+    restored++;
+  }
+  printf("Restored %zd of %zd optimizer tensors\n", restored,
+         optimizer_state_.size());
 }
 
 
 void
 DnnlProgram::print() const
 {
+  printf("Primitive cache: %zd entries, %zd hits\n",
+         ctx_->primitive_cache_.size(), ctx_->primitive_cache_hits_);
+
+  printf("\n\nInference:\n");
   for(const auto &op : infer_operations_) {
     op->print();
   }
+
+  printf("\n\nTraining:\n");
+  for(const auto &op : train_operations_) {
+    op->print();
+  }
+  for(const auto &op : bwd_operations_) {
+    op->print();
+  }
+  for(const auto &op : upd_operations_) {
+    op->print();
+  }
 }
 
 void
@@ -347,10 +353,6 @@ DnnlProgram::dnnl_desc_from_tensor_any(std::shared_ptr<Tensor> t)
   dnnl_memory_desc_t desc;
   dnnl_dims_t dims;
 
-  auto it = tensors_.find(t);
-  if(it != tensors_.end()) {
-    return it->second->desc_;
-  }
   assert(t->dims_.size() <= DNNL_MAX_NDIMS);
 
   for(size_t i = 0; i < t->dims_.size(); i++)
@@ -387,13 +389,16 @@ DnnlProgram::dnnl_desc_from_tensor(std::shared_ptr<Tensor> t)
 }
 
 
-
-
-
-
-//------------------------------------------------------------------------
-
-
+// Same dimensions and data type as t, layout chosen by the primitive
+static dnnl_memory_desc_t
+any_desc(const DnnlTensor &t)
+{
+  dnnl_memory_desc_t desc;
+  chkDNNL(dnnl_memory_desc_init_by_tag(&desc, t.desc_.ndims, t.desc_.dims,
+                                       t.desc_.data_type,
+                                       dnnl_format_tag_any));
+  return desc;
+}
 
 
 //------------------------------------------------------------------------
@@ -401,21 +406,23 @@ DnnlProgram::dnnl_desc_from_tensor(std::shared_ptr<Tensor> t)
 
 struct DnnlPrimitive : public DnnlOperation {
 
-  DnnlPrimitive(dnnl_primitive_desc_t desc,
+  DnnlPrimitive(std::shared_ptr<DnnlPrimitiveCacheEntry> cached,
                 const std::vector<dnnl_exec_arg_t> &args)
-    : desc_(desc)
+    : cached_(cached)
+    , desc_(cached->desc_)
     , args_(args)
   {
-    chkDNNL(dnnl_primitive_create(&prim_, desc_));
   }
 
   ~DnnlPrimitive()
   {
-    chkDNNL(dnnl_primitive_destroy(prim_));
-    chkDNNL(dnnl_primitive_desc_destroy(desc_));
+    for(auto m : memories_)
+      chkDNNL(dnnl_memory_destroy(m));
   }
 
   void print() const {
+    for(const auto &op : pre_)
+      op->print();
 
     dnnl_primitive_kind_t prim_kind = dnnl_undefined_primitive;
     dnnl_prop_kind_t prop_kind = dnnl_prop_kind_undef;
@@ -427,17 +434,246 @@ struct DnnlPrimitive : public DnnlOperation {
            dnnl_prim_kind2str(prim_kind),
            dnnl_prop_kind2str(prop_kind),
            impl_info);
+
+    for(const auto &op : post_)
+      op->print();
   }
 
 
   void exec(DnnlProgram &p) {
-    chkDNNL(dnnl_primitive_execute(prim_, p.ctx_->stream_,
+    for(const auto &op : pre_)
+      op->exec(p);
+    chkDNNL(dnnl_primitive_execute(cached_->prim_, p.ctx_->stream_,
                                    args_.size(), &args_[0]));
+    for(const auto &op : post_)
+      op->exec(p);
+  }
+
+  dnnl_memory_t arg(int arg) const {
+    for(const auto &a : args_) {
+      if(a.arg == arg)
+        return a.memory;
+    }
+    return NULL;
+  }
+
+  const std::shared_ptr<DnnlPrimitiveCacheEntry> cached_;
+  const dnnl_primitive_desc_t desc_;
+  std::vector<dnnl_exec_arg_t> args_;
+
+  // Reorders into (pre) and out of (post) the layouts the primitive
+  // wants, see DnnlBinder
+  DnnlOperations pre_;
+  DnnlOperations post_;
+
+  // Workspaces, temporaries and such only referred to by args_
+  std::vector<std::shared_ptr<DnnlTensor>> owned_;
+  std::vector<dnnl_memory_t> memories_;
+};
+
+
+// Operations executed in order, used for the backward pass of a node
+struct DnnlSequence : public DnnlOperation {
+
+  void add(const std::shared_ptr<DnnlOperation> &op) {
+    ops_.push_back(op);
+  }
+
+  void print() const {
+    for(const auto &op : ops_)
+      op->print();
+  }
+
+  void exec(DnnlProgram &p) {
+    for(const auto &op : ops_)
+      op->exec(p);
+  }
+
+  DnnlOperations ops_;
+};
+
+
+template<typename T> static void
+key_append(std::string &key, const T &v)
+{
+  key.append((const char *)&v, sizeof(T));
+}
+
+
+/**
+ * Operation descriptors are plain structs (zeroed by their init
+ * functions) so their bytes identify the primitive. Backward
+ * primitives also depend on the forward primitive given as hint
+ */
+template<typename T> static std::shared_ptr<DnnlPrimitiveCacheEntry>
+make_pd(DnnlProgram &p, const T &op_desc,
+        const std::shared_ptr<DnnlPrimitive> &hint = nullptr)
+{
+  std::string key("op");
+  key_append(key, op_desc);
+  if(hint)
+    key += hint->cached_->key_;
+
+  return p.ctx_->findPrimitive(key, [&] {
+      dnnl_primitive_desc_t pd;
+      chkDNNL(dnnl_primitive_desc_create(&pd, &op_desc, NULL,
+                                         p.ctx_->engine_,
+                                         hint ? hint->desc_ : NULL));
+      return pd;
+    });
+}
+
+
+// dst = src * scale + dst * beta
+static std::shared_ptr<DnnlPrimitive>
+make_reorder(DnnlProgram &p,
+             const dnnl_memory_desc_t *src_desc, dnnl_memory_t src,
+             const dnnl_memory_desc_t *dst_desc, dnnl_memory_t dst,
+             float scale = 1.0f, float beta = 0.0f)
+{
+  std::string key("reorder");
+  key_append(key, *src_desc);
+  key_append(key, *dst_desc);
+  key_append(key, scale);
+  key_append(key, beta);
+
+  auto cached = p.ctx_->findPrimitive(key, [&] {
+      dnnl_primitive_attr_t attr = NULL;
+      if(scale != 1.0f || beta) {
+        chkDNNL(dnnl_primitive_attr_create(&attr));
+        if(scale != 1.0f)
+          chkDNNL(dnnl_primitive_attr_set_output_scales(attr, 1, 0, &scale));
+        if(beta) {
+          dnnl_post_ops_t po;
+          chkDNNL(dnnl_post_ops_create(&po));
+          chkDNNL(dnnl_post_ops_append_sum(po, beta));
+          chkDNNL(dnnl_primitive_attr_set_post_ops(attr, po));
+          chkDNNL(dnnl_post_ops_destroy(po));
+        }
+      }
+
+      dnnl_primitive_desc_t pd;
+      chkDNNL(dnnl_reorder_primitive_desc_create(&pd,
+                                                 src_desc, p.ctx_->engine_,
+                                                 dst_desc, p.ctx_->engine_,
+                                                 attr));
+      if(attr)
+        chkDNNL(dnnl_primitive_attr_destroy(attr));
+      return pd;
+    });
+
+  return std::make_shared<DnnlPrimitive>(cached, std::vector<dnnl_exec_arg_t>{
+      {DNNL_ARG_SRC, src},
+      {DNNL_ARG_DST, dst}});
+}
+
+
+static std::shared_ptr<DnnlPrimitive>
+make_reorder(DnnlProgram &p,
+             const dnnl_memory_desc_t *src_desc, dnnl_memory_t src,
+             const DnnlTensor &dst,
+             float scale = 1.0f, float beta = 0.0f)
+{
+  return make_reorder(p, src_desc, src, &dst.desc_, dst.memory_,
+                      scale, beta);
+}
+
+
+/**
+ * Binds tensors to the arguments of a primitive. If the primitive
+ * wants another layout than the one the tensor has we go through a
+ * temporary that is reordered before (inputs) or after (outputs) the
+ * primitive. Outputs with beta = 1 (see compute_dx_beta()) are always
+ * written to a temporary which is then added to the tensor.
+ *
+ * Graph tensors that are not lowered yet get the layout the primitive
+ * prefers. Activations thus stay in blocked formats between
+ * consecutive primitives and reorders are only needed at the edges of
+ * the graph (batch accessors) and around operations that are
+ * restricted to plain layouts
+ */
+struct DnnlBinder {
+
+  DnnlBinder(DnnlProgram &p, std::shared_ptr<DnnlPrimitiveCacheEntry> pd)
+    : p_(p)
+    , pd_(pd)
+  {}
+
+  const dnnl_memory_desc_t *desc(int arg) const {
+    return dnnl_primitive_desc_query_md(pd_->desc_, dnnl_query_exec_arg_md,
+                                        arg);
+  }
+
+  void arg(int arg, dnnl_memory_t memory) {
+    args_.push_back({arg, memory});
+  }
+
+  void input(int arg, const std::shared_ptr<DnnlTensor> &t) {
+    auto d = desc(arg);
+    if(dnnl_memory_desc_equal(d, &t->desc_)) {
+      args_.push_back({arg, t->memory_});
+      return;
+    }
+    auto tmp = std::make_shared<DnnlTensor>(d, p_.ctx_,
+                                            t->namePostfix("reorder"));
+    pre_.push_back(make_reorder(p_, &t->desc_, t->memory_, *tmp));
+    temporaries_.push_back(tmp);
+    args_.push_back({arg, tmp->memory_});
+  }
+
+  void output(int arg, const std::shared_ptr<DnnlTensor> &t,
+              float beta = 0) {
+    auto d = desc(arg);
+    if(!beta && dnnl_memory_desc_equal(d, &t->desc_)) {
+      args_.push_back({arg, t->memory_});
+      return;
+    }
+    auto tmp = std::make_shared<DnnlTensor>(d, p_.ctx_,
+                                            t->namePostfix("reorder"));
+    post_.push_back(make_reorder(p_, &tmp->desc_, tmp->memory_, *t,
+                                 1.0f, beta));
+    temporaries_.push_back(tmp);
+    args_.push_back({arg, tmp->memory_});
+  }
+
+  std::shared_ptr<DnnlTensor> lower_input(int arg,
+                                          std::shared_ptr<Tensor> src) {
+    auto it = p_.tensors_.find(src);
+    if(it != p_.tensors_.end()) {
+      input(arg, it->second);
+      return it->second;
+    }
+    auto dt = p_.lower_tensor(src, desc(arg));
+    args_.push_back({arg, dt->memory_});
+    return dt;
+  }
+
+  std::shared_ptr<DnnlTensor> lower_output(int arg,
+                                           std::shared_ptr<Tensor> src) {
+    auto it = p_.tensors_.find(src);
+    if(it != p_.tensors_.end()) {
+      output(arg, it->second);
+      return it->second;
+    }
+    auto dt = p_.lower_tensor(src, desc(arg));
+    args_.push_back({arg, dt->memory_});
+    return dt;
+  }
+
+  std::shared_ptr<DnnlPrimitive> make() {
+    auto prim = std::make_shared<DnnlPrimitive>(pd_, args_);
+    prim->pre_ = pre_;
+    prim->post_ = post_;
+    prim->owned_ = temporaries_;
+    return prim;
   }
 
-  dnnl_primitive_desc_t desc_;
-  dnnl_primitive_t prim_;
+  DnnlProgram &p_;
+  const std::shared_ptr<DnnlPrimitiveCacheEntry> pd_;
   std::vector<dnnl_exec_arg_t> args_;
+  DnnlOperations pre_;
+  DnnlOperations post_;
+  std::vector<std::shared_ptr<DnnlTensor>> temporaries_;
 };
 
 
@@ -454,9 +690,23 @@ print_desc(const char *prefix, const dnnl_memory_desc_t *desc)
 
 //------------------------------------------------------------------------
 
+struct ConvParams {
+  dnnl_dims_t strides;
+  dnnl_dims_t padding;
 
-static void
-conv_infer(DnnlProgram &p, const Node &n)
+  ConvParams(const Node &n) {
+    const int pad = n.attributes_.get("pad", 0);
+    const int stride = n.attributes_.get("stride", 1);
+    for(int i = 0; i < 3; i++) {
+      strides[i] = stride;
+      padding[i] = pad;
+    }
+  }
+};
+
+
+static std::shared_ptr<DnnlPrimitive>
+conv_fwd(DnnlProgram &p, const Node &n, dnnl_prop_kind_t prop)
 {
   auto xh = n.inputs_.get("x");
   auto wh = n.inputs_.get("w");
@@ -464,7 +714,11 @@ conv_infer(DnnlProgram &p, const Node &n)
   auto yh = n.outputs_.get("y");
 
   auto x_desc = p.dnnl_desc_from_tensor_any(xh);
-  auto w_desc = dnnl_desc_from_tensor(wh, 0, dnnl_format_tag_any);
+
+  // Weights shared with another program keep the layout they have
+  auto wt = p.tensors_.find(wh);
+  auto w_desc = wt != p.tensors_.end() ? wt->second->desc_ :
+    dnnl_desc_from_tensor(wh, 0, dnnl_format_tag_any);
 
   dnnl_memory_desc_t *b_desc = NULL, b_desc0;
   if(bh) {
@@ -473,167 +727,323 @@ conv_infer(DnnlProgram &p, const Node &n)
   }
   auto y_desc = p.dnnl_desc_from_tensor_any(yh);
 
-  const int pad = n.attributes_.get("pad", 0);
-  const int stride = n.attributes_.get("stride", 1);
+  const ConvParams cp(n);
 
-  dnnl_dims_t strides = {stride, stride, stride};
-  dnnl_dims_t padding = {pad,    pad,    pad};
+  // Backward primitives only come in the direct flavour
+  const dnnl_alg_kind_t alg = prop == dnnl_forward_inference ?
+    dnnl_convolution_auto : dnnl_convolution_direct;
 
   dnnl_convolution_desc_t conv_desc;
-  chkDNNL(dnnl_convolution_forward_desc_init(&conv_desc,
-                                             dnnl_forward_inference,
-                                             dnnl_convolution_auto, &x_desc,
-                                             &w_desc, b_desc, &y_desc,
-                                             strides, padding, NULL));
+  chkDNNL(dnnl_convolution_forward_desc_init(&conv_desc, prop, alg,
+                                             &x_desc, &w_desc, b_desc,
+                                             &y_desc, cp.strides,
+                                             cp.padding, NULL));
+
+  DnnlBinder b(p, make_pd(p, conv_desc));
+  b.lower_input(DNNL_ARG_SRC, xh);
+  b.lower_input(DNNL_ARG_WEIGHTS, wh);
+  if(bh)
+    b.arg(DNNL_ARG_BIAS, p.lower_tensor(bh, b_desc)->memory_);
+  b.lower_output(DNNL_ARG_DST, yh);
+  return b.make();
+}
+
+
+static void
+conv_infer(DnnlProgram &p, const Node &n)
+{
+  p.infer(conv_fwd(p, n, dnnl_forward_inference));
+}
 
-  dnnl_primitive_desc_t pd;
-  chkDNNL(dnnl_primitive_desc_create(&pd, &conv_desc, NULL,
-                                     p.ctx_->engine_, NULL));
 
-  auto x = p.lower_tensor(xh, pd, dnnl_query_src_md);
-  auto w = p.lower_tensor(wh, pd, dnnl_query_weights_md);
-  auto y = p.lower_tensor(yh, pd, dnnl_query_dst_md);
-  auto b = bh ? p.lower_tensor(bh, b_desc) : NULL;
+static void
+conv_train(DnnlProgram &p, const Node &n)
+{
+  auto f = conv_fwd(p, n, dnnl_forward_training);
+  p.train(f);
+
+  auto x = p.lower_tensor(n.inputs_.get("x"));
+  auto w = p.lower_tensor(n.inputs_.get("w"));
+  auto b = p.lower_tensor(n.inputs_.get("b"));
+  auto y = p.lower_tensor(n.outputs_.get("y"));
+  auto dy = y->makeGrad();
+  const float dx_beta = n.attributes_.get("dx.beta", 0.0f);
+  const ConvParams cp(n);
+
+  auto seq = std::make_shared<DnnlSequence>();
+
+  auto x_any = any_desc(*x);
+  auto w_any = any_desc(*w);
+  auto y_any = any_desc(*y);
+
+  // No gradient for x when it's the input of the network
+  if(x->grad_) {
+    dnnl_convolution_desc_t desc;
+    chkDNNL(dnnl_convolution_backward_data_desc_init(&desc,
+                                                     dnnl_convolution_direct,
+                                                     &x_any, &w_any, &y_any,
+                                                     cp.strides, cp.padding,
+                                                     NULL));
+    DnnlBinder bd(p, make_pd(p, desc, f));
+    bd.input(DNNL_ARG_DIFF_DST, dy);
+    bd.input(DNNL_ARG_WEIGHTS, w);
+    bd.output(DNNL_ARG_DIFF_SRC, x->grad_, dx_beta);
+    seq->add(bd.make());
+  }
 
-  std::vector<dnnl_exec_arg_t> args;
-  args.push_back({DNNL_ARG_SRC,     x->memory_});
-  args.push_back({DNNL_ARG_WEIGHTS, w->memory_});
+  auto dw = w->makeGrad();
+  auto db = b ? b->makeGrad() : nullptr;
+  auto b_any = b ? any_desc(*b) : dnnl_memory_desc_t{};
+
+  dnnl_convolution_desc_t desc;
+  chkDNNL(dnnl_convolution_backward_weights_desc_init(&desc,
+                                                      dnnl_convolution_direct,
+                                                      &x_any, &w_any,
+                                                      b ? &b_any : NULL,
+                                                      &y_any,
+                                                      cp.strides, cp.padding,
+                                                      NULL));
+  DnnlBinder bw(p, make_pd(p, desc, f));
+  bw.input(DNNL_ARG_SRC, x);
+  bw.input(DNNL_ARG_DIFF_DST, dy);
+  bw.output(DNNL_ARG_DIFF_WEIGHTS, dw);
+  if(db)
+    bw.output(DNNL_ARG_DIFF_BIAS, db);
+  seq->add(bw.make());
+
+  p.bwd(seq);
+  p.upd(w, dw);
   if(b)
-    args.push_back({DNNL_ARG_BIAS,    b->memory_});
-  args.push_back({DNNL_ARG_DST,     y->memory_});
-
-  p.infer(std::make_shared<DnnlPrimitive>(pd, args));
+    p.upd(b, db);
 }
 
 //------------------------------------------------------------------------
 
 
-static void
-relu_infer(DnnlProgram &p, const Node &n)
+static std::shared_ptr<DnnlPrimitive>
+relu_fwd(DnnlProgram &p, const Node &n, dnnl_prop_kind_t prop)
 {
   auto xh = n.inputs_.get("x");
   auto yh = n.outputs_.get("y");
 
   auto x = p.lower_tensor_batch(xh);
-  auto y = p.lower_tensor(yh, &x->desc_);
 
   dnnl_eltwise_desc_t relu_desc;
-  chkDNNL(dnnl_eltwise_forward_desc_init(&relu_desc, dnnl_forward,
+  chkDNNL(dnnl_eltwise_forward_desc_init(&relu_desc, prop,
                                          dnnl_eltwise_relu, &x->desc_,
                                          0.0f, 0));
 
-  dnnl_primitive_desc_t pd;
-  chkDNNL(dnnl_primitive_desc_create(&pd, &relu_desc, NULL,
-                                     p.ctx_->engine_, NULL));
-
+  DnnlBinder b(p, make_pd(p, relu_desc));
+  b.arg(DNNL_ARG_SRC, x->memory_);
+  b.lower_output(DNNL_ARG_DST, yh);
+  return b.make();
+}
 
-  std::vector<dnnl_exec_arg_t> args;
-  args.push_back({DNNL_ARG_SRC,     x->memory_});
-  args.push_back({DNNL_ARG_DST,     y->memory_});
+static void
+relu_infer(DnnlProgram &p, const Node &n)
+{
+  p.infer(relu_fwd(p, n, dnnl_forward_inference));
+}
 
-  p.infer(std::make_shared<DnnlPrimitive>(pd, args));
+static void
+relu_train(DnnlProgram &p, const Node &n)
+{
+  auto f = relu_fwd(p, n, dnnl_forward_training);
+  p.train(f);
+
+  auto x = p.lower_tensor(n.inputs_.get("x"));
+  auto y = p.lower_tensor(n.outputs_.get("y"));
+  auto dy = y->makeGrad();
+  auto dx = x->makeGrad();
+
+  dnnl_eltwise_desc_t desc;
+  chkDNNL(dnnl_eltwise_backward_desc_init(&desc, dnnl_eltwise_relu,
+                                          &dy->desc_, &x->desc_,
+                                          0.0f, 0));
+
+  auto seq = std::make_shared<DnnlSequence>();
+  DnnlBinder b(p, make_pd(p, desc, f));
+  b.input(DNNL_ARG_SRC, x);
+  b.input(DNNL_ARG_DIFF_DST, dy);
+  b.output(DNNL_ARG_DIFF_SRC, dx, n.attributes_.get("dx.beta", 0.0f));
+  seq->add(b.make());
+  p.bwd(seq);
 }
 
 //------------------------------------------------------------------------
 
-static void
-pooling_infer(DnnlProgram &p, const Node &n, dnnl_alg_kind_t mode)
+struct PoolParams {
+  dnnl_dims_t kernel;
+  dnnl_dims_t strides;
+  dnnl_dims_t padding;
+
+  PoolParams(const Node &n, const DnnlTensor &x) {
+    int size;
+    if(n.attributes_.get("global", false)) {
+      size = x.dims_[2];
+    } else {
+      size = n.attributes_.get("size", 1);
+    }
+    const int pad    = n.attributes_.get("pad", 0);
+    const int stride = n.attributes_.get("stride", 1);
+    for(int i = 0; i < 3; i++) {
+      kernel[i] = size;
+      strides[i] = stride;
+      padding[i] = pad;
+    }
+  }
+};
+
+
+static std::shared_ptr<DnnlPrimitive>
+pooling_fwd(DnnlProgram &p, const Node &n, dnnl_alg_kind_t mode,
+            dnnl_prop_kind_t prop)
 {
   auto xh = n.inputs_.get("x");
   auto yh = n.outputs_.get("y");
   auto x = p.lower_tensor_batch(xh);
   auto y_desc = p.dnnl_desc_from_tensor_any(yh);
 
-  int size;
-  if(n.attributes_.get("global", false)) {
-    size = x->dims_[2];
-  } else {
-    size = n.attributes_.get("size", 1);
-  }
-  const int pad    = n.attributes_.get("pad", 0);
-  const int stride = n.attributes_.get("stride", 1);
-
-  dnnl_dims_t kernel  = {size,   size,   size};
-  dnnl_dims_t strides = {stride, stride, stride};
-  dnnl_dims_t padding = {pad,    pad,    pad};
+  const PoolParams pp(n, *x);
 
   dnnl_pooling_desc_t desc;
-  chkDNNL(dnnl_pooling_forward_desc_init(&desc, dnnl_forward_inference,
+  chkDNNL(dnnl_pooling_forward_desc_init(&desc, prop,
                                          mode,
                                          &x->desc_, &y_desc,
-                                         strides, kernel, padding, NULL));
+                                         pp.strides, pp.kernel, pp.padding,
+                                         NULL));
+
+  DnnlBinder b(p, make_pd(p, desc));
+  b.arg(DNNL_ARG_SRC, x->memory_);
+  b.lower_output(DNNL_ARG_DST, yh);
+
+  // Max pooling remembers where the maximum was for the backward pass
+  auto ws_desc = dnnl_primitive_desc_query_md(b.pd_->desc_,
+                                              dnnl_query_workspace_md, 0);
+  if(ws_desc != NULL && ws_desc->ndims) {
+    auto ws = std::make_shared<DnnlTensor>(ws_desc, p.ctx_);
+    b.arg(DNNL_ARG_WORKSPACE, ws->memory_);
+    b.temporaries_.push_back(ws);
+  }
+  return b.make();
+}
 
-  dnnl_primitive_desc_t pd;
-  chkDNNL(dnnl_primitive_desc_create(&pd, &desc, NULL,
-                                     p.ctx_->engine_, NULL));
 
-  auto y = p.lower_tensor(yh, pd, dnnl_query_dst_md);
+static void
+pooling_train(DnnlProgram &p, const Node &n, dnnl_alg_kind_t mode)
+{
+  auto f = pooling_fwd(p, n, mode, dnnl_forward_training);
+  p.train(f);
 
-  std::vector<dnnl_exec_arg_t> args;
-  args.push_back({DNNL_ARG_SRC,     x->memory_});
-  args.push_back({DNNL_ARG_DST,     y->memory_});
+  auto x = p.lower_tensor(n.inputs_.get("x"));
+  auto y = p.lower_tensor(n.outputs_.get("y"));
+  auto dy = y->makeGrad();
+  auto dx = x->makeGrad();
+  const PoolParams pp(n, *x);
 
-  p.infer(std::make_shared<DnnlPrimitive>(pd, args));
+  auto x_any = any_desc(*x);
+  auto y_any = any_desc(*y);
+
+  dnnl_pooling_desc_t desc;
+  chkDNNL(dnnl_pooling_backward_desc_init(&desc, mode, &x_any, &y_any,
+                                          pp.strides, pp.kernel, pp.padding,
+                                          NULL));
+
+  auto seq = std::make_shared<DnnlSequence>();
+  DnnlBinder b(p, make_pd(p, desc, f));
+  b.input(DNNL_ARG_DIFF_DST, dy);
+  b.output(DNNL_ARG_DIFF_SRC, dx, n.attributes_.get("dx.beta", 0.0f));
+  auto ws = f->arg(DNNL_ARG_WORKSPACE);
+  if(ws)
+    b.arg(DNNL_ARG_WORKSPACE, ws);
+  seq->add(b.make());
+  p.bwd(seq);
 }
 
 static void
 maxpool_infer(DnnlProgram &p, const Node &n)
 {
-  pooling_infer(p, n, dnnl_pooling_max);
+  p.infer(pooling_fwd(p, n, dnnl_pooling_max, dnnl_forward_inference));
+}
+
+static void
+maxpool_train(DnnlProgram &p, const Node &n)
+{
+  pooling_train(p, n, dnnl_pooling_max);
 }
 
 static void
 avgpool_infer(DnnlProgram &p, const Node &n)
 {
-  pooling_infer(p, n, dnnl_pooling_avg_include_padding);
+  p.infer(pooling_fwd(p, n, dnnl_pooling_avg_include_padding,
+                      dnnl_forward_inference));
+}
+
+static void
+avgpool_train(DnnlProgram &p, const Node &n)
+{
+  pooling_train(p, n, dnnl_pooling_avg_include_padding);
 }
 
 
 //------------------------------------------------------------------------
 
-static void
-reshape_infer(DnnlProgram &p, const Node &n)
+static dnnl_memory_desc_t
+reshape_desc(const DnnlTensor &x)
 {
-  auto xh = n.inputs_.get("x");
-  auto yh = n.outputs_.get("y");
+  dnnl_memory_desc_t desc;
 
-  auto x = p.lower_tensor_batch(xh);
-  auto y = p.lower_tensor_batch(yh);
+  dnnl_format_tag_t ft = (dnnl_format_tag_t)(dnnl_a + x.dims_.size() - 1);
 
-  dnnl_memory_desc_t dst_desc;
+  chkDNNL(dnnl_memory_desc_init_by_tag(&desc, x.dims_.size(),
+                                       &x.dims_.i64()[0],
+                                       dnnlDataType_from_dataType(x.data_type_),
+                                       ft));
+  return desc;
+}
 
-  dnnl_format_tag_t ft = (dnnl_format_tag_t)(dnnl_a + x->dims_.size() - 1);
 
-  chkDNNL(dnnl_memory_desc_init_by_tag(&dst_desc, x->dims_.size(),
-                                       &x->dims_.i64()[0],
-                                       dnnlDataType_from_dataType(x->data_type_),
-                                       ft));
+// y has the elements of x in row-major order
+static std::shared_ptr<DnnlPrimitive>
+reshape_fwd(DnnlProgram &p, const Node &n)
+{
+  auto x = p.lower_tensor_batch(n.inputs_.get("x"));
+  auto y = p.lower_tensor_batch(n.outputs_.get("y"));
 
-  dnnl_primitive_desc_t pd;
-  chkDNNL(dnnl_reorder_primitive_desc_create(&pd,
-                                             &x->desc_, p.ctx_->engine_,
-                                             &dst_desc, p.ctx_->engine_,
-                                             NULL));
+  const auto dst_desc = reshape_desc(*x);
+  return make_reorder(p, &x->desc_, x->memory_, &dst_desc, y->memory_);
+}
 
 
-  std::vector<dnnl_exec_arg_t> args;
-  args.push_back({DNNL_ARG_SRC,     x->memory_});
-  args.push_back({DNNL_ARG_DST,     y->memory_});
+static void
+reshape_infer(DnnlProgram &p, const Node &n)
+{
+  p.infer(reshape_fwd(p, n));
+}
 
-  p.infer(std::make_shared<DnnlPrimitive>(pd, args));
+
+static void
+reshape_train(DnnlProgram &p, const Node &n)
+{
+  p.train(reshape_fwd(p, n));
+
+  auto x = p.lower_tensor(n.inputs_.get("x"));
+  auto y = p.lower_tensor(n.outputs_.get("y"));
+  auto dy = y->makeGrad();
+  auto dx = x->makeGrad();
+
+  // dy holds the gradient in row-major order of x's dimensions
+  const auto src_desc = reshape_desc(*x);
+  p.bwd(make_reorder(p, &src_desc, dy->memory_, *dx, 1.0f,
+                     n.attributes_.get("dx.beta", 0.0f)));
 }
 
 //------------------------------------------------------------------------
 
-
-static void
-fc_infer(DnnlProgram &p, const Node &n)
+static dnnl_memory_desc_t
+fc_weights_desc(const Node &n)
 {
-  auto xh = n.inputs_.get("x");
   auto wh = n.inputs_.get("w");
-  auto bh = n.inputs_.get("b");
-  auto yh = n.outputs_.get("y");
-
   bool transW = n.attributes_.get("transW", false);
 
   dnnl_memory_desc_t w_desc;
@@ -651,6 +1061,19 @@ fc_infer(DnnlProgram &p, const Node &n)
                                          dnnlDataType_from_dataType(wh->data_type_),
                                          dnnl_ba));
   }
+  return w_desc;
+}
+
+
+static std::shared_ptr<DnnlPrimitive>
+fc_fwd(DnnlProgram &p, const Node &n, dnnl_prop_kind_t prop)
+{
+  auto xh = n.inputs_.get("x");
+  auto wh = n.inputs_.get("w");
+  auto bh = n.inputs_.get("b");
+  auto yh = n.outputs_.get("y");
+
+  const auto w_desc = fc_weights_desc(n);
 
   dnnl_memory_desc_t *b_desc = NULL, b_desc0;
 
@@ -671,16 +1094,12 @@ fc_infer(DnnlProgram &p, const Node &n)
 
   dnnl_inner_product_desc_t desc;
   chkDNNL(dnnl_inner_product_forward_desc_init(&desc,
-                                               dnnl_forward_inference,
+                                               prop,
                                                &x->desc_,
                                                &w_desc,
                                                b_desc,
                                                &y->desc_));
 
-  dnnl_primitive_desc_t pd;
-  chkDNNL(dnnl_primitive_desc_create(&pd, &desc, NULL,
-                                     p.ctx_->engine_, NULL));
-
   std::vector<dnnl_exec_arg_t> args;
   args.push_back({DNNL_ARG_SRC,     x->memory_});
   args.push_back({DNNL_ARG_WEIGHTS, w->memory_});
@@ -688,13 +1107,72 @@ fc_infer(DnnlProgram &p, const Node &n)
   if(b)
     args.push_back({DNNL_ARG_BIAS,    b->memory_});
 
-  p.infer(std::make_shared<DnnlPrimitive>(pd, args));
+  return std::make_shared<DnnlPrimitive>(make_pd(p, desc), args);
 }
 
-//------------------------------------------------------------------------
 
 static void
-concat_infer(DnnlProgram &p, const Node &n)
+fc_infer(DnnlProgram &p, const Node &n)
+{
+  p.infer(fc_fwd(p, n, dnnl_forward_inference));
+}
+
+
+// Weights are bound as is, w_desc describes the same memory as w (but
+// possibly transposed)
+static void
+fc_train(DnnlProgram &p, const Node &n)
+{
+  auto f = fc_fwd(p, n, dnnl_forward_training);
+  p.train(f);
+
+  auto x = p.lower_tensor(n.inputs_.get("x"));
+  auto w = p.lower_tensor(n.inputs_.get("w"));
+  auto b = p.lower_tensor(n.inputs_.get("b"));
+  auto y = p.lower_tensor(n.outputs_.get("y"));
+  auto dy = y->makeGrad();
+  const auto w_desc = fc_weights_desc(n);
+
+  auto seq = std::make_shared<DnnlSequence>();
+
+  if(x->grad_) {
+    dnnl_inner_product_desc_t desc;
+    chkDNNL(dnnl_inner_product_backward_data_desc_init(&desc, &x->desc_,
+                                                       &w_desc, &y->desc_));
+    DnnlBinder bd(p, make_pd(p, desc, f));
+    bd.arg(DNNL_ARG_DIFF_DST, dy->memory_);
+    bd.arg(DNNL_ARG_WEIGHTS, w->memory_);
+    bd.output(DNNL_ARG_DIFF_SRC, x->grad_,
+              n.attributes_.get("dx.beta", 0.0f));
+    seq->add(bd.make());
+  }
+
+  auto dw = w->makeGrad();
+  auto db = b ? b->makeGrad() : nullptr;
+
+  dnnl_inner_product_desc_t desc;
+  chkDNNL(dnnl_inner_product_backward_weights_desc_init(&desc, &x->desc_,
+                                                        &w_desc,
+                                                        b ? &b->desc_ : NULL,
+                                                        &y->desc_));
+  DnnlBinder bw(p, make_pd(p, desc, f));
+  bw.arg(DNNL_ARG_SRC, x->memory_);
+  bw.arg(DNNL_ARG_DIFF_DST, dy->memory_);
+  bw.arg(DNNL_ARG_DIFF_WEIGHTS, dw->memory_);
+  if(db)
+    bw.arg(DNNL_ARG_DIFF_BIAS, db->memory_);
+  seq->add(bw.make());
+
+  p.bwd(seq);
+  p.upd(w, dw);
+  if(b)
+    p.upd(b, db);
+}
+
+//------------------------------------------------------------------------
+
+static std::shared_ptr<DnnlPrimitive>
+concat_fwd(DnnlProgram &p, const Node &n)
 {
   const int axis = 1;
 
@@ -710,42 +1188,912 @@ concat_infer(DnnlProgram &p, const Node &n)
     src_descs[i] = xv[i]->desc_;
   }
 
-  dnnl_primitive_desc_t pd;
-  chkDNNL(dnnl_concat_primitive_desc_create(&pd, &y_desc, xhv.size(),
-                                            axis, src_descs, NULL,
-                                            p.ctx_->engine_));
-
-  std::vector<dnnl_exec_arg_t> args;
+  std::string key("concat");
+  key_append(key, y_desc);
+  for(size_t i = 0; i < xhv.size(); i++)
+    key_append(key, src_descs[i]);
 
-  auto y = p.lower_tensor(yh, pd, dnnl_query_dst_md);
+  DnnlBinder b(p, p.ctx_->findPrimitive(key, [&] {
+        dnnl_primitive_desc_t pd;
+        chkDNNL(dnnl_concat_primitive_desc_create(&pd, &y_desc, xhv.size(),
+                                                  axis, src_descs, NULL,
+                                                  p.ctx_->engine_));
+        return pd;
+      }));
 
-  args.push_back({DNNL_ARG_DST, y->memory_});
+  b.lower_output(DNNL_ARG_DST, yh);
   for(size_t i = 0; i < xhv.size(); i++) {
-    args.push_back({DNNL_ARG_MULTIPLE_SRC + (int)i, xv[i]->memory_});
+    b.arg(DNNL_ARG_MULTIPLE_SRC + (int)i, xv[i]->memory_);
+  }
+  return b.make();
+}
+
+
+static void
+concat_infer(DnnlProgram &p, const Node &n)
+{
+  p.infer(concat_fwd(p, n));
+}
+
+
+// Gradient of each input is a slice (along the channel axis) of dy
+static void
+concat_train(DnnlProgram &p, const Node &n)
+{
+  p.train(concat_fwd(p, n));
+
+  auto y = p.lower_tensor(n.outputs_.get("y"));
+  auto dy = y->makeGrad();
+
+  auto seq = std::make_shared<DnnlSequence>();
+  dnnl_dims_t offsets = {};
+
+  for(const auto &xh : n.inputs_.getv("x")) {
+    auto x = p.lower_tensor(xh);
+    auto dx = x->makeGrad();
+
+    dnnl_memory_desc_t sub_desc;
+    chkDNNL(dnnl_memory_desc_init_submemory(&sub_desc, &dy->desc_,
+                                            x->desc_.dims, offsets));
+    dnnl_memory_t sub;
+    chkDNNL(dnnl_memory_create(&sub, &sub_desc, p.ctx_->engine_,
+                               dy->deviceMem()));
+
+    auto r = make_reorder(p, &sub_desc, sub, *dx);
+    r->memories_.push_back(sub);
+    seq->add(r);
+    offsets[1] += x->desc_.dims[1];
+  }
+  p.bwd(seq);
+}
+
+//------------------------------------------------------------------------
+
+static const unsigned batchnorm_flags = dnnl_use_scale | dnnl_use_shift;
+
+static dnnl_memory_desc_t
+batchnorm_param_desc(const DnnlTensor &x)
+{
+  dnnl_memory_desc_t desc;
+  dnnl_dims_t dims = {x.dims_[1]};
+  chkDNNL(dnnl_memory_desc_init_by_tag(&desc, 1, dims, dnnl_f32, dnnl_a));
+  return desc;
+}
+
+
+static std::shared_ptr<DnnlPrimitive>
+batchnorm_fwd(DnnlProgram &p, const Node &n, dnnl_prop_kind_t prop)
+{
+  auto x = p.lower_tensor_batch(n.inputs_.get("x"));
+
+  const auto param_desc = batchnorm_param_desc(*x);
+  auto s = p.lower_tensor(n.inputs_.get("s"), &param_desc);
+  auto b = p.lower_tensor(n.inputs_.get("b"), &param_desc);
+  auto m = p.lower_tensor(n.inputs_.get("m"), &param_desc);
+  auto v = p.lower_tensor(n.inputs_.get("v"), &param_desc);
+
+  const float epsilon = n.attributes_.get("epsilon", 1e-5f);
+  const bool training = prop == dnnl_forward_training;
+
+  dnnl_batch_normalization_desc_t desc;
+  chkDNNL(dnnl_batch_normalization_forward_desc_init(&desc, prop, &x->desc_,
+                                                     epsilon,
+                                                     batchnorm_flags |
+                                                     (training ? 0 :
+                                                      dnnl_use_global_stats)));
+
+  DnnlBinder bn(p, make_pd(p, desc));
+  bn.arg(DNNL_ARG_SRC,   x->memory_);
+  bn.arg(DNNL_ARG_SCALE, s->memory_);
+  bn.arg(DNNL_ARG_SHIFT, b->memory_);
+
+  if(training) {
+    // Statistics of the batch, running averages are updated from these.
+    // batchnorm_train() expects them first in owned_
+    auto sm = std::make_shared<DnnlTensor>(*m, m->namePostfix("batch"));
+    auto sv = std::make_shared<DnnlTensor>(*v, v->namePostfix("batch"));
+    bn.arg(DNNL_ARG_MEAN,     sm->memory_);
+    bn.arg(DNNL_ARG_VARIANCE, sv->memory_);
+    bn.temporaries_.push_back(sm);
+    bn.temporaries_.push_back(sv);
+  } else {
+    bn.arg(DNNL_ARG_MEAN,     m->memory_);
+    bn.arg(DNNL_ARG_VARIANCE, v->memory_);
+  }
+
+  bn.lower_output(DNNL_ARG_DST, n.outputs_.get("y"));
+  return bn.make();
+}
+
+
+struct DnnlBatchNormRunning : public DnnlOperation {
+
+  const std::shared_ptr<DnnlTensor> m_, v_, sm_, sv_;
+  const float expavgf_;
+  const float correction_;
+
+  DnnlBatchNormRunning(std::shared_ptr<DnnlTensor> m,
+                       std::shared_ptr<DnnlTensor> v,
+                       std::shared_ptr<DnnlTensor> sm,
+                       std::shared_ptr<DnnlTensor> sv,
+                       float expavgf, int64_t samples)
+    : m_(m)
+    , v_(v)
+    , sm_(sm)
+    , sv_(sv)
+    , expavgf_(expavgf)
+    , correction_(samples > 1 ? (float)samples / (samples - 1) : 1.0f)
+  {}
+
+  void print() const {
+    printf("BatchNorm running averages\n");
+  }
+
+  // Running variance is unbiased (same as cuDNN)
+  void exec(DnnlProgram &p) {
+    float *m = (float *)m_->deviceMem();
+    float *v = (float *)v_->deviceMem();
+    const float *sm = (const float *)sm_->deviceMem();
+    const float *sv = (const float *)sv_->deviceMem();
+    const float f = expavgf_;
+    for(int64_t i = 0; i < m_->elements_; i++) {
+      m[i] = m[i] * (1.0f - f) + sm[i] * f;
+      v[i] = v[i] * (1.0f - f) + sv[i] * correction_ * f;
+    }
+  }
+};
+
+
+static void
+batchnorm_infer(DnnlProgram &p, const Node &n)
+{
+  p.infer(batchnorm_fwd(p, n, dnnl_forward_inference));
+}
+
+
+static void
+batchnorm_train(DnnlProgram &p, const Node &n)
+{
+  auto f = batchnorm_fwd(p, n, dnnl_forward_training);
+  p.train(f);
+
+  auto x = p.lower_tensor(n.inputs_.get("x"));
+  auto y = p.lower_tensor(n.outputs_.get("y"));
+  auto s = p.lower_tensor(n.inputs_.get("s"));
+  auto b = p.lower_tensor(n.inputs_.get("b"));
+  auto sm = f->owned_[0];
+  auto sv = f->owned_[1];
+
+  p.train(std::make_shared<DnnlBatchNormRunning>(p.lower_tensor(n.inputs_.get("m")),
+                                                 p.lower_tensor(n.inputs_.get("v")),
+                                                 sm, sv,
+                                                 n.attributes_.get("expavg", 0.1f),
+                                                 x->elements_ / x->dims_[1]));
+  auto dy = y->makeGrad();
+  auto dx = x->makeGrad();
+  auto ds = s->makeGrad();
+  auto db = b->makeGrad();
+
+  dnnl_batch_normalization_desc_t desc;
+  chkDNNL(dnnl_batch_normalization_backward_desc_init(&desc, dnnl_backward,
+                                                      &dy->desc_, &x->desc_,
+                                                      n.attributes_.get("epsilon", 1e-5f),
+                                                      batchnorm_flags));
+
+  auto seq = std::make_shared<DnnlSequence>();
+  DnnlBinder bb(p, make_pd(p, desc, f));
+  bb.input(DNNL_ARG_SRC, x);
+  bb.input(DNNL_ARG_DIFF_DST, dy);
+  bb.arg(DNNL_ARG_MEAN, sm->memory_);
+  bb.arg(DNNL_ARG_VARIANCE, sv->memory_);
+  bb.arg(DNNL_ARG_SCALE, s->memory_);
+  bb.arg(DNNL_ARG_DIFF_SCALE, ds->memory_);
+  bb.arg(DNNL_ARG_DIFF_SHIFT, db->memory_);
+  bb.output(DNNL_ARG_DIFF_SRC, dx, n.attributes_.get("dx.beta", 0.0f));
+  seq->add(bb.make());
+  p.bwd(seq);
+
+  p.upd(s, ds);
+  p.upd(b, db);
+}
+
+//------------------------------------------------------------------------
+
+// Stateless hash of (seed, counter), so each element's mask bit can be
+// computed independently and the loop split across threads
+static inline uint32_t
+dropout_hash(uint64_t seed, uint64_t i)
+{
+  uint64_t z = seed + i * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return (z ^ (z >> 31)) >> 32;
+}
+
+
+struct DnnlDropoutFwd : public DnnlOperation {
+
+  const std::shared_ptr<DnnlTensor> x_, y_;
+  const float prob_;
+  const float scale_;
+  const size_t elements_;
+  std::vector<uint8_t> mask_;
+  uint64_t iteration_ = 0;
+
+  DnnlDropoutFwd(DnnlProgram &p, const Node &n)
+    : x_(p.lower_tensor_batch(n.inputs_.get("x")))
+    , y_(p.lower_tensor(n.outputs_.get("y"), &x_->desc_))
+    , prob_(n.attributes_.get("prob", 0.5f))
+    , scale_(1.0f / (1.0f - prob_))
+    , elements_(dnnl_memory_desc_get_size(&x_->desc_) / sizeof(float))
+    , mask_(elements_)
+  {
+    if(x_->data_type_ != Tensor::DataType::FLOAT) {
+      fprintf(stderr, "Dropout: Unsupported tensor %s\n", x_->info().c_str());
+      abort();
+    }
+  }
+
+  void print() const {
+    printf("Dropout Fwd %.2f\n", prob_);
+    printf("\tx: %s\n", x_->info().c_str());
+    printf("\ty: %s\n", y_->info().c_str());
+  }
+
+  // Elementwise, so the layout of x (same as y) doesn't matter
+  void exec(DnnlProgram &p) {
+    const float *x = (const float *)x_->deviceMem();
+    float *y = (float *)y_->deviceMem();
+    uint8_t *mask = mask_.data();
+    const uint32_t threshold = prob_ * 4294967295.0;
+    const float scale = scale_;
+    const uint64_t seed = (0x2545f491ULL << 32) ^ iteration_++;
+    const int64_t n = elements_;
+
+#pragma omp parallel for
+    for(int64_t i = 0; i < n; i++) {
+      mask[i] = dropout_hash(seed, i) >= threshold;
+      y[i] = mask[i] ? x[i] * scale : 0;
+    }
+  }
+};
+
+
+struct DnnlDropoutBwd : public DnnlOperation {
+
+  const std::shared_ptr<DnnlDropoutFwd> fwd_;
+  const std::shared_ptr<DnnlTensor> dx_, dy_;
+  const float dx_beta_;
+
+  DnnlDropoutBwd(const Node &n, std::shared_ptr<DnnlDropoutFwd> fwd)
+    : fwd_(fwd)
+    , dx_(fwd->x_->makeGrad())
+    , dy_(fwd->y_->makeGrad())
+    , dx_beta_(n.attributes_.get("dx.beta", 0.0f))
+  {}
+
+  void print() const {
+    printf("Dropout Bwd\n");
+    printf("\tdy: %s\n", dy_->info().c_str());
+    printf("\tdx: %s\n", dx_->info().c_str());
+  }
+
+  void exec(DnnlProgram &p) {
+    const float *dy = (const float *)dy_->deviceMem();
+    float *dx = (float *)dx_->deviceMem();
+    const uint8_t *mask = fwd_->mask_.data();
+    const float scale = fwd_->scale_;
+    const float beta = dx_beta_;
+    const int64_t n = fwd_->elements_;
+
+#pragma omp parallel for
+    for(int64_t i = 0; i < n; i++) {
+      const float v = mask[i] ? dy[i] * scale : 0;
+      dx[i] = beta ? dx[i] + v : v;
+    }
+  }
+};
+
+
+static void
+dropout_train(DnnlProgram &p, const Node &n)
+{
+  auto f = std::make_shared<DnnlDropoutFwd>(p, n);
+  p.train(f);
+  p.bwd(std::make_shared<DnnlDropoutBwd>(n, f));
+}
+
+//------------------------------------------------------------------------
+
+// Row and column strides (in elements) of a plain 2D tensor
+static std::pair<int64_t, int64_t>
+strides_2d(const DnnlTensor &t, const char *what)
+{
+  const auto &d = t.desc_;
+  if(d.ndims != 2 || d.format_kind != dnnl_blocked ||
+     d.format_desc.blocking.inner_nblks != 0) {
+    fprintf(stderr, "%s: Unsupported layout of %s\n", what, t.info().c_str());
+    abort();
+  }
+  return {d.format_desc.blocking.strides[0], d.format_desc.blocking.strides[1]};
+}
+
+
+struct DnnlCatClassifierFwd : public DnnlOperation {
+
+  const std::shared_ptr<DnnlTensor> x_, y_;
+
+  DnnlCatClassifierFwd(DnnlProgram &p, const Node &n)
+    : x_(p.lower_tensor_batch(n.inputs_.get("x")))
+    , y_(p.lower_tensor_batch(n.outputs_.get("y")))
+  {
+    if(x_->data_type_ != Tensor::DataType::FLOAT ||
+       y_->data_type_ != Tensor::DataType::I32) {
+      fprintf(stderr, "CatClassifier: Unsupported tensor %s\n",
+              x_->info().c_str());
+      abort();
+    }
+  }
+
+  void print() const {
+    printf("CatClassifier Fwd\n");
+    printf("\tx: %s\n", x_->info().c_str());
+    printf("\ty: %s\n", y_->info().c_str());
+  }
+
+  void exec(DnnlProgram &p) {
+    const auto xs = strides_2d(*x_, "CatClassifier");
+    const int64_t ys = strides_2d(*y_, "CatClassifier").first;
+    const float *x = (const float *)x_->deviceMem();
+    int32_t *y = (int32_t *)y_->deviceMem();
+    const int n = x_->dims_[0];
+    const int c = x_->dims_[1];
+
+#pragma omp parallel for
+    for(int i = 0; i < n; i++) {
+      const float *row = x + i * xs.first;
+      int label = 0;
+      float max = row[0];
+      for(int j = 1; j < c; j++) {
+        const float v = row[j * xs.second];
+        if(v > max) {
+          max = v;
+          label = j;
+        }
+      }
+      y[i * ys] = label;
+    }
+  }
+};
+
+
+// Softmax cross-entropy, see catclassifier_bwd() in cuda_kernels.cu.
+// Rows labeled outside of [0, channels) are ignored
+struct DnnlCatClassifierBwd : public DnnlOperation {
+
+  const std::shared_ptr<DnnlCatClassifierFwd> fwd_;
+  const std::shared_ptr<DnnlTensor> dx_, dy_, loss_;
+
+  DnnlCatClassifierBwd(DnnlProgram &p, const Node &n,
+                       std::shared_ptr<DnnlCatClassifierFwd> fwd)
+    : fwd_(fwd)
+    , dx_(fwd->x_->makeGrad())
+    , dy_(fwd->y_->makeGrad())
+    , loss_(p.lower_tensor_batch(n.outputs_.get("loss")))
+  {}
+
+  void print() const {
+    printf("CatClassifier Bwd\n");
+    printf("\tdy: %s\n", dy_->info().c_str());
+    printf("\tdx: %s\n", dx_->info().c_str());
+  }
+
+  void exec(DnnlProgram &p) {
+    const auto xs = strides_2d(*fwd_->x_, "CatClassifier");
+    const auto dxs = strides_2d(*dx_, "CatClassifier");
+    const int64_t dys = strides_2d(*dy_, "CatClassifier").first;
+    const int64_t ls = loss_ ? strides_2d(*loss_, "CatClassifier").first : 0;
+    const float *x = (const float *)fwd_->x_->deviceMem();
+    float *dx = (float *)dx_->deviceMem();
+    const int32_t *dy = (const int32_t *)dy_->deviceMem();
+    float *loss = loss_ ? (float *)loss_->deviceMem() : NULL;
+    const int n = fwd_->x_->dims_[0];
+    const int c = fwd_->x_->dims_[1];
+    const double scale = 1.0 / n;
+
+#pragma omp parallel for
+    for(int i = 0; i < n; i++) {
+      const float *xr = x + i * xs.first;
+      float *dxr = dx + i * dxs.first;
+      const int label = dy[i * dys];
+
+      if(label < 0 || label >= c) {
+        for(int j = 0; j < c; j++)
+          dxr[j * dxs.second] = 0;
+        if(loss)
+          loss[i * ls] = 0;
+        continue;
+      }
+
+      double max = xr[0];
+      for(int j = 1; j < c; j++)
+        max = std::max(max, (double)xr[j * xs.second]);
+      double sum = 0;
+      for(int j = 0; j < c; j++)
+        sum += exp(xr[j * xs.second] - max);
+      const double offset = max + log(sum);
+
+      for(int j = 0; j < c; j++) {
+        const double prob = exp(xr[j * xs.second] - offset);
+        dxr[j * dxs.second] = (j == label ? prob - 1.0 : prob) * scale;
+      }
+      if(loss)
+        loss[i * ls] = offset - xr[label * xs.second];
+    }
+  }
+};
+
+
+static void
+catclassifier_infer(DnnlProgram &p, const Node &n)
+{
+  p.infer(std::make_shared<DnnlCatClassifierFwd>(p, n));
+}
+
+static void
+catclassifier_train(DnnlProgram &p, const Node &n)
+{
+  auto f = std::make_shared<DnnlCatClassifierFwd>(p, n);
+  p.train(f);
+  p.bwd(std::make_shared<DnnlCatClassifierBwd>(p, n, f));
+}
+
+//------------------------------------------------------------------------
+
+// y = (y - mean) / std per channel, in place after the reorder from x
+// has converted and scaled. See CudnnConvert for the CUDA counterpart
+struct DnnlNormalize : public DnnlOperation {
+
+  const std::shared_ptr<DnnlTensor> y_, mean_, stddev_;
+  int64_t channel_stride_;
+
+  DnnlNormalize(std::shared_ptr<DnnlTensor> y,
+                std::shared_ptr<DnnlTensor> mean,
+                std::shared_ptr<DnnlTensor> stddev)
+    : y_(y)
+    , mean_(mean)
+    , stddev_(stddev)
+  {
+    if(!mean_ || !stddev_ ||
+       mean_->data_type_ != Tensor::DataType::FLOAT ||
+       stddev_->data_type_ != Tensor::DataType::FLOAT) {
+      fprintf(stderr, "Convert: Normalization needs FLOAT mean and std\n");
+      abort();
+    }
+
+    // Channel is computed from the element index, so y must be packed
+    const auto &d = y_->desc_;
+    int64_t span = 1;
+    if(d.format_kind == dnnl_blocked &&
+       d.format_desc.blocking.inner_nblks == 0) {
+      for(int i = 0; i < d.ndims; i++)
+        span += (d.dims[i] - 1) * d.format_desc.blocking.strides[i];
+    }
+
+    if(y_->data_type_ != Tensor::DataType::FLOAT || d.ndims < 2 ||
+       span != y_->elements_ ||
+       mean_->elements_ != d.dims[1] || stddev_->elements_ != d.dims[1]) {
+      fprintf(stderr, "Convert: Unable to normalize %s\n",
+              y_->info().c_str());
+      abort();
+    }
+    channel_stride_ = d.format_desc.blocking.strides[1];
+  }
+
+  void print() const {
+    printf("Normalize\n");
+    printf("\tmean: %s\n", mean_->info().c_str());
+    printf("\tstd:  %s\n", stddev_->info().c_str());
+    printf("\ty: %s\n", y_->info().c_str());
+  }
+
+  void exec(DnnlProgram &p) {
+    float *y = (float *)y_->deviceMem();
+    const float *mean = (const float *)mean_->deviceMem();
+    const float *stddev = (const float *)stddev_->deviceMem();
+    const int64_t n = y_->elements_;
+    const int64_t cs = channel_stride_;
+    const int channels = mean_->elements_;
+
+#pragma omp parallel for
+    for(int64_t i = 0; i < n; i++) {
+      const int c = (i / cs) % channels;
+      y[i] = (y[i] - mean[c]) / stddev[c];
+    }
+  }
+};
+
+
+static void
+convert_make(DnnlProgram &p, const Node &n,
+             void (DnnlProgram::*add)(const std::shared_ptr<DnnlOperation> &))
+{
+  auto x = p.lower_tensor_batch(n.inputs_.get("x"));
+  auto y = p.lower_tensor_batch(n.outputs_.get("y"));
+  (p.*add)(make_reorder(p, &x->desc_, x->memory_, *y,
+                        n.attributes_.get("scale", 1.0f)));
+
+  auto mean = p.lower_tensor(n.inputs_.get("mean"));
+  auto stddev = p.lower_tensor(n.inputs_.get("std"));
+  if(mean || stddev)
+    (p.*add)(std::make_shared<DnnlNormalize>(y, mean, stddev));
+}
+
+static void
+convert_infer(DnnlProgram &p, const Node &n)
+{
+  convert_make(p, n, &DnnlProgram::infer);
+}
+
+static void
+convert_train(DnnlProgram &p, const Node &n)
+{
+  convert_make(p, n, &DnnlProgram::train);
+}
+
+//------------------------------------------------------------------------
+
+#define ADAM_EPSILON 1e-8
+#define ADAM_B1      0.9
+#define ADAM_B2      0.999
+
+struct DnnlAdam : public DnnlOperation {
+
+  struct Param {
+    std::shared_ptr<DnnlTensor> w, dw, m, v;
+    size_t elements;
+  };
+
+  const float learning_rate_;
+  std::vector<Param> params_;
+  int iteration_ = 0;
+
+  DnnlAdam(DnnlProgram &p)
+    : learning_rate_(p.learning_rate_)
+  {
+    for(const auto &it : p.params_) {
+      auto w = it.first;
+      if(w->data_type_ != Tensor::DataType::FLOAT) {
+        fprintf(stderr, "Adam: Unsupported data type for %s\n",
+                w->info().c_str());
+        abort();
+      }
+
+      // Moments share the (possibly blocked) layout of the weights
+      Param pa;
+      pa.w = w;
+      pa.dw = it.second;
+      pa.m = std::make_shared<DnnlTensor>(*w, w->namePostfix("adam.m"));
+      pa.v = std::make_shared<DnnlTensor>(*w, w->namePostfix("adam.v"));
+      pa.elements = dnnl_memory_desc_get_size(&w->desc_) / sizeof(float);
+      params_.push_back(pa);
+
+      if(w->name_) {
+        p.optimizer_state_[*pa.m->name_] = pa.m;
+        p.optimizer_state_[*pa.v->name_] = pa.v;
+      }
+    }
+  }
+
+  void print() const {
+    printf("Adam (%zd tensors)\n", params_.size());
+    for(const auto &pa : params_) {
+      printf("\tweights:  %s\n", pa.w->info().c_str());
+      printf("\tgradient: %s\n", pa.dw->info().c_str());
+    }
+  }
+
+  void exec(DnnlProgram &p) {
+    iteration_++;
+    const float b1 = ADAM_B1;
+    const float b2 = ADAM_B2;
+    const float e = ADAM_EPSILON;
+    const float b1t = 1.0 / (1.0 - pow(ADAM_B1, iteration_));
+    const float b2t = 1.0 / (1.0 - pow(ADAM_B2, iteration_));
+    const float lr = learning_rate_;
+
+    for(const auto &pa : params_) {
+      float *w = (float *)pa.w->deviceMem();
+      const float *dw = (const float *)pa.dw->deviceMem();
+      float *m = (float *)pa.m->deviceMem();
+      float *v = (float *)pa.v->deviceMem();
+      const int64_t n = pa.elements;
+
+#pragma omp parallel for
+      for(int64_t i = 0; i < n; i++) {
+        const float mt = m[i] = b1 * m[i] + (1.0f - b1) * dw[i];
+        const float vt = v[i] = b2 * v[i] + (1.0f - b2) * dw[i] * dw[i];
+        w[i] -= lr * (mt * b1t) / (sqrtf(vt * b2t) + e);
+      }
+    }
+  }
+};
+
+
+void
+DnnlProgram::setupOptimizer()
+{
+  if(params_.empty())
+    return;
+  upd_operations_.push_back(std::make_shared<DnnlAdam>(*this));
+}
+
+
+//------------------------------------------------------------------------
+
+static void
+set_affinity(const std::vector<int> &cpus)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(int cpu : cpus)
+    CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+
+/**
+ * Primitives execute on the calling thread with an OpenMP team of
+ * cpu_threads workers. With cpu_affinity each worker (including the
+ * calling thread) is pinned to a core of its own. The OpenMP runtime
+ * keeps its threads around so this only has to be done once
+ */
+void
+DnnlProgram::setupThreads()
+{
+  if(cpus_.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for(int i = 0; i < CPU_SETSIZE; i++) {
+        if(CPU_ISSET(i, &set))
+          cpus_.push_back(i);
+      }
+    }
+    if(cpus_.empty())
+      cpus_.push_back(0);
+  }
+
+  const int threads = config_.cpu_threads > 0 ? config_.cpu_threads :
+    cpus_.size();
+  omp_set_num_threads(threads);
+
+  if(!config_.cpu_affinity || threads_pinned_)
+    return;
+  threads_pinned_ = true;
+
+#pragma omp parallel num_threads(threads)
+  {
+    set_affinity({cpus_[omp_get_thread_num() % cpus_.size()]});
+  }
+}
+
+
+void
+DnnlProgram::setupAccessors(const BatchTensorAccessors &accessors)
+{
+  for(const auto &a : accessors) {
+    if(a.which != Which::VALUE)
+      continue;
+
+    auto src = a.tensor;
+    auto desc = dnnl_desc_from_tensor(src);
+    auto t = std::make_shared<DnnlTensor>(&desc, ctx_, src->name_, SLOTS);
+    flips_.push_back(t);
+    t->copyFromLocked(*src);
+    tensors_[src] = t;
+    addPrePostOp(t, a);
   }
 
-  p.infer(std::make_shared<DnnlPrimitive>(pd, args));
+  for(const auto &a : accessors) {
+    if(a.which != Which::GRADIENT)
+      continue;
+
+    auto src = a.tensor;
+    auto desc = dnnl_desc_from_tensor(src);
+    auto g = std::make_shared<DnnlTensor>(&desc, ctx_, src->name_, SLOTS);
+    flips_.push_back(g);
 
+    auto t = lower_tensor_batch(src);
+    t->grad_ = g;
+    addPrePostOp(g, a);
+  }
 }
 
 
+void
+DnnlProgram::addPrePostOp(std::shared_ptr<DnnlTensor> t,
+                          const BatchTensorAccess &a)
+{
+  auto op = DnnlBatchAccessOp{.tensor_ = t, .fn_ = a.fn};
+
+  if(a.phase == Phase::PRE) {
+    if(a.mode == Mode::INFER || a.mode == Mode::ALL)
+      infer_pre_.push_back(op);
+
+    if(a.mode == Mode::TRAIN || a.mode == Mode::ALL)
+      train_pre_.push_back(op);
+
+  } else {
+
+    if(a.mode == Mode::INFER || a.mode == Mode::ALL)
+      infer_post_.push_back(op);
+
+    if(a.mode == Mode::TRAIN || a.mode == Mode::ALL)
+      train_post_.push_back(op);
+  }
+}
+
+
+void
+DnnlProgram::execOps(const DnnlOperations &ops)
+{
+  for(const auto &op : ops)
+    op->exec(*this);
+}
+
+
+/**
+ * Batch N uses slot (N % SLOTS) of the double buffered tensors. While
+ * the calling thread computes a batch, a loader thread runs the PRE
+ * accessors of the next one and a completion thread runs the POST
+ * accessors of the previous one
+ */
+void
+DnnlProgram::execute(long batches,
+                     const DnnlBatchAccessOps &pre,
+                     const DnnlBatchAccessOps &post,
+                     const std::function<void(void)> &fn)
+{
+  if(batches == 0)
+    return;
+
+  setupThreads();
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  long loaded = 0;     // Batches PRE accessors are done with
+  long computed = 0;   // Batches computed
+  long completed = 0;  // Batches POST accessors are done with
+
+  auto wait_for = [&](const std::function<bool(void)> &pred) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, pred);
+  };
+
+  auto advance = [&](long &counter) {
+    std::unique_lock<std::mutex> lock(mutex);
+    counter++;
+    cond.notify_all();
+  };
+
+  // A slot can be reused once the batch that previously occupied it
+  // has been computed and inspected
+  auto slot_free = [&](long i) {
+    return computed > i - SLOTS && (post.empty() || completed > i - SLOTS);
+  };
+
+  // Helper threads would otherwise inherit the affinity of a worker
+  const bool unpin = config_.cpu_affinity;
+
+  std::thread loader([&] {
+      if(unpin)
+        set_affinity(cpus_);
+      for(long i = 0; i < batches; i++) {
+        wait_for([&] { return slot_free(i); });
+        for(const auto &op : pre) {
+          auto ta = op.tensor_->access(i % SLOTS);
+          op.fn_(*ta, i);
+        }
+        advance(loaded);
+      }
+    });
+
+  std::thread completion;
+  if(!post.empty()) {
+    completion = std::thread([&] {
+        if(unpin)
+          set_affinity(cpus_);
+        for(long i = 0; i < batches; i++) {
+          wait_for([&] { return computed > i; });
+          for(const auto &op : post) {
+            auto ta = op.tensor_->access(i % SLOTS);
+            op.fn_(*ta, i);
+          }
+          advance(completed);
+        }
+      });
+  }
+
+  for(long i = 0; i < batches; i++) {
+    wait_for([&] { return loaded > i && (post.empty() ||
+                                         completed > i - SLOTS); });
+    for(const auto &t : flips_)
+      t->setSlot(i % SLOTS);
+    fn();
+    chkDNNL(dnnl_stream_wait(ctx_->stream_));
+    advance(computed);
+  }
+
+  loader.join();
+  if(completion.joinable())
+    completion.join();
+}
+
+
+void
+DnnlProgram::infer(long batches)
+{
+  execute(batches, infer_pre_, infer_post_,
+          [&] { execOps(infer_operations_); });
+}
+
+
+void
+DnnlProgram::train(long batches)
+{
+  execute(batches, train_pre_, train_post_, [&] {
+      execOps(train_operations_);
+      execOps(bwd_operations_);
+      execOps(upd_operations_);
+    });
+}
 
 
 //------------------------------------------------------------------------
 
+// Gradients of tensors consumed by more than one node must be summed,
+// see compute_dx_beta() in cuda_common.cpp
+static std::vector<std::shared_ptr<Node>>
+compute_dx_beta(const std::vector<std::shared_ptr<Node>> &nodes)
+{
+  std::vector<std::shared_ptr<Node>> r;
+  std::unordered_set<std::shared_ptr<Tensor>> xset;
+
+  for(ssize_t i = nodes.size() - 1; i >= 0; i--) {
+    std::shared_ptr<Node> n = nodes[i];
+    auto x = n->inputs_.get("x");
+    if(x) {
+      if(xset.find(x) == xset.end()) {
+        xset.insert(x);
+      } else {
+        auto n2 = std::make_shared<Node>(*n);
+        n2->attributes_["dx.beta"] = 1.0f;
+        n = n2;
+      }
+    }
+    r.insert(r.begin(), n);
+  }
+  return r;
+}
+
+
 static const struct Operation {
   const char *name;
   void (*create_infer)(DnnlProgram &p, const Node &n);
   void (*create_train)(DnnlProgram &p, const Node &n);
 } nodetypes[] = {
-  { "conv",             conv_infer},
-  { "relu",             relu_infer},
-  { "maxpool",          maxpool_infer},
-  { "reshape",          reshape_infer},
-  { "fc",               fc_infer},
-  { "dropout",          reshape_infer},
-  { "concat",           concat_infer},
-  { "avgpool",          avgpool_infer},
+  { "conv",             conv_infer,          conv_train },
+  { "relu",             relu_infer,          relu_train },
+  { "maxpool",          maxpool_infer,       maxpool_train },
+  { "reshape",          reshape_infer,       reshape_train },
+  { "fc",               fc_infer,            fc_train },
+  { "dropout",          reshape_infer,       dropout_train },
+  { "concat",           concat_infer,        concat_train },
+  { "avgpool",          avgpool_infer,       avgpool_train },
+  { "batchnorm",        batchnorm_infer,     batchnorm_train },
+  { "catclassifier",    catclassifier_infer, catclassifier_train },
+  { "convert",          convert_infer,       convert_train },
 };
 
 static const Operation *
@@ -760,19 +2108,49 @@ find_operation(const Node &n)
 }
 
 
+bool
+DnnlContext::supportsNode(const Node &n, const ProgramConfig &pc) const
+{
+  auto op = find_operation(n);
+  if(op == NULL)
+    return false;
+  if(pc.training && !op->create_train)
+    return false;
+  if(pc.inference && !op->create_infer)
+    return false;
+  if(n.attributes_.find("y.beta") != n.attributes_.end())
+    return false;  // Outputs are always overwritten
+  return true;
+}
+
 
 std::shared_ptr<Program>
-DnnlContext::createProgram(const Graph &g,
-                           const ProgramConfig &pc)
+DnnlContext::createProgram(const Graph &graph,
+                           const ProgramConfig &pc,
+                           const BatchTensorAccessors &accessors)
 {
+  const Graph g = optimizedGraph(graph, pc, accessors);
 
-  auto p = std::make_shared<DnnlProgram>(shared_from_this(),
-                                         pc.tensor_layout,
-                                         pc.batch_size,
-                                         pc.initial_learning_rate);
-  if(pc.training) {
+  auto p = std::make_shared<DnnlProgram>(shared_from_this(), pc);
 
-    fprintf(stderr, "DNNL Training not implemented yet\n");
+  // Primitives are tuned for the number of threads they will run with
+  p->setupThreads();
+  p->setupAccessors(accessors);
+
+  if(pc.training) {
+    for(const auto &n : compute_dx_beta(g.nodes_)) {
+      auto op = find_operation(*n);
+      if(op != NULL && op->create_train) {
+        op->create_train(*p, *n);
+      } else {
+        fprintf(stderr, "Unable to create training operation for node %s\n",
+                n->type_.c_str());
+        n->print();
+        exit(1);
+      }
+    }
+    p->setupOptimizer();
+    p->restoreOptimizerState(g);
   }
 
   if(pc.inference) {
@@ -788,6 +2166,8 @@ DnnlContext::createProgram(const Graph &g,
       }
     }
   }
+
+  chkDNNL(dnnl_stream_wait(stream_));
   return p;
 }
 
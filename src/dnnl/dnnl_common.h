@@ -28,6 +28,12 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
 #include "saga.h"
 #include "dnnl.h"
 #include "dnnl_debug.h"
@@ -46,6 +52,24 @@
 
 namespace saga {
 
+class DnnlTensor;
+class DnnlOperation;
+
+dnnl_data_type_t dnnlDataType_from_dataType(Tensor::DataType data_type);
+
+
+// A primitive and its descriptor, see DnnlContext::findPrimitive()
+struct DnnlPrimitiveCacheEntry {
+
+  DnnlPrimitiveCacheEntry(dnnl_primitive_desc_t desc, const std::string &key);
+  ~DnnlPrimitiveCacheEntry();
+
+  const std::string key_;
+  const dnnl_primitive_desc_t desc_;
+  dnnl_primitive_t prim_;
+};
+
+
 class DnnlContext : public Context,
                     public std::enable_shared_from_this<DnnlContext> {
 
@@ -55,11 +79,139 @@ public:
   ~DnnlContext();
 
   std::shared_ptr<Program> createProgram(const Graph &graph,
-                                         const ProgramConfig &pc);
+                                         const ProgramConfig &pc,
+                                         const BatchTensorAccessors &accessors);
 
+  bool supportsNode(const Node &n, const ProgramConfig &pc) const override;
+
+  std::shared_ptr<DnnlPrimitiveCacheEntry>
+  findPrimitive(const std::string &key,
+                const std::function<dnnl_primitive_desc_t(void)> &create);
 
   dnnl_engine_t engine_;
   dnnl_stream_t stream_;
+
+  // Keyed by operation descriptor (and hint) or memory descriptors
+  std::mutex primitive_cache_mutex_;
+  std::unordered_map<std::string,
+                     std::shared_ptr<DnnlPrimitiveCacheEntry>> primitive_cache_;
+  size_t primitive_cache_hits_ = 0;
+};
+
+
+struct DnnlBatchAccessOp {
+  std::shared_ptr<DnnlTensor> tensor_;
+  BatchTensorAccessFn fn_;
+};
+
+typedef std::vector<DnnlBatchAccessOp> DnnlBatchAccessOps;
+
+typedef std::vector<std::shared_ptr<DnnlOperation>> DnnlOperations;
+
+
+class DnnlProgram : public Program {
+public:
+
+  DnnlProgram(std::shared_ptr<DnnlContext> ctx,
+              const ProgramConfig &pc)
+    : ctx_(ctx)
+    , config_(pc)
+    , tensor_layout_(pc.tensor_layout)
+    , batch_size_(pc.batch_size)
+    , learning_rate_(pc.initial_learning_rate)
+    , debug_(false)
+  {
+  }
+
+  std::shared_ptr<Tensor> resolveTensor(std::shared_ptr<Tensor> t) override;
+  void infer(long batches) override;
+  void train(long batches) override;
+  void print() const override;
+  void debug(bool) override;
+  Tensors optimizerState() override;
+
+  const std::shared_ptr<DnnlContext> ctx_;
+  const ProgramConfig config_;
+  const TensorLayout tensor_layout_;
+  const int batch_size_;
+  const float learning_rate_;
+  bool debug_;
+
+  DnnlOperations infer_operations_;
+  DnnlOperations train_operations_;
+  DnnlOperations bwd_operations_;
+  DnnlOperations upd_operations_;
+
+  // Weights and their gradients, all updated by one optimizer operation
+  std::vector<std::pair<std::shared_ptr<DnnlTensor>,
+                        std::shared_ptr<DnnlTensor>>> params_;
+
+  // Saved and restored with checkpoints, see optimizerState()
+  std::unordered_map<std::string, std::shared_ptr<DnnlTensor>> optimizer_state_;
+
+  DnnlBatchAccessOps infer_pre_;
+  DnnlBatchAccessOps infer_post_;
+  DnnlBatchAccessOps train_pre_;
+  DnnlBatchAccessOps train_post_;
+
+  // Tensors accessed from the host are double buffered so the next
+  // batch can be loaded (and the previous one inspected) while a batch
+  // is computed
+  static const int SLOTS = 2;
+  std::vector<std::shared_ptr<DnnlTensor>> flips_;
+
+  // CPUs available to the process, see setupThreads()
+  std::vector<int> cpus_;
+  bool threads_pinned_ = false;
+
+  std::unordered_map<std::shared_ptr<Tensor>,
+                     std::shared_ptr<DnnlTensor>> tensors_;
+
+  dnnl_memory_desc_t dnnl_desc_from_tensor_any(std::shared_ptr<Tensor> t);
+
+  dnnl_memory_desc_t dnnl_desc_from_tensor(std::shared_ptr<Tensor> t);
+
+  std::shared_ptr<DnnlTensor> lower_tensor(std::shared_ptr<Tensor> src);
+
+  std::shared_ptr<DnnlTensor> lower_tensor(std::shared_ptr<Tensor> src,
+                                           const dnnl_memory_desc_t *desc);
+
+  std::shared_ptr<DnnlTensor> lower_tensor(std::shared_ptr<Tensor> src,
+                                           dnnl_primitive_desc_t desc,
+                                           dnnl_query_t what);
+
+  std::shared_ptr<DnnlTensor> lower_tensor_batch(std::shared_ptr<Tensor> src);
+
+  void infer(const std::shared_ptr<DnnlOperation> &op);
+  void train(const std::shared_ptr<DnnlOperation> &op);
+  void bwd(const std::shared_ptr<DnnlOperation> &op);
+  void upd(std::shared_ptr<DnnlTensor> weights,
+           std::shared_ptr<DnnlTensor> gradient);
+
+  void setupAccessors(const BatchTensorAccessors &accessors);
+
+  void addPrePostOp(std::shared_ptr<DnnlTensor> t, const BatchTensorAccess &a);
+
+  void setupOptimizer();
+
+  void restoreOptimizerState(const Graph &g);
+
+  void setupThreads();
+
+  void execOps(const DnnlOperations &ops);
+
+  void execute(long batches,
+               const DnnlBatchAccessOps &pre,
+               const DnnlBatchAccessOps &post,
+               const std::function<void(void)> &fn);
+};
+
+
+class DnnlOperation {
+public:
+  virtual ~DnnlOperation() {}
+  virtual void exec(DnnlProgram &p) = 0;
+  virtual void print() const = 0;
 };
 
 }
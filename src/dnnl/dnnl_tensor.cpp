@@ -37,21 +37,37 @@ class DnnlTensorStorage : public TensorStorage {
 
 public:
   DnnlTensorStorage(Tensor::DataType data_type, size_t size,
-                    const std::shared_ptr<DnnlContext> &ctx)
+                    const std::shared_ptr<DnnlContext> &ctx,
+                    int num_buffers)
     : TensorStorage(data_type)
     , ctx_(ctx)
+    , size_(size)
+    , buffers_(num_buffers)
   {
-    data_ = valloc(size);
-    memset(data_, 0, size);
+    for(auto &b : buffers_) {
+      b = valloc(size);
+      memset(b, 0, size);
+    }
+    data_ = buffers_[0];
   }
 
   ~DnnlTensorStorage()
   {
-    free(data_);
+    for(auto b : buffers_)
+      free(b);
+  }
+
+  void *buffer(int slot) const {
+    return buffers_[slot % buffers_.size()];
   }
 
+  void setIndex(int slot) {
+    data_ = buffer(slot);
+  }
 
   const std::shared_ptr<DnnlContext> ctx_;
+  const size_t size_;
+  std::vector<void *> buffers_;
 };
 
 
@@ -62,10 +78,12 @@ class DnnlTensorAccess : public TensorAccess {
 
 public:
   DnnlTensorAccess(std::shared_ptr<DnnlTensorStorage> storage,
-                   const dnnl_memory_desc_t *desc)
+                   const dnnl_memory_desc_t *desc,
+                   void *data, bool sync = false)
     : storage_(storage)
     , desc_(*desc)
-    , sync_(false)
+    , data_(data)
+    , sync_(sync)
   {
     //    storage_->ctx_->mutex_.lock();
   }
@@ -74,9 +92,34 @@ public:
     //    storage_->ctx_->mutex_.unlock();
   }
 
-  Dims strides() { return {}; }
+  // Only plain (non blocked) layouts can be accessed directly
+  bool plain() const {
+    return desc_.format_kind == dnnl_blocked &&
+      desc_.format_desc.blocking.inner_nblks == 0;
+  }
+
+  Dims strides() {
+    Dims r;
+    if(!plain())
+      return r;
+    for(int i = 0; i < desc_.ndims; i++)
+      r.push_back(desc_.format_desc.blocking.strides[i]);
+    return r;
+  }
 
-  void *data() { return nullptr; }
+  void *data() {
+    if(!plain())
+      return nullptr;
+    wait();
+    return (char *)data_ + desc_.offset0 * storage_->element_size_;
+  }
+
+  void wait() {
+    if(!sync_) {
+      chkDNNL(dnnl_stream_wait(storage_->ctx_->stream_));
+      sync_ = true;
+    }
+  }
 
   int64_t offsetForElement(const Dims &element) const {
 
@@ -115,30 +158,29 @@ public:
   }
 
   virtual double get(const Dims &element) {
-    if(!sync_) {
-      chkDNNL(dnnl_stream_wait(storage_->ctx_->stream_));
-      sync_ = true;
-    }
-    return storage_->get(offsetForElement(element));
+    wait();
+    return storage_->get_(data_, offsetForElement(element));
   };
 
   virtual void set(const Dims &element, double value) {
-    if(!sync_) {
-      chkDNNL(dnnl_stream_wait(storage_->ctx_->stream_));
-      sync_ = true;
-    }
-
-    storage_->set(offsetForElement(element), value);
+    wait();
+    storage_->set_(data_, offsetForElement(element), value);
   }
 
   virtual void copyBytesFrom(const Dims &element,
                              const void *data, size_t size) {
-    fprintf(stderr, "%s not implemented\n", __FUNCTION__);
-    abort();
+    if(!plain()) {
+      fprintf(stderr, "%s: Tensor is not in a plain layout\n", __FUNCTION__);
+      abort();
+    }
+    wait();
+    const size_t offset = offsetForElement(element) * storage_->element_size_;
+    memcpy((char *)data_ + offset, data, size);
   }
 
   const std::shared_ptr<DnnlTensorStorage> storage_;
   dnnl_memory_desc_t desc_;
+  void *data_;
   bool sync_;
 };
 
@@ -146,8 +188,7 @@ public:
 
 
 
-#if 0
-static dnnl_data_type_t
+dnnl_data_type_t
 dnnlDataType_from_dataType(Tensor::DataType data_type)
 {
   switch(data_type) {
@@ -159,6 +200,8 @@ dnnlDataType_from_dataType(Tensor::DataType data_type)
     return dnnl_u8;
   case Tensor::DataType::I32:
     return dnnl_s32;
+  case Tensor::DataType::I8:
+    return dnnl_s8;
   default:
     fprintf(stderr, "Unsupported data_type %d for dnnl tensor\n",
             (int)data_type);
@@ -166,15 +209,6 @@ dnnlDataType_from_dataType(Tensor::DataType data_type)
   }
 }
 
-static void
-dnnl_dims_from_dims(dnnl_dims_t dims, const Dims &src)
-{
-  assert(src.size() <= DNNL_MAX_NDIMS);
-  for(int i = 0; i < src.size(); i++)
-    dims[i] = src[i];
-}
-#endif
-
 
 static Tensor::DataType
 dmd_to_datatype(const dnnl_memory_desc_t *desc)
@@ -188,6 +222,8 @@ dmd_to_datatype(const dnnl_memory_desc_t *desc)
     return Tensor::DataType::I32;
   case dnnl_u8:
     return Tensor::DataType::U8;
+  case dnnl_s8:
+    return Tensor::DataType::I8;
   default:
     fprintf(stderr, "%s: Can't handle data_type %d\n",
             __FUNCTION__, desc->data_type);
@@ -209,14 +245,23 @@ dmd_to_dims(const dnnl_memory_desc_t *desc)
 
 DnnlTensor::DnnlTensor(const dnnl_memory_desc_t *desc,
                        const std::shared_ptr<DnnlContext> &ctx,
-                       const std::optional<const std::string> &name)
+                       const std::optional<const std::string> &name,
+                       int slots)
   : Tensor(dmd_to_datatype(desc), dmd_to_dims(desc), name)
   , desc_(*desc)
 {
   const size_t byte_size = dnnl_memory_desc_get_size(desc);
-  storage_ = std::make_shared<DnnlTensorStorage>(data_type_, byte_size, ctx);
+  storage_ = std::make_shared<DnnlTensorStorage>(data_type_, byte_size, ctx,
+                                                 slots);
   chkDNNL(dnnl_memory_create(&memory_, &desc_, ctx->engine_,
-                             storage_->data_));
+                             storage_->data()));
+}
+
+
+DnnlTensor::DnnlTensor(const DnnlTensor &blueprint,
+                       const std::optional<const std::string> &name)
+  : DnnlTensor(&blueprint.desc_, blueprint.storage_->ctx_, name)
+{
 }
 
 
@@ -247,7 +292,44 @@ DnnlTensor::info() const
 std::unique_ptr<TensorAccess>
 DnnlTensor::access()
 {
-  return std::make_unique<DnnlTensorAccess>(storage_, &desc_);
+  return std::make_unique<DnnlTensorAccess>(storage_, &desc_,
+                                            storage_->data());
+}
+
+
+// Used by batch accessors. No need to wait for the stream, the buffer
+// of the slot is not in use by the batch being computed
+std::unique_ptr<TensorAccess>
+DnnlTensor::access(int slot)
+{
+  return std::make_unique<DnnlTensorAccess>(storage_, &desc_,
+                                            storage_->buffer(slot), true);
+}
+
+
+void *
+DnnlTensor::deviceMem() const
+{
+  return storage_->data();
+}
+
+
+std::shared_ptr<DnnlTensor>
+DnnlTensor::makeGrad()
+{
+  if(!grad_)
+    grad_ = std::make_shared<DnnlTensor>(*this, namePostfix("grad"));
+  return grad_;
+}
+
+
+// Primitives refer to memory_ so switching its data handle is all
+// that's needed to move a double buffered tensor to another slot
+void
+DnnlTensor::setSlot(int slot)
+{
+  storage_->setIndex(slot);
+  chkDNNL(dnnl_memory_set_data_handle(memory_, storage_->data()));
 }
 
 
@@ -295,11 +377,10 @@ DnnlTensor::copyFromLocked(Tensor &t)
     src_rank--;
   }
 
-  assert(t.data_type_ == Tensor::DataType::FLOAT);
   dnnl_memory_desc_t src_desc;
   chkDNNL(dnnl_memory_desc_init_by_strides(&src_desc, src_rank,
                                            src_dims,
-                                           dnnl_f32,
+                                           dnnlDataType_from_dataType(t.data_type_),
                                            src_strides));
 
   dnnl_memory_t src_memory;
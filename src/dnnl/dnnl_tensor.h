@@ -38,9 +38,16 @@ class DnnlTensorStorage;
 class DnnlTensor : public Tensor {
 
 public:
+  // Tensors with more than one slot are double buffered, see
+  // DnnlProgram::execute()
   DnnlTensor(const dnnl_memory_desc_t *desc,
              const std::shared_ptr<DnnlContext> &ctx,
-             const std::optional<const std::string> &name = std::nullopt);
+             const std::optional<const std::string> &name = std::nullopt,
+             int slots = 1);
+
+  // Same layout as blueprint
+  DnnlTensor(const DnnlTensor &blueprint,
+             const std::optional<const std::string> &name);
 
   ~DnnlTensor();
 
@@ -48,6 +55,9 @@ public:
 
   std::unique_ptr<TensorAccess> access() override;
 
+  // Access to the buffer of a specific slot
+  std::unique_ptr<TensorAccess> access(int slot);
+
   std::shared_ptr<Tensor> slice(const Dims &offset, const Dims &size) override;
 
   std::shared_ptr<Tensor> grad() const override {
@@ -62,6 +72,8 @@ public:
 
   void copyFromLocked(Tensor &t);
 
+  void setSlot(int slot);
+
   const dnnl_memory_desc_t desc_;
   dnnl_memory_t memory_;
 
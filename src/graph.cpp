@@ -131,6 +131,12 @@ Graph::tensorMappings() const
 void
 Graph::loadTensors(const char *path)
 {
+  struct stat st;
+  if(stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+    loadCheckpoint(path);
+    return;
+  }
+
   struct dirent **namelist;
   int n = scandir(path, &namelist, NULL, NULL);
   if(n == -1) {
@@ -0,0 +1,496 @@
+#include <ctype.h>
+#include <math.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "saga.h"
+
+/*
+ * Backend independent graph rewrites, run before lowering
+ *
+ *  - Constant folding: Nodes computing only from initializers (shape
+ *    computations, add / mul on constants, ...) are evaluated on the
+ *    host and replaced by the result
+ *  - Common subexpression elimination: Nodes of the same type with the
+ *    same inputs and attributes are merged
+ *  - Dead node elimination: Nodes not contributing to the outputs of the
+ *    graph are dropped, so are initializers no longer used
+ *
+ * Tensors in the graph's inputs_ and outputs_ (and those passed in keep)
+ * are never replaced or left without their producer. Neither are results
+ * no node consumes when the graph doesn't declare outputs_
+ */
+
+namespace saga {
+
+typedef std::vector<std::shared_ptr<Node>> Nodes;
+
+typedef std::unordered_map<std::shared_ptr<Tensor>,
+                           std::shared_ptr<Tensor>> TensorReplacements;
+
+typedef std::unordered_set<std::shared_ptr<Tensor>> TensorSet;
+
+
+// Inputs lowered with a batch dimension. Constants can't be fed there
+static bool
+is_batch_input(const std::string &name)
+{
+  return name == "x" ||
+    (name.size() > 1 && name[0] == 'x' && isdigit(name[1]));
+}
+
+
+static TensorSet
+produced_tensors(const Nodes &nodes)
+{
+  TensorSet r;
+  for(const auto &n : nodes) {
+    for(const auto &it : n->outputs_)
+      r.insert(it.second);
+  }
+  return r;
+}
+
+
+// Copy of nodes with inputs substituted, nodes remain shared if untouched
+static Nodes
+replace_inputs(const Nodes &nodes, const TensorReplacements &r)
+{
+  if(r.empty())
+    return nodes;
+
+  Nodes out;
+  for(const auto &n : nodes) {
+    bool touched = false;
+    for(const auto &it : n->inputs_)
+      touched |= r.count(it.second) > 0;
+
+    if(!touched) {
+      out.push_back(n);
+      continue;
+    }
+    auto n2 = std::make_shared<Node>(*n);
+    for(auto &it : n2->inputs_) {
+      auto x = r.find(it.second);
+      if(x != r.end())
+        it.second = x->second;
+    }
+    out.push_back(n2);
+  }
+  return out;
+}
+
+
+//------------------------------------------------------------------------
+// Constant folding
+
+// Call fn for each element of dims in row-major order
+static void
+for_each_element(const Dims &dims, const std::function<void(const Dims &)> &fn)
+{
+  for(auto d : dims) {
+    if(d < 1)
+      return;
+  }
+
+  Dims e(dims.size(), 0);
+  while(1) {
+    fn(e);
+    ssize_t i = dims.size() - 1;
+    for(; i >= 0; i--) {
+      if(++e[i] < dims[i])
+        break;
+      e[i] = 0;
+    }
+    if(i < 0)
+      return;
+  }
+}
+
+
+// Element of b that e of a tensor with dims broadcasts from (numpy
+// rules, dimensions aligned to the right), false if it doesn't
+static bool
+broadcast_element(const Dims &dims, const Dims &b, const Dims &e, Dims &be)
+{
+  if(b.size() > dims.size())
+    return false;
+  const size_t skip = dims.size() - b.size();
+  be.resize(b.size());
+  for(size_t i = 0; i < b.size(); i++) {
+    if(b[i] == dims[i + skip])
+      be[i] = e[i + skip];
+    else if(b[i] == 1)
+      be[i] = 0;
+    else
+      return false;
+  }
+  return true;
+}
+
+
+static std::shared_ptr<Tensor>
+fold_binary(const Node &n, const std::shared_ptr<Tensor> &y,
+            const TensorReplacements &values, bool mul)
+{
+  auto xi = n.inputs_.get("x");
+  auto bi = n.inputs_.get(mul && n.inputs_.get("s") ? "s" : "b");
+  if(xi == nullptr || bi == nullptr)
+    return nullptr;
+  auto x = values.at(xi);
+  auto b = values.at(bi);
+
+  Dims be;
+  if(x->dims_ != y->dims_ ||
+     !broadcast_element(x->dims_, b->dims_, Dims(x->dims_.size(), 0), be))
+    return nullptr;
+
+  auto r = makeCPUTensor(y->data_type_, y->dims_, y->name_);
+  auto xa = x->access();
+  auto ba = b->access();
+  auto ra = r->access();
+  for_each_element(y->dims_, [&](const Dims &e) {
+      broadcast_element(x->dims_, b->dims_, e, be);
+      const double v = xa->get(e);
+      const double w = ba->get(be);
+      ra->set(e, mul ? v * w : v + w);
+    });
+  return r;
+}
+
+
+static std::shared_ptr<Tensor>
+fold_node(const Node &n, const TensorReplacements &values)
+{
+  auto y = n.outputs_.get("y");
+  if(y == nullptr || n.outputs_.size() != 1)
+    return nullptr;
+
+  if(n.type_ == "add" || n.type_ == "mul")
+    return fold_binary(n, y, values, n.type_ == "mul");
+
+  if(n.type_ == "sum") {
+    auto r = makeCPUTensor(y->data_type_, y->dims_, y->name_);
+    auto ra = r->access();
+    for(const auto &x : n.inputs_.getv("x")) {
+      auto xt = values.at(x);
+      if(xt->dims_ != y->dims_)
+        return nullptr;
+      auto xa = xt->access();
+      for_each_element(y->dims_, [&](const Dims &e) {
+          ra->set(e, ra->get(e) + xa->get(e));
+        });
+    }
+    return r;
+  }
+
+  auto xi = n.inputs_.get("x");
+  if(xi == nullptr)
+    return nullptr;
+  auto x = values.at(xi);
+  if(x->elements_ != y->elements_)
+    return nullptr;
+
+  auto r = makeCPUTensor(y->data_type_, y->dims_, y->name_);
+  auto xa = x->access();
+  auto ra = r->access();
+
+  if(n.type_ == "relu") {
+    for_each_element(y->dims_, [&](const Dims &e) {
+        ra->set(e, std::max(0.0, xa->get(e)));
+      });
+    return r;
+  }
+
+  if(n.type_ == "convert") {
+    // Normalization (mean / std inputs) is not folded
+    if(n.inputs_.size() != 1)
+      return nullptr;
+    const float scale = n.attributes_.get("scale", 1.0f);
+    for_each_element(y->dims_, [&](const Dims &e) {
+        ra->set(e, xa->get(e) * scale);
+      });
+    return r;
+  }
+
+  if(n.type_ == "reshape") {
+    // Same elements in row-major order
+    Dims xe(x->dims_.size(), 0);
+    for_each_element(y->dims_, [&](const Dims &e) {
+        ra->set(e, xa->get(xe));
+        for(ssize_t i = xe.size() - 1; i >= 0; i--) {
+          if(++xe[i] < x->dims_[i])
+            break;
+          xe[i] = 0;
+        }
+      });
+    return r;
+  }
+  return nullptr;
+}
+
+
+static Nodes
+fold_constants(const Nodes &nodes, const TensorSet &protect,
+               const TensorSet &roots)
+{
+  const auto produced = produced_tensors(nodes);
+
+  // Value of each constant tensor, initializers map to themselves
+  TensorReplacements values;
+  std::vector<std::shared_ptr<Tensor>> folded(nodes.size());
+
+  for(size_t i = 0; i < nodes.size(); i++) {
+    const auto &n = nodes[i];
+    if(n->loader_ || n->mapped_loader_ || n->inputs_.empty())
+      continue;
+
+    bool constant = true;
+    for(const auto &it : n->inputs_) {
+      const auto &t = it.second;
+      if(values.count(t))
+        continue;
+      if(!produced.count(t) && !protect.count(t) && t->access()) {
+        values[t] = t;
+        continue;
+      }
+      constant = false;
+      break;
+    }
+    if(!constant)
+      continue;
+
+    folded[i] = fold_node(*n, values);
+    if(folded[i])
+      values[n->outputs_.get("y")] = folded[i];
+  }
+
+  // A folded node must stay if its result is a root (nothing would
+  // produce it otherwise) or fed into a batch input of a node that
+  // stays. Decided consumers first
+  TensorSet needed;
+  std::vector<bool> keep(nodes.size());
+  for(ssize_t i = nodes.size() - 1; i >= 0; i--) {
+    const auto &n = nodes[i];
+    if(folded[i]) {
+      auto y = n->outputs_.get("y");
+      keep[i] = roots.count(y) || needed.count(y);
+    } else {
+      keep[i] = true;
+    }
+    if(!keep[i])
+      continue;
+    for(const auto &it : n->inputs_) {
+      if(is_batch_input(it.first))
+        needed.insert(it.second);
+    }
+  }
+
+  TensorReplacements r;
+  Nodes out;
+  for(size_t i = 0; i < nodes.size(); i++) {
+    if(keep[i])
+      out.push_back(nodes[i]);
+    else
+      r[nodes[i]->outputs_.get("y")] = folded[i];
+  }
+  return replace_inputs(out, r);
+}
+
+
+//------------------------------------------------------------------------
+// Common subexpression elimination
+
+// Node types whose outputs differ between otherwise identical nodes
+static bool
+has_side_effects(const Node &n, bool training)
+{
+  if(n.loader_ || n.mapped_loader_ ||
+     n.type_ == "jpegdecoder" || n.type_ == "catclassifier")
+    return true;
+  return training && (n.type_ == "dropout" || n.type_ == "spatialtransform");
+}
+
+
+static bool
+same_node(const Node &a, const Node &b)
+{
+  return a.type_ == b.type_ &&
+    a.inputs_ == b.inputs_ &&
+    a.attributes_ == b.attributes_ &&
+    a.outputs_.size() == b.outputs_.size();
+}
+
+
+// Type and all inputs sorted by name. Nodes with the same key are
+// candidates, same_node() has the final say
+static std::string
+input_key(const Node &n)
+{
+  std::vector<std::pair<std::string, const Tensor *>> inputs;
+  for(const auto &it : n.inputs_)
+    inputs.push_back({it.first, it.second.get()});
+  std::sort(inputs.begin(), inputs.end());
+
+  std::string key = n.type_;
+  for(const auto &it : inputs) {
+    char ptr[32];
+    snprintf(ptr, sizeof(ptr), "=%p ", it.second);
+    key += it.first + ptr;
+  }
+  return key;
+}
+
+
+static Nodes
+eliminate_common(const Nodes &nodes, const TensorSet &roots, bool training)
+{
+  TensorReplacements r;
+  Nodes out;
+
+  // Candidates by their type and inputs
+  std::unordered_multimap<std::string, std::shared_ptr<Node>> seen;
+
+  for(const auto &n0 : nodes) {
+    auto n = replace_inputs({n0}, r)[0];
+    if(n->inputs_.empty() || has_side_effects(*n, training)) {
+      out.push_back(n);
+      continue;
+    }
+
+    bool replaceable = true;
+    for(const auto &it : n->outputs_)
+      replaceable = replaceable && !roots.count(it.second);
+
+    const auto key = input_key(*n);
+    std::shared_ptr<Node> same;
+    if(replaceable) {
+      auto range = seen.equal_range(key);
+      for(auto it = range.first; it != range.second; ++it) {
+        if(same_node(*it->second, *n)) {
+          same = it->second;
+          break;
+        }
+      }
+    }
+
+    if(same) {
+      for(const auto &it : n->outputs_) {
+        auto o = same->outputs_.get(it.first);
+        if(o == nullptr || o->dims_ != it.second->dims_ ||
+           o->data_type_ != it.second->data_type_) {
+          same = nullptr;
+          break;
+        }
+      }
+    }
+
+    if(same) {
+      for(const auto &it : n->outputs_)
+        r[it.second] = same->outputs_.get(it.first);
+      continue;
+    }
+
+    seen.insert({key, n});
+    out.push_back(n);
+  }
+  return out;
+}
+
+
+//------------------------------------------------------------------------
+// Dead node elimination
+
+static Nodes
+eliminate_dead(const Nodes &nodes, const TensorSet &roots)
+{
+  TensorSet live = roots;
+  std::vector<bool> keep(nodes.size());
+
+  for(ssize_t i = nodes.size() - 1; i >= 0; i--) {
+    const auto &n = nodes[i];
+    for(const auto &it : n->outputs_)
+      keep[i] = keep[i] || live.count(it.second);
+    if(!keep[i])
+      continue;
+    for(const auto &it : n->inputs_)
+      live.insert(it.second);
+  }
+
+  Nodes out;
+  for(size_t i = 0; i < nodes.size(); i++) {
+    if(keep[i])
+      out.push_back(nodes[i]);
+  }
+  return out;
+}
+
+
+//------------------------------------------------------------------------
+
+size_t
+Graph::optimize(bool training, const TensorSet &keep)
+{
+  TensorSet protect = keep;
+  protect.insert(inputs_.begin(), inputs_.end());
+  protect.insert(outputs_.begin(), outputs_.end());
+
+  // Without declared outputs everything computed but not consumed is
+  // considered a result
+  TensorSet roots = protect;
+  if(outputs_.empty()) {
+    auto dangling = outputTensors();
+    roots.insert(dangling.begin(), dangling.end());
+  }
+
+  TensorSet used_before;
+  for(const auto &n : nodes_) {
+    for(const auto &it : n->inputs_)
+      used_before.insert(it.second);
+  }
+
+  const size_t before = nodes_.size();
+
+  Nodes nodes = nodes_;
+  // Trained weights are not constants
+  if(!training)
+    nodes = fold_constants(nodes, protect, roots);
+  nodes = eliminate_common(nodes, roots, training);
+  nodes = eliminate_dead(nodes, roots);
+  nodes_ = nodes;
+
+  // Initializers only read by nodes that are gone
+  TensorSet used;
+  for(const auto &n : nodes_) {
+    for(const auto &it : n->inputs_)
+      used.insert(it.second);
+  }
+
+  for(auto it = tensors_.begin(); it != tensors_.end(); ) {
+    const auto &t = it->second;
+    if(used_before.count(t) && !used.count(t) && !protect.count(t))
+      it = tensors_.erase(it);
+    else
+      ++it;
+  }
+
+  return before - nodes_.size();
+}
+
+
+
+Graph
+optimizedGraph(const Graph &g, const ProgramConfig &pc,
+               const BatchTensorAccessors &accessors)
+{
+  TensorSet keep;
+  for(const auto &a : accessors)
+    keep.insert(a.tensor);
+
+  Graph r = g;
+  r.optimize(pc.training, keep);
+  return r;
+}
+
+}
@@ -0,0 +1,669 @@
+#include <math.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "saga.h"
+#include "tensor.h"
+
+/*
+ * Heterogeneous inference
+ *
+ * The graph is cut into partitions of consecutive nodes placed on the
+ * same context. Each partition is a program of its own. Tensors crossing
+ * a boundary are picked up by a POST accessor of the producing partition
+ * (for CUDA that's the async download into pinned memory) and handed
+ * to PRE accessors of the consumers through a ring of host buffers.
+ * Partitions run in threads of their own so while one partition
+ * computes batch N the next one can work on batch N - 1
+ */
+
+namespace saga {
+
+// Cost model used to place nodes. Units are roughly multiply-adds on
+// the first (highest priority) context. Other contexts are assumed to be
+// CPU_SLOWDOWN times slower and each byte crossing a partition boundary
+// costs TRANSFER_COST
+static const double CPU_SLOWDOWN = 20;
+static const double TRANSFER_COST = 1000;
+
+static double
+node_work(const Node &n)
+{
+  auto y = n.outputs_.get("y");
+  if(y == nullptr)
+    return 1;
+
+  // Multiply-adds of conv / fc: Each output is a dot product over the
+  // weights of its output channel
+  auto w = n.inputs_.get("w");
+  if(w != nullptr && y->dims_.size() > 1 && y->dims_[1] > 0)
+    return (double)y->elements_ * w->elements_ / y->dims_[1];
+  return y->elements_;
+}
+
+
+static size_t
+tensor_bytes(const Tensor &t)
+{
+  return t.elements_ * Tensor::DataTypeSize(t.data_type_);
+}
+
+
+// Index into contexts for each node, empty if some node can't be placed
+static std::vector<int>
+place_nodes(const Graph &g,
+            const std::vector<std::shared_ptr<Context>> &contexts,
+            const ProgramConfig &pc)
+{
+  const size_t num_nodes = g.nodes_.size();
+  const size_t nc = contexts.size();
+
+  std::unordered_set<std::shared_ptr<Tensor>> produced;
+  for(const auto &n : g.nodes_) {
+    for(const auto &it : n->outputs_)
+      produced.insert(it.second);
+  }
+
+  // Cheapest placement of the nodes so far that ends on each context,
+  // and the context of the previous node in that placement
+  std::vector<double> cost(nc, 0);
+  std::vector<std::vector<int>> prev(num_nodes, std::vector<int>(nc, -1));
+
+  for(size_t i = 0; i < num_nodes; i++) {
+    const Node &n = *g.nodes_[i];
+
+    // Switching context means moving the inputs computed so far
+    double transfer = 0;
+    for(const auto &it : n.inputs_) {
+      if(produced.count(it.second))
+        transfer += tensor_bytes(*it.second) * TRANSFER_COST;
+    }
+
+    const double work = node_work(n);
+    std::vector<double> next(nc, INFINITY);
+
+    for(size_t c = 0; c < nc; c++) {
+      if(!contexts[c]->supportsNode(n, pc))
+        continue;
+      const double w = c ? work * CPU_SLOWDOWN : work;
+      for(size_t p = 0; p < nc; p++) {
+        const double v = cost[p] + w + (i && p != c ? transfer : 0);
+        if(v < next[c]) {
+          next[c] = v;
+          prev[i][c] = p;
+        }
+      }
+    }
+
+    bool placed = false;
+    for(size_t c = 0; c < nc; c++)
+      placed |= next[c] < INFINITY;
+
+    if(!placed) {
+      fprintf(stderr, "No context can run node %s\n", n.type_.c_str());
+      n.print();
+      return {};
+    }
+    cost = next;
+  }
+
+  std::vector<int> r(num_nodes);
+  int c = 0;
+  for(size_t i = 1; i < nc; i++) {
+    if(cost[i] < cost[c])
+      c = i;
+  }
+  for(ssize_t i = num_nodes - 1; i >= 0; i--) {
+    r[i] = c;
+    c = prev[i][c];
+  }
+  return r;
+}
+
+
+//------------------------------------------------------------------------
+
+// Copy between the host side of two accessor tensors
+static void
+copy_access(TensorAccess &dst, TensorAccess &src, const Tensor &t,
+            const Dims &dims)
+{
+  void *data = src.data();
+  if(data == NULL || dst.data() == NULL) {
+    fprintf(stderr, "Tensor %s can't be moved between partitions\n",
+            t.info().c_str());
+    abort();
+  }
+
+  Dims strides = src.strides();
+  strides.resize(dims.size());
+  // Memory stays owned by the accessor
+  std::shared_ptr<void> mapping(data, [](void *) {});
+  auto s = makeMappedCPUTensor(t.data_type_, dims, mapping, data,
+                               t.name_, strides);
+
+  if(!copy_tensor(dst.data(), dims.size(), &dims[0], &dst.strides()[0],
+                  t.data_type_, *s)) {
+    fprintf(stderr, "Tensor %s copy between partitions failed\n",
+            t.info().c_str());
+    abort();
+  }
+}
+
+
+/**
+ * Tensors produced by one partition (or fed by the application) for
+ * later partitions. A slot holds all of them for one batch and is
+ * recycled once every consumer has read its tensors
+ */
+class HeteroChannel {
+public:
+  HeteroChannel(int depth, int batch_size)
+    : depth_(depth)
+    , batch_size_(batch_size)
+  {}
+
+  // Index of t in the channel
+  size_t add(const std::shared_ptr<Tensor> &t);
+
+  void addReader(size_t index) { total_reads_++; }
+
+  void allocate();
+
+  // Fill tensor index of batch with fn, waits for a free slot
+  void fill(size_t index, long batch, const BatchTensorAccessFn &fn);
+
+  void put(size_t index, TensorAccess &src, long batch);
+
+  void get(size_t index, TensorAccess &dst, long batch);
+
+  const std::vector<std::shared_ptr<Tensor>> &tensors() const {
+    return tensors_;
+  }
+
+private:
+  struct Slot {
+    long batch = -1;  // -1 when free
+    int writes = 0;
+    int reads = 0;
+    std::vector<std::shared_ptr<Tensor>> tensors;
+  };
+
+  Slot &slot(long batch) { return slots_[batch % depth_]; }
+
+  const int depth_;
+  const int batch_size_;
+  std::vector<std::shared_ptr<Tensor>> tensors_;
+  int total_reads_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<Slot> slots_;
+};
+
+
+size_t
+HeteroChannel::add(const std::shared_ptr<Tensor> &t)
+{
+  for(size_t i = 0; i < tensors_.size(); i++) {
+    if(tensors_[i] == t)
+      return i;
+  }
+  tensors_.push_back(t);
+  return tensors_.size() - 1;
+}
+
+
+void
+HeteroChannel::allocate()
+{
+  slots_.resize(depth_);
+  for(auto &s : slots_) {
+    for(const auto &t : tensors_)
+      s.tensors.push_back(makeCPUTensor(t->data_type_,
+                                        t->dims_.n(batch_size_), t->name_));
+  }
+}
+
+
+void
+HeteroChannel::fill(size_t index, long batch, const BatchTensorAccessFn &fn)
+{
+  Slot &s = slot(batch);
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [&] { return s.batch == -1 || s.batch == batch; });
+    s.batch = batch;
+  }
+
+  auto ta = s.tensors[index]->access();
+  fn(*ta, batch);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  s.writes++;
+  cond_.notify_all();
+}
+
+
+void
+HeteroChannel::put(size_t index, TensorAccess &src, long batch)
+{
+  const auto &t = *tensors_[index];
+  fill(index, batch, [&](TensorAccess &dst, long) {
+      copy_access(dst, src, t, t.dims_.n(batch_size_));
+    });
+}
+
+
+void
+HeteroChannel::get(size_t index, TensorAccess &dst, long batch)
+{
+  Slot &s = slot(batch);
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [&] {
+        return s.batch == batch && s.writes == (int)tensors_.size();
+      });
+  }
+
+  const auto &t = *tensors_[index];
+  auto ta = s.tensors[index]->access();
+  copy_access(dst, *ta, t, t.dims_.n(batch_size_));
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if(++s.reads == total_reads_) {
+    s.batch = -1;
+    s.writes = 0;
+    s.reads = 0;
+    cond_.notify_all();
+  }
+}
+
+
+//------------------------------------------------------------------------
+
+struct HeteroPartition {
+  std::shared_ptr<Context> ctx;
+  Graph graph;
+  std::shared_ptr<Program> program;
+
+  // Tensors of this partition read by later partitions
+  std::unique_ptr<HeteroChannel> exports;
+};
+
+
+class HeteroProgram : public Program {
+public:
+  HeteroProgram(const ProgramConfig &pc)
+    : depth_(std::max(2, pc.prefetch_depth + 1))
+    , batch_size_(pc.batch_size)
+  {}
+
+  std::shared_ptr<Tensor> resolveTensor(std::shared_ptr<Tensor> t) override;
+  void infer(long batches) override;
+  void train(long batches) override;
+  void print() const override;
+  void debug(bool on) override;
+  void profile(bool on) override;
+  ProfileReport profileReport() override;
+
+  bool setup(const Graph &g, const std::vector<int> &placement,
+             const std::vector<std::shared_ptr<Context>> &contexts,
+             const ProgramConfig &pc,
+             const BatchTensorAccessors &accessors);
+
+private:
+  void feed(long batches);
+
+  const int depth_;
+  const int batch_size_;
+
+  std::vector<std::unique_ptr<HeteroPartition>> partitions_;
+
+  // Application PRE accessors of graph inputs used by several
+  // partitions are run once per batch on a thread of their own
+  std::unique_ptr<HeteroChannel> feeder_;
+  std::vector<std::pair<size_t, BatchTensorAccessFn>> feed_;
+};
+
+
+bool
+HeteroProgram::setup(const Graph &g, const std::vector<int> &placement,
+                     const std::vector<std::shared_ptr<Context>> &contexts,
+                     const ProgramConfig &pc,
+                     const BatchTensorAccessors &accessors)
+{
+  // Runs of nodes on the same context
+  std::unordered_map<std::shared_ptr<Tensor>, size_t> owner;
+  std::vector<std::unordered_set<std::shared_ptr<Tensor>>> consumed;
+
+  for(size_t i = 0; i < g.nodes_.size(); i++) {
+    if(i == 0 || placement[i] != placement[i - 1]) {
+      auto p = std::make_unique<HeteroPartition>();
+      p->ctx = contexts[placement[i]];
+      p->exports = std::make_unique<HeteroChannel>(depth_, batch_size_);
+      p->graph.tensors_ = g.tensors_;
+      partitions_.push_back(std::move(p));
+      consumed.push_back({});
+    }
+
+    const size_t pi = partitions_.size() - 1;
+    const auto &n = g.nodes_[i];
+    partitions_[pi]->graph.nodes_.push_back(n);
+    for(const auto &it : n->inputs_) {
+      auto o = owner.find(it.second);
+      if(o == owner.end() || o->second != pi)
+        consumed[pi].insert(it.second);
+    }
+    for(const auto &it : n->outputs_)
+      owner[it.second] = pi;
+  }
+
+  std::vector<BatchTensorAccessors> pre(partitions_.size());
+  std::vector<std::unordered_map<std::shared_ptr<Tensor>,
+                                 std::vector<BatchTensorAccessFn>>> post(partitions_.size());
+
+  // Boundary tensors
+  for(size_t pi = 0; pi < partitions_.size(); pi++) {
+    auto &graph = partitions_[pi]->graph;
+    for(const auto &t : consumed[pi]) {
+      auto o = owner.find(t);
+      if(o == owner.end())
+        continue;
+      auto ch = partitions_[o->second]->exports.get();
+      const size_t index = ch->add(t);
+      ch->addReader(index);
+      pre[pi].push_back({Phase::PRE, Which::VALUE, Mode::INFER, t,
+                         [=](TensorAccess &ta, long batch) {
+                           ch->get(index, ta, batch);
+                         }});
+      graph.inputs_.insert(t);
+      partitions_[o->second]->graph.outputs_.insert(t);
+    }
+  }
+
+  for(size_t pi = 0; pi < partitions_.size(); pi++) {
+    auto ch = partitions_[pi]->exports.get();
+    for(size_t i = 0; i < ch->tensors().size(); i++) {
+      post[pi][ch->tensors()[i]].push_back([=](TensorAccess &ta, long batch) {
+          ch->put(i, ta, batch);
+        });
+    }
+  }
+
+  // Application accessors go to the partition producing (POST) or
+  // consuming (PRE) the tensor
+  feeder_ = std::make_unique<HeteroChannel>(depth_, batch_size_);
+  for(const auto &a : accessors) {
+    if(a.which != Which::VALUE)
+      continue;
+
+    if(a.phase == Phase::POST) {
+      auto o = owner.find(a.tensor);
+      if(o == owner.end()) {
+        fprintf(stderr, "POST accessor for %s which is not computed\n",
+                a.tensor->info().c_str());
+        return false;
+      }
+      post[o->second][a.tensor].push_back(a.fn);
+      continue;
+    }
+
+    if(owner.count(a.tensor)) {
+      fprintf(stderr, "PRE accessor for %s which is computed\n",
+              a.tensor->info().c_str());
+      return false;
+    }
+
+    std::vector<size_t> users;
+    for(size_t pi = 0; pi < partitions_.size(); pi++) {
+      if(consumed[pi].count(a.tensor))
+        users.push_back(pi);
+    }
+
+    if(users.size() == 1) {
+      pre[users[0]].push_back(a);
+      continue;
+    }
+
+    const size_t index = feeder_->add(a.tensor);
+    feed_.push_back({index, a.fn});
+    auto ch = feeder_.get();
+    for(size_t pi : users) {
+      ch->addReader(index);
+      pre[pi].push_back({Phase::PRE, Which::VALUE, Mode::INFER, a.tensor,
+                         [=](TensorAccess &ta, long batch) {
+                           ch->get(index, ta, batch);
+                         }});
+    }
+  }
+
+  feeder_->allocate();
+  for(auto &p : partitions_)
+    p->exports->allocate();
+
+  for(size_t pi = 0; pi < partitions_.size(); pi++) {
+    auto &p = partitions_[pi];
+    auto acc = pre[pi];
+    for(auto &it : post[pi]) {
+      auto fns = it.second;
+      acc.push_back({Phase::POST, Which::VALUE, Mode::INFER, it.first,
+                     [fns](TensorAccess &ta, long batch) {
+                       for(const auto &fn : fns)
+                         fn(ta, batch);
+                     }});
+    }
+
+    for(const auto &t : g.inputs_) {
+      if(consumed[pi].count(t))
+        p->graph.inputs_.insert(t);
+    }
+    for(const auto &t : g.outputs_) {
+      auto o = owner.find(t);
+      if(o != owner.end() && o->second == pi)
+        p->graph.outputs_.insert(t);
+    }
+
+    p->program = p->ctx->createProgram(p->graph, pc, acc);
+    if(!p->program) {
+      fprintf(stderr, "Unable to create program for partition %zd\n", pi);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+std::shared_ptr<Tensor>
+HeteroProgram::resolveTensor(std::shared_ptr<Tensor> t)
+{
+  // Boundary tensors are resolved in the partition producing them
+  for(const auto &p : partitions_) {
+    auto r = p->program->resolveTensor(t);
+    if(r)
+      return r;
+  }
+  return nullptr;
+}
+
+
+void
+HeteroProgram::feed(long batches)
+{
+  for(long i = 0; i < batches; i++) {
+    for(const auto &f : feed_)
+      feeder_->fill(f.first, i, f.second);
+  }
+}
+
+
+void
+HeteroProgram::infer(long batches)
+{
+  if(batches == 0)
+    return;
+
+  std::vector<std::thread> threads;
+  if(!feed_.empty())
+    threads.push_back(std::thread([&] { feed(batches); }));
+
+  for(size_t i = 1; i < partitions_.size(); i++) {
+    auto program = partitions_[i]->program;
+    threads.push_back(std::thread([=] { program->infer(batches); }));
+  }
+
+  partitions_[0]->program->infer(batches);
+
+  for(auto &t : threads)
+    t.join();
+}
+
+
+void
+HeteroProgram::train(long batches)
+{
+  fprintf(stderr, "Heterogeneous programs can't be trained\n");
+  abort();
+}
+
+
+void
+HeteroProgram::print() const
+{
+  for(size_t i = 0; i < partitions_.size(); i++) {
+    const auto &p = partitions_[i];
+    printf("Partition %zd: %zd nodes, %zd tensors exported\n",
+           i, p->graph.nodes_.size(), p->exports->tensors().size());
+    p->program->print();
+  }
+}
+
+
+void
+HeteroProgram::debug(bool on)
+{
+  for(const auto &p : partitions_)
+    p->program->debug(on);
+}
+
+
+void
+HeteroProgram::profile(bool on)
+{
+  for(const auto &p : partitions_)
+    p->program->profile(on);
+}
+
+
+ProfileReport
+HeteroProgram::profileReport()
+{
+  // Device state is taken from the first partition reporting it
+  ProfileReport r;
+  std::vector<ProfileEntry> entries;
+  long batches = 0;
+  size_t memory = 0;
+  for(const auto &p : partitions_) {
+    auto pr = p->program->profileReport();
+    entries.insert(entries.end(), pr.entries.begin(), pr.entries.end());
+    batches = std::max(batches, pr.batches);
+    memory += pr.program_memory;
+    if(r.device.empty())
+      r = pr;
+  }
+  r.entries = std::move(entries);
+  r.batches = batches;
+  r.program_memory = memory;
+  return r;
+}
+
+
+//------------------------------------------------------------------------
+
+class HeteroContext : public Context {
+public:
+  HeteroContext(const std::vector<std::shared_ptr<Context>> &contexts)
+    : contexts_(contexts)
+  {}
+
+  std::shared_ptr<Program> createProgram(const Graph &graph,
+                                         const ProgramConfig &pc,
+                                         const BatchTensorAccessors &accessors) override;
+
+  bool supportsNode(const Node &n, const ProgramConfig &pc) const override;
+
+private:
+  const std::vector<std::shared_ptr<Context>> contexts_;
+};
+
+
+bool
+HeteroContext::supportsNode(const Node &n, const ProgramConfig &pc) const
+{
+  for(const auto &c : contexts_) {
+    if(c->supportsNode(n, pc))
+      return true;
+  }
+  return false;
+}
+
+
+std::shared_ptr<Program>
+HeteroContext::createProgram(const Graph &graph,
+                             const ProgramConfig &pc,
+                             const BatchTensorAccessors &accessors)
+{
+  // Folded and dead nodes are left out of the placement
+  const Graph g = optimizedGraph(graph, pc, accessors);
+
+  if(contexts_.empty()) {
+    fprintf(stderr, "No contexts to create program on\n");
+    return nullptr;
+  }
+
+  if(g.nodes_.empty())
+    return contexts_[0]->createProgram(g, pc, accessors);
+
+  if(pc.training) {
+    // Gradients would have to cross partitions backwards, use the
+    // first context able to run the whole graph
+    for(const auto &c : contexts_) {
+      bool all = true;
+      for(const auto &n : g.nodes_)
+        all = all && c->supportsNode(*n, pc);
+      if(all)
+        return c->createProgram(g, pc, accessors);
+    }
+    fprintf(stderr, "No single context can train the graph\n");
+    return nullptr;
+  }
+
+  auto placement = place_nodes(g, contexts_, pc);
+  if(placement.empty())
+    return nullptr;
+
+  bool split = false;
+  for(size_t i = 1; i < placement.size(); i++)
+    split |= placement[i] != placement[0];
+
+  if(!split)
+    return contexts_[placement[0]]->createProgram(g, pc, accessors);
+
+  auto p = std::make_shared<HeteroProgram>(pc);
+  if(!p->setup(g, placement, contexts_, pc, accessors))
+    return nullptr;
+  return p;
+}
+
+
+std::shared_ptr<Context>
+createHeterogeneousContext(const std::vector<std::shared_ptr<Context>> &contexts)
+{
+  return std::make_shared<HeteroContext>(contexts);
+}
+
+}
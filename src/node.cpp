@@ -380,8 +380,20 @@ jpegdecoder_y(const Node &n, const std::optional<const std::string> &name)
     return nullptr;
   const int channels = n.attributes_.get("channels", 3);
 
+  // Decoded images are transformed into a network input of the given
+  // datatype and size when augmentation is used
+  const int datatype = n.attributes_.get("datatype", -1);
+  if(datatype != -1) {
+    const int output_width = n.attributes_.get("output_width", width);
+    const int output_height = n.attributes_.get("output_height", height);
+    return std::make_shared<Tensor>((Tensor::DataType)datatype,
+                                    Dims({1, channels,
+                                          output_height, output_width}),
+                                    name);
+  }
+
   return std::make_shared<Tensor>(Tensor::DataType::U8,
-                                  Dims({1, channels, width, height}), name);
+                                  Dims({1, channels, height, width}), name);
 }
 
 
@@ -42,6 +42,7 @@
 #include <google/protobuf/io/coded_stream.h>
 
 #include "saga.h"
+#include "tensor.h"
 
 using namespace google::protobuf::io;
 using namespace std;
@@ -211,17 +212,21 @@ public:
     : CodedInputStream((const uint8_t *)data, size)
     , data_(data)
     , size_(size)
+    , mapping_(data, [=](void *p) { munmap(p, size); })
   {
     SetTotalBytesLimit(size, size);
   }
 
-  ~MappedPBFile() {
-    munmap(data_, size_);
-  }
+  const uint8_t *data() const { return (const uint8_t *)data_; }
+  size_t size() const { return size_; }
+
+  // Tensors referring directly to the file keep this alive
+  const std::shared_ptr<void> &mapping() const { return mapping_; }
 
 private:
   void *data_;
   size_t size_;
+  std::shared_ptr<void> mapping_;
 };
 
 
@@ -334,6 +339,201 @@ make_tensor(const onnx::TensorProto &tp)
 
 
 
+//------------------------------------------------------------------------
+// Zero copy loading of initializers
+//
+// Parsing a ModelProto copies every raw_data field. Instead we walk the
+// serialized model, turn initializers with raw_data (or external data)
+// into tensors that point straight into the mapped files and only hand
+// the rest of the graph to protobuf
+
+struct PBField {
+  uint32_t number;
+  const uint8_t *begin;   // Including tag
+  const uint8_t *end;
+  const uint8_t *payload; // Length delimited fields only
+  size_t payload_size;
+};
+
+
+static bool
+pb_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+  *v = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    if(*p == end)
+      return false;
+    const uint8_t b = *(*p)++;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if(!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+
+// Split a serialized message into its top level fields
+static bool
+pb_fields(const uint8_t *data, size_t size, std::vector<PBField> &fields)
+{
+  const uint8_t *p = data;
+  const uint8_t *end = data + size;
+
+  while(p < end) {
+    PBField f{};
+    f.begin = p;
+    uint64_t tag, v;
+    if(!pb_varint(&p, end, &tag))
+      return false;
+    f.number = tag >> 3;
+
+    switch(tag & 7) {
+    case 0:
+      if(!pb_varint(&p, end, &v))
+        return false;
+      break;
+    case 1:
+      p += 8;
+      break;
+    case 2:
+      if(!pb_varint(&p, end, &v) || v > (uint64_t)(end - p))
+        return false;
+      f.payload = p;
+      f.payload_size = v;
+      p += v;
+      break;
+    case 5:
+      p += 4;
+      break;
+    default:
+      return false;
+    }
+    if(p > end)
+      return false;
+    f.end = p;
+    fields.push_back(f);
+  }
+  return true;
+}
+
+
+struct ExternalFiles {
+  std::string dir_;
+  std::map<std::string, std::pair<std::shared_ptr<void>, size_t>> files_;
+
+  bool map(const std::string &location, std::shared_ptr<void> *mapping,
+           size_t *size) {
+    auto it = files_.find(location);
+    if(it == files_.end()) {
+      const std::string path = dir_ + location;
+      const int fd = open(path.c_str(), O_RDONLY);
+      if(fd == -1) {
+        fprintf(stderr, "Failed to open external data %s: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+      }
+      struct stat st;
+      void *mem = MAP_FAILED;
+      if(fstat(fd, &st) == 0 && st.st_size > 0)
+        mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if(mem == MAP_FAILED) {
+        fprintf(stderr, "Failed to map external data %s\n", path.c_str());
+        return false;
+      }
+      const size_t len = st.st_size;
+      std::shared_ptr<void> m(mem, [=](void *p) { munmap(p, len); });
+      it = files_.insert({location, {m, len}}).first;
+    }
+    *mapping = it->second.first;
+    *size = it->second.second;
+    return true;
+  }
+};
+
+
+// Returns nullptr if the initializer should be parsed the normal way
+static shared_ptr<Tensor>
+map_initializer(const PBField &f, const MappedPBFile &pb, ExternalFiles &ext)
+{
+  std::vector<PBField> fields;
+  if(!pb_fields(f.payload, f.payload_size, fields))
+    return nullptr;
+
+  // Everything but raw_data (9) is small, parse that with protobuf
+  std::string meta;
+  const PBField *raw = NULL;
+  for(const auto &tf : fields) {
+    if(tf.number == 9) {
+      raw = &tf;
+    } else {
+      meta.append((const char *)tf.begin, tf.end - tf.begin);
+    }
+  }
+
+  onnx::TensorProto tp;
+  if(!tp.ParseFromString(meta))
+    return nullptr;
+
+  std::shared_ptr<void> mapping;
+  const uint8_t *data;
+  size_t size;
+
+  if(tp.data_location() == onnx::TensorProto_DataLocation_EXTERNAL) {
+    std::string location;
+    size_t offset = 0;
+    ssize_t length = -1;
+    for(const auto &kv : tp.external_data()) {
+      if(kv.key() == "location")
+        location = kv.value();
+      else if(kv.key() == "offset")
+        offset = strtoull(kv.value().c_str(), NULL, 10);
+      else if(kv.key() == "length")
+        length = strtoull(kv.value().c_str(), NULL, 10);
+    }
+    size_t file_size;
+    if(location.empty() || !ext.map(location, &mapping, &file_size))
+      return nullptr;
+    if(length < 0)
+      length = file_size - std::min(offset, file_size);
+    if(offset + length > file_size) {
+      fprintf(stderr, "External data for %s outside of %s\n",
+              tp.name().c_str(), location.c_str());
+      return nullptr;
+    }
+    data = (const uint8_t *)mapping.get() + offset;
+    size = length;
+  } else if(raw != NULL) {
+    mapping = pb.mapping();
+    data = raw->payload;
+    size = raw->payload_size;
+  } else {
+    return nullptr;
+  }
+
+  Dims dims;
+  for(const auto &dim : tp.dims()) {
+    dims.push_back(dim);
+  }
+
+  const auto dt = DataType_map(tp.data_type());
+  const size_t element_size = Tensor::DataTypeSize(dt);
+  if(size != dims.elements() * element_size) {
+    fprintf(stderr, "Unable to load %s: Size mismatch\n", tp.name().c_str());
+    abort();
+  }
+
+  // Protobuf doesn't align bytes fields, copy the odd ones
+  if((uintptr_t)data % element_size) {
+    auto t = makeCPUTensor(dt, dims, tp.name());
+    memcpy(t->access()->data(), data, size);
+    return t;
+  }
+
+  return makeMappedCPUTensor(dt, dims, mapping, (void *)data, tp.name());
+}
+
+
 static shared_ptr<Tensor>
 find_tensor(Graph &g, const std::string &name)
 {
@@ -627,7 +827,8 @@ make_dropout(Graph &g, const onnx::NodeProto &np, const Attributes &attribs)
 
 
 static bool
-loadgraph(Graph &g, const onnx::GraphProto &gp)
+loadgraph(Graph &g, const onnx::GraphProto &gp,
+          const std::vector<shared_ptr<Tensor>> &initializers)
 {
   for(const auto &vip : gp.input()) {
     auto t = make_tensor(vip);
@@ -635,13 +836,20 @@ loadgraph(Graph &g, const onnx::GraphProto &gp)
     g.inputs_.insert(t);
   }
 
-  for(const auto &tp : gp.initializer()) {
-
-    auto it = g.tensors_.find(tp.name());
+  auto add_initializer = [&](const std::string &name, shared_ptr<Tensor> t) {
+    auto it = g.tensors_.find(name);
     if(it != g.tensors_.end()) {
       g.inputs_.erase(it->second);
     }
-    g.tensors_[tp.name()] = make_tensor(tp);
+    g.tensors_[name] = t;
+  };
+
+  for(const auto &t : initializers) {
+    add_initializer(*t->name_, t);
+  }
+
+  for(const auto &tp : gp.initializer()) {
+    add_initializer(tp.name(), make_tensor(tp));
   }
 
   for(const auto &np : gp.node()) {
@@ -725,11 +933,46 @@ Graph::load(const char *path)
   if(pb == NULL)
     return nullptr;
 
-  onnx::ModelProto mp;
-  if(!mp.ParseFromCodedStream(pb.get()))
+  // External data locations are relative to the model file
+  ExternalFiles ext;
+  const char *slash = strrchr(path, '/');
+  if(slash != NULL)
+    ext.dir_ = std::string(path, slash - path + 1);
+
+  // GraphProto (ModelProto field 7) with the initializers (field 5) we
+  // could map left out
+  std::string graph;
+  std::vector<shared_ptr<Tensor>> initializers;
+
+  std::vector<PBField> model;
+  if(!pb_fields(pb->data(), pb->size(), model)) {
+    fprintf(stderr, "Failed to parse %s\n", path);
     return nullptr;
+  }
+
+  for(const auto &mf : model) {
+    if(mf.number != 7 || mf.payload == NULL)
+      continue;
+    std::vector<PBField> fields;
+    if(!pb_fields(mf.payload, mf.payload_size, fields)) {
+      fprintf(stderr, "Failed to parse graph in %s\n", path);
+      return nullptr;
+    }
+    for(const auto &f : fields) {
+      if(f.number == 5 && f.payload != NULL) {
+        auto t = map_initializer(f, *pb, ext);
+        if(t) {
+          initializers.push_back(t);
+          continue;
+        }
+      }
+      graph.append((const char *)f.begin, f.end - f.begin);
+    }
+  }
 
-  const auto &gp = mp.graph();
+  onnx::GraphProto gp;
+  if(!gp.ParseFromString(graph))
+    return nullptr;
 
   if(0)
     print_onnx_graph_info(gp);
@@ -737,7 +980,7 @@ Graph::load(const char *path)
 
   auto g = make_shared<Graph>();
 
-  if(!loadgraph(*g.get(), gp))
+  if(!loadgraph(*g.get(), gp, initializers))
     return nullptr;
 
   return g;
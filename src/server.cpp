@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2019, Andreas Smas
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "saga.h"
+#include "tensor.h"
+
+namespace saga {
+
+typedef std::chrono::steady_clock Clock;
+
+//------------------------------------------------------------------------
+
+/**
+ * One element of a batch tensor as seen through the TensorAccess handed
+ * to a batch accessor. Lets copy_tensor() move a request in or out of
+ * its row without going through get() / set() for each element
+ */
+class BatchRowAccess : public TensorAccess {
+public:
+  BatchRowAccess(TensorAccess &ta, int row, size_t element_size)
+    : ta_(ta)
+    , row_(row)
+    , strides_(ta.strides())
+    , element_size_(element_size)
+  {}
+
+  Dims strides() override { return strides_; }
+
+  void *data() override {
+    char *data = (char *)ta_.data();
+    if(data == NULL)
+      return NULL;
+    return data + (size_t)row_ * strides_[0] * element_size_;
+  }
+
+  void copyBytesFrom(const Dims &element,
+                     const void *data, size_t size) override {
+    ta_.copyBytesFrom(batchElement(element), data, size);
+  }
+
+  double get(const Dims &element) override {
+    return ta_.get(batchElement(element));
+  }
+
+  void set(const Dims &element, double value) override {
+    ta_.set(batchElement(element), value);
+  }
+
+private:
+  Dims batchElement(const Dims &element) const {
+    Dims e = element;
+    e[0] = row_;
+    return e;
+  }
+
+  TensorAccess &ta_;
+  const int row_;
+  const Dims strides_;
+  const size_t element_size_;
+};
+
+
+class BatchRow : public Tensor {
+public:
+  BatchRow(TensorAccess &ta, int row, Tensor::DataType data_type,
+           const Dims &dims)
+    : Tensor(data_type, dims.n(1))
+    , ta_(ta)
+    , row_(row)
+  {}
+
+  std::unique_ptr<TensorAccess> access() override {
+    return std::make_unique<BatchRowAccess>(ta_, row_,
+                                            DataTypeSize(data_type_));
+  }
+
+private:
+  TensorAccess &ta_;
+  const int row_;
+};
+
+
+//------------------------------------------------------------------------
+
+struct InferenceRequest {
+  std::shared_ptr<Tensor> input;
+  std::promise<std::shared_ptr<Tensor>> result;
+  Clock::time_point arrival;
+};
+
+
+class DynamicBatchServer;
+
+struct BatchWorker {
+  int batch_size;
+  std::shared_ptr<Program> program;
+  std::thread thread;
+  bool idle = true;
+
+  // Requests of the batch being executed, accessed by the accessors
+  std::vector<InferenceRequest> batch;
+};
+
+
+class DynamicBatchServer : public InferenceServer {
+public:
+  DynamicBatchServer(const InferenceServerConfig &config,
+                     std::shared_ptr<Tensor> input,
+                     std::shared_ptr<Tensor> output)
+    : max_delay_(std::chrono::microseconds(config.max_delay_us))
+    , input_(input)
+    , output_(output)
+  {}
+
+  ~DynamicBatchServer();
+
+  std::future<std::shared_ptr<Tensor>> infer(std::shared_ptr<Tensor> input) override;
+
+  InferenceServerStats stats() override;
+
+  bool start(const std::shared_ptr<Context> &ctx, const Graph &g,
+             const InferenceServerConfig &config);
+
+private:
+  void run(BatchWorker *w);
+  BatchWorker *pick(size_t queued) const;
+  void load(BatchWorker *w, TensorAccess &ta);
+  void store(BatchWorker *w, TensorAccess &ta);
+
+  const Clock::duration max_delay_;
+  const std::shared_ptr<Tensor> input_;
+  const std::shared_ptr<Tensor> output_;
+
+  // Sorted on batch size
+  std::vector<std::unique_ptr<BatchWorker>> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<InferenceRequest> queue_;
+  bool stop_ = false;
+
+  // Latencies of the most recent requests, in us
+  static const size_t LATENCY_HISTORY = 4096;
+  std::vector<float> latencies_;
+  size_t latency_index_ = 0;
+  long requests_ = 0;
+  long batches_ = 0;
+  long rows_ = 0;
+};
+
+
+bool
+DynamicBatchServer::start(const std::shared_ptr<Context> &ctx,
+                          const Graph &g,
+                          const InferenceServerConfig &config)
+{
+  auto batch_sizes = config.batch_sizes;
+  std::sort(batch_sizes.begin(), batch_sizes.end());
+  batch_sizes.erase(std::unique(batch_sizes.begin(), batch_sizes.end()),
+                    batch_sizes.end());
+
+  for(int bs : batch_sizes) {
+    if(bs < 1)
+      continue;
+    auto w = std::make_unique<BatchWorker>();
+    auto wp = w.get();
+    w->batch_size = bs;
+
+    BatchTensorAccessors accessors;
+    accessors.push_back({Phase::PRE, Which::VALUE, Mode::INFER, input_,
+                         [this, wp](TensorAccess &ta, long batch) {
+                           load(wp, ta);
+                         }});
+    accessors.push_back({Phase::POST, Which::VALUE, Mode::INFER, output_,
+                         [this, wp](TensorAccess &ta, long batch) {
+                           store(wp, ta);
+                         }});
+
+    w->program = ctx->createProgram(g, {
+        .inference = true,
+        .training = false,
+        .batch_size = bs,
+        .initial_learning_rate = 0,
+        .tensor_layout = config.tensor_layout,
+        .program_cache = config.program_cache,
+        .cuda_graph = config.cuda_graph,
+      }, accessors);
+
+    if(!w->program) {
+      fprintf(stderr, "Unable to create program for batch size %d\n", bs);
+      return false;
+    }
+    workers_.push_back(std::move(w));
+  }
+
+  if(workers_.empty()) {
+    fprintf(stderr, "No valid batch sizes for inference server\n");
+    return false;
+  }
+
+  for(auto &w : workers_) {
+    auto wp = w.get();
+    w->thread = std::thread([this, wp] { run(wp); });
+  }
+  return true;
+}
+
+
+DynamicBatchServer::~DynamicBatchServer()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+    cond_.notify_all();
+  }
+  for(auto &w : workers_) {
+    if(w->thread.joinable())
+      w->thread.join();
+  }
+  for(auto &r : queue_)
+    r.result.set_value(nullptr);
+}
+
+
+std::future<std::shared_ptr<Tensor>>
+DynamicBatchServer::infer(std::shared_ptr<Tensor> input)
+{
+  InferenceRequest r;
+  auto f = r.result.get_future();
+
+  if(input == nullptr ||
+     input->elements_ * input_->dims_[0] != input_->elements_) {
+    fprintf(stderr, "Inference request does not match input %s\n",
+            input_->info().c_str());
+    r.result.set_value(nullptr);
+    return f;
+  }
+
+  r.input = input;
+  r.arrival = Clock::now();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  queue_.push_back(std::move(r));
+  cond_.notify_all();
+  return f;
+}
+
+
+// The smallest idle program the queued requests fit in, or the largest
+// idle program if they don't fit in any
+BatchWorker *
+DynamicBatchServer::pick(size_t queued) const
+{
+  BatchWorker *largest = NULL;
+  for(const auto &w : workers_) {
+    if(!w->idle)
+      continue;
+    if((size_t)w->batch_size >= queued)
+      return w.get();
+    largest = w.get();
+  }
+  return largest;
+}
+
+
+void
+DynamicBatchServer::run(BatchWorker *w)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while(!stop_) {
+    if(queue_.empty()) {
+      cond_.wait(lock);
+      continue;
+    }
+
+    // Hold back until the batch fills the largest idle program or the
+    // oldest request is due
+    size_t largest_idle = 0;
+    for(const auto &o : workers_) {
+      if(o->idle)
+        largest_idle = std::max(largest_idle, (size_t)o->batch_size);
+    }
+
+    const auto deadline = queue_.front().arrival + max_delay_;
+    if(queue_.size() < largest_idle && Clock::now() < deadline) {
+      cond_.wait_until(lock, deadline);
+      continue;
+    }
+
+    if(pick(queue_.size()) != w) {
+      cond_.wait(lock);
+      continue;
+    }
+
+    const size_t n = std::min(queue_.size(), (size_t)w->batch_size);
+    for(size_t i = 0; i < n; i++) {
+      w->batch.push_back(std::move(queue_.front()));
+      queue_.pop_front();
+    }
+    w->idle = false;
+    batches_++;
+    rows_ += w->batch_size;
+    cond_.notify_all();
+
+    lock.unlock();
+    w->program->infer(1);
+
+    // Requests not answered by the POST accessor
+    for(auto &r : w->batch) {
+      if(r.input)
+        r.result.set_value(nullptr);
+    }
+    w->batch.clear();
+    lock.lock();
+
+    w->idle = true;
+    cond_.notify_all();
+  }
+}
+
+
+void
+DynamicBatchServer::load(BatchWorker *w, TensorAccess &ta)
+{
+  for(int i = 0; i < w->batch_size; i++) {
+    BatchRow row(ta, i, input_->data_type_, input_->dims_);
+    if(i < (int)w->batch.size()) {
+      row.copyFrom(*w->batch[i].input);
+      continue;
+    }
+
+    // Padding
+    auto ra = row.access();
+    void *data = ra->data();
+    if(data != NULL)
+      memset(data, 0, ra->strides()[0] * Tensor::DataTypeSize(input_->data_type_));
+  }
+}
+
+
+void
+DynamicBatchServer::store(BatchWorker *w, TensorAccess &ta)
+{
+  const auto now = Clock::now();
+  std::vector<float> latencies;
+
+  for(int i = 0; i < (int)w->batch.size(); i++) {
+    auto &r = w->batch[i];
+    BatchRow row(ta, i, output_->data_type_, output_->dims_);
+    auto result = makeCPUTensor(output_->data_type_, output_->dims_.n(1),
+                                output_->name_);
+    result->copyFrom(row);
+    r.result.set_value(result);
+    r.input.reset();
+
+    latencies.push_back(std::chrono::duration<float, std::micro>(now - r.arrival).count());
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for(float l : latencies) {
+    if(latencies_.size() < LATENCY_HISTORY) {
+      latencies_.push_back(l);
+    } else {
+      latencies_[latency_index_] = l;
+      latency_index_ = (latency_index_ + 1) % LATENCY_HISTORY;
+    }
+  }
+  requests_ += latencies.size();
+}
+
+
+InferenceServerStats
+DynamicBatchServer::stats()
+{
+  std::vector<float> l;
+  InferenceServerStats s;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    l = latencies_;
+    s.requests = requests_;
+    s.batches = batches_;
+    s.mean_batch_fill = rows_ ? (double)requests_ / rows_ : 0;
+  }
+
+  if(l.empty())
+    return s;
+
+  std::sort(l.begin(), l.end());
+  s.p50_us = l[l.size() / 2];
+  s.p99_us = l[std::min(l.size() - 1, l.size() * 99 / 100)];
+  s.max_us = l.back();
+  return s;
+}
+
+
+void
+InferenceServerStats::print() const
+{
+  printf("%ld requests in %ld batches, %.1f%% fill\n",
+         requests, batches, mean_batch_fill * 100);
+  printf("Latency p50: %.0fus  p99: %.0fus  max: %.0fus\n",
+         p50_us, p99_us, max_us);
+}
+
+
+//------------------------------------------------------------------------
+
+static std::shared_ptr<Tensor>
+only_tensor(const std::unordered_set<std::shared_ptr<Tensor>> &tensors,
+            const char *what)
+{
+  if(tensors.size() != 1) {
+    fprintf(stderr, "Graph has %zd %s tensors, specify which to serve\n",
+            tensors.size(), what);
+    return nullptr;
+  }
+  return *tensors.begin();
+}
+
+
+std::shared_ptr<InferenceServer>
+createInferenceServer(const std::shared_ptr<Context> &ctx,
+                      const Graph &g,
+                      const InferenceServerConfig &config)
+{
+  auto input = config.input ? config.input : only_tensor(g.inputs_, "input");
+  auto output = config.output ? config.output : only_tensor(g.outputs_,
+                                                            "output");
+  if(!input || !output)
+    return nullptr;
+
+  auto s = std::make_shared<DynamicBatchServer>(config, input, output);
+  if(!s->start(ctx, g, config))
+    return nullptr;
+  return s;
+}
+
+}
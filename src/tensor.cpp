@@ -33,6 +33,7 @@
 
 #include <random>
 #include <sstream>
+#include <thread>
 
 #include <inttypes.h>
 #include <x86intrin.h>
@@ -94,6 +95,12 @@ get_u8(const void *base, size_t offset)
   return ((const uint8_t *)base)[offset];
 }
 
+static double
+get_i8(const void *base, size_t offset)
+{
+  return ((const int8_t *)base)[offset];
+}
+
 static double
 get_i64(const void *base, size_t offset)
 {
@@ -124,6 +131,12 @@ set_u8(void *base, size_t offset, double v)
   ((uint8_t *)base)[offset] = v;
 }
 
+static void
+set_i8(void *base, size_t offset, double v)
+{
+  ((int8_t *)base)[offset] = v;
+}
+
 static void
 set_i64(void *base, size_t offset, double v)
 {
@@ -145,6 +158,7 @@ datatype_get(Tensor::DataType dt)
   case Tensor::DataType::FLOAT: return &get_float;
   case Tensor::DataType::INT64: return &get_i64;
   case Tensor::DataType::I32:   return &get_i32;
+  case Tensor::DataType::I8:    return &get_i8;
   default: abort();
   }
 }
@@ -158,6 +172,7 @@ datatype_set(Tensor::DataType dt)
   case Tensor::DataType::FLOAT: return &set_float;
   case Tensor::DataType::INT64: return &set_i64;
   case Tensor::DataType::I32:   return &set_i32;
+  case Tensor::DataType::I8:    return &set_i8;
   default: abort();
   }
 }
@@ -172,6 +187,7 @@ datatype_str(Tensor::DataType dt)
   case Tensor::DataType::FLOAT: return "float";
   case Tensor::DataType::INT64: return "i64";
   case Tensor::DataType::I32:   return "i32";
+  case Tensor::DataType::I8:    return "i8";
   default: return "?";
   }
 }
@@ -185,6 +201,7 @@ Tensor::DataTypeSize(DataType dt)
   case Tensor::DataType::FLOAT: return 4;
   case Tensor::DataType::INT64: return 8;
   case Tensor::DataType::I32:   return 4;
+  case Tensor::DataType::I8:    return 1;
   default: abort();
   }
 }
@@ -261,32 +278,32 @@ Tensor::stats()
   }
   Dims c(dims_.size(), 0);
 
+  // Welford's method, sum of squares minus squared mean loses all
+  // precision for values far from zero
   double max = -INFINITY;
   double min = INFINITY;
-  double sum = 0;
+  double mean = 0;
+  double m2 = 0;
+  int64_t count = 0;
+  int64_t nans = 0;
+  int64_t infs = 0;
 
   for(int64_t i = 0; i < elements_; i++) {
     const double v = ta->get(c);
 
-    max = std::max(max, v);
-    min = std::min(min, v);
-    sum += v;
-
-    for(ssize_t j = c.size() - 1; j >= 0; j--) {
-      c[j]++;
-      if(c[j] == dims_[j]) {
-        c[j] = 0;
-      } else {
-        break;
-      }
+    if(isnan(v)) {
+      nans++;
+    } else if(isinf(v)) {
+      infs++;
+    } else {
+      max = std::max(max, v);
+      min = std::min(min, v);
+      count++;
+      const double d = v - mean;
+      mean += d / count;
+      m2 += d * (v - mean);
     }
-  }
 
-  const double mean = sum / elements_;
-  double sum2 = 0;
-  for(int64_t i = 0; i < elements_; i++) {
-    const double v = ta->get(c) - mean;
-    sum2 += v * v;
     for(ssize_t j = c.size() - 1; j >= 0; j--) {
       c[j]++;
       if(c[j] == dims_[j]) {
@@ -296,8 +313,21 @@ Tensor::stats()
       }
     }
   }
-  return Stats({.min = min, .max = max, .mean = mean,
-        .stddev = sqrt(sum2 / elements_)});
+  return Stats({.min = count ? min : 0, .max = count ? max : 0,
+        .mean = mean, .stddev = count ? sqrt(m2 / count) : 0,
+        .nans = nans, .infs = infs});
+}
+
+
+Tensor::Stats
+Tensor::statsFromSums(double min, double max, double sum, double sum2,
+                      int64_t count, int64_t nans, int64_t infs)
+{
+  // Rounding can leave the difference slightly negative
+  const double mean = count ? sum / count : 0;
+  const double var = count ? std::max(0.0, sum2 / count - mean * mean) : 0;
+  return Stats({.min = count ? min : 0, .max = count ? max : 0,
+        .mean = mean, .stddev = sqrt(var), .nans = nans, .infs = infs});
 }
 
 
@@ -306,8 +336,12 @@ Tensor::statsString(void)
 {
   auto s = stats();
   char buf[512];
-  snprintf(buf, sizeof(buf), "{min:%f mean:%f max:%f stddev:%f}",
-           s.min, s.mean, s.max, s.stddev);
+  int len = snprintf(buf, sizeof(buf), "{min:%f mean:%f max:%f stddev:%f",
+                     s.min, s.mean, s.max, s.stddev);
+  if(s.nans || s.infs)
+    len += snprintf(buf + len, sizeof(buf) - len, " nan:%ld inf:%ld",
+                    (long)s.nans, (long)s.infs);
+  snprintf(buf + len, sizeof(buf) - len, "}");
   return std::string(buf);
 }
 
@@ -316,8 +350,11 @@ void
 Tensor::printStats(const char *prefix)
 {
   auto s = stats();
-  printf("%s: min:%f max:%f mean:%f stddev:%f\n", prefix,
+  printf("%s: min:%f max:%f mean:%f stddev:%f", prefix,
          s.min, s.max, s.mean, s.stddev);
+  if(s.nans || s.infs)
+    printf(" nan:%ld inf:%ld", (long)s.nans, (long)s.infs);
+  printf("\n");
 }
 
 
@@ -560,27 +597,198 @@ DimInfo::reduce(std::vector<DimInfo> &dis)
 
 
 
+// Innermost runs of a copy. dst is always contiguous
+
 template< typename T > static void
-copy_tensor_T(T *dst, const T *src, int rank, const DimInfo *di)
+copy_run(T *dst, const T *src, int n, int src_stride)
+{
+  if(src_stride == 1) {
+    memcpy(dst, src, n * sizeof(T));
+  } else {
+    for(int i = 0; i < n; i++) {
+      dst[i] = src[i * src_stride];
+    }
+  }
+}
+
+
+// Same conversion as going through TensorAccess::get()
+template< typename D, typename S > static void
+convert_run(D *dst, const S *src, int n, int src_stride)
+{
+  for(int i = 0; i < n; i++) {
+    dst[i] = (double)src[i * src_stride];
+  }
+}
+
+
+static void
+float_to_half_run(uint16_t *dst, const float *src, int n, int src_stride)
+{
+  int i = 0;
+#ifdef __F16C__
+  if(src_stride == 1) {
+    for(; i + 8 <= n; i += 8) {
+      const __m256 v = _mm256_loadu_ps(src + i);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(v, 0));
+    }
+  }
+#endif
+  for(; i < n; i++) {
+    dst[i] = _cvtss_sh(src[i * src_stride], 0);
+  }
+}
+
+
+static void
+half_to_float_run(float *dst, const uint16_t *src, int n, int src_stride)
+{
+  int i = 0;
+#ifdef __F16C__
+  if(src_stride == 1) {
+    for(; i + 8 <= n; i += 8) {
+      const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+      _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(v));
+    }
+  }
+#endif
+  for(; i < n; i++) {
+    dst[i] = _cvtsh_ss(src[i * src_stride]);
+  }
+}
+
+
+template< typename D, typename S, typename F > static void
+copy_tensor_R(D *dst, const S *src, int rank, const DimInfo *di, F run)
 {
   const int n = di->size;
   const int src_stride = di->src_stride;
   const int dst_stride = di->dst_stride;
   if(rank == 1) {
     assert(dst_stride == 1);
-    if(src_stride == 1 && n >= 64) {
-      memcpy(dst, src, n * sizeof(T));
-    } else {
-      for(int i = 0; i < n; i++) {
-        dst[i] = src[i * src_stride];
-      }
-    }
+    run(dst, src, n, src_stride);
     return;
   }
   rank--;
   di++;
   for(int i = 0; i < n; i++) {
-    copy_tensor_T(dst + i * dst_stride, src + i * src_stride, rank, di);
+    copy_tensor_R(dst + i * dst_stride, src + i * src_stride, rank, di, run);
+  }
+}
+
+
+/**
+ * Large copies are split over threads along the outermost dimension
+ * (or the only one, for a single contiguous run)
+ */
+#define PARALLEL_COPY_BYTES_PER_THREAD (2 * 1024 * 1024)
+#define PARALLEL_COPY_MAX_THREADS 8
+
+template< typename D, typename S, typename F > static void
+copy_tensor_P(D *dst, const S *src, const std::vector<DimInfo> &dis, F run)
+{
+  const int rank = dis.size();
+  const int n = dis[0].size;
+  int64_t bytes = sizeof(D);
+  for(const auto &d : dis)
+    bytes *= d.size;
+
+  const int threads =
+    std::min<int64_t>({bytes / PARALLEL_COPY_BYTES_PER_THREAD,
+                       std::thread::hardware_concurrency(),
+                       PARALLEL_COPY_MAX_THREADS, n});
+  if(threads < 2) {
+    copy_tensor_R(dst, src, rank, &dis[0], run);
+    return;
+  }
+
+  auto part = [&](int start, int end) {
+    const DimInfo &di = dis[0];
+    if(rank == 1) {
+      run(dst + start, src + (int64_t)start * di.src_stride,
+          end - start, di.src_stride);
+      return;
+    }
+    for(int i = start; i < end; i++) {
+      copy_tensor_R(dst + (int64_t)i * di.dst_stride,
+                    src + (int64_t)i * di.src_stride,
+                    rank - 1, &dis[1], run);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for(int i = 1; i < threads; i++)
+    workers.push_back(std::thread(part, (int64_t)n * i / threads,
+                                  (int64_t)n * (i + 1) / threads));
+  part(0, n / threads);
+  for(auto &w : workers)
+    w.join();
+}
+
+
+template< typename D > static bool
+convert_tensor(D *dst, const void *src, Tensor::DataType src_type,
+               const std::vector<DimInfo> &dis)
+{
+  switch(src_type) {
+  case Tensor::DataType::U8:
+    copy_tensor_P(dst, (const uint8_t *)src, dis, convert_run<D, uint8_t>);
+    break;
+  case Tensor::DataType::I8:
+    copy_tensor_P(dst, (const int8_t *)src, dis, convert_run<D, int8_t>);
+    break;
+  case Tensor::DataType::FLOAT:
+    copy_tensor_P(dst, (const float *)src, dis, convert_run<D, float>);
+    break;
+  case Tensor::DataType::I32:
+    copy_tensor_P(dst, (const int32_t *)src, dis, convert_run<D, int32_t>);
+    break;
+  case Tensor::DataType::INT64:
+    copy_tensor_P(dst, (const int64_t *)src, dis, convert_run<D, int64_t>);
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+
+// Conversion between data types when the source is in host memory.
+// Returns false for combinations left to the TensorAccess::get() path
+static bool
+convert_tensor(void *dst, Tensor::DataType dst_type,
+               const void *src, Tensor::DataType src_type,
+               const std::vector<DimInfo> &dis)
+{
+  if(dst_type == Tensor::DataType::HALF) {
+    if(src_type != Tensor::DataType::FLOAT)
+      return false;
+    copy_tensor_P((uint16_t *)dst, (const float *)src, dis,
+                  float_to_half_run);
+    return true;
+  }
+
+  if(src_type == Tensor::DataType::HALF) {
+    if(dst_type != Tensor::DataType::FLOAT)
+      return false;
+    copy_tensor_P((float *)dst, (const uint16_t *)src, dis,
+                  half_to_float_run);
+    return true;
+  }
+
+  switch(dst_type) {
+  case Tensor::DataType::U8:
+    return convert_tensor((uint8_t *)dst, src, src_type, dis);
+  case Tensor::DataType::I8:
+    return convert_tensor((int8_t *)dst, src, src_type, dis);
+  case Tensor::DataType::FLOAT:
+    return convert_tensor((float *)dst, src, src_type, dis);
+  case Tensor::DataType::I32:
+    return convert_tensor((int32_t *)dst, src, src_type, dis);
+  case Tensor::DataType::INT64:
+    return convert_tensor((int64_t *)dst, src, src_type, dis);
+  default:
+    return false;
   }
 }
 
@@ -684,17 +892,22 @@ copy_tensor(void *dst,
     // We can copy using recursive strided copies
     switch(datatype) {
     case Tensor::DataType::U8:
-      copy_tensor_T((uint8_t *)dst, (const uint8_t *)src, dis.size(), &dis[0]);
+    case Tensor::DataType::I8:
+      copy_tensor_P((uint8_t *)dst, (const uint8_t *)src, dis,
+                    copy_run<uint8_t>);
       break;
     case Tensor::DataType::HALF:
-      copy_tensor_T((uint16_t *)dst, (const uint16_t *)src, dis.size(), &dis[0]);
+      copy_tensor_P((uint16_t *)dst, (const uint16_t *)src, dis,
+                    copy_run<uint16_t>);
       break;
     case Tensor::DataType::FLOAT:
     case Tensor::DataType::I32:
-      copy_tensor_T((uint32_t *)dst, (const uint32_t *)src, dis.size(), &dis[0]);
+      copy_tensor_P((uint32_t *)dst, (const uint32_t *)src, dis,
+                    copy_run<uint32_t>);
       break;
     case Tensor::DataType::INT64:
-      copy_tensor_T((uint64_t *)dst, (const uint64_t *)src, dis.size(), &dis[0]);
+      copy_tensor_P((uint64_t *)dst, (const uint64_t *)src, dis,
+                    copy_run<uint64_t>);
       break;
     default:
       fprintf(stderr, "%s can't handle %s\n", __FUNCTION__, datatype_str(datatype));
@@ -703,6 +916,14 @@ copy_tensor(void *dst,
     return true;
   }
 
+  if(src != NULL) {
+    // The reduced plan has no use for src_dim so work on a copy
+    std::vector<DimInfo> reduced = dis;
+    DimInfo::reduce(reduced);
+    if(convert_tensor(dst, datatype, src, t.data_type_, reduced))
+      return true;
+  }
+
   Dims selem(t.dims_.size(), 0);
   switch(datatype) {
   case Tensor::DataType::U8:
@@ -717,6 +938,9 @@ copy_tensor(void *dst,
   case Tensor::DataType::I32:
     copy_tensor_T((int32_t *)dst, ta.get(), selem, dis.size(), &dis[0]);
     break;
+  case Tensor::DataType::I8:
+    copy_tensor_T((int8_t *)dst, ta.get(), selem, dis.size(), &dis[0]);
+    break;
   case Tensor::DataType::INT64:
     copy_tensor_T((int64_t *)dst, ta.get(), selem, dis.size(), &dis[0]);
     break;
@@ -944,14 +1168,26 @@ public:
     data_ = data;
   }
 
+  HostTensorStorage(Tensor::DataType data_type,
+                    std::shared_ptr<void> mapping, void *data)
+    : TensorStorage(data_type)
+    , buffer_size_(0)
+    , mmaped_(NULL)
+    , mapping_(mapping)
+  {
+    data_ = data;
+  }
+
   ~HostTensorStorage()
   {
     if(mmaped_) {
       munmap(mmaped_, buffer_size_);
-    } else {
+    } else if(!mapping_) {
       free(data_);
     }
   }
+
+  const std::shared_ptr<void> mapping_;
 };
 
 
@@ -1115,21 +1351,125 @@ makeCPUTensor(Tensor::DataType data_type, const Dims &size,
 }
 
 
+std::shared_ptr<Tensor>
+makeMappedCPUTensor(Tensor::DataType data_type, const Dims &size,
+                    std::shared_ptr<void> mapping, void *data,
+                    const std::optional<const std::string> &name,
+                    const Dims &strides)
+{
+  auto storage = std::make_shared<HostTensorStorage>(data_type, mapping, data);
+  return std::make_shared<CPUTensor>(size, strides.empty() ?
+                                     computeCPUStrides(size) : strides,
+                                     storage, 0, name);
+}
+
+
 //------------------------------------------------------------------------
 // Raw tensor disk IO.
 
-typedef enum {
-  TENSOR_DISK_FLOAT = 0,
-  TENSOR_DISK_HALF  = 1,
-} TensorDiskType;
-
 struct TensorDiskHeader {
   uint8_t magic[8];
-  TensorDiskType type;
+  uint32_t type;
   unsigned int rank;
 } __attribute__((packed));
 
 
+bool
+tensor_disk_type(Tensor::DataType data_type, uint32_t *type)
+{
+  switch(data_type) {
+  case Tensor::DataType::FLOAT:
+    *type = TENSOR_DISK_FLOAT;
+    return true;
+  case Tensor::DataType::HALF:
+    *type = TENSOR_DISK_HALF;
+    return true;
+  case Tensor::DataType::U8:
+    *type = TENSOR_DISK_U8;
+    return true;
+  case Tensor::DataType::I32:
+    *type = TENSOR_DISK_I32;
+    return true;
+  case Tensor::DataType::INT64:
+    *type = TENSOR_DISK_INT64;
+    return true;
+  case Tensor::DataType::I8:
+    *type = TENSOR_DISK_I8;
+    return true;
+  }
+  return false;
+}
+
+
+bool
+tensor_data_type(uint32_t type, Tensor::DataType *data_type)
+{
+  switch(type) {
+  case TENSOR_DISK_FLOAT:
+    *data_type = Tensor::DataType::FLOAT;
+    return true;
+  case TENSOR_DISK_HALF:
+    *data_type = Tensor::DataType::HALF;
+    return true;
+  case TENSOR_DISK_U8:
+    *data_type = Tensor::DataType::U8;
+    return true;
+  case TENSOR_DISK_I32:
+    *data_type = Tensor::DataType::I32;
+    return true;
+  case TENSOR_DISK_INT64:
+    *data_type = Tensor::DataType::INT64;
+    return true;
+  case TENSOR_DISK_I8:
+    *data_type = Tensor::DataType::I8;
+    return true;
+  }
+  return false;
+}
+
+
+static bool
+write_all(int fd, const void *data, size_t size)
+{
+  const char *p = (const char *)data;
+  while(size) {
+    ssize_t r = write(fd, p, size);
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+    p += r;
+    size -= r;
+  }
+  return true;
+}
+
+
+bool
+tensor_write(int fd, Tensor &t)
+{
+  const size_t size = t.elements_ * Tensor::DataTypeSize(t.data_type_);
+  const auto packed = computeCPUStrides(t.dims_);
+
+  {
+    // Tensors already packed in row-major order are written as is
+    auto ta = t.access();
+    if(ta == nullptr)
+      return false;
+    if(ta->strides() == packed) {
+      const void *data = ta->data();
+      if(data != NULL)
+        return write_all(fd, data, size);
+    }
+  }
+
+  CPUTensor copy(t.data_type_, t.dims_, std::nullopt);
+  copy.copyFrom(t);
+  return write_all(fd, copy.access()->data(), size);
+}
+
+
 std::shared_ptr<Tensor>
 Tensor::load(const char *path, const std::optional<const std::string> &name)
 {
@@ -1169,14 +1509,7 @@ Tensor::load(const char *path, const std::optional<const std::string> &name)
 
   Tensor::DataType data_type;
 
-  switch(tdh->type) {
-  case TENSOR_DISK_FLOAT:
-    data_type = Tensor::DataType::FLOAT;
-    break;
-  case TENSOR_DISK_HALF:
-    data_type = Tensor::DataType::HALF;
-    break;
-  default:
+  if(!tensor_data_type(tdh->type, &data_type)) {
     fprintf(stderr, "Unable to load %s -- Unsupported data type:%d\n",
             path, tdh->type);
     munmap(mem, st.st_size);
@@ -1222,18 +1555,13 @@ Tensor::save(const char *path)
   TensorDiskHeader tdh;
   memcpy(&tdh.magic, "sagaT001", 8);
 
-  switch(data_type_) {
-  case Tensor::DataType::FLOAT:
-    tdh.type = TENSOR_DISK_FLOAT;
-    break;
-  case Tensor::DataType::HALF:
-    tdh.type = TENSOR_DISK_HALF;
-    break;
-  default:
-    fprintf(stderr, "Unable to load %s -- Unsupported data type:%d\n",
+  uint32_t type;
+  if(!tensor_disk_type(data_type_, &type)) {
+    fprintf(stderr, "Unable to save %s -- Unsupported data type:%d\n",
             path, (int)data_type_);
     return false;
   }
+  tdh.type = type;
 
   int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
   if(fd == -1) {
@@ -1243,33 +1571,14 @@ Tensor::save(const char *path)
 
   tdh.rank = dims_.size();
 
-  if(write(fd, &tdh, sizeof(tdh)) != sizeof(tdh)) {
-    fprintf(stderr, "Unable to save %s -- %s\n", path, strerror(errno));
-    close(fd);
-    return false;
-  }
-
   uint32_t ondiskdims[tdh.rank];
   for(unsigned int i = 0; i < tdh.rank; i++) {
     ondiskdims[i] = dims_[i];
   }
 
-  if(write(fd, &ondiskdims[0], sizeof(int) * tdh.rank) !=
-     (int)(sizeof(int) * tdh.rank)) {
-    fprintf(stderr, "Unable to save %s -- %s\n", path, strerror(errno));
-    close(fd);
-    return false;
-  }
-
-  CPUTensor copy(data_type_, dims_, std::nullopt);
-  copy.copyFrom(*this);
-
-  auto ta = copy.access();
-
-  size_t size =
-    copy.strides_[0] * copy.dims_[0] * Tensor::DataTypeSize(data_type_);
-
-  if(write(fd, ta->data(), size) != (int)size) {
+  if(!write_all(fd, &tdh, sizeof(tdh)) ||
+     !write_all(fd, &ondiskdims[0], sizeof(int) * tdh.rank) ||
+     !tensor_write(fd, *this)) {
     fprintf(stderr, "Unable to save %s -- %s\n", path, strerror(errno));
     close(fd);
     return false;
@@ -43,4 +43,43 @@ bool copy_tensor(void *dst,
                  Tensor::DataType dst_datatype,
                  Tensor &src);
 
+
+// On-disk data type, shared by the tensor and checkpoint file formats
+enum TensorDiskType {
+  TENSOR_DISK_FLOAT = 0,
+  TENSOR_DISK_HALF  = 1,
+  TENSOR_DISK_U8    = 2,
+  TENSOR_DISK_I32   = 3,
+  TENSOR_DISK_INT64 = 4,
+  TENSOR_DISK_I8    = 5,
+};
+
+bool tensor_disk_type(Tensor::DataType data_type, uint32_t *type);
+
+bool tensor_data_type(uint32_t type, Tensor::DataType *data_type);
+
+// Write elements of t packed in row-major order at the current file
+// position
+bool tensor_write(int fd, Tensor &t);
+
+// CPU tensor backed by memory kept alive by 'mapping' (eg. a mmap:ed
+// file). Packed in row-major order unless strides are given
+std::shared_ptr<Tensor> makeMappedCPUTensor(Tensor::DataType data_type,
+                                            const Dims &size,
+                                            std::shared_ptr<void> mapping,
+                                            void *data,
+                                            const std::optional<const std::string> &name,
+                                            const Dims &strides = Dims());
+
+
+struct CheckpointItem {
+  std::string name;
+  std::shared_ptr<Tensor> tensor;
+  bool optimizer;
+};
+
+// Write a single file checkpoint, see Graph::saveCheckpoint()
+bool checkpoint_write(const char *path,
+                      const std::vector<CheckpointItem> &items);
+
 };
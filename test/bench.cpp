@@ -0,0 +1,302 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "saga.h"
+#include "cli.h"
+#include "test_classifier.h"
+
+using namespace saga;
+
+
+static int64_t
+get_ts(void)
+{
+  struct timespec tv;
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return (int64_t)tv.tv_sec * 1000000LL + (tv.tv_nsec / 1000);
+}
+
+
+static std::vector<std::string>
+split(const char *str)
+{
+  std::vector<std::string> r;
+  std::string s(str);
+  size_t pos = 0;
+  while(1) {
+    size_t e = s.find(',', pos);
+    r.push_back(s.substr(pos, e == std::string::npos ? e : e - pos));
+    if(e == std::string::npos)
+      break;
+    pos = e + 1;
+  }
+  return r;
+}
+
+
+struct BenchModel {
+  std::shared_ptr<Graph> graph;
+  std::shared_ptr<Tensor> labels;  // Output of catclassifier, if any
+  bool onnx;
+};
+
+
+static bool
+load_model(BenchModel &m, const std::string &name, Tensor::DataType dt)
+{
+  if(name.size() > 5 && name.compare(name.size() - 5, 5, ".onnx") == 0) {
+    if(dt != Tensor::DataType::FLOAT)
+      return false;
+    m.graph = Graph::load(name.c_str());
+    if(!m.graph) {
+      fprintf(stderr, "Failed to load model graph %s\n", name.c_str());
+      exit(1);
+    }
+    m.onnx = true;
+    return true;
+  }
+
+  m.graph = std::make_shared<Graph>();
+  m.onnx = false;
+
+  const Dims dims = name == "lecun" ? Dims({1, 1, 28, 28}) :
+    Dims({1, 3, 32, 32});
+  auto x = std::make_shared<Tensor>(Tensor::DataType::U8, dims, "input");
+  auto n = m.graph->addNode("convert", {{"x", x}},
+                            {{"scale", 1.0f / 255.0f}, {"datatype", (int)dt}});
+  n = make_network(*m.graph, n, name, 10);
+  if(!n) {
+    fprintf(stderr, "Network type %s not available\n", name.c_str());
+    exit(1);
+  }
+  n = m.graph->addNode("catclassifier", {{"x", n->y()}}, {});
+  m.graph->inputs_.insert(x);
+  m.graph->outputs_.insert(n->y());
+  m.labels = n->y();
+  return true;
+}
+
+
+static double
+percentile(const std::vector<double> &v, double p)
+{
+  size_t i = std::min(v.size() - 1, (size_t)(v.size() * p));
+  return v[i];
+}
+
+
+static const char *
+dt_name(Tensor::DataType dt)
+{
+  return dt == Tensor::DataType::HALF ? "half" : "float";
+}
+
+
+static const char *
+layout_name(TensorLayout l)
+{
+  switch(l) {
+  case TensorLayout::NCHW:
+    return "nchw";
+  case TensorLayout::NHWC:
+    return "nhwc";
+  default:
+    return "auto";
+  }
+}
+
+
+static int
+bench_main(int argc, char **argv)
+{
+  int opt;
+  int batches = 100;
+  int warmup = 10;
+  bool training = false;
+  const char *outpath = NULL;
+  std::vector<std::string> batch_sizes = {"1", "32", "256"};
+  std::vector<std::string> datatypes = {"float", "half"};
+  std::vector<std::string> layouts = {"nchw", "nhwc"};
+
+  while((opt = getopt(argc, argv, "b:d:l:n:w:to:")) != -1) {
+    switch(opt) {
+    case 'b':
+      batch_sizes = split(optarg);
+      break;
+    case 'd':
+      datatypes = split(optarg);
+      break;
+    case 'l':
+      layouts = split(optarg);
+      break;
+    case 'n':
+      batches = atoi(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 't':
+      training = true;
+      break;
+    case 'o':
+      outpath = optarg;
+      break;
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if(argc < 1 || batches < 1) {
+    fprintf(stderr, "Usage: bench [OPTIONS ...] <network|modelpath> ...\n");
+    return 1;
+  }
+
+  FILE *out = stdout;
+  if(outpath != NULL) {
+    out = fopen(outpath, "w");
+    if(out == NULL) {
+      fprintf(stderr, "Unable to open %s -- %s\n", outpath, strerror(errno));
+      return 1;
+    }
+  }
+
+  auto ctx = createContext();
+  std::string device;
+  int results = 0;
+
+  fprintf(out, "{\n  \"batches\": %d,\n  \"warmup\": %d,\n"
+          "  \"results\": [", batches, warmup);
+
+  for(int i = 0; i < argc; i++) {
+    for(const auto &dts : datatypes) {
+      const auto dt = dts == "half" ? Tensor::DataType::HALF :
+        Tensor::DataType::FLOAT;
+
+      for(const auto &ls : layouts) {
+        const auto layout = ls == "nhwc" ? TensorLayout::NHWC :
+          ls == "nchw" ? TensorLayout::NCHW : TensorLayout::Auto;
+
+        for(const auto &bss : batch_sizes) {
+          const int batch_size = atoi(bss.c_str());
+
+          for(int train = 0; train <= (int)training; train++) {
+
+            BenchModel m;
+            if(!load_model(m, argv[i], dt))
+              continue;
+            if(train && m.onnx)
+              continue;
+
+            fprintf(stderr, "%s %s %s %s batch_size:%d\n", argv[i],
+                    train ? "train" : "infer", dt_name(dt),
+                    layout_name(layout), batch_size);
+
+            const int64_t t0 = get_ts();
+            auto p = ctx->createProgram(*m.graph, {
+                .inference = !train,
+                .training = (bool)train,
+                .batch_size = batch_size,
+                .initial_learning_rate = 1e-4,
+                .tensor_layout = layout
+              });
+            const int64_t t1 = get_ts();
+
+            for(const auto &t : m.graph->inputs_) {
+              auto x = p->resolveTensor(t);
+              if(!x)
+                continue;
+              const bool u8 = x->data_type_ == Tensor::DataType::U8;
+              x->copyFrom(*Tensor::make(x->data_type_, x->dims_,
+                                        u8 ? 128 : 0, u8 ? 32 : 1));
+            }
+
+            if(m.labels) {
+              auto dy = p->resolveTensor(m.labels)->grad();
+              if(dy) {
+                auto ta = dy->access();
+                for(int j = 0; j < batch_size; j++)
+                  ta->set({j}, j % 10);
+              }
+            }
+
+            auto run = [&](long n) {
+              if(train)
+                p->train(n);
+              else
+                p->infer(n);
+            };
+
+            if(warmup)
+              run(warmup);
+
+            // Throughput with all batches in flight
+            const int64_t t2 = get_ts();
+            run(batches);
+            const int64_t t3 = get_ts();
+
+            // Latency of each batch in isolation
+            std::vector<double> lat;
+            double lat_sum = 0;
+            for(int j = 0; j < batches; j++) {
+              const int64_t ts = get_ts();
+              run(1);
+              const double ms = (get_ts() - ts) / 1e3;
+              lat.push_back(ms);
+              lat_sum += ms;
+            }
+            std::sort(lat.begin(), lat.end());
+
+            auto r = p->profileReport();
+            if(device.empty())
+              device = r.device;
+
+            fprintf(out, "%s\n    {\n", results++ ? "," : "");
+            fprintf(out,
+                    "      \"model\": \"%s\",\n"
+                    "      \"mode\": \"%s\",\n"
+                    "      \"datatype\": \"%s\",\n"
+                    "      \"layout\": \"%s\",\n"
+                    "      \"batch_size\": %d,\n"
+                    "      \"create_ms\": %.3f,\n"
+                    "      \"images_per_sec\": %.1f,\n",
+                    argv[i], train ? "train" : "infer",
+                    dt_name(dt), layout_name(layout), batch_size,
+                    (t1 - t0) / 1e3,
+                    (double)batches * batch_size * 1e6 / (t3 - t2));
+            fprintf(out,
+                    "      \"latency_ms\": {\"min\": %.3f, \"mean\": %.3f, "
+                    "\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                    "\"max\": %.3f},\n",
+                    lat[0], lat_sum / lat.size(),
+                    percentile(lat, 0.5), percentile(lat, 0.9),
+                    percentile(lat, 0.99), lat[lat.size() - 1]);
+            fprintf(out,
+                    "      \"program_memory\": %zd,\n"
+                    "      \"device_memory_used\": %zd\n"
+                    "    }",
+                    r.program_memory, r.mem_used);
+            fflush(out);
+          }
+        }
+      }
+    }
+  }
+
+  fprintf(out, "\n  ],\n  \"device\": \"%s\"\n}\n", device.c_str());
+  if(out != stdout)
+    fclose(out);
+  return 0;
+}
+
+
+SAGA_CLI_CMD("bench",
+             "bench [OPTIONS ...] <NETWORK|PATH> ...",
+             "Benchmark builtin networks and onnx models, output JSON",
+             bench_main);
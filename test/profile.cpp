@@ -0,0 +1,84 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "saga.h"
+#include "cli.h"
+
+using namespace saga;
+
+
+static int
+profile_main(int argc, char **argv)
+{
+  int opt;
+  int batch_size = 1;
+  int batches = 100;
+  int warmup = 10;
+  int verbose = 0;
+  auto tensor_layout = TensorLayout::Auto;
+
+  while((opt = getopt(argc, argv, "b:n:w:cCv")) != -1) {
+    switch(opt) {
+    case 'b':
+      batch_size = atoi(optarg);
+      break;
+    case 'n':
+      batches = atoi(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'c':
+      tensor_layout = TensorLayout::NHWC;
+      break;
+    case 'C':
+      tensor_layout = TensorLayout::NCHW;
+      break;
+    case 'v':
+      verbose++;
+      break;
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if(argc != 1) {
+    fprintf(stderr, "Usage: profile [OPTIONS ...] <modelpath>\n");
+    return 1;
+  }
+
+  auto g = Graph::load(argv[0]);
+  if(g == NULL) {
+    fprintf(stderr, "Failed to load model graph %s\n", argv[0]);
+    return 1;
+  }
+
+  auto ctx = createContext();
+  auto p = ctx->createProgram(*g, {
+      .inference = true,
+      .training = false,
+      .batch_size = batch_size,
+      .initial_learning_rate = 0,
+      .tensor_layout = tensor_layout
+    });
+
+  if(verbose)
+    p->print();
+
+  p->infer(warmup);
+
+  p->profile(true);
+  p->infer(batches);
+  p->profile(false);
+
+  p->profileReport().print();
+  return 0;
+}
+
+
+SAGA_CLI_CMD("profile",
+             "profile [OPTIONS ...] <PATH>",
+             "Time each operation of an onnx model",
+             profile_main);
@@ -0,0 +1,190 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <chrono>
+
+#include "saga.h"
+#include "cli.h"
+
+using namespace saga;
+
+
+static std::vector<std::string>
+list_dir(const std::string &path, bool dirs)
+{
+  std::vector<std::string> r;
+  struct dirent **namelist;
+  int n = scandir(path.c_str(), &namelist, NULL, alphasort);
+  if(n == -1)
+    return r;
+
+  for(int i = 0; i < n; i++) {
+    const char *fname = namelist[i]->d_name;
+    if(fname[0] != '.') {
+      const std::string p = path + "/" + fname;
+      struct stat st;
+      if(stat(p.c_str(), &st) == 0 &&
+         (dirs ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode)))
+        r.push_back(p);
+    }
+    free(namelist[i]);
+  }
+  free(namelist);
+  return r;
+}
+
+
+static bool
+read_file(const std::string &path, std::vector<uint8_t> &buf)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd == -1)
+    return false;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if(ok) {
+    buf.resize(st.st_size);
+    ok = read(fd, buf.data(), buf.size()) == (ssize_t)buf.size();
+  }
+  close(fd);
+  return ok;
+}
+
+
+static int
+records_pack(int argc, char **argv)
+{
+  int opt;
+  size_t per_shard = 65536;
+
+  while((opt = getopt(argc, argv, "n:")) != -1) {
+    switch(opt) {
+    case 'n':
+      per_shard = atoi(optarg);
+      break;
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if(argc != 2) {
+    fprintf(stderr, "Usage: records pack [-n records-per-shard] "
+            "<prefix> <dir>\n");
+    return 1;
+  }
+
+  // Each subdirectory is a class, labeled in sorted order
+  const auto classes = list_dir(argv[1], true);
+  if(classes.empty()) {
+    fprintf(stderr, "No class directories in %s\n", argv[1]);
+    return 1;
+  }
+
+  auto w = createRecordWriter(argv[0], RecordFormat{}, per_shard);
+  if(!w)
+    return 1;
+
+  std::vector<uint8_t> buf;
+  size_t records = 0;
+  for(size_t label = 0; label < classes.size(); label++) {
+    for(const auto &path : list_dir(classes[label], false)) {
+      if(!read_file(path, buf)) {
+        fprintf(stderr, "Unable to read %s\n", path.c_str());
+        continue;
+      }
+      if(!w->write(buf.data(), buf.size(), label))
+        return 1;
+      records++;
+    }
+  }
+
+  if(!w->finish())
+    return 1;
+  printf("Packed %zd records in %zd classes\n", records, classes.size());
+  return 0;
+}
+
+
+static int
+records_read(int argc, char **argv)
+{
+  int opt;
+  int batch_size = 256;
+  bool shuffle = false;
+
+  while((opt = getopt(argc, argv, "b:s")) != -1) {
+    switch(opt) {
+    case 'b':
+      batch_size = atoi(optarg);
+      break;
+    case 's':
+      shuffle = true;
+      break;
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if(argc < 1) {
+    fprintf(stderr, "Usage: records read [-s] [-b batch-size] "
+            "<shard> ...\n");
+    return 1;
+  }
+
+  auto ds = openDataset(std::vector<std::string>(argv, argv + argc));
+  if(!ds)
+    return 1;
+
+  ds->beginEpoch(batch_size, shuffle);
+
+  auto t0 = std::chrono::steady_clock::now();
+
+  // Touch every byte so the data is actually read
+  size_t bytes = 0;
+  uint64_t sum = 0;
+  const long batches = (ds->size() + batch_size - 1) / batch_size;
+  for(long b = 0; b < batches; b++) {
+    for(int i = 0; i < batch_size; i++) {
+      const Record r = ds->get(b, i);
+      for(size_t j = 0; j < r.size; j++)
+        sum += r.data[j];
+      bytes += r.size;
+    }
+  }
+
+  auto t1 = std::chrono::steady_clock::now();
+  const double secs = std::chrono::duration<double>(t1 - t0).count();
+
+  printf("%zd records, %.1f MB in %.2fs, %.1f MB/s, %.0f records/s "
+         "(checksum %lx)\n",
+         ds->size(), bytes / 1e6, secs, bytes / 1e6 / secs,
+         ds->size() / secs, (unsigned long)sum);
+  return 0;
+}
+
+
+static int
+records_main(int argc, char **argv)
+{
+  if(argc >= 2 && !strcmp(argv[1], "pack"))
+    return records_pack(argc - 1, argv + 1);
+  if(argc >= 2 && !strcmp(argv[1], "read"))
+    return records_read(argc - 1, argv + 1);
+
+  fprintf(stderr, "Usage: records pack|read ...\n");
+  return 1;
+}
+
+
+SAGA_CLI_CMD("records",
+             "records pack|read [OPTIONS ...] <ARGS ...>",
+             "Pack images into record shards or measure read throughput",
+             records_main);
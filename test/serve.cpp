@@ -0,0 +1,130 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "saga.h"
+#include "cli.h"
+
+using namespace saga;
+
+
+static std::vector<int>
+parse_batch_sizes(const char *str)
+{
+  std::vector<int> r;
+  std::stringstream ss(str);
+  std::string item;
+  while(std::getline(ss, item, ','))
+    r.push_back(atoi(item.c_str()));
+  return r;
+}
+
+
+static int
+serve_main(int argc, char **argv)
+{
+  int opt;
+  int requests = 10000;
+  int burst = 64;
+  int rate = 2000;
+  InferenceServerConfig config;
+
+  while((opt = getopt(argc, argv, "b:d:n:B:r:cCgP:")) != -1) {
+    switch(opt) {
+    case 'b':
+      config.batch_sizes = parse_batch_sizes(optarg);
+      break;
+    case 'd':
+      config.max_delay_us = atoi(optarg);
+      break;
+    case 'n':
+      requests = atoi(optarg);
+      break;
+    case 'B':
+      burst = atoi(optarg);
+      break;
+    case 'r':
+      rate = atoi(optarg);
+      break;
+    case 'c':
+      config.tensor_layout = TensorLayout::NHWC;
+      break;
+    case 'C':
+      config.tensor_layout = TensorLayout::NCHW;
+      break;
+    case 'g':
+      config.cuda_graph = true;
+      break;
+    case 'P':
+      config.program_cache = optarg;
+      break;
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if(argc != 1) {
+    fprintf(stderr, "Usage: serve [OPTIONS ...] <modelpath>\n");
+    return 1;
+  }
+
+  auto g = Graph::load(argv[0]);
+  if(g == NULL) {
+    fprintf(stderr, "Failed to load model graph %s\n", argv[0]);
+    return 1;
+  }
+
+  auto ctx = createContext();
+  auto server = createInferenceServer(ctx, *g, config);
+  if(!server)
+    return 1;
+
+  auto input = *g->inputs_.begin();
+  auto x = makeCPUTensor(input->data_type_, input->dims_.n(1));
+  x->copyFrom(*Tensor::make(input->data_type_, input->dims_.n(1), 0, 1));
+
+  // Bursts of random size, Poisson arrivals averaging rate requests/s
+  std::mt19937 gen(5678);
+  std::exponential_distribution<double> gap(rate);
+  std::uniform_int_distribution<int> burst_size(1, std::max(1, burst));
+
+  std::vector<std::future<std::shared_ptr<Tensor>>> results;
+  results.reserve(requests);
+
+  auto t0 = std::chrono::steady_clock::now();
+  auto next = t0;
+  while((int)results.size() < requests) {
+    std::this_thread::sleep_until(next);
+    const int n = std::min(burst_size(gen), requests - (int)results.size());
+    for(int i = 0; i < n; i++)
+      results.push_back(server->infer(x));
+    next += std::chrono::duration_cast<std::chrono::steady_clock::duration>
+      (std::chrono::duration<double>(gap(gen) * n));
+  }
+
+  int failed = 0;
+  for(auto &f : results) {
+    if(f.get() == nullptr)
+      failed++;
+  }
+
+  auto t1 = std::chrono::steady_clock::now();
+  const double secs = std::chrono::duration<double>(t1 - t0).count();
+
+  printf("%d requests in %.2fs, %.0f requests/s, %d failed\n",
+         requests, secs, requests / secs, failed);
+  server->stats().print();
+  return failed ? 1 : 0;
+}
+
+
+SAGA_CLI_CMD("serve",
+             "serve [OPTIONS ...] <PATH>",
+             "Dynamic batching inference of an onnx model under bursty load",
+             serve_main);
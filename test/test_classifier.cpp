@@ -2,6 +2,7 @@
 #include <signal.h>
 
 #include "saga.h"
+#include "test_classifier.h"
 
 using namespace saga;
 
@@ -278,9 +279,9 @@ test(Graph &g, std::shared_ptr<Node> n, bool bn, int output_classes)
 
 
 
-static std::shared_ptr<Node>
-make_network(Graph &g, std::shared_ptr<Node> n, const std::string &name,
-             int output_classes)
+std::shared_ptr<Node>
+saga::make_network(Graph &g, std::shared_ptr<Node> n, const std::string &name,
+                   int output_classes)
 {
   if(name == "lecun") {
     return lecun(g, n, output_classes);
@@ -357,16 +358,30 @@ test_classifier(int argc, char **argv,
   std::string mode = "lecun";
   int verbose = 0;
   bool augmentation = false;
+  bool autotune = false;
+  bool cuda_graph = false;
+  bool data_parallel = false;
+  bool profile = false;
+  int prefetch_depth = 1;
+  int cpu_threads = 0;
+  bool cpu_affinity = false;
+  bool recompute = false;
+  int gradient_accumulation = 1;
+  int health_check_interval = 0;
   auto dt = Tensor::DataType::FLOAT;
   auto tensor_layout = TensorLayout::Auto;
   const char *savepath = NULL;
   const char *loadpath = NULL;
+  const char *checkpointpath = NULL;
 
-  while((opt = getopt(argc, argv, "ns:l:b:hm:r:vacC")) != -1) {
+  while((opt = getopt(argc, argv, "ns:S:l:b:hm:r:vacCtgpP:RT:AkG:H:")) != -1) {
     switch(opt) {
     case 's':
       savepath = optarg;
       break;
+    case 'S':
+      checkpointpath = optarg;
+      break;
     case 'l':
       loadpath = optarg;
       break;
@@ -394,6 +409,36 @@ test_classifier(int argc, char **argv,
     case 'C':
       tensor_layout = TensorLayout::NCHW;
       break;
+    case 't':
+      autotune = true;
+      break;
+    case 'g':
+      cuda_graph = true;
+      break;
+    case 'p':
+      data_parallel = true;
+      break;
+    case 'P':
+      prefetch_depth = atoi(optarg);
+      break;
+    case 'R':
+      profile = true;
+      break;
+    case 'T':
+      cpu_threads = atoi(optarg);
+      break;
+    case 'A':
+      cpu_affinity = true;
+      break;
+    case 'k':
+      recompute = true;
+      break;
+    case 'G':
+      gradient_accumulation = atoi(optarg);
+      break;
+    case 'H':
+      health_check_interval = atoi(optarg);
+      break;
     }
   }
 
@@ -510,7 +555,16 @@ test_classifier(int argc, char **argv,
       .training = true,
       .batch_size = batch_size,
       .initial_learning_rate = learning_rate,
-      .tensor_layout = tensor_layout
+      .tensor_layout = tensor_layout,
+      .autotune = autotune,
+      .cuda_graph = cuda_graph,
+      .prefetch_depth = prefetch_depth,
+      .data_parallel = data_parallel,
+      .cpu_threads = cpu_threads,
+      .cpu_affinity = cpu_affinity,
+      .recompute = recompute,
+      .gradient_accumulation = gradient_accumulation,
+      .health_check_interval = health_check_interval
    }, bta);
 
   if(verbose > 1)
@@ -519,6 +573,8 @@ test_classifier(int argc, char **argv,
   theta = p->resolveTensor(theta);
   postconv = p->resolveTensor(postconv);
 
+  std::future<bool> checkpoint;
+
   while(g_run) {
     if(theta)
       fill_theta(theta.get(), batch_size);
@@ -527,7 +583,9 @@ test_classifier(int argc, char **argv,
     epoch_begin(batch_size, false);
     const int64_t t0 = get_ts();
     loss_sum = 0;
+    p->profile(profile);
     p->train(train_inputs / batch_size);
+    p->profile(false);
 
     // Test
     epoch_begin(batch_size, true);
@@ -542,6 +600,14 @@ test_classifier(int argc, char **argv,
            (t1 - t0) / 1e6,
            (t2 - t1) / 1e6,
            loss_sum / test_inputs);
+    if(profile)
+      p->profileReport().print();
+    if(health_check_interval)
+      p->healthReport().print();
+
+    // Written in the background while the next epoch trains
+    if(checkpointpath != NULL)
+      checkpoint = p->saveCheckpointAsync(g, checkpointpath);
     if(percentage > 99 || !g_run)
       break;
   }
@@ -549,6 +615,9 @@ test_classifier(int argc, char **argv,
   if(savepath != NULL)
     g.saveTensors(savepath, p.get());
 
+  if(checkpoint.valid() && !checkpoint.get())
+    fprintf(stderr, "Failed to write checkpoint %s\n", checkpointpath);
+
 }
 
 }
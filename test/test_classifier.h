@@ -5,6 +5,11 @@
 
 namespace saga {
 
+// Returns nullptr if name is not a known network
+std::shared_ptr<Node>
+make_network(Graph &g, std::shared_ptr<Node> n, const std::string &name,
+             int output_classes);
+
 void
 test_classifier(int argc, char **argv,
                 std::shared_ptr<Tensor> input,
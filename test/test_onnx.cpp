@@ -113,18 +113,22 @@ test_onnx_main(int argc, char **argv)
 {
   int opt;
   int verbose = 0;
-  while((opt = getopt(argc, argv, "v")) != -1) {
+  bool hetero = false;
+  while((opt = getopt(argc, argv, "vx")) != -1) {
     switch(opt) {
     case 'v':
       verbose++;
       break;
+    case 'x':
+      hetero = true;
+      break;
     }
   }
 
   argc -= optind;
   argv += optind;
 
-  auto ctx = createContext();
+  auto ctx = hetero ? createHeterogeneousContext() : createContext();
 
   if(argc == 1) {
     return test_one(argv[0], ctx, verbose);
@@ -6,7 +6,9 @@
 
 #include <algorithm>
 #include <numeric>
+#include <random>
 #include <string.h>
+#include <math.h>
 
 #include "saga.h"
 #include "cli.h"
@@ -573,6 +575,21 @@ static const TensorData batchnorm_output = {
 // -----------------------------------------------
 
 
+// Step e to the next element of dims in row major order
+static void
+next_element(Dims &e, const Dims &dims)
+{
+  for(ssize_t j = e.size() - 1; j >= 0; j--) {
+    e[j]++;
+    if(e[j] == dims[j]) {
+      e[j] = 0;
+    } else {
+      break;
+    }
+  }
+}
+
+
 static std::shared_ptr<Tensor>
 load_tensor(Tensor::DataType dt, const TensorData &td)
 {
@@ -583,15 +600,7 @@ load_tensor(Tensor::DataType dt, const TensorData &td)
   Dims e(td.dims.size(), 0);
   for(size_t i = 0; i < elements; i++) {
     dst->set(e, td.data[i]);
-
-    for(ssize_t j = e.size() - 1; j >= 0; j--) {
-      e[j]++;
-      if(e[j] == td.dims[j]) {
-        e[j] = 0;
-      } else {
-        break;
-      }
-    }
+    next_element(e, td.dims);
   }
   return t;
 }
@@ -658,6 +667,904 @@ test_op(std::shared_ptr<Context> ctx,
 }
 
 
+//------------------------------------------------------------------------
+// Tests against references computed on the host, from random inputs.
+// Inputs are generated in the data type under test so the reference
+// sees the same (rounded) values as the device
+
+static std::shared_ptr<Tensor>
+random_tensor(Tensor::DataType dt, const Dims &dims, float lo, float hi,
+              unsigned int seed)
+{
+  std::mt19937 rnd(seed);
+  std::uniform_real_distribution<float> dist(lo, hi);
+
+  auto t = makeCPUTensor(dt, dims);
+  auto ta = t->access();
+  Dims e(dims.size(), 0);
+  for(size_t i = 0; i < dims.elements(); i++) {
+    ta->set(e, dist(rnd));
+    next_element(e, dims);
+  }
+  return t;
+}
+
+
+static void
+copy_elements(TensorAccess &dst, TensorAccess &src, const Dims &dims)
+{
+  Dims e(dims.size(), 0);
+  for(size_t i = 0; i < dims.elements(); i++) {
+    dst.set(e, src.get(e));
+    next_element(e, dims);
+  }
+}
+
+
+// Copy host into the program's tensor before each batch
+static BatchTensorAccess
+feed(Which which, std::shared_ptr<Tensor> t, std::shared_ptr<Tensor> host)
+{
+  return BatchTensorAccess(Phase::PRE, which, Mode::ALL, t,
+                           [=](TensorAccess &ta, long batch) {
+                             copy_elements(ta, *host->access(), host->dims_);
+                           });
+}
+
+
+// Copy the program's tensor to host after each batch
+static BatchTensorAccess
+fetch(Which which, std::shared_ptr<Tensor> t, std::shared_ptr<Tensor> host)
+{
+  return BatchTensorAccess(Phase::POST, which, Mode::ALL, t,
+                           [=](TensorAccess &ta, long batch) {
+                             copy_elements(*host->access(), ta, host->dims_);
+                           });
+}
+
+
+static int
+check(const std::string &what, Tensor &y, Tensor &ref, double max_sse)
+{
+  const double sse = y.sse(ref);
+  if(sse > max_sse) {
+    printf("Test of %s FAILED sse:%e\n", what.c_str(), sse);
+    if(g_verbose) {
+      y.print("  Y");
+      ref.print("REF");
+    }
+    return 1;
+  }
+  printf("Test of %s OK SSE:%e\n", what.c_str(), sse);
+  return 0;
+}
+
+
+// Write a shard of <records> labeled records and open it as a dataset
+static std::shared_ptr<Dataset>
+label_dataset(int records, int classes)
+{
+  char dir[] = "/tmp/saga-test-XXXXXX";
+  if(mkdtemp(dir) == NULL)
+    return nullptr;
+  const std::string prefix = std::string(dir) + "/labels";
+  const std::string path = prefix + "-00000.rec";
+
+  auto w = createRecordWriter(prefix, RecordFormat{});
+  const uint8_t data = 0;
+  for(int i = 0; i < records; i++) {
+    if(!w->write(&data, sizeof(data), (i * 7919) % classes))
+      return nullptr;
+  }
+  if(!w->finish())
+    return nullptr;
+
+  // The mapping outlives the file
+  auto ds = openDataset({path}, {.shuffle_buffer = 0});
+  unlink(path.c_str());
+  rmdir(dir);
+  return ds;
+}
+
+
+// Allowed sum of squared errors against a double precision reference
+static double
+tolerance(Tensor::DataType dt, size_t elements)
+{
+  return elements * (dt == Tensor::DataType::HALF ? 1e-4 : 1e-9);
+}
+
+
+// Run one batch through an inference program, x fed from the host
+static std::shared_ptr<Tensor>
+run_inference(std::shared_ptr<Context> ctx, const Graph &g,
+              std::shared_ptr<Tensor> x, std::shared_ptr<Tensor> xv,
+              std::shared_ptr<Tensor> y)
+{
+  Dims dims = y->dims_;
+  dims[0] = xv->dims_[0];
+  auto yv = makeCPUTensor(y->data_type_, dims);
+
+  auto p = ctx->createProgram(g, {
+      .inference = true,
+      .training = false,
+      .batch_size = xv->dims_[0],
+      .initial_learning_rate = 1e-3,
+      .tensor_layout = TensorLayout::Auto
+    }, {
+      feed(Which::VALUE, x, xv),
+      fetch(Which::VALUE, y, yv),
+    });
+  p->infer(1);
+  if(g_verbose)
+    p->print();
+  return yv;
+}
+
+
+// NCHW convolution, stride 1, square filters
+static std::shared_ptr<Tensor>
+ref_conv(Tensor &x, Tensor &w, Tensor *b, int pad)
+{
+  const int n = x.dims_[0], c = x.dims_[1], h = x.dims_[2], wd = x.dims_[3];
+  const int k = w.dims_[0], size = w.dims_[2];
+  const int oh = h + 2 * pad - size + 1, ow = wd + 2 * pad - size + 1;
+
+  auto y = makeCPUTensor(Tensor::DataType::FLOAT, Dims({n, k, oh, ow}));
+  auto xa = x.access();
+  auto wa = w.access();
+  auto ya = y->access();
+  auto ba = b ? b->access() : nullptr;
+
+  for(int i = 0; i < n; i++) {
+    for(int o = 0; o < k; o++) {
+      for(int oy = 0; oy < oh; oy++) {
+        for(int ox = 0; ox < ow; ox++) {
+          double sum = ba ? ba->get({0, o}) : 0;
+          for(int j = 0; j < c; j++) {
+            for(int fy = 0; fy < size; fy++) {
+              const int iy = oy + fy - pad;
+              if(iy < 0 || iy >= h)
+                continue;
+              for(int fx = 0; fx < size; fx++) {
+                const int ix = ox + fx - pad;
+                if(ix < 0 || ix >= wd)
+                  continue;
+                sum += xa->get({i, j, iy, ix}) * wa->get({o, j, fy, fx});
+              }
+            }
+          }
+          ya->set({i, o, oy, ox}, sum);
+        }
+      }
+    }
+  }
+  return y;
+}
+
+
+static void
+ref_relu(Tensor &t)
+{
+  auto ta = t.access();
+  Dims e(t.dims_.size(), 0);
+  for(int64_t i = 0; i < t.elements_; i++) {
+    ta->set(e, std::max(0.0, ta->get(e)));
+    next_element(e, t.dims_);
+  }
+}
+
+
+// Inference fuses the relu into the convolution
+static int
+test_conv_relu(std::shared_ptr<Context> ctx, Tensor::DataType dt, bool bias)
+{
+  const int n = 2, c = 8, size = 3, k = 16;
+  Graph g;
+  auto x = makeCPUTensor(dt, Dims({1, c, 9, 9}), "x");
+  auto w = random_tensor(dt, Dims({k, c, size, size}), -0.3, 0.3, 1);
+  auto b = random_tensor(dt, Dims({1, k}), -0.5, 0.5, 2);
+
+  Tensors inputs = {{"x", x}, {"w", w}};
+  if(bias)
+    inputs["b"] = b;
+  auto conv = g.addNode("conv", inputs,
+                        {{"size", size}, {"activations", k}, {"pad", 1},
+                         {"bias", bias}});
+  auto relu = g.addNode("relu", {{"x", conv->y()}}, {});
+
+  auto xv = random_tensor(dt, Dims({n, c, 9, 9}), -1, 1, 3);
+  auto yv = run_inference(ctx, g, x, xv, relu->y());
+
+  auto ref = ref_conv(*xv, *w, bias ? b.get() : NULL, 1);
+  ref_relu(*ref);
+
+  return check(std::string("conv+relu") + (bias ? " bias" : ""), *yv, *ref,
+               tolerance(dt, ref->elements_));
+}
+
+
+// Inference folds the batchnorm into the convolution's weights and
+// bias, a trailing relu is then fused as well
+static int
+test_batchnorm_fold(std::shared_ptr<Context> ctx, Tensor::DataType dt,
+                    bool bias, bool relu)
+{
+  const int n = 2, c = 8, size = 3, k = 16;
+  const float epsilon = 1e-3;
+  Graph g;
+  auto x = makeCPUTensor(dt, Dims({1, c, 9, 9}), "x");
+  auto w = random_tensor(dt, Dims({k, c, size, size}), -0.3, 0.3, 4);
+  auto b = random_tensor(dt, Dims({1, k}), -0.5, 0.5, 5);
+
+  Tensors inputs = {{"x", x}, {"w", w}};
+  if(bias)
+    inputs["b"] = b;
+  auto conv = g.addNode("conv", inputs,
+                        {{"size", size}, {"activations", k}, {"pad", 1},
+                         {"bias", bias}});
+
+  const auto f = Tensor::DataType::FLOAT;
+  auto bn_s = random_tensor(f, Dims({1, k}), 0.5, 2, 6);
+  auto bn_b = random_tensor(f, Dims({1, k}), -1, 1, 7);
+  auto bn_m = random_tensor(f, Dims({1, k}), -0.5, 0.5, 8);
+  auto bn_v = random_tensor(f, Dims({1, k}), 0.5, 2, 9);
+  auto bn = g.addNode("batchnorm", {{"x", conv->y()}, {"s", bn_s},
+                                    {"b", bn_b}, {"m", bn_m}, {"v", bn_v}},
+                      {{"epsilon", epsilon}});
+  auto y = relu ? g.addNode("relu", {{"x", bn->y()}}, {})->y() : bn->y();
+
+  auto xv = random_tensor(dt, Dims({n, c, 9, 9}), -1, 1, 10);
+  auto yv = run_inference(ctx, g, x, xv, y);
+
+  auto ref = ref_conv(*xv, *w, bias ? b.get() : NULL, 1);
+  auto ra = ref->access();
+  Dims e(ref->dims_.size(), 0);
+  for(int64_t i = 0; i < ref->elements_; i++) {
+    const int o = e[1];
+    const double scale = bn_s->access()->get({0, o}) /
+      sqrt(bn_v->access()->get({0, o}) + epsilon);
+    ra->set(e, (ra->get(e) - bn_m->access()->get({0, o})) * scale +
+            bn_b->access()->get({0, o}));
+    next_element(e, ref->dims_);
+  }
+  if(relu)
+    ref_relu(*ref);
+
+  std::string name = "batchnorm fold";
+  if(bias)
+    name += " bias";
+  if(relu)
+    name += " relu";
+  return check(name, *yv, *ref, tolerance(dt, ref->elements_));
+}
+
+
+// y = beta * y + x * w^T + b
+static void
+ref_fc(Tensor &x, Tensor &w, Tensor *b, Tensor &y, double beta)
+{
+  const int n = x.dims_[0], inputs = x.dims_[1], outputs = w.dims_[0];
+  auto xa = x.access();
+  auto wa = w.access();
+  auto ya = y.access();
+  auto ba = b ? b->access() : nullptr;
+
+  for(int i = 0; i < n; i++) {
+    for(int o = 0; o < outputs; o++) {
+      double sum = beta ? beta * ya->get({i, o}) : 0;
+      if(ba)
+        sum += ba->get({0, o});
+      for(int j = 0; j < inputs; j++)
+        sum += xa->get({i, j}) * wa->get({o, j});
+      ya->set({i, o}, sum);
+    }
+  }
+}
+
+
+// Bias and relu end up in the GEMM epilogue. With beta a second layer
+// adds its result to the output of the first
+static int
+test_fc(std::shared_ptr<Context> ctx, Tensor::DataType dt, bool bias,
+        bool relu, bool beta)
+{
+  const int n = 4, inputs = 24, outputs = 16;
+  Graph g;
+  auto x = makeCPUTensor(dt, Dims({1, inputs}), "x");
+  auto w = random_tensor(dt, Dims({outputs, inputs}), -0.5, 0.5, 70);
+  auto b = random_tensor(dt, Dims({1, outputs}), -0.5, 0.5, 71);
+  auto x2 = makeCPUTensor(dt, Dims({1, 8}), "x2");
+  auto w2 = random_tensor(dt, Dims({outputs, 8}), -0.5, 0.5, 72);
+
+  Tensors in = {{"x", x}, {"w", w}};
+  if(bias)
+    in["b"] = b;
+  auto y = g.addNode("fc", in, {{"transW", true}})->y();
+
+  std::shared_ptr<Node> fc2;
+  if(beta) {
+    fc2 = g.addNode("fc", {{"x", x2}, {"w", w2}},
+                    {{"transW", true}, {"y.beta", 1.0f}});
+    fc2->outputs_["y"] = y;
+  }
+  if(relu)
+    y = g.addNode("relu", {{"x", y}}, {})->y();
+
+  std::string name = "fc";
+  if(bias)
+    name += " bias";
+  if(relu)
+    name += " relu";
+  if(beta)
+    name += " beta";
+  if(fc2 && !ctx->supportsNode(*fc2, {.inference = true})) {
+    printf("Test of %s skipped, not supported by context\n", name.c_str());
+    return 0;
+  }
+
+  auto xv = random_tensor(dt, Dims({n, inputs}), -1, 1, 73);
+  auto x2v = random_tensor(dt, Dims({n, 8}), -1, 1, 74);
+  auto yv = makeCPUTensor(dt, Dims({n, outputs}));
+
+  BatchTensorAccessors accessors = {
+    feed(Which::VALUE, x, xv),
+    fetch(Which::VALUE, y, yv),
+  };
+  if(beta)
+    accessors.push_back(feed(Which::VALUE, x2, x2v));
+
+  auto p = ctx->createProgram(g, {
+      .inference = true,
+      .training = false,
+      .batch_size = n,
+      .initial_learning_rate = 1e-3,
+      .tensor_layout = TensorLayout::Auto
+    }, accessors);
+  p->infer(1);
+  if(g_verbose)
+    p->print();
+
+  auto ref = makeCPUTensor(Tensor::DataType::FLOAT, Dims({n, outputs}));
+  ref_fc(*xv, *w, bias ? b.get() : nullptr, *ref, 0);
+  if(beta)
+    ref_fc(*x2v, *w2, nullptr, *ref, 1);
+  if(relu)
+    ref_relu(*ref);
+
+  return check(name, *yv, *ref, tolerance(dt, ref->elements_));
+}
+
+
+// Gradients after a single training batch. When gradients are
+// accumulated the bias gradient can't come from the weight gradient
+// GEMM epilogue, and the update is not due yet so the gradients are
+// left in place
+static int
+test_fc_train(std::shared_ptr<Context> ctx, Tensor::DataType dt,
+              int accumulation)
+{
+  const int n = 4, inputs = 24, outputs = 16;
+  Graph g;
+  auto x = makeCPUTensor(dt, Dims({1, inputs}), "x");
+  auto w = random_tensor(dt, Dims({outputs, inputs}), -0.5, 0.5, 75);
+  auto b = random_tensor(dt, Dims({1, outputs}), -0.5, 0.5, 76);
+  auto y = g.addNode("fc", {{"x", x}, {"w", w}, {"b", b}},
+                     {{"transW", true}})->y();
+
+  auto xv = random_tensor(dt, Dims({n, inputs}), -1, 1, 77);
+  auto dyv = random_tensor(dt, Dims({n, outputs}), -1, 1, 78);
+  auto dxv = makeCPUTensor(dt, Dims({n, inputs}));
+
+  auto p = ctx->createProgram(g, {
+      .inference = false,
+      .training = true,
+      .batch_size = n,
+      .initial_learning_rate = 1e-3,
+      .tensor_layout = TensorLayout::Auto,
+      .gradient_accumulation = accumulation
+    }, {
+      feed(Which::VALUE, x, xv),
+      feed(Which::GRADIENT, y, dyv),
+      fetch(Which::GRADIENT, x, dxv),
+    });
+  p->train(1);
+  if(g_verbose)
+    p->print();
+
+  auto ref_dx = makeCPUTensor(Tensor::DataType::FLOAT, Dims({n, inputs}));
+  auto ref_dw = makeCPUTensor(Tensor::DataType::FLOAT, w->dims_);
+  auto ref_db = makeCPUTensor(Tensor::DataType::FLOAT, b->dims_);
+  auto xa = xv->access();
+  auto wa = w->access();
+  auto dya = dyv->access();
+
+  for(int i = 0; i < n; i++) {
+    for(int j = 0; j < inputs; j++) {
+      double sum = 0;
+      for(int o = 0; o < outputs; o++)
+        sum += dya->get({i, o}) * wa->get({o, j});
+      ref_dx->access()->set({i, j}, sum);
+    }
+  }
+
+  for(int o = 0; o < outputs; o++) {
+    double db = 0;
+    for(int i = 0; i < n; i++)
+      db += dya->get({i, o});
+    ref_db->access()->set({0, o}, db);
+
+    for(int j = 0; j < inputs; j++) {
+      double dw = 0;
+      for(int i = 0; i < n; i++)
+        dw += dya->get({i, o}) * xa->get({i, j});
+      ref_dw->access()->set({o, j}, dw);
+    }
+  }
+
+  const std::string name = "fc train accumulation " +
+    std::to_string(accumulation);
+  int r = 0;
+  r |= check(name + " dx", *dxv, *ref_dx, tolerance(dt, ref_dx->elements_));
+  r |= check(name + " dw", *p->resolveTensor(w)->grad(), *ref_dw,
+             tolerance(dt, ref_dw->elements_));
+  r |= check(name + " db", *p->resolveTensor(b)->grad(), *ref_db,
+             tolerance(dt, ref_db->elements_));
+  return r;
+}
+
+
+// One Adam step on fully connected layers of the given data types, HALF
+// weights are updated through their fp32 master copy. Layer sizes are
+// chosen so some weights are a multiple of 4 elements (vectorized
+// update) and some are not. Inputs are positive and the gradient of each
+// output has a fixed sign so no weight gradient is close to zero, the
+// first step then moves every weight by the learning rate
+static int
+test_adam(std::shared_ptr<Context> ctx,
+          const std::vector<Tensor::DataType> &types)
+{
+  const int n = 4, inputs = 5;
+  const float lr = 1e-2;
+  static const int outputs[] = {1, 3, 8, 16};
+
+  struct Layer {
+    Tensor::DataType dt;
+    std::shared_ptr<Tensor> x, w, b, y, xv, dyv;
+  };
+  std::vector<Layer> layers;
+
+  Graph g;
+  BatchTensorAccessors accessors;
+  for(size_t i = 0; i < 4; i++) {
+    Layer l;
+    const int o = outputs[i];
+    l.dt = types[i % types.size()];
+    l.x = makeCPUTensor(l.dt, Dims({1, inputs}), "x" + std::to_string(i));
+    l.w = random_tensor(l.dt, Dims({o, inputs}), -0.5, 0.5, 20 + i);
+    l.b = random_tensor(l.dt, Dims({1, o}), -0.5, 0.5, 30 + i);
+    l.y = g.addNode("fc", {{"x", l.x}, {"w", l.w}, {"b", l.b}},
+                    {{"transW", true}})->y();
+    l.xv = random_tensor(l.dt, Dims({n, inputs}), 0.5, 1, 40 + i);
+    l.dyv = random_tensor(l.dt, Dims({n, o}), 0.5, 1, 50 + i);
+    auto dya = l.dyv->access();
+    for(int j = 0; j < n; j++) {
+      for(int k = 1; k < o; k += 2)
+        dya->set({j, k}, -dya->get({j, k}));
+    }
+    accessors.push_back(feed(Which::VALUE, l.x, l.xv));
+    accessors.push_back(feed(Which::GRADIENT, l.y, l.dyv));
+    layers.push_back(l);
+  }
+
+  auto p = ctx->createProgram(g, {
+      .inference = false,
+      .training = true,
+      .batch_size = n,
+      .initial_learning_rate = lr,
+      .tensor_layout = TensorLayout::Auto
+    }, accessors);
+  p->train(1);
+  if(g_verbose)
+    p->print();
+
+  // Bias corrected moments of the first step are g and g * g
+  auto step = [&](TensorAccess &ta, const Dims &e, double g) {
+    ta.set(e, ta.get(e) - lr * g / (fabs(g) + 1e-8));
+  };
+
+  int r = 0;
+  for(size_t i = 0; i < layers.size(); i++) {
+    const auto &l = layers[i];
+    const int o = outputs[i];
+    auto ref_w = makeCPUTensor(Tensor::DataType::FLOAT, l.w->dims_);
+    auto ref_b = makeCPUTensor(Tensor::DataType::FLOAT, l.b->dims_);
+    ref_w->copyFrom(*l.w);
+    ref_b->copyFrom(*l.b);
+    auto xa = l.xv->access();
+    auto dya = l.dyv->access();
+    auto wa = ref_w->access();
+    auto ba = ref_b->access();
+
+    for(int k = 0; k < o; k++) {
+      double db = 0;
+      for(int j = 0; j < n; j++)
+        db += dya->get({j, k});
+      step(*ba, {0, k}, db);
+
+      for(int m = 0; m < inputs; m++) {
+        double dw = 0;
+        for(int j = 0; j < n; j++)
+          dw += dya->get({j, k}) * xa->get({j, m});
+        step(*wa, {k, m}, dw);
+      }
+    }
+
+    // Rounding of HALF weights is well below the step
+    const double max_sse = l.dt == Tensor::DataType::HALF ? 1e-7 : 1e-12;
+    const std::string name = std::string("adam ") +
+      (l.dt == Tensor::DataType::HALF ? "mixed " : "float ") +
+      std::to_string(o) + "x" + std::to_string(inputs) +
+      (types.size() > 1 ? " grouped" : "");
+    r |= check(name + " w", *p->resolveTensor(l.w), *ref_w,
+               max_sse * ref_w->elements_);
+    r |= check(name + " b", *p->resolveTensor(l.b), *ref_b,
+               max_sse * ref_b->elements_);
+  }
+  return r;
+}
+
+
+// Per channel normalization while converting the network input. With
+// an odd number of elements the scalar kernel is used, otherwise the
+// vectorized one
+static int
+test_convert_normalize(std::shared_ptr<Context> ctx, Tensor::DataType src,
+                       Tensor::DataType dt, int h, int w)
+{
+  const int n = 2, c = 3;
+  const float scale = src == Tensor::DataType::U8 ? 1 / 255.0f : 1.0f;
+  Graph g;
+  auto x = makeCPUTensor(src, Dims({1, c, h, w}), "x");
+  auto mean = random_tensor(Tensor::DataType::FLOAT, Dims({1, c}),
+                            0.3, 0.6, 60);
+  auto stddev = random_tensor(Tensor::DataType::FLOAT, Dims({1, c}),
+                              0.2, 0.3, 61);
+  auto node = g.addNode("convert",
+                        {{"x", x}, {"mean", mean}, {"std", stddev}},
+                        {{"datatype", (int)dt}, {"scale", scale}});
+  auto y = node->y();
+
+  const std::string name = std::string("convert normalize ") +
+    (src == Tensor::DataType::U8 ? "u8" : "float") + " " +
+    std::to_string(h) + "x" + std::to_string(w);
+  if(!ctx->supportsNode(*node, {.inference = true})) {
+    printf("Test of %s skipped, not supported by context\n", name.c_str());
+    return 0;
+  }
+
+  auto xv = random_tensor(src, Dims({n, c, h, w}), 0,
+                          src == Tensor::DataType::U8 ? 255 : 1, 62);
+  auto yv = run_inference(ctx, g, x, xv, y);
+
+  auto ref = makeCPUTensor(Tensor::DataType::FLOAT, yv->dims_);
+  auto xa = xv->access();
+  auto ra = ref->access();
+  Dims e(ref->dims_.size(), 0);
+  for(int64_t i = 0; i < ref->elements_; i++) {
+    const int ch = e[1];
+    ra->set(e, (xa->get(e) * scale - mean->access()->get({0, ch})) /
+            stddev->access()->get({0, ch}));
+    next_element(e, ref->dims_);
+  }
+
+  return check(name, *yv, *ref, tolerance(dt, ref->elements_));
+}
+
+
+// Covers the thread, warp and block per row kernels with and
+// without vectorized loads.
+// With fewer records than the batch size the labels come from a dataset
+// and the final batch is padded with rows that must be ignored
+static int
+test_catclassifier(std::shared_ptr<Context> ctx, Tensor::DataType dt,
+                   int classes, int records = 16)
+{
+  const int n = 16;
+  Graph g;
+  auto x = makeCPUTensor(dt, Dims({1, classes}), "x");
+  auto node = g.addNode("catclassifier", {{"x", x}}, {});
+  auto y = node->outputs_["y"];
+  auto loss = node->outputs_["loss"];
+
+  auto xv = random_tensor(dt, Dims({n, classes}), -4, 4, classes);
+  auto labels = makeCPUTensor(Tensor::DataType::I32, Dims({n, 1}));
+  for(int i = 0; i < n; i++)
+    labels->access()->set({i, 0}, i < records ? (i * 7919) % classes : -1);
+
+  auto label_feed = feed(Which::GRADIENT, y, labels);
+  if(records < n) {
+    auto ds = label_dataset(records, classes);
+    if(!ds) {
+      printf("Test of catclassifier partial batch FAILED, no dataset\n");
+      return 1;
+    }
+    ds->beginEpoch(n, false);
+    label_feed = BatchTensorAccess(Phase::PRE, Which::GRADIENT, Mode::ALL,
+                                   y, ds->labelAccessor());
+  }
+
+  auto yv = makeCPUTensor(Tensor::DataType::I32, Dims({n, 1}));
+  auto dxv = makeCPUTensor(dt, Dims({n, classes}));
+  auto lossv = makeCPUTensor(Tensor::DataType::FLOAT, Dims({n, 1}));
+
+  auto p = ctx->createProgram(g, {
+      .inference = false,
+      .training = true,
+      .batch_size = n,
+      .initial_learning_rate = 1e-3,
+      .tensor_layout = TensorLayout::Auto
+    }, {
+      feed(Which::VALUE, x, xv),
+      label_feed,
+      fetch(Which::VALUE, y, yv),
+      fetch(Which::GRADIENT, x, dxv),
+      fetch(Which::VALUE, loss, lossv),
+    });
+  p->train(1);
+
+  auto ref_y = makeCPUTensor(Tensor::DataType::I32, Dims({n, 1}));
+  auto ref_dx = makeCPUTensor(Tensor::DataType::FLOAT, Dims({n, classes}));
+  auto ref_loss = makeCPUTensor(Tensor::DataType::FLOAT, Dims({n, 1}));
+  auto xa = xv->access();
+  auto dxa = ref_dx->access();
+  for(int i = 0; i < n; i++) {
+    int best = 0;
+    double max = xa->get({i, 0});
+    for(int j = 1; j < classes; j++) {
+      if(xa->get({i, j}) > max) {
+        max = xa->get({i, j});
+        best = j;
+      }
+    }
+    ref_y->access()->set({i, 0}, best);
+
+    const int label = labels->access()->get({i, 0});
+    if(label < 0) {
+      for(int j = 0; j < classes; j++)
+        dxa->set({i, j}, 0);
+      ref_loss->access()->set({i, 0}, 0);
+      continue;
+    }
+
+    double sum = 0;
+    for(int j = 0; j < classes; j++)
+      sum += exp(xa->get({i, j}) - max);
+    const double offset = max + log(sum);
+    for(int j = 0; j < classes; j++) {
+      const double prob = exp(xa->get({i, j}) - offset);
+      dxa->set({i, j}, (j == label ? prob - 1 : prob) / n);
+    }
+    ref_loss->access()->set({i, 0}, offset - xa->get({i, label}));
+  }
+
+  std::string name = "catclassifier " + std::to_string(classes);
+  if(records < n)
+    name += " partial " + std::to_string(records);
+  int r = 0;
+  r |= check(name + " y", *yv, *ref_y, 0);
+  r |= check(name + " dx", *dxv, *ref_dx, 1e-5);
+  r |= check(name + " loss", *lossv, *ref_loss, 1e-3);
+  return r;
+}
+
+
+struct CaptureRun {
+  std::shared_ptr<Tensor> y, w, b;
+};
+
+// Fully connected layer fed a different batch every time. Returns every
+// batch's output and the final weights
+static CaptureRun
+run_capture(std::shared_ptr<Context> ctx, Tensor::DataType dt,
+            bool training, bool cuda_graph, int batches)
+{
+  const int n = 4, inputs = 8, outputs = 16;
+  Graph g;
+  auto x = makeCPUTensor(dt, Dims({1, inputs}), "x");
+  auto w = random_tensor(dt, Dims({outputs, inputs}), -0.5, 0.5, 100);
+  auto b = random_tensor(dt, Dims({1, outputs}), -0.5, 0.5, 101);
+  auto y = g.addNode("fc", {{"x", x}, {"w", w}, {"b", b}},
+                     {{"transW", true}})->y();
+
+  auto xall = random_tensor(dt, Dims({batches * n, inputs}), -1, 1, 102);
+  auto dyall = random_tensor(dt, Dims({batches * n, outputs}), -1, 1, 103);
+  auto yall = makeCPUTensor(dt, Dims({batches * n, outputs}));
+
+  // Copy rows of batch <batch> between a [n, cols] tensor and all
+  auto rows = [=](TensorAccess &ta, TensorAccess &all, long batch,
+                  int cols, bool to_all) {
+    for(int i = 0; i < n; i++) {
+      for(int j = 0; j < cols; j++) {
+        const Dims e = {(int)batch * n + i, j};
+        if(to_all)
+          all.set(e, ta.get({i, j}));
+        else
+          ta.set({i, j}, all.get(e));
+      }
+    }
+  };
+
+  BatchTensorAccessors accessors = {
+    BatchTensorAccess(Phase::PRE, Which::VALUE, Mode::ALL, x,
+                      [=](TensorAccess &ta, long batch) {
+                        rows(ta, *xall->access(), batch, inputs, false);
+                      }),
+    BatchTensorAccess(Phase::POST, Which::VALUE, Mode::ALL, y,
+                      [=](TensorAccess &ta, long batch) {
+                        rows(ta, *yall->access(), batch, outputs, true);
+                      }),
+  };
+  if(training)
+    accessors.push_back(BatchTensorAccess(Phase::PRE, Which::GRADIENT,
+                                          Mode::ALL, y,
+                                          [=](TensorAccess &ta, long batch) {
+                                            rows(ta, *dyall->access(), batch,
+                                                 outputs, false);
+                                          }));
+
+  auto p = ctx->createProgram(g, {
+      .inference = !training,
+      .training = training,
+      .batch_size = n,
+      .initial_learning_rate = 1e-2,
+      .tensor_layout = TensorLayout::Auto,
+      .cuda_graph = cuda_graph,
+      .prefetch_depth = 2,
+      .health_check_interval = 2
+    }, accessors);
+  if(training)
+    p->train(batches);
+  else
+    p->infer(batches);
+  if(g_verbose)
+    p->print();
+
+  CaptureRun r;
+  r.y = yall;
+  r.w = makeCPUTensor(dt, w->dims_);
+  r.b = makeCPUTensor(dt, b->dims_);
+  r.w->copyFrom(*p->resolveTensor(w));
+  r.b->copyFrom(*p->resolveTensor(b));
+  return r;
+}
+
+
+// Replayed graphs must give the same results as issuing the operations
+// one by one. More batches than pipeline slots so every slot's graph is
+// replayed, and health checks every other batch so the checked variant
+// of each slot's graph is as well
+static int
+test_cuda_graph(std::shared_ptr<Context> ctx, Tensor::DataType dt,
+                bool training)
+{
+  const int batches = 7;
+  auto ref = run_capture(ctx, dt, training, false, batches);
+  auto cap = run_capture(ctx, dt, training, true, batches);
+
+  const std::string name = std::string("cuda graph ") +
+    (training ? "train" : "infer");
+  int r = 0;
+  r |= check(name + " y", *cap.y, *ref.y, 0);
+  r |= check(name + " w", *cap.w, *ref.w, 0);
+  r |= check(name + " b", *cap.b, *ref.b, 0);
+  return r;
+}
+
+
+//------------------------------------------------------------------------
+// Graph::optimize(), host only
+
+static int
+check_optimize(const std::string &what, bool ok, const Graph &g)
+{
+  if(!ok) {
+    printf("Test of optimize %s FAILED, %zd nodes left\n",
+           what.c_str(), g.nodes_.size());
+    if(g_verbose)
+      g.print();
+    return 1;
+  }
+  printf("Test of optimize %s OK\n", what.c_str());
+  return 0;
+}
+
+
+// No declared inputs or outputs, as built by test_op(). The input has
+// host data so the node folds, but its result must stay produced
+static int
+test_optimize_undeclared()
+{
+  Graph g;
+  auto n = g.addNode("relu", {{"x", load_tensor(Tensor::DataType::FLOAT,
+                                                relu_input)}}, {});
+  g.optimize(false);
+  return check_optimize("undeclared", g.nodes_.size() == 1 &&
+                        g.nodes_[0]->y() == n->y(), g);
+}
+
+
+// add of two initializers is folded into the non-batch input of mul
+static int
+test_optimize_fold()
+{
+  Graph g;
+  auto x = makeCPUTensor(Tensor::DataType::FLOAT, Dims({1, 4}), "x");
+  auto a = random_tensor(Tensor::DataType::FLOAT, Dims({1, 4}), -1, 1, 90);
+  auto b = random_tensor(Tensor::DataType::FLOAT, Dims({1, 4}), -1, 1, 91);
+  auto c = g.addNode("add", {{"x", a}, {"b", b}}, {})->y();
+  auto y = g.addNode("mul", {{"x", x}, {"b", c}}, {})->y();
+  g.inputs_.insert(x);
+  g.outputs_.insert(y);
+
+  g.optimize(false);
+  if(check_optimize("fold", g.nodes_.size() == 1 &&
+                    g.nodes_[0]->type_ == "mul" &&
+                    g.nodes_[0]->y() == y, g))
+    return 1;
+
+  auto ref = makeCPUTensor(Tensor::DataType::FLOAT, Dims({1, 4}));
+  for(int i = 0; i < 4; i++)
+    ref->access()->set({0, i}, a->access()->get({0, i}) +
+                       b->access()->get({0, i}));
+  return check("optimize fold value", *g.nodes_[0]->inputs_.get("b"), *ref,
+               1e-12);
+}
+
+
+// Only the add with identical inputs merges, the one sharing just x
+// stays
+static int
+test_optimize_cse()
+{
+  Graph g;
+  auto x = makeCPUTensor(Tensor::DataType::FLOAT, Dims({1, 4}), "x");
+  auto b1 = random_tensor(Tensor::DataType::FLOAT, Dims({1, 4}), -1, 1, 92);
+  auto b2 = random_tensor(Tensor::DataType::FLOAT, Dims({1, 4}), -1, 1, 93);
+  auto y0 = g.addNode("add", {{"x", x}, {"b", b1}}, {})->y();
+  auto y1 = g.addNode("add", {{"x", x}, {"b", b2}}, {})->y();
+  auto y2 = g.addNode("add", {{"b", b1}, {"x", x}}, {})->y();
+  auto s = g.addNode("sum", {{"x0", y0}, {"x1", y1}, {"x2", y2}}, {});
+  g.inputs_.insert(x);
+  g.outputs_.insert(s->y());
+
+  g.optimize(true);
+  const auto &in = g.nodes_.back()->inputs_;
+  return check_optimize("cse", g.nodes_.size() == 3 &&
+                        in.get("x0") == y0 && in.get("x1") == y1 &&
+                        in.get("x2") == y0, g);
+}
+
+
+// The mul doesn't contribute to the output, it goes and so does its
+// initializer
+static int
+test_optimize_dead()
+{
+  Graph g;
+  auto x = makeCPUTensor(Tensor::DataType::FLOAT, Dims({1, 4}), "x");
+  auto w = random_tensor(Tensor::DataType::FLOAT, Dims({1, 4}), -1, 1, 94);
+  g.tensors_["w"] = w;
+  auto y = g.addNode("relu", {{"x", x}}, {})->y();
+  g.addNode("mul", {{"x", x}, {"b", w}}, {});
+  g.inputs_.insert(x);
+  g.outputs_.insert(y);
+
+  g.optimize(true);
+  return check_optimize("dead", g.nodes_.size() == 1 &&
+                        g.nodes_[0]->y() == y && !g.tensors_.count("w"), g);
+}
+
 
 extern int
 ops_main(int argc, char **argv)
@@ -682,6 +1589,11 @@ ops_main(int argc, char **argv)
   auto ctx = createContext();
 
   int r = 0;
+  r |= test_optimize_undeclared();
+  r |= test_optimize_fold();
+  r |= test_optimize_cse();
+  r |= test_optimize_dead();
+
   r |= test_op(ctx, "relu", {{"x", load_tensor(dt, relu_input)}}, {},
           load_tensor(dt, relu_output));
 
@@ -753,6 +1665,37 @@ ops_main(int argc, char **argv)
         }, {{"epsilon", 5}},
     load_tensor(dt, batchnorm_output));
 
+  for(int classes : {10, 64, 66, 2048, 2051})
+    r |= test_catclassifier(ctx, dt, classes);
+  r |= test_catclassifier(ctx, dt, 10, 11);
+
+  r |= test_conv_relu(ctx, dt, false);
+  r |= test_conv_relu(ctx, dt, true);
+
+  for(bool bias : {false, true})
+    for(bool relu : {false, true})
+      r |= test_batchnorm_fold(ctx, dt, bias, relu);
+
+  for(bool bias : {false, true})
+    for(bool relu : {false, true})
+      r |= test_fc(ctx, dt, bias, relu, false);
+  r |= test_fc(ctx, dt, true, false, true);
+  r |= test_fc_train(ctx, dt, 1);
+  r |= test_fc_train(ctx, dt, 2);
+
+  r |= test_cuda_graph(ctx, dt, false);
+  r |= test_cuda_graph(ctx, dt, true);
+
+  r |= test_adam(ctx, {dt});
+  r |= test_adam(ctx, {Tensor::DataType::FLOAT, Tensor::DataType::HALF});
+
+  r |= test_convert_normalize(ctx, Tensor::DataType::U8, dt, 5, 7);
+  r |= test_convert_normalize(ctx, Tensor::DataType::U8, dt, 4, 4);
+  if(dt == Tensor::DataType::HALF) {
+    r |= test_convert_normalize(ctx, Tensor::DataType::FLOAT, dt, 5, 7);
+    r |= test_convert_normalize(ctx, Tensor::DataType::FLOAT, dt, 4, 4);
+  }
+
   return r;
 }
 